@@ -0,0 +1,660 @@
+/**
+ * @file AccessLog.h
+ * @brief Asynchronous access log with per-thread ring buffers and a background writer.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_ACCESSLOG_H
+#define SUPPORTLIB_ACCESSLOG_H
+#include "Object.h"
+#include "Exception.h"
+#include <boost/asio/ip/address.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace giri {
+
+    /**
+     *  @brief Exception to be thrown on AccessLog errors.
+     */
+    class AccessLogException : public ExceptionBase
+    {
+    public:
+        AccessLogException(const std::string &msg) : ExceptionBase(msg) {};
+        using SPtr = std::shared_ptr<AccessLogException>;
+        using UPtr = std::unique_ptr<AccessLogException>;
+        using WPtr = std::weak_ptr<AccessLogException>;
+    };
+
+    /**
+     * @brief Line format of an AccessLog.
+     */
+    enum class AccessLogFormat {
+        Common,   ///< NCSA common log format.
+        Combined, ///< Common log format with referer and user agent.
+        JSON      ///< One JSON object per line.
+    };
+
+    /**
+     * @brief Options of an AccessLog.
+     */
+    struct AccessLogOptions {
+        AccessLogFormat LogFormat = AccessLogFormat::Combined;   ///< Line format.
+        uint64_t MaxFileSize = 0;                                ///< Rotate once the file exceeds this size in bytes, 0 never rotates.
+        unsigned MaxFiles = 5;                                   ///< Number of rotated files to keep.
+        size_t RingSize = 4096;                                  ///< Records buffered per thread, rounded up to a power of two.
+        std::chrono::milliseconds FlushInterval = std::chrono::milliseconds(50); ///< Delay between the writes of the background thread.
+    };
+
+    /**
+     * @brief Asynchronous access log, e.g. of a HTTPServer (see HTTPServer::setAccessLog).
+     *
+     * Logging a request copies it into a compact fixed size record in a ring buffer
+     * of the calling thread, without locking, formatting or system calls. A background
+     * thread formats the records and appends them to the log file with one gathered
+     * write (writev on linux) per round. If the disk cannot keep up and the ring of a
+     * thread is full, records are dropped and counted (see getDropped) instead of
+     * blocking the thread serving the request.
+     *
+     * The file is rotated once it exceeds a size (log, log.1, log.2, ...), reopen()
+     * supports external tools like logrotate. Records of different threads may appear
+     * slightly out of order. Request targets, referers and user agents are truncated
+     * to fit the record, times are logged in UTC with a resolution of a few milliseconds.
+     *
+     * Formats:
+     * - Common: 127.0.0.1 - - [10/Oct/2020:13:55:36 +0000] "GET /index.html HTTP/1.1" 200 2326
+     * - Combined: Common followed by "referer" "user agent"
+     * - JSON: one object per line, {"time":"2020-10-10T13:55:36.123Z","client":"127.0.0.1","method":"GET",...}
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  AccessLog::Options options;
+     *  options.LogFormat = AccessLog::Format::Combined;
+     *  options.MaxFileSize = 100 * 1024 * 1024; // keeps access.log.1 ... access.log.5
+     *  auto log = std::make_shared<AccessLog>("/var/log/myserver/access.log", options);
+     *
+     *  auto srv = std::make_shared<HTTPServer>("0.0.0.0", "8080", "/var/www", 4);
+     *  srv->setAccessLog(log);
+     *  srv->run();
+     *  @endcode
+     */
+    class AccessLog : public Object<AccessLog>
+    {
+    public:
+        using Format = AccessLogFormat;
+        using Options = AccessLogOptions;
+        /**
+         * @brief Logged request, the strings are copied.
+         */
+        struct Entry {
+            boost::asio::ip::address Client; ///< Address of the client.
+            std::string_view Method;         ///< Request method, e.g. "GET".
+            std::string_view Target;         ///< Request target.
+            unsigned Version = 11;           ///< HTTP version, e.g. 11 for HTTP/1.1.
+            unsigned Status = 0;             ///< Status code of the response.
+            uint64_t Bytes = Unknown;        ///< Size of the response body, Unknown if it is not known in advance.
+            std::string_view Referer;        ///< Referer header, empty if none.
+            std::string_view UserAgent;      ///< User-Agent header, empty if none.
+        };
+        static constexpr uint64_t Unknown = ~uint64_t(0); ///< Unknown size of a response body, e.g. of streamed responses.
+
+        /**
+         * AccessLog constructor, starts the background thread. Throws AccessLogException
+         * if the file cannot be opened.
+         * @param path File to append to, created if it does not exist.
+         * @param options Format, rotation and buffering.
+         */
+        explicit AccessLog(const std::filesystem::path& path, const Options& options = Options()) :
+            m_Path(path),
+            m_Options(options),
+            m_Id(nextId())
+        {
+            size_t size = 1;
+            while(size < std::max<size_t>(options.RingSize, 2))
+                size *= 2;
+            m_Options.RingSize = size;
+            std::string error;
+            if(!open(error))
+                throw AccessLogException("Open: " + error);
+            m_Thread = std::thread([this]{ run(); });
+            Registry& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.Mutex);
+            reg.Live.push_back(m_Id); // ids grow, stays sorted
+        }
+        AccessLog(const AccessLog&) = delete;
+        AccessLog& operator=(const AccessLog&) = delete;
+        /**
+         * Writes the remaining records and stops the background thread.
+         */
+        ~AccessLog() {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Stop = true;
+            }
+            m_Cv.notify_all();
+            m_Thread.join();
+            close();
+            Registry& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.Mutex);
+            reg.Live.erase(std::lower_bound(reg.Live.begin(), reg.Live.end(), m_Id));
+            reg.Generation.fetch_add(1, std::memory_order_release);
+        }
+        /**
+         * Logs a request. Never blocks, may be called from any thread.
+         * @param entry Request to log.
+         * @returns false if the record was dropped because the buffer of this thread is full.
+         */
+        bool log(const Entry& entry) {
+            Ring& ring = local();
+            const uint64_t head = ring.Head.load(std::memory_order_relaxed);
+            if(head - ring.Tail.load(std::memory_order_acquire) >= ring.Records.size()) {
+                ring.Dropped.store(ring.Dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+            Record& r = ring.Records[head & (ring.Records.size() - 1)];
+            r.Time = now();
+            r.Bytes = entry.Bytes;
+            r.Status = static_cast<uint16_t>(std::min(entry.Status, 999u));
+            r.Version = static_cast<uint8_t>(std::min(entry.Version, 99u));
+            if(entry.Client.is_v4()) {
+                const auto bytes = entry.Client.to_v4().to_bytes();
+                std::memcpy(r.Address.data(), bytes.data(), bytes.size());
+                r.Family = 4;
+            }
+            else if(entry.Client.is_v6()) {
+                const auto bytes = entry.Client.to_v6().to_bytes();
+                std::memcpy(r.Address.data(), bytes.data(), bytes.size());
+                r.Family = 6;
+            }
+            else
+                r.Family = 0;
+            size_t pos = 0;
+            auto copy = [&](std::string_view value, size_t max) {
+                const size_t n = std::min(value.size(), max);
+                std::memcpy(r.Text + pos, value.data(), n);
+                pos += n;
+                return static_cast<uint16_t>(n);
+            };
+            r.MethodSize = static_cast<uint8_t>(copy(entry.Method, MaxMethod));
+            r.TargetSize = copy(entry.Target, MaxTarget);
+            r.RefererSize = copy(entry.Referer, MaxReferer);
+            r.AgentSize = copy(entry.UserAgent, MaxAgent);
+            ring.Head.store(head + 1, std::memory_order_release);
+            if(head - ring.Tail.load(std::memory_order_relaxed) == ring.Records.size() / 2 && !m_Wake.exchange(true, std::memory_order_relaxed))
+                m_Cv.notify_all(); // half full, do not wait for the flush interval
+            return true;
+        }
+        /**
+         * Blocks until all records logged before were written.
+         */
+        void flush() {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            const uint64_t request = ++m_FlushRequested;
+            m_Cv.notify_all();
+            m_Cv.wait(lock, [&]{ return m_Flushed >= request || m_Stop; });
+        }
+        /**
+         * Reopens the file on the next write, e.g. after it was moved away by logrotate.
+         */
+        void reopen() {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Reopen = true;
+            }
+            m_Cv.notify_all();
+        }
+        /**
+         * @returns Number of records dropped because a buffer was full or the file could not be written.
+         */
+        uint64_t getDropped() const {
+            uint64_t dropped = m_WriteDropped.load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(m_RingsMutex);
+            for(const auto& ring : m_Rings)
+                dropped += ring->Dropped.load(std::memory_order_relaxed);
+            return dropped;
+        }
+        /**
+         * @returns Number of records written.
+         */
+        uint64_t getWritten() const {
+            return m_Written.load(std::memory_order_relaxed);
+        }
+        /**
+         * @returns Path of the log file.
+         */
+        const std::filesystem::path& getPath() const {
+            return m_Path;
+        }
+        using SPtr = std::shared_ptr<AccessLog>;
+        using UPtr = std::unique_ptr<AccessLog>;
+        using WPtr = std::weak_ptr<AccessLog>;
+    private:
+        static constexpr size_t MaxMethod = 16;
+        static constexpr size_t MaxTarget = 224;
+        static constexpr size_t MaxReferer = 96;
+        static constexpr size_t MaxAgent = 128;
+
+        struct Record { // 512 bytes, strings are stored back to back in Text
+            int64_t Time;           // milliseconds since epoch
+            uint64_t Bytes;
+            uint16_t Status;
+            uint16_t TargetSize;
+            uint16_t RefererSize;
+            uint16_t AgentSize;
+            uint8_t MethodSize;
+            uint8_t Version;
+            uint8_t Family;         // 4, 6 or 0 if unknown
+            std::array<uint8_t, 16> Address;
+            char Text[MaxMethod + MaxTarget + MaxReferer + MaxAgent];
+        };
+        struct alignas(64) Ring { // single producer (the owning thread), single consumer (the writer)
+            explicit Ring(size_t size) : Records(size) {}
+            std::vector<Record> Records;
+            alignas(64) std::atomic<uint64_t> Head{0};
+            alignas(64) std::atomic<uint64_t> Tail{0};
+            std::atomic<uint64_t> Dropped{0};
+        };
+        struct LocalRings { // rings of the calling thread, by instance
+            uint64_t Id = 0;
+            Ring* Current = nullptr;
+            std::vector<std::pair<uint64_t, Ring*>> Others;
+            uint64_t Generation = 0; // of the Registry when Others was pruned last
+        };
+        struct Registry { // ids of the live instances, lets threads prune LocalRings of destroyed ones
+            std::mutex Mutex;
+            std::vector<uint64_t> Live;             // sorted
+            std::atomic<uint64_t> Generation{0};    // counts destroyed instances
+        };
+        static Registry& registry() {
+            static Registry reg;
+            return reg;
+        }
+
+        static uint64_t nextId() {
+            static std::atomic<uint64_t> id{0};
+            return ++id; // never reused, stale entries of LocalRings do not match
+        }
+        static int64_t now() {
+        #if defined(__linux__)
+            timespec ts;
+            clock_gettime(CLOCK_REALTIME_COARSE, &ts); // a few milliseconds resolution, much cheaper
+            return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+        #else
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        #endif
+        }
+        Ring& local() {
+            thread_local LocalRings rings;
+            if(rings.Id == m_Id)
+                return *rings.Current;
+            Registry& reg = registry();
+            const uint64_t generation = reg.Generation.load(std::memory_order_acquire);
+            if(rings.Generation != generation) { // instances were destroyed meanwhile, drop their entries
+                std::lock_guard<std::mutex> lock(reg.Mutex);
+                auto dead = [&](uint64_t id){ return !std::binary_search(reg.Live.begin(), reg.Live.end(), id); };
+                rings.Others.erase(std::remove_if(rings.Others.begin(), rings.Others.end(), [&](const auto& o){ return dead(o.first); }), rings.Others.end());
+                if(rings.Current && dead(rings.Id))
+                    rings.Current = nullptr;
+                rings.Generation = generation;
+            }
+            Ring* ring = nullptr;
+            for(auto it = rings.Others.begin(); it != rings.Others.end(); ++it)
+                if(it->first == m_Id) {
+                    ring = it->second;
+                    rings.Others.erase(it);
+                    break;
+                }
+            if(!ring) {
+                std::lock_guard<std::mutex> lock(m_RingsMutex);
+                m_Rings.push_back(std::make_unique<Ring>(m_Options.RingSize));
+                ring = m_Rings.back().get();
+            }
+            if(rings.Current)
+                rings.Others.emplace_back(rings.Id, rings.Current);
+            rings.Id = m_Id;
+            rings.Current = ring;
+            return *ring;
+        }
+        void run() {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            while(true) {
+                const bool stop = m_Stop;
+                const bool reopenFile = m_Reopen;
+                const uint64_t flush = m_FlushRequested;
+                m_Reopen = false;
+                lock.unlock();
+                if(reopenFile) {
+                    close();
+                    std::string error;
+                    open(error); // retried on the next write
+                }
+                writeRecords();
+                lock.lock();
+                m_Flushed = flush;
+                m_Cv.notify_all();
+                if(stop)
+                    return;
+                m_Cv.wait_for(lock, m_Options.FlushInterval, [&]{ return m_Stop || m_Reopen || m_FlushRequested != m_Flushed || m_Wake.load(std::memory_order_relaxed); });
+                m_Wake.store(false, std::memory_order_relaxed);
+            }
+        }
+        void writeRecords() {
+            std::vector<Ring*> rings;
+            {
+                std::lock_guard<std::mutex> lock(m_RingsMutex);
+                for(const auto& ring : m_Rings)
+                    rings.push_back(ring.get());
+            }
+            if(m_Batches.size() < rings.size())
+                m_Batches.resize(rings.size());
+            size_t used = 0;
+            uint64_t records = 0;
+            for(Ring* ring : rings) { // one batch per ring, released as soon as it was formatted
+                const uint64_t tail = ring->Tail.load(std::memory_order_relaxed);
+                const uint64_t head = ring->Head.load(std::memory_order_acquire);
+                if(head == tail)
+                    continue;
+                std::string& batch = m_Batches[used++];
+                batch.clear();
+                for(uint64_t i = tail; i != head; ++i)
+                    format(ring->Records[i & (ring->Records.size() - 1)], batch);
+                ring->Tail.store(head, std::memory_order_release);
+                records += head - tail;
+            }
+            if(used == 0)
+                return;
+            uint64_t size = 0;
+            for(size_t i = 0; i < used; ++i)
+                size += m_Batches[i].size();
+            if(m_Options.MaxFileSize > 0 && m_FileSize > 0 && m_FileSize + size > m_Options.MaxFileSize)
+                rotate();
+            if(write(used))
+                m_Written.fetch_add(records, std::memory_order_relaxed);
+            else
+                m_WriteDropped.fetch_add(records, std::memory_order_relaxed);
+            for(size_t i = 0; i < used; ++i)
+                if(m_Batches[i].capacity() > MaxBatchCapacity) // e.g. after a burst
+                    std::string().swap(m_Batches[i]);
+        }
+        bool write(size_t count) {
+        #if defined(__linux__)
+            if(m_Fd < 0) {
+                std::string error;
+                if(!open(error))
+                    return false;
+            }
+            std::vector<iovec> iov;
+            for(size_t i = 0; i < count; ++i)
+                iov.push_back({const_cast<char*>(m_Batches[i].data()), m_Batches[i].size()});
+            size_t first = 0;
+            while(first < iov.size()) {
+                const ssize_t n = ::writev(m_Fd, iov.data() + first, static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX)));
+                if(n < 0) {
+                    if(errno == EINTR)
+                        continue;
+                    return false;
+                }
+                m_FileSize += static_cast<uint64_t>(n);
+                size_t done = static_cast<size_t>(n);
+                while(first < iov.size() && done >= iov[first].iov_len)
+                    done -= iov[first++].iov_len;
+                if(first < iov.size()) { // partially written
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + done;
+                    iov[first].iov_len -= done;
+                }
+            }
+            return true;
+        #else
+            if(!m_File.is_open()) {
+                std::string error;
+                if(!open(error))
+                    return false;
+            }
+            for(size_t i = 0; i < count; ++i) {
+                m_File.write(m_Batches[i].data(), static_cast<std::streamsize>(m_Batches[i].size()));
+                m_FileSize += m_Batches[i].size();
+            }
+            m_File.flush();
+            return m_File.good();
+        #endif
+        }
+        bool open(std::string& error) {
+        #if defined(__linux__)
+            m_Fd = ::open(m_Path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if(m_Fd < 0) {
+                error = std::string(std::strerror(errno)) + ": " + m_Path.string();
+                return false;
+            }
+            struct stat st;
+            m_FileSize = fstat(m_Fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+            return true;
+        #else
+            m_File.open(m_Path, std::ios::binary | std::ios::app);
+            if(!m_File.is_open()) {
+                error = "Cannot open " + m_Path.string();
+                return false;
+            }
+            std::error_code ec;
+            const auto size = std::filesystem::file_size(m_Path, ec);
+            m_FileSize = ec ? 0 : static_cast<uint64_t>(size);
+            return true;
+        #endif
+        }
+        void close() {
+        #if defined(__linux__)
+            if(m_Fd >= 0)
+                ::close(m_Fd);
+            m_Fd = -1;
+        #else
+            if(m_File.is_open())
+                m_File.close();
+        #endif
+        }
+        void rotate() { // log -> log.1 -> log.2 ..., the oldest is overwritten
+            close();
+            std::error_code ec;
+            auto rotated = [this](unsigned i) { return std::filesystem::path(m_Path) += "." + std::to_string(i); };
+            if(m_Options.MaxFiles == 0)
+                std::filesystem::remove(m_Path, ec);
+            else {
+                for(unsigned i = m_Options.MaxFiles - 1; i > 0; --i)
+                    if(std::filesystem::exists(rotated(i), ec))
+                        std::filesystem::rename(rotated(i), rotated(i + 1), ec);
+                std::filesystem::rename(m_Path, rotated(1), ec);
+            }
+            std::string error;
+            open(error); // retried on the next write
+        }
+        void format(const Record& r, std::string& out) {
+            const std::string_view method(r.Text, r.MethodSize);
+            const std::string_view target(r.Text + r.MethodSize, r.TargetSize);
+            const std::string_view referer(r.Text + r.MethodSize + r.TargetSize, r.RefererSize);
+            const std::string_view agent(r.Text + r.MethodSize + r.TargetSize + r.RefererSize, r.AgentSize);
+            char version[16]; // HTTP/2 is logged as HTTP/2.0 like httpd does
+            std::snprintf(version, sizeof(version), "HTTP/%u.%u", r.Version / 10u, r.Version >= 20 ? 0u : r.Version % 10u);
+            if(m_Options.LogFormat == Format::JSON) {
+                out += "{\"time\":\"";
+                appendTime(r.Time, true, out);
+                out += "\",\"client\":\"";
+                appendAddress(r, out);
+                out += "\",\"method\":\"";
+                appendJSON(method, out);
+                out += "\",\"target\":\"";
+                appendJSON(target, out);
+                out += "\",\"version\":\"";
+                out += version;
+                out += "\",\"status\":";
+                out += std::to_string(r.Status);
+                out += ",\"bytes\":";
+                out += r.Bytes == Unknown ? "null" : std::to_string(r.Bytes);
+                out += ",\"referer\":\"";
+                appendJSON(referer, out);
+                out += "\",\"user_agent\":\"";
+                appendJSON(agent, out);
+                out += "\"}\n";
+                return;
+            }
+            appendAddress(r, out);
+            out += " - - [";
+            appendTime(r.Time, false, out);
+            out += "] \"";
+            if(method.empty()) // e.g. the request could not be parsed
+                out += '-';
+            else {
+                appendEscaped(method, out);
+                out += ' ';
+                appendEscaped(target, out);
+                out += ' ';
+                out += version;
+            }
+            out += "\" ";
+            out += std::to_string(r.Status);
+            out += ' ';
+            out += r.Bytes == Unknown || r.Bytes == 0 ? "-" : std::to_string(r.Bytes);
+            if(m_Options.LogFormat == Format::Combined) {
+                out += " \"";
+                if(referer.empty())
+                    out += '-';
+                else
+                    appendEscaped(referer, out);
+                out += "\" \"";
+                if(agent.empty())
+                    out += '-';
+                else
+                    appendEscaped(agent, out);
+                out += '"';
+            }
+            out += '\n';
+        }
+        void appendTime(int64_t ms, bool iso, std::string& out) { // the formatted second is reused
+            const int64_t second = ms >= 0 ? ms / 1000 : (ms - 999) / 1000;
+            std::string& cached = iso ? m_IsoTime : m_ClfTime;
+            int64_t& cachedSecond = iso ? m_IsoSecond : m_ClfSecond;
+            if(second != cachedSecond || cached.empty()) {
+                const std::time_t t = static_cast<std::time_t>(second);
+                std::tm tm{};
+            #if defined(_WIN32)
+                gmtime_s(&tm, &t);
+            #else
+                gmtime_r(&t, &tm);
+            #endif
+                char buf[64];
+                const size_t n = std::strftime(buf, sizeof(buf), iso ? "%Y-%m-%dT%H:%M:%S" : "%d/%b/%Y:%H:%M:%S +0000", &tm);
+                cached.assign(buf, n);
+                cachedSecond = second;
+            }
+            out += cached;
+            if(iso) {
+                char millis[8];
+                std::snprintf(millis, sizeof(millis), ".%03dZ", static_cast<int>(ms - second * 1000));
+                out += millis;
+            }
+        }
+        static void appendAddress(const Record& r, std::string& out) {
+            if(r.Family == 4) {
+                boost::asio::ip::address_v4::bytes_type bytes;
+                std::memcpy(bytes.data(), r.Address.data(), bytes.size());
+                out += boost::asio::ip::address_v4(bytes).to_string();
+            }
+            else if(r.Family == 6) {
+                boost::asio::ip::address_v6::bytes_type bytes;
+                std::memcpy(bytes.data(), r.Address.data(), bytes.size());
+                const boost::asio::ip::address_v6 address(bytes);
+                out += address.is_v4_mapped() ? boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address).to_string() : address.to_string();
+            }
+            else
+                out += '-';
+        }
+        static void appendEscaped(std::string_view value, std::string& out) { // like Apache httpd, quotes, backslashes and non printable bytes
+            for(char c : value) {
+                const unsigned char u = static_cast<unsigned char>(c);
+                if(c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                }
+                else if(u < 0x20 || u >= 0x7f) {
+                    char hex[5];
+                    std::snprintf(hex, sizeof(hex), "\\x%02x", u);
+                    out += hex;
+                }
+                else
+                    out += c;
+            }
+        }
+        static void appendJSON(std::string_view value, std::string& out) { // invalid UTF-8 is passed through
+            for(char c : value) {
+                const unsigned char u = static_cast<unsigned char>(c);
+                if(c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                }
+                else if(u < 0x20) {
+                    char hex[7];
+                    std::snprintf(hex, sizeof(hex), "\\u%04x", u);
+                    out += hex;
+                }
+                else
+                    out += c;
+            }
+        }
+
+        static constexpr size_t MaxBatchCapacity = 4 * 1024 * 1024;
+
+        std::filesystem::path m_Path;
+        Options m_Options;
+        const uint64_t m_Id;
+        mutable std::mutex m_RingsMutex;
+        std::vector<std::unique_ptr<Ring>> m_Rings;    // kept until destruction
+        std::vector<std::string> m_Batches;            // writer thread only
+    #if defined(__linux__)
+        int m_Fd = -1;
+    #else
+        std::ofstream m_File;
+    #endif
+        uint64_t m_FileSize = 0;
+        std::string m_ClfTime;
+        std::string m_IsoTime;
+        int64_t m_ClfSecond = 0;
+        int64_t m_IsoSecond = 0;
+        std::atomic<uint64_t> m_Written{0};
+        std::atomic<uint64_t> m_WriteDropped{0};
+        std::mutex m_Mutex;                            // stop, flush and reopen requests
+        std::condition_variable m_Cv;
+        std::atomic<bool> m_Wake{false};               // a ring is half full, set by the producers without locking
+        bool m_Stop = false;
+        bool m_Reopen = false;
+        uint64_t m_FlushRequested = 0;
+        uint64_t m_Flushed = 0;
+        std::thread m_Thread;
+    };
+}
+#endif //SUPPORTLIB_ACCESSLOG_H
@@ -0,0 +1,207 @@
+/**
+ * @file ConnectionLimiter.h
+ * @brief Limits concurrent connections, in total and per client address.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_CONNECTIONLIMITER_H
+#define SUPPORTLIB_CONNECTIONLIMITER_H
+#include "Object.h"
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/address_v6.hpp>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace giri {
+
+    /**
+     * @brief Counts concurrent connections and rejects new ones above a limit.
+     *
+     * acquire() hands out a Ticket for every admitted connection, the connection
+     * is counted until the ticket is destroyed. Per address counters are kept in
+     * independently locked shards, so concurrent acceptors rarely contend.
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  #include <ConnectionLimiter.h>
+     *
+     *  using namespace giri;
+     *
+     *  int main()
+     *  {
+     *      ConnectionLimiter::SPtr limiter = std::make_shared<ConnectionLimiter>(10000, 64);
+     *      ConnectionLimiter::Ticket ticket = limiter->acquire(boost::asio::ip::make_address("127.0.0.1"));
+     *      if(!ticket)
+     *          return EXIT_FAILURE; // too many connections
+     *      // ... keep ticket as long as the connection is open
+     *      return EXIT_SUCCESS;
+     *  }
+     *  @endcode
+     */
+    class ConnectionLimiter : public Object<ConnectionLimiter>, public std::enable_shared_from_this<ConnectionLimiter>
+    {
+    public:
+        /**
+         * @brief Admission of one connection, releases it on destruction.
+         */
+        class Ticket {
+        public:
+            Ticket() = default;
+            Ticket(Ticket&&) = default;
+            Ticket& operator=(Ticket&& other) {
+                if(this != &other) {
+                    release();
+                    m_Limiter = std::move(other.m_Limiter);
+                    m_Address = other.m_Address;
+                }
+                return *this;
+            }
+            ~Ticket() {
+                release();
+            }
+            /**
+             * @returns true if the connection was admitted.
+             */
+            explicit operator bool() const {
+                return m_Limiter != nullptr;
+            }
+        private:
+            friend class ConnectionLimiter;
+            Ticket(std::shared_ptr<ConnectionLimiter> limiter, const boost::asio::ip::address& address) :
+                m_Limiter(std::move(limiter)),
+                m_Address(address)
+            {
+            }
+            void release() {
+                if(m_Limiter)
+                    m_Limiter->release(m_Address);
+                m_Limiter.reset();
+            }
+            std::shared_ptr<ConnectionLimiter> m_Limiter;
+            boost::asio::ip::address m_Address;
+        };
+
+        /**
+         * ConnectionLimiter constructor.
+         * @param maxConnections Maximum number of concurrent connections. (0 for unlimited)
+         * @param maxPerAddress Maximum number of concurrent connections per client address. (0 for unlimited)
+         */
+        explicit ConnectionLimiter(size_t maxConnections = 0, size_t maxPerAddress = 0) :
+            m_MaxConnections(maxConnections),
+            m_MaxPerAddress(maxPerAddress)
+        {
+        }
+        /**
+         * Admits a connection if no limit is exceeded. Needs to be owned by a std::shared_ptr.
+         * @param address Address of the client.
+         * @returns Ticket to keep as long as the connection is open, an empty ticket if the connection has to be rejected.
+         */
+        Ticket acquire(const boost::asio::ip::address& address) {
+            const size_t max = m_MaxConnections.load(std::memory_order_relaxed);
+            if(m_Active.fetch_add(1, std::memory_order_relaxed) >= max && max > 0) {
+                m_Active.fetch_sub(1, std::memory_order_relaxed);
+                m_Rejected.fetch_add(1, std::memory_order_relaxed);
+                return {};
+            }
+            const size_t perAddress = m_MaxPerAddress.load(std::memory_order_relaxed);
+            if(perAddress > 0) {
+                const Key k = key(address);
+                Shard& s = shard(k);
+                std::lock_guard<std::mutex> lock(s.Mutex);
+                size_t& count = s.Counts[k];
+                if(count >= perAddress) {
+                    m_Active.fetch_sub(1, std::memory_order_relaxed);
+                    m_Rejected.fetch_add(1, std::memory_order_relaxed);
+                    return {};
+                }
+                ++count;
+            }
+            return Ticket(shared_from_this(), perAddress > 0 ? address : boost::asio::ip::address());
+        }
+        /**
+         * Sets the limits, only affects connections admitted from now on.
+         * @param maxConnections Maximum number of concurrent connections. (0 for unlimited)
+         * @param maxPerAddress Maximum number of concurrent connections per client address. (0 for unlimited)
+         */
+        void setLimits(size_t maxConnections, size_t maxPerAddress) {
+            m_MaxConnections = maxConnections;
+            m_MaxPerAddress = maxPerAddress;
+        }
+        /**
+         * @returns Maximum number of concurrent connections, 0 if unlimited.
+         */
+        size_t getMaxConnections() const {
+            return m_MaxConnections;
+        }
+        /**
+         * @returns Maximum number of concurrent connections per client address, 0 if unlimited.
+         */
+        size_t getMaxPerAddress() const {
+            return m_MaxPerAddress;
+        }
+        /**
+         * @returns Number of currently admitted connections.
+         */
+        size_t getActive() const {
+            return m_Active.load(std::memory_order_relaxed);
+        }
+        /**
+         * @returns Number of rejected connections.
+         */
+        uint64_t getRejected() const {
+            return m_Rejected.load(std::memory_order_relaxed);
+        }
+        using SPtr = std::shared_ptr<ConnectionLimiter>;
+        using UPtr = std::unique_ptr<ConnectionLimiter>;
+        using WPtr = std::weak_ptr<ConnectionLimiter>;
+    private:
+        using Key = boost::asio::ip::address_v6::bytes_type; // IPv4 addresses are mapped to IPv6
+        struct KeyHash {
+            size_t operator()(const Key& k) const {
+                uint64_t h = 14695981039346656037ull; // FNV-1a
+                for(unsigned char c : k)
+                    h = (h ^ c) * 1099511628211ull;
+                return static_cast<size_t>(h);
+            }
+        };
+        struct Shard {
+            std::mutex Mutex;
+            std::unordered_map<Key, size_t, KeyHash> Counts;
+        };
+
+        static Key key(const boost::asio::ip::address& address) {
+            if(address.is_v4())
+                return boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes();
+            return address.to_v6().to_bytes();
+        }
+        Shard& shard(const Key& k) {
+            return m_Shards[KeyHash()(k) % m_Shards.size()];
+        }
+        void release(const boost::asio::ip::address& address) {
+            if(!address.is_unspecified()) { // counted per address
+                const Key k = key(address);
+                Shard& s = shard(k);
+                std::lock_guard<std::mutex> lock(s.Mutex);
+                auto it = s.Counts.find(k);
+                if(it != s.Counts.end() && --it->second == 0)
+                    s.Counts.erase(it);
+            }
+            m_Active.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        std::atomic<size_t> m_MaxConnections;
+        std::atomic<size_t> m_MaxPerAddress;
+        std::atomic<size_t> m_Active{0};
+        std::atomic<uint64_t> m_Rejected{0};
+        std::array<Shard, 16> m_Shards;
+    };
+}
+#endif //SUPPORTLIB_CONNECTIONLIMITER_H
@@ -0,0 +1,383 @@
+/**
+ * @file FileCache.h
+ * @brief Sharded, size bounded in-memory cache for static files.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_FILECACHE_H
+#define SUPPORTLIB_FILECACHE_H
+#include "Object.h"
+#include "FileSystem.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace giri {
+
+    /**
+     * @brief Sharded LRU cache holding immutable file contents and their
+     * precomputed HTTP headers.
+     *
+     * Entries are looked up by a key (e.g. the requested path) which may differ
+     * from the path of the cached file (e.g. a directory resolving to its index
+     * file). Entries are shared and immutable, so a hit only costs a hash lookup
+     * and a reference count increment. Stale entries are detected either by
+     * calling invalidate() (e.g. from a FileSystem::FileWatcher) or by revalidating
+     * the file's modification time, size and inode once the revalidation interval
+     * of an entry elapsed. Encoded variants of a file (e.g. gzip) are cached under
+     * their own key and are invalidated together with the file they were created from.
+     */
+    class FileCache : public Object<FileCache>
+    {
+    public:
+        /**
+         * @brief Immutable cached file.
+         */
+        struct Entry {
+            std::filesystem::path Path;                   ///< Cached file.
+            std::shared_ptr<const std::vector<char>> Body; ///< File content.
+            std::string ContentType;                      ///< Content-Type header value.
+            std::string ContentEncoding;                  ///< Content-Encoding header value, empty if not encoded.
+            std::string ContentLength;                    ///< Content-Length header value.
+            std::string ETag;                             ///< ETag header value.
+            std::string LastModified;                     ///< Last-Modified header value.
+            uint64_t Size = 0;
+            uint64_t Inode = 0;
+            int64_t MTime = 0;                            ///< Modification time in nanoseconds since epoch.
+            bool Vary = false;                            ///< true if the response depends on Accept-Encoding.
+            mutable std::atomic<int64_t> Validated{0};    ///< Steady clock time (ns) of the last validation.
+        };
+        using EntryPtr = std::shared_ptr<const Entry>;
+        /**
+         * Transforms file content before it is cached, e.g. compresses it.
+         * Returns false if the result should not be cached.
+         */
+        using Transform = std::function<bool(std::vector<char>&)>;
+
+        /**
+         * FileCache constructor.
+         * @param maxBytes Maximum number of cached content bytes. (defaults to 64MiB)
+         * @param maxFileSize Files bigger than this are not cached. (defaults to 1MiB)
+         * @param shards Number of independently locked shards. (defaults to 16)
+         */
+        explicit FileCache(size_t maxBytes = 64 * 1024 * 1024, size_t maxFileSize = 1024 * 1024, size_t shards = 16) :
+            m_MaxFileSize(maxFileSize),
+            m_Shards(shards ? shards : 1)
+        {
+            for(auto& s : m_Shards)
+                s.MaxBytes = maxBytes / m_Shards.size();
+        }
+        /**
+         * Looks up an entry. Returns nullptr if not cached or if the entry is due
+         * for revalidation and the file changed meanwhile.
+         * @param key Key the entry was inserted with.
+         * @returns The cached entry or nullptr.
+         */
+        EntryPtr find(const std::string& key) {
+            Shard& s = shard(key);
+            EntryPtr entry;
+            {
+                std::lock_guard<std::mutex> lock(s.Mutex);
+                auto it = s.Map.find(key);
+                if(it == s.Map.end()) {
+                    ++m_Misses;
+                    return nullptr;
+                }
+                s.Lru.splice(s.Lru.begin(), s.Lru, it->second);
+                entry = it->second->second;
+            }
+            int64_t interval = m_Revalidate.load(std::memory_order_relaxed);
+            if(interval >= 0) {
+                int64_t now = steadyNow();
+                if(now - entry->Validated.load(std::memory_order_relaxed) >= interval) {
+                    if(!unchanged(*entry)) {
+                        erase(key);
+                        ++m_Misses;
+                        return nullptr;
+                    }
+                    entry->Validated.store(now, std::memory_order_relaxed);
+                }
+            }
+            ++m_Hits;
+            return entry;
+        }
+        /**
+         * Loads a file and caches it. Returns nullptr without caching if the file
+         * cannot be read, is not a regular file or exceeds the maximum file size.
+         * @param key Key to cache the entry with.
+         * @param file File to load.
+         * @param contentType Content-Type to be sent with the file.
+         * @param contentEncoding Content-Encoding of the cached content. (defaults to none)
+         * @param transform Applied to the file content before caching, e.g. to compress it. (optional)
+         * @param vary true if the response depends on Accept-Encoding. (defaults to false)
+         * @returns The new entry or nullptr.
+         */
+        EntryPtr insert(const std::string& key, const std::filesystem::path& file, const std::string& contentType, const std::string& contentEncoding = "", const Transform& transform = nullptr, bool vary = false) {
+            FileSystem::DirEntry st;
+            if(!statFile(file, st) || st.Type != std::filesystem::file_type::regular || st.Size > m_MaxFileSize)
+                return nullptr;
+            EntryPtr entry = load(file, contentType, contentEncoding, transform, vary);
+            if(entry)
+                store(key, entry);
+            return entry;
+        }
+        /**
+         * Loads a file into an entry without caching it.
+         * @param file File to load.
+         * @param contentType Content-Type to be sent with the file.
+         * @param contentEncoding Content-Encoding of the content. (defaults to none)
+         * @param transform Applied to the file content, e.g. to compress it. (optional)
+         * @param vary true if the response depends on Accept-Encoding. (defaults to false)
+         * @returns The entry or nullptr if the file cannot be read or is not a regular file.
+         */
+        static EntryPtr load(const std::filesystem::path& file, const std::string& contentType, const std::string& contentEncoding = "", const Transform& transform = nullptr, bool vary = false) {
+            FileSystem::DirEntry st;
+            if(!statFile(file, st) || st.Type != std::filesystem::file_type::regular)
+                return nullptr;
+            auto entry = std::make_shared<Entry>();
+            try {
+                std::vector<char> body = FileSystem::LoadFile(file);
+                if(transform && !transform(body))
+                    return nullptr;
+                entry->Body = std::make_shared<const std::vector<char>>(std::move(body));
+            }
+            catch(const FileSystem::FileSystemException&) {
+                return nullptr;
+            }
+            entry->Path = file.lexically_normal();
+            entry->ContentType = contentType;
+            entry->ContentEncoding = contentEncoding;
+            entry->Vary = vary;
+            entry->ContentLength = std::to_string(entry->Body->size());
+            entry->Size = st.Size;
+            entry->Inode = st.Inode;
+            entry->MTime = st.MTime;
+            entry->ETag = makeETag(st);
+            if(!contentEncoding.empty()) // differs from the unencoded file
+                entry->ETag.insert(entry->ETag.size() - 1, "-" + contentEncoding);
+            entry->LastModified = httpDate(st.MTime / 1000000000);
+            entry->Validated = steadyNow();
+            return entry;
+        }
+        /**
+         * Caches an existing entry under another key, e.g. to remember that there
+         * is no encoded variant of a file and the unencoded one should be served.
+         * @param key Additional key for the entry.
+         * @param entry Entry to cache.
+         */
+        void alias(const std::string& key, const EntryPtr& entry) {
+            if(entry)
+                store(key, entry);
+        }
+        /**
+         * Removes all entries caching the given file, or any file below it if
+         * path is a directory.
+         * @param path Changed file or directory.
+         */
+        void invalidate(const std::filesystem::path& path) {
+            std::string p = path.lexically_normal().string();
+            while(p.size() > 1 && p.back() == '/')
+                p.pop_back();
+            for(auto& s : m_Shards) {
+                std::lock_guard<std::mutex> lock(s.Mutex);
+                for(auto it = s.Lru.begin(); it != s.Lru.end();) {
+                    if(isBelow(it->second->Path.string(), p)) {
+                        s.Bytes -= it->second->Body->size();
+                        s.Map.erase(it->first);
+                        it = s.Lru.erase(it);
+                    }
+                    else
+                        ++it;
+                }
+            }
+        }
+        /**
+         * Removes all entries.
+         */
+        void clear() {
+            for(auto& s : m_Shards) {
+                std::lock_guard<std::mutex> lock(s.Mutex);
+                s.Map.clear();
+                s.Lru.clear();
+                s.Bytes = 0;
+            }
+        }
+        /**
+         * Sets how often cached files are checked for modifications. Use a negative
+         * interval to disable revalidation, e.g. if the cache gets invalidated by a file watcher.
+         * @param interval Revalidation interval, 0 checks on every hit. (defaults to 1s)
+         */
+        void setRevalidateInterval(std::chrono::milliseconds interval) {
+            m_Revalidate = interval.count() < 0 ? -1 : std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count();
+        }
+        /**
+         * @returns Files bigger than this are not cached.
+         */
+        size_t getMaxFileSize() const {
+            return m_MaxFileSize;
+        }
+        /**
+         * @returns Number of cache hits.
+         */
+        uint64_t getHits() const {
+            return m_Hits;
+        }
+        /**
+         * @returns Number of cache misses.
+         */
+        uint64_t getMisses() const {
+            return m_Misses;
+        }
+        /**
+         * @returns Number of cached content bytes.
+         */
+        size_t getBytes() const {
+            size_t bytes = 0;
+            for(auto& s : m_Shards) {
+                std::lock_guard<std::mutex> lock(s.Mutex);
+                bytes += s.Bytes;
+            }
+            return bytes;
+        }
+        /**
+         * Formats a unix timestamp as HTTP date (RFC 7231), e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+         * @param time Seconds since epoch.
+         * @returns Formatted date.
+         */
+        static std::string httpDate(std::time_t time) {
+            std::tm tm{};
+        #if defined(_WIN32)
+            gmtime_s(&tm, &time);
+        #else
+            gmtime_r(&time, &tm);
+        #endif
+            char buf[64];
+            size_t len = std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            return std::string(buf, len);
+        }
+        /**
+         * Parses a HTTP date (RFC 7231 IMF-fixdate), e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+         * @param date Formatted date.
+         * @param time Receives the seconds since epoch.
+         * @returns false if the date cannot be parsed.
+         */
+        static bool parseHttpDate(std::string_view date, std::time_t& time) {
+            static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+            char mon[4] = {};
+            std::tm tm{};
+            std::string buf(date);
+            if(std::sscanf(buf.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+                return false;
+            const char* m = std::strstr(months, mon);
+            if(!m || mon[0] == 0 || (m - months) % 3 != 0)
+                return false;
+            tm.tm_mon = static_cast<int>((m - months) / 3);
+            tm.tm_year -= 1900;
+        #if defined(_WIN32)
+            time = _mkgmtime(&tm);
+        #else
+            time = timegm(&tm);
+        #endif
+            return time != static_cast<std::time_t>(-1);
+        }
+        /**
+         * Builds an ETag from inode, size and modification time (in nanoseconds) of a file.
+         * @param st Stat result of the file.
+         * @returns ETag header value.
+         */
+        static std::string makeETag(const FileSystem::DirEntry& st) {
+            char buf[80];
+            int len = std::snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"", static_cast<unsigned long long>(st.Inode),
+                                    static_cast<unsigned long long>(st.Size), static_cast<unsigned long long>(st.MTime));
+            return std::string(buf, static_cast<size_t>(len));
+        }
+        /**
+         * Stats a file, following symbolic links.
+         * @param file File to stat.
+         * @param st Result.
+         * @returns true on success.
+         */
+        static bool statFile(const std::filesystem::path& file, FileSystem::DirEntry& st) {
+        #if defined(__linux__)
+            return FileSystem::DirectoryWalker::statAt(AT_FDCWD, file.c_str(), st, true);
+        #else
+            return FileSystem::DirectoryWalker::statAt(0, file.string().c_str(), st, true);
+        #endif
+        }
+        using SPtr = std::shared_ptr<FileCache>;
+        using UPtr = std::unique_ptr<FileCache>;
+        using WPtr = std::weak_ptr<FileCache>;
+    private:
+        struct Shard {
+            mutable std::mutex Mutex;
+            std::list<std::pair<std::string, EntryPtr>> Lru;
+            std::unordered_map<std::string, std::list<std::pair<std::string, EntryPtr>>::iterator> Map;
+            size_t Bytes = 0;
+            size_t MaxBytes = 0;
+        };
+
+        Shard& shard(const std::string& key) {
+            return m_Shards[std::hash<std::string>{}(key) % m_Shards.size()];
+        }
+        void store(const std::string& key, const EntryPtr& entry) {
+            Shard& s = shard(key);
+            std::lock_guard<std::mutex> lock(s.Mutex);
+            auto it = s.Map.find(key);
+            if(it != s.Map.end()) {
+                s.Bytes -= it->second->second->Body->size();
+                s.Lru.erase(it->second);
+                s.Map.erase(it);
+            }
+            s.Lru.emplace_front(key, entry);
+            s.Map[key] = s.Lru.begin();
+            s.Bytes += entry->Body->size();
+            while(s.Bytes > s.MaxBytes && s.Lru.size() > 1) { // evict least recently used
+                s.Bytes -= s.Lru.back().second->Body->size();
+                s.Map.erase(s.Lru.back().first);
+                s.Lru.pop_back();
+            }
+        }
+        void erase(const std::string& key) {
+            Shard& s = shard(key);
+            std::lock_guard<std::mutex> lock(s.Mutex);
+            auto it = s.Map.find(key);
+            if(it == s.Map.end())
+                return;
+            s.Bytes -= it->second->second->Body->size();
+            s.Lru.erase(it->second);
+            s.Map.erase(it);
+        }
+        static bool unchanged(const Entry& e) {
+            FileSystem::DirEntry st;
+            return statFile(e.Path, st) && st.Size == e.Size && st.Inode == e.Inode && st.MTime == e.MTime;
+        }
+        static bool isBelow(const std::string& file, const std::string& dir) {
+            return file.size() >= dir.size() && file.compare(0, dir.size(), dir) == 0 &&
+                   (file.size() == dir.size() || file[dir.size()] == '/' || dir.back() == '/');
+        }
+        static int64_t steadyNow() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        size_t m_MaxFileSize;
+        std::vector<Shard> m_Shards;
+        std::atomic<int64_t> m_Revalidate{1000000000};
+        std::atomic<uint64_t> m_Hits{0};
+        std::atomic<uint64_t> m_Misses{0};
+    };
+}
+#endif //SUPPORTLIB_FILECACHE_H
@@ -11,11 +11,45 @@
 #define SUPPORTLIB_FILESYSTEM_H
 
 #include "Exception.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <deque>
 #include <vector>
 #include <fstream>
 #include <filesystem>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#if defined(__linux__)
+#include <spawn.h>
+#include <linux/fs.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+extern char **environ;
+#endif
 
 namespace giri {
 
@@ -76,32 +110,461 @@ namespace giri {
             return true;
         }
         /**
-         * Searches for an executable within PATH.
+         * Called while copying or transferring data with the number of bytes
+         * done so far and the total number of bytes. Return false to abort.
+         */
+        using ProgressHandler = std::function<bool(uint64_t, uint64_t)>;
+
+#if defined(__linux__)
+        /**
+         * @brief Owns a file descriptor and closes it on destruction.
+         */
+        class FileDescriptor final
+        {
+        public:
+            explicit FileDescriptor(int fd = -1) : m_Fd(fd) {}
+            ~FileDescriptor() { reset(); }
+            FileDescriptor(FileDescriptor&& other) noexcept : m_Fd(other.release()) {}
+            FileDescriptor& operator=(FileDescriptor&& other) noexcept {
+                if(this != &other)
+                    reset(other.release());
+                return *this;
+            }
+            FileDescriptor(const FileDescriptor&) = delete;
+            FileDescriptor& operator=(const FileDescriptor&) = delete;
+            /**
+             * @returns The owned file descriptor, -1 if none.
+             */
+            int get() const { return m_Fd; }
+            /**
+             * Releases ownership without closing.
+             * @returns The released file descriptor.
+             */
+            int release() { int fd = m_Fd; m_Fd = -1; return fd; }
+            /**
+             * Closes the owned file descriptor and takes ownership of fd.
+             * @param fd File descriptor to own. (defaults to none)
+             */
+            void reset(int fd = -1) {
+                if(m_Fd >= 0)
+                    ::close(m_Fd);
+                m_Fd = fd;
+            }
+            explicit operator bool() const { return m_Fd >= 0; }
+        private:
+            int m_Fd;
+        };
+
+        /**
+         * Transfers data between file descriptors within the kernel. Uses sendfile
+         * (file to file or socket), falls back to splice through a pipe and finally
+         * to read/write if neither is supported for the given descriptors. Non-blocking
+         * output descriptors are waited for using poll. Throws FileSystemException on error.
+         * @param outFd Descriptor to write to, e.g. a socket.
+         * @param inFd Descriptor to read from, e.g. a regular file.
+         * @param offset Offset within inFd to start reading from.
+         * @param count Number of bytes to transfer, stops early at end of file.
+         * @param progress Handler to report progress. (optional)
+         * @returns Number of transferred bytes.
+         */
+        inline uint64_t Transfer(int outFd, int inFd, uint64_t offset, uint64_t count, const ProgressHandler& progress = nullptr) {
+            constexpr size_t chunk = 16 * 1024 * 1024;
+            enum class Method { Sendfile, Splice, ReadWrite } method = Method::Sendfile;
+            FileDescriptor pipeIn, pipeOut;
+            uint64_t done = 0;
+            while(done < count) {
+                size_t len = static_cast<size_t>(std::min<uint64_t>(count - done, chunk));
+                ssize_t ret = -1;
+                if(method == Method::Sendfile) {
+                    off_t off = static_cast<off_t>(offset + done);
+                    ret = ::sendfile(outFd, inFd, &off, len);
+                    if(ret < 0 && (errno == EINVAL || errno == ENOSYS) && done == 0) {
+                        method = Method::Splice;
+                        continue;
+                    }
+                }
+                else if(method == Method::Splice) {
+                    if(!pipeIn) {
+                        int fds[2];
+                        if(pipe2(fds, O_CLOEXEC) != 0) {
+                            method = Method::ReadWrite;
+                            continue;
+                        }
+                        pipeOut.reset(fds[0]);
+                        pipeIn.reset(fds[1]);
+                    }
+                    loff_t off = static_cast<loff_t>(offset + done);
+                    ret = ::splice(inFd, &off, pipeIn.get(), nullptr, std::min<size_t>(len, 1024 * 1024), SPLICE_F_MOVE);
+                    if(ret < 0 && (errno == EINVAL || errno == ENOSYS) && done == 0) {
+                        method = Method::ReadWrite;
+                        continue;
+                    }
+                    for(ssize_t left = ret; left > 0;) {
+                        ssize_t out = ::splice(pipeOut.get(), nullptr, outFd, nullptr, static_cast<size_t>(left), SPLICE_F_MOVE | SPLICE_F_MORE);
+                        if(out < 0 && errno == EAGAIN) {
+                            pollfd pfd{outFd, POLLOUT, 0};
+                            ::poll(&pfd, 1, -1);
+                            continue;
+                        }
+                        if(out < 0 && errno == EINTR)
+                            continue;
+                        if(out <= 0)
+                            throw FileSystemException(std::string("splice() failed: ") + strerror(errno));
+                        left -= out;
+                    }
+                }
+                else {
+                    std::array<char, 64 * 1024> buffer;
+                    ret = ::pread(inFd, buffer.data(), std::min(len, buffer.size()), static_cast<off_t>(offset + done));
+                    for(ssize_t pos = 0; pos < ret;) {
+                        ssize_t out = ::write(outFd, buffer.data() + pos, static_cast<size_t>(ret - pos));
+                        if(out < 0 && errno == EAGAIN) {
+                            pollfd pfd{outFd, POLLOUT, 0};
+                            ::poll(&pfd, 1, -1);
+                            continue;
+                        }
+                        if(out < 0 && errno == EINTR)
+                            continue;
+                        if(out <= 0)
+                            throw FileSystemException(std::string("write() failed: ") + strerror(errno));
+                        pos += out;
+                    }
+                }
+                if(ret < 0 && errno == EAGAIN) {
+                    pollfd pfd{outFd, POLLOUT, 0};
+                    ::poll(&pfd, 1, -1);
+                    continue;
+                }
+                if(ret < 0 && errno == EINTR)
+                    continue;
+                if(ret < 0)
+                    throw FileSystemException(std::string("Transfer failed: ") + strerror(errno));
+                if(ret == 0)
+                    break; // end of file
+                done += static_cast<uint64_t>(ret);
+                if(progress && !progress(done, count))
+                    throw FileSystemException("Transfer aborted.");
+            }
+            return done;
+        }
+
+        /**
+         * Transfers a file to a descriptor (e.g. a socket) without copying it
+         * through user space, see Transfer(int, int, uint64_t, uint64_t, const ProgressHandler&).
+         * Throws FileSystemException on error.
+         * @param outFd Descriptor to write to.
+         * @param file File to send.
+         * @param offset Offset within the file to start at. (defaults to 0)
+         * @param count Number of bytes to send. (defaults to the whole file)
+         * @param progress Handler to report progress. (optional)
+         * @returns Number of transferred bytes.
+         */
+        inline uint64_t Transfer(int outFd, const std::filesystem::path& file, uint64_t offset = 0, uint64_t count = std::numeric_limits<uint64_t>::max(), const ProgressHandler& progress = nullptr) {
+            FileDescriptor in(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+            if(!in)
+                throw FileSystemException("Could not open file: " + file.string());
+            struct stat st;
+            if(::fstat(in.get(), &st) != 0)
+                throw FileSystemException("Could not stat file: " + file.string());
+            uint64_t size = static_cast<uint64_t>(st.st_size);
+            if(offset >= size)
+                return 0;
+            return Transfer(outFd, in.get(), offset, std::min(count, size - offset), progress);
+        }
+#endif
+
+        /**
+         * Copies a file. On linux the data never passes through user space: the
+         * copy is done as reflink (FICLONE) if the filesystem supports it, otherwise
+         * using copy_file_range, with sendfile and read/write as fallbacks. If the
+         * destination exists it will be overridden. Throws FileSystemException on error,
+         * also if source and destination are the same file (e.g. hard links).
+         * @param from File to copy.
+         * @param to Destination file.
+         * @param progress Handler to report progress. (optional, not called for reflinks before completion)
+         * @param reflink Try to share the data blocks using a reflink. (defaults to true)
+         * @returns Number of copied bytes.
+         */
+        inline uint64_t Copy(const std::filesystem::path& from, const std::filesystem::path& to, const ProgressHandler& progress = nullptr, bool reflink = true) {
+        #if defined(__linux__)
+            FileDescriptor in(::open(from.c_str(), O_RDONLY | O_CLOEXEC));
+            if(!in)
+                throw FileSystemException("Could not open file: " + from.string());
+            struct stat st;
+            if(::fstat(in.get(), &st) != 0)
+                throw FileSystemException("Could not stat file: " + from.string());
+            FileDescriptor out(::open(to.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, st.st_mode & 07777));
+            if(!out)
+                throw FileSystemException("Could not open file: " + to.string());
+            struct stat dst;
+            if(::fstat(out.get(), &dst) != 0)
+                throw FileSystemException("Could not stat file: " + to.string());
+            if(dst.st_dev == st.st_dev && dst.st_ino == st.st_ino) // truncating would destroy the source
+                throw FileSystemException("Source and destination are the same file: " + from.string());
+            if(::ftruncate(out.get(), 0) != 0)
+                throw FileSystemException("Could not truncate file: " + to.string() + ": " + strerror(errno));
+            uint64_t size = static_cast<uint64_t>(st.st_size);
+
+            if(reflink && ::ioctl(out.get(), FICLONE, in.get()) == 0) {
+                if(progress)
+                    progress(size, size);
+                return size;
+            }
+
+            constexpr size_t chunk = 16 * 1024 * 1024;
+            uint64_t done = 0;
+            while(done < size) {
+                ssize_t ret = ::copy_file_range(in.get(), nullptr, out.get(), nullptr, static_cast<size_t>(std::min<uint64_t>(size - done, chunk)), 0);
+                if(ret < 0 && errno == EINTR)
+                    continue;
+                if(ret < 0 && done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    return Transfer(out.get(), in.get(), 0, size, progress); // copy_file_range not supported here
+                }
+                if(ret < 0)
+                    throw FileSystemException("Could not copy file: " + from.string() + ": " + strerror(errno));
+                if(ret == 0)
+                    break; // file shrunk meanwhile
+                done += static_cast<uint64_t>(ret);
+                if(progress && !progress(done, size))
+                    throw FileSystemException("Copy aborted: " + from.string());
+            }
+            return done;
+        #else
+            (void)reflink;
+            std::error_code ec;
+            if(std::filesystem::equivalent(from, to, ec))
+                throw FileSystemException("Source and destination are the same file: " + from.string());
+            std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+            if(ec)
+                throw FileSystemException("Could not copy file: " + from.string() + ": " + ec.message());
+            uint64_t size = std::filesystem::file_size(to, ec);
+            if(progress)
+                progress(size, size);
+            return size;
+        #endif
+        }
+
+        /**
+         * @brief Resolves executable names to paths within PATH and caches the results.
+         *
+         * Cached entries belong to the PATH value they were resolved for and
+         * are dropped when PATH changes. On linux the PATH directories are
+         * watched using inotify, so executables being added, removed or changing
+         * permissions invalidate the cache. Where no inotify watch can be set up
+         * (e.g. the directory does not exist yet) no results depending on that
+         * directory are cached, setting up the watch is retried on later lookups.
+         * Results found through relative PATH directories (e.g. ".") are never cached.
+         * Lookups may be issued concurrently from multiple threads.
+         */
+        class ExecutableResolver : public Object<ExecutableResolver>
+        {
+        public:
+            ExecutableResolver() {
+            #if defined(__linux__)
+                m_Inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            #endif
+            }
+            ~ExecutableResolver() {
+            #if defined(__linux__)
+                if(m_Inotify >= 0)
+                    ::close(m_Inotify);
+            #endif
+            }
+            ExecutableResolver(const ExecutableResolver&) = delete;
+            ExecutableResolver& operator=(const ExecutableResolver&) = delete;
+
+            /**
+             * Searches for an executable within PATH.
+             * @param executable Name of executable to search for.
+             * @returns Path to executable if existent, emtpty string if not existent.
+             */
+            std::filesystem::path find(const std::string &executable) {
+                const char* env = getenv("PATH");
+                std::string_view pathVar = env ? env : "";
+                if(m_Inotify < 0)
+                    return search(pathVar, executable);
+
+                checkChanges();
+                {
+                    std::shared_lock<std::shared_mutex> lock(m_Mutex);
+                    if(pathVar == m_Path) {
+                        auto it = m_Cache.find(executable);
+                        if(it != m_Cache.end())
+                            return it->second;
+                    }
+                }
+                uint64_t generation;
+                {
+                    std::unique_lock<std::shared_mutex> lock(m_Mutex);
+                    if(pathVar != m_Path)
+                        rewatch(pathVar);
+                    else if(m_Unwatched > 0)
+                        rearm();
+                    generation = m_Generation;
+                }
+                size_t searched = 0;
+                std::filesystem::path res = search(pathVar, executable, &searched);
+                checkChanges();
+                std::unique_lock<std::shared_mutex> lock(m_Mutex);
+                if(generation == m_Generation && pathVar == m_Path && watched(searched))
+                    m_Cache.emplace(executable, res);
+                return res;
+            }
+            /**
+             * Drops all cached results.
+             */
+            void clear() {
+                std::unique_lock<std::shared_mutex> lock(m_Mutex);
+                m_Cache.clear();
+                ++m_Generation;
+            }
+            using SPtr = std::shared_ptr<ExecutableResolver>;
+            using UPtr = std::unique_ptr<ExecutableResolver>;
+            using WPtr = std::weak_ptr<ExecutableResolver>;
+        private:
+            static bool isExecutable(const std::filesystem::path& file) {
+            #if defined(__linux__)
+                struct stat st;
+                return ::stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode) && ::access(file.c_str(), X_OK) == 0;
+            #else
+                std::error_code ec;
+                return std::filesystem::exists(file, ec);
+            #endif
+            }
+
+            template<typename F>
+            static void forEachDir(std::string_view pathVar, F func) {
+            #if defined(_WIN32)
+                char delim = ';';
+            #else
+                char delim = ':';
+            #endif
+                size_t pos = 0;
+                while(pos < pathVar.size()) {
+                    size_t end = pathVar.find(delim, pos);
+                    if(end == std::string_view::npos)
+                        end = pathVar.size();
+                    if(end > pos && func(pathVar.substr(pos, end - pos)))
+                        return;
+                    pos = end + 1;
+                }
+            }
+
+            static std::filesystem::path search(std::string_view pathVar, const std::string &executable, size_t* searched = nullptr) {
+                std::filesystem::path res;
+                forEachDir(pathVar, [&](std::string_view dir){
+                    if(searched)
+                        ++*searched;
+                    std::filesystem::path exec(dir);
+                    exec.append(executable);
+                    if(isExecutable(exec)) {
+                        res = std::move(exec);
+                        return true;
+                    }
+                    exec.replace_extension(".exe");
+                    if(isExecutable(exec)) {
+                        res = std::move(exec);
+                        return true;
+                    }
+                    return false;
+                });
+                return res;
+            }
+
+            // expects m_Mutex to be locked exclusively
+            void rewatch(std::string_view pathVar) {
+            #if defined(__linux__)
+                for(const auto& dir : m_Dirs)
+                    if(dir.second >= 0)
+                        inotify_rm_watch(m_Inotify, dir.second);
+                m_Dirs.clear();
+                m_Unwatched = 0;
+                forEachDir(pathVar, [&](std::string_view dir){
+                    const bool relative = dir.front() != '/'; // depends on the working directory, never cached
+                    m_Dirs.emplace_back(std::string(dir), relative ? Relative : -1);
+                    m_Unwatched += relative ? 0 : 1;
+                    return false;
+                });
+                rearm();
+            #endif
+                m_Path = pathVar;
+                m_Cache.clear();
+                ++m_Generation;
+            }
+
+            // expects m_Mutex to be locked exclusively, tries to watch the directories which have no watch yet
+            void rearm() {
+            #if defined(__linux__)
+                for(auto& dir : m_Dirs) {
+                    if(dir.second != -1)
+                        continue;
+                    dir.second = inotify_add_watch(m_Inotify, dir.first.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+                    if(dir.second >= 0)
+                        --m_Unwatched;
+                }
+            #endif
+            }
+
+            // expects m_Mutex to be locked, true if the first count PATH directories are watched
+            bool watched(size_t count) const {
+                for(size_t i = 0; i < count && i < m_Dirs.size(); ++i)
+                    if(m_Dirs[i].second < 0)
+                        return false;
+                return true;
+            }
+
+            // events are only read with m_Mutex locked exclusively, so they are applied before anyone reads the cache again
+            void checkChanges() {
+            #if defined(__linux__)
+                pollfd pfd{m_Inotify, POLLIN, 0};
+                if(::poll(&pfd, 1, 0) <= 0)
+                    return;
+                std::unique_lock<std::shared_mutex> lock(m_Mutex);
+                alignas(inotify_event) std::array<char, 4096> buffer;
+                bool changed = false;
+                std::vector<int> ignored; // watches removed by the kernel, e.g. the directory was deleted
+                ssize_t len;
+                while((len = ::read(m_Inotify, buffer.data(), buffer.size())) > 0) {
+                    changed = true;
+                    for(ssize_t pos = 0; pos < len;) {
+                        const auto* ev = reinterpret_cast<const inotify_event*>(buffer.data() + pos);
+                        if(ev->mask & IN_IGNORED)
+                            ignored.push_back(ev->wd);
+                        pos += static_cast<ssize_t>(sizeof(inotify_event) + ev->len);
+                    }
+                }
+                if(!changed)
+                    return;
+                for(auto& dir : m_Dirs) {
+                    if(dir.second >= 0 && std::find(ignored.begin(), ignored.end(), dir.second) != ignored.end()) {
+                        dir.second = -1; // set up again by rearm
+                        ++m_Unwatched;
+                    }
+                }
+                m_Cache.clear();
+                ++m_Generation;
+            #endif
+            }
+
+            int m_Inotify = -1;
+            std::shared_mutex m_Mutex;
+            std::string m_Path;
+            uint64_t m_Generation = 0;
+            std::unordered_map<std::string, std::filesystem::path> m_Cache;
+            static constexpr int Relative = -2; // m_Dirs entry relative to the working directory
+            std::vector<std::pair<std::string, int>> m_Dirs; // PATH directories and their watches, -1 if unwatched
+            size_t m_Unwatched = 0;
+        };
+        /**
+         * Searches for an executable within PATH. Results are cached
+         * by a process wide ExecutableResolver.
          * @param executable Name of executable to search for.
          * @returns Path to executable if existent, emtpty string if not existent.
          */
         inline std::filesystem::path FindExecutableInPath(const std::string &executable)
         {
-            std::string path = getenv("PATH");
-        #if defined(_WIN32)
-            char delim = ';';
-        #else
-            char delim = ':';
-        #endif
-            std::vector<std::string> tokens;
-            std::string token;
-            std::istringstream tokenStream(path);
-            while (std::getline(tokenStream, token, delim))
-            {
-                std::filesystem::path exec(token);
-                exec.append(executable);
-                if(std::filesystem::exists(exec))
-                    return exec;
-                exec.replace_extension(".exe");
-                if(std::filesystem::exists(exec))
-                    return exec;
-            }
-            return "";
+            static ExecutableResolver resolver;
+            return resolver.find(executable);
         }
         /**
          * Executes a command synchronously.
@@ -125,13 +588,821 @@ namespace giri {
             return result;
         }
         /**
-         * Executes a command asynchronously.
+         * @brief Entry reported by WalkDirectory and StatFiles.
+         *
+         * The stat fields are only valid if HasStat is true.
+         */
+        struct DirEntry {
+            std::filesystem::path Path;
+            std::filesystem::file_type Type = std::filesystem::file_type::none;
+            size_t Depth = 0;   ///< 0 for direct children of the walked root.
+            bool HasStat = false;
+            uint64_t Device = 0;
+            uint64_t Inode = 0;
+            uint64_t Size = 0;
+            uint32_t Mode = 0;
+            uint32_t NLink = 0;
+            int64_t MTime = 0;  ///< Modification time in nanoseconds since epoch.
+        };
+
+        /**
+         * @brief Options for WalkDirectory.
+         */
+        struct WalkOptions {
+            size_t Threads = std::thread::hardware_concurrency(); ///< Number of threads used for walking (including the calling one).
+            bool Stat = true;       ///< false enables the fast mode which only reports the type provided by the directory listing.
+            size_t MaxDepth = std::numeric_limits<size_t>::max(); ///< Maximum depth to descend to.
+            size_t BatchSize = 256; ///< Number of entries per batch, only used by WalkDirectoryBatched.
+            std::function<bool(const DirEntry&)> Filter; ///< Return false to not report an entry. (does not prevent descending)
+            std::function<bool(const DirEntry&)> Prune;  ///< Return true to not descend into a directory.
+        };
+
+        /**
+         * @brief Walks directory trees using multiple threads.
+         *
+         * Directories are listed with getdents64 and entries are stat'ed relative
+         * to their directory (statx/fstatat), the directory queue is distributed
+         * among the threads using work stealing. Use WalkDirectory or WalkDirectoryBatched
+         * instead of using this class directly.
+         */
+        class DirectoryWalker : public Object<DirectoryWalker>
+        {
+        public:
+            using EntryHandler = std::function<void(const DirEntry&)>;
+            using BatchHandler = std::function<void(std::vector<DirEntry>&&)>;
+
+            /**
+             * @param opts Options to use.
+             */
+            explicit DirectoryWalker(const WalkOptions& opts = {}) : m_Options(opts) {
+                if(m_Options.Threads == 0)
+                    m_Options.Threads = 1;
+                if(m_Options.BatchSize == 0)
+                    m_Options.BatchSize = 1;
+            }
+            /**
+             * Walks the tree below root. Handlers are called concurrently from all
+             * walker threads. Directories which cannot be opened are skipped. If a handler
+             * throws the walk is aborted and the exception rethrown. Throws FileSystemException
+             * if root is not a directory.
+             * @param root Directory to walk.
+             * @param onEntry Handler called for each entry, may be empty if onBatch is used.
+             * @param onBatch Handler called with batches of entries, may be empty if onEntry is used.
+             * @returns Number of reported entries.
+             */
+            size_t walk(const std::filesystem::path& root, const EntryHandler& onEntry, const BatchHandler& onBatch = nullptr) {
+                std::error_code ec;
+                if(!std::filesystem::is_directory(root, ec))
+                    throw FileSystemException("Not a directory: " + root.string());
+                m_OnEntry = &onEntry;
+                m_OnBatch = &onBatch;
+                m_Queues = std::vector<Queue>(m_Options.Threads);
+                m_Pending = 0;
+                m_Reported = 0;
+                m_Abort = false;
+                m_Error = nullptr;
+                push(0, Task{root.string(), 0});
+
+                std::vector<std::thread> threads;
+                threads.reserve(m_Options.Threads - 1);
+                for(size_t i = 1; i < m_Options.Threads; i++)
+                    threads.emplace_back([this, i]{ work(i); });
+                work(0);
+                for(auto& t : threads)
+                    t.join();
+                m_Queues.clear();
+                if(m_Error)
+                    std::rethrow_exception(m_Error);
+                return m_Reported;
+            }
+            using SPtr = std::shared_ptr<DirectoryWalker>;
+            using UPtr = std::unique_ptr<DirectoryWalker>;
+            using WPtr = std::weak_ptr<DirectoryWalker>;
+
+            /**
+             * Stats a file relative to a directory file descriptor.
+             * @param dirFd Directory file descriptor or AT_FDCWD.
+             * @param name Name of the file relative to dirFd.
+             * @param entry Entry to fill.
+             * @param follow Follow symbolic links.
+             * @returns true on success.
+             */
+            static bool statAt(int dirFd, const char* name, DirEntry& entry, bool follow = false) {
+            #if defined(__linux__) && defined(STATX_BASIC_STATS)
+                struct statx stx;
+                if(::statx(dirFd, name, (follow ? 0 : AT_SYMLINK_NOFOLLOW) | AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_MTIME, &stx) != 0)
+                    return false;
+                entry.Device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+                entry.Inode = stx.stx_ino;
+                entry.Size = stx.stx_size;
+                entry.Mode = stx.stx_mode;
+                entry.NLink = stx.stx_nlink;
+                entry.MTime = static_cast<int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+            #elif defined(__linux__)
+                struct stat st;
+                if(::fstatat(dirFd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+                    return false;
+                entry.Device = st.st_dev;
+                entry.Inode = st.st_ino;
+                entry.Size = st.st_size;
+                entry.Mode = st.st_mode;
+                entry.NLink = st.st_nlink;
+                entry.MTime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+            #else
+                (void)dirFd;
+                std::error_code ec;
+                std::filesystem::path p(name);
+                auto status = follow ? std::filesystem::status(p, ec) : std::filesystem::symlink_status(p, ec);
+                if(ec)
+                    return false;
+                entry.Type = status.type();
+                entry.Size = entry.Type == std::filesystem::file_type::regular ? std::filesystem::file_size(p, ec) : 0;
+                entry.MTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::filesystem::last_write_time(p, ec).time_since_epoch()).count();
+                entry.HasStat = true;
+                return true;
+            #endif
+            #if defined(__linux__)
+                switch(entry.Mode & S_IFMT) {
+                    case S_IFREG: entry.Type = std::filesystem::file_type::regular; break;
+                    case S_IFDIR: entry.Type = std::filesystem::file_type::directory; break;
+                    case S_IFLNK: entry.Type = std::filesystem::file_type::symlink; break;
+                    case S_IFBLK: entry.Type = std::filesystem::file_type::block; break;
+                    case S_IFCHR: entry.Type = std::filesystem::file_type::character; break;
+                    case S_IFIFO: entry.Type = std::filesystem::file_type::fifo; break;
+                    case S_IFSOCK: entry.Type = std::filesystem::file_type::socket; break;
+                    default: entry.Type = std::filesystem::file_type::unknown;
+                }
+                entry.HasStat = true;
+                return true;
+            #endif
+            }
+        private:
+            struct Task {
+                std::string Path;
+                size_t Depth;
+            };
+            struct Queue {
+                std::mutex Mutex;
+                std::deque<Task> Tasks;
+            };
+
+            void push(size_t self, Task&& task) {
+                ++m_Pending;
+                {
+                    std::lock_guard<std::mutex> lock(m_Queues[self].Mutex);
+                    m_Queues[self].Tasks.push_back(std::move(task));
+                }
+                if(m_Idle > 0)
+                    m_Cv.notify_one();
+            }
+
+            bool pop(size_t self, Task& task) {
+                { // own queue is used lifo to keep the working set small
+                    Queue& q = m_Queues[self];
+                    std::lock_guard<std::mutex> lock(q.Mutex);
+                    if(!q.Tasks.empty()) {
+                        task = std::move(q.Tasks.back());
+                        q.Tasks.pop_back();
+                        return true;
+                    }
+                }
+                for(size_t i = 1; i < m_Queues.size(); i++) { // steal the oldest (biggest) work of others
+                    Queue& q = m_Queues[(self + i) % m_Queues.size()];
+                    std::lock_guard<std::mutex> lock(q.Mutex);
+                    if(!q.Tasks.empty()) {
+                        task = std::move(q.Tasks.front());
+                        q.Tasks.pop_front();
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void work(size_t self) {
+                std::vector<DirEntry> batch;
+                Task task;
+                while(!m_Abort) {
+                    if(pop(self, task)) {
+                        try {
+                            process(self, task, batch);
+                        }
+                        catch(...) {
+                            std::lock_guard<std::mutex> lock(m_WaitMutex);
+                            if(!m_Error)
+                                m_Error = std::current_exception();
+                            m_Abort = true;
+                        }
+                        if(--m_Pending == 0 || m_Abort) {
+                            std::lock_guard<std::mutex> lock(m_WaitMutex);
+                            m_Cv.notify_all();
+                        }
+                        continue;
+                    }
+                    std::unique_lock<std::mutex> lock(m_WaitMutex);
+                    if(m_Pending == 0 || m_Abort)
+                        break;
+                    ++m_Idle;
+                    m_Cv.wait_for(lock, std::chrono::milliseconds(1));
+                    --m_Idle;
+                }
+                if(!batch.empty() && !m_Abort && *m_OnBatch) {
+                    try {
+                        (*m_OnBatch)(std::move(batch));
+                    }
+                    catch(...) {
+                        std::lock_guard<std::mutex> lock(m_WaitMutex);
+                        if(!m_Error)
+                            m_Error = std::current_exception();
+                        m_Abort = true;
+                    }
+                }
+            }
+
+            void report(DirEntry&& entry, std::vector<DirEntry>& batch) {
+                if(m_Options.Filter && !m_Options.Filter(entry))
+                    return;
+                ++m_Reported;
+                if(*m_OnEntry)
+                    (*m_OnEntry)(entry);
+                if(*m_OnBatch) {
+                    batch.push_back(std::move(entry));
+                    if(batch.size() >= m_Options.BatchSize) {
+                        (*m_OnBatch)(std::move(batch));
+                        batch.clear();
+                        batch.reserve(m_Options.BatchSize);
+                    }
+                }
+            }
+
+        #if defined(__linux__)
+            static std::filesystem::file_type fromDirentType(unsigned char type) {
+                switch(type) {
+                    case DT_REG: return std::filesystem::file_type::regular;
+                    case DT_DIR: return std::filesystem::file_type::directory;
+                    case DT_LNK: return std::filesystem::file_type::symlink;
+                    case DT_BLK: return std::filesystem::file_type::block;
+                    case DT_CHR: return std::filesystem::file_type::character;
+                    case DT_FIFO: return std::filesystem::file_type::fifo;
+                    case DT_SOCK: return std::filesystem::file_type::socket;
+                    default: return std::filesystem::file_type::unknown;
+                }
+            }
+
+            void process(size_t self, const Task& task, std::vector<DirEntry>& batch) {
+                int fd = ::open(task.Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if(fd < 0)
+                    return; // skip unreadable directories
+                struct LinuxDirent64 {
+                    uint64_t d_ino;
+                    int64_t d_off;
+                    unsigned short d_reclen;
+                    unsigned char d_type;
+                    char d_name[];
+                };
+                alignas(LinuxDirent64) std::array<char, 64 * 1024> buffer;
+                try {
+                    while(!m_Abort) {
+                        long len = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+                        if(len <= 0)
+                            break;
+                        for(long pos = 0; pos < len;) {
+                            auto* d = reinterpret_cast<LinuxDirent64*>(buffer.data() + pos);
+                            pos += d->d_reclen;
+                            if(d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+                                continue;
+                            DirEntry entry;
+                            entry.Depth = task.Depth;
+                            entry.Inode = d->d_ino;
+                            entry.Type = fromDirentType(d->d_type);
+                            if(m_Options.Stat || entry.Type == std::filesystem::file_type::unknown)
+                                statAt(fd, d->d_name, entry);
+                            entry.Path = task.Path;
+                            entry.Path /= d->d_name;
+                            bool descend = entry.Type == std::filesystem::file_type::directory &&
+                                           task.Depth < m_Options.MaxDepth &&
+                                           !(m_Options.Prune && m_Options.Prune(entry));
+                            if(descend)
+                                push(self, Task{entry.Path.string(), task.Depth + 1});
+                            report(std::move(entry), batch);
+                        }
+                    }
+                }
+                catch(...) {
+                    ::close(fd);
+                    throw;
+                }
+                ::close(fd);
+            }
+        #else
+            void process(size_t self, const Task& task, std::vector<DirEntry>& batch) {
+                std::error_code ec;
+                for(const auto& de : std::filesystem::directory_iterator(task.Path, std::filesystem::directory_options::skip_permission_denied, ec)) {
+                    if(m_Abort)
+                        return;
+                    DirEntry entry;
+                    entry.Depth = task.Depth;
+                    entry.Path = de.path();
+                    entry.Type = de.symlink_status(ec).type();
+                    if(m_Options.Stat)
+                        statAt(0, entry.Path.string().c_str(), entry);
+                    bool descend = entry.Type == std::filesystem::file_type::directory &&
+                                   task.Depth < m_Options.MaxDepth &&
+                                   !(m_Options.Prune && m_Options.Prune(entry));
+                    if(descend)
+                        push(self, Task{entry.Path.string(), task.Depth + 1});
+                    report(std::move(entry), batch);
+                }
+            }
+        #endif
+
+            WalkOptions m_Options;
+            const EntryHandler* m_OnEntry = nullptr;
+            const BatchHandler* m_OnBatch = nullptr;
+            std::vector<Queue> m_Queues;
+            std::atomic<size_t> m_Pending{0};
+            std::atomic<size_t> m_Reported{0};
+            std::atomic<size_t> m_Idle{0};
+            std::atomic<bool> m_Abort{false};
+            std::exception_ptr m_Error;
+            std::mutex m_WaitMutex;
+            std::condition_variable m_Cv;
+        };
+
+        /**
+         * Walks a directory tree in parallel and calls onEntry for every entry
+         * below root. onEntry is called concurrently from multiple threads.
+         * Throws FileSystemException if root is not a directory.
+         *
+         *  Example Usage:
+         *  --------------
+         *
+         *  @code{.cpp}
+         *  #include <FileSystem.h>
+         *  #include <iostream>
+         *
+         *  using namespace giri;
+         *
+         *  int main()
+         *  {
+         *      std::atomic<uint64_t> bytes{0};
+         *      FileSystem::WalkOptions opts;
+         *      opts.Prune = [](const FileSystem::DirEntry& e){ return e.Path.filename() == ".git"; };
+         *      FileSystem::WalkDirectory("/home/giri", [&](const FileSystem::DirEntry& e){
+         *          bytes += e.Size;
+         *      }, opts);
+         *      std::cout << bytes << " bytes" << std::endl;
+         *      return EXIT_SUCCESS;
+         *  }
+         *  @endcode
+         * @param root Directory to walk.
+         * @param onEntry Handler to be called for each entry.
+         * @param opts Walk options, see WalkOptions.
+         * @returns Number of reported entries.
+         */
+        inline size_t WalkDirectory(const std::filesystem::path& root, const DirectoryWalker::EntryHandler& onEntry, const WalkOptions& opts = {}) {
+            return DirectoryWalker(opts).walk(root, onEntry);
+        }
+
+        /**
+         * Walks a directory tree in parallel and reports the entries in batches
+         * of up to WalkOptions::BatchSize entries. onBatch is called concurrently from
+         * multiple threads. Throws FileSystemException if root is not a directory.
+         * @param root Directory to walk.
+         * @param onBatch Handler to be called for each batch.
+         * @param opts Walk options, see WalkOptions.
+         * @returns Number of reported entries.
+         */
+        inline size_t WalkDirectoryBatched(const std::filesystem::path& root, const DirectoryWalker::BatchHandler& onBatch, const WalkOptions& opts = {}) {
+            return DirectoryWalker(opts).walk(root, nullptr, onBatch);
+        }
+
+        /**
+         * Stats many files in parallel.
+         * @param files Files to stat.
+         * @param threads Number of threads to use. (defaults to the number of cores)
+         * @param follow Follow symbolic links. (defaults to true)
+         * @returns One entry per file in the order of files, HasStat is false for files which could not be stat'ed.
+         */
+        inline std::vector<DirEntry> StatFiles(const std::vector<std::filesystem::path>& files, size_t threads = std::thread::hardware_concurrency(), bool follow = true) {
+            std::vector<DirEntry> res(files.size());
+            std::atomic<size_t> next{0};
+            auto work = [&]{
+                for(size_t i = next++; i < files.size(); i = next++) {
+                    res[i].Path = files[i];
+                #if defined(__linux__)
+                    bool ok = DirectoryWalker::statAt(AT_FDCWD, files[i].c_str(), res[i], follow);
+                #else
+                    bool ok = DirectoryWalker::statAt(0, files[i].string().c_str(), res[i], follow);
+                #endif
+                    if(!ok)
+                        res[i].Type = std::filesystem::file_type::not_found;
+                }
+            };
+            threads = std::max<size_t>(1, std::min(threads, files.size() / 64 + 1));
+            std::vector<std::thread> pool;
+            for(size_t i = 1; i < threads; i++)
+                pool.emplace_back(work);
+            work();
+            for(auto& t : pool)
+                t.join();
+            return res;
+        }
+
+#if defined(__linux__)
+        /**
+         * @brief Runs shell commands asynchronously with a bounded number of
+         * concurrently running child processes.
+         *
+         * Commands exceeding the concurrency limit are queued. All children are
+         * driven by a single event loop thread (epoll on the output pipes and
+         * pidfds), so hundreds of running commands do not need hundreds of threads.
+         * Output and completion handlers are invoked on that event loop thread,
+         * therefore they never run concurrently to each other and should not block.
+         *
+         *  Example Usage:
+         *  --------------
+         *
+         *  @code{.cpp}
+         *  #include <FileSystem.h>
+         *  #include <iostream>
+         *
+         *  using namespace giri;
+         *
+         *  int main()
+         *  {
+         *      FileSystem::ProcessPool pool(4); // run at most 4 commands at once
+         *      std::vector<std::future<int>> results;
+         *      for(int i = 0; i < 100; i++)
+         *          results.push_back(pool.execute("echo " + std::to_string(i), [](std::string_view out){
+         *              std::cout << out;
+         *          }));
+         *      for(auto& r : results)
+         *          r.wait();
+         *      return EXIT_SUCCESS;
+         *  }
+         *  @endcode
+         */
+        class ProcessPool : public Object<ProcessPool>
+        {
+        public:
+            /**
+             * Called with chunks of the standard output of a command.
+             */
+            using OutputHandler = std::function<void(std::string_view)>;
+            /**
+             * Called once a command finished. Receives the exit code (128 + signal
+             * number if the command was terminated by a signal) and an exception
+             * pointer which is set if the command could not be started or a
+             * handler threw.
+             */
+            using CompletionHandler = std::function<void(int, std::exception_ptr)>;
+
+            /**
+             * ProcessPool constructor. Starts the event loop thread.
+             * @param maxConcurrent Maximum number of concurrently running commands. (defaults to the number of cores)
+             */
+            explicit ProcessPool(size_t maxConcurrent = std::thread::hardware_concurrency()) :
+                m_MaxConcurrent(maxConcurrent ? maxConcurrent : 1)
+            {
+                m_Epoll = epoll_create1(EPOLL_CLOEXEC);
+                if(m_Epoll < 0)
+                    throw FileSystemException("epoll_create1() failed!");
+                m_Wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if(m_Wake < 0) {
+                    ::close(m_Epoll);
+                    throw FileSystemException("eventfd() failed!");
+                }
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.fd = m_Wake;
+                epoll_ctl(m_Epoll, EPOLL_CTL_ADD, m_Wake, &ev);
+                m_Thread = std::thread([this]{ loop(); });
+            }
+            /**
+             * Destructor. Waits until all queued and running commands finished.
+             */
+            ~ProcessPool() {
+                m_Stop = true;
+                wake();
+                if(m_Thread.joinable())
+                    m_Thread.join();
+                ::close(m_Wake);
+                ::close(m_Epoll);
+            }
+            ProcessPool(const ProcessPool&) = delete;
+            ProcessPool& operator=(const ProcessPool&) = delete;
+
+            /**
+             * Queues a command for execution.
+             * @param cmd Command to execute (passed to /bin/sh -c).
+             * @param onOutput Handler receiving the command output. (optional, output is discarded if empty)
+             * @param onDone Handler called when the command finished. (optional)
+             */
+            void execute(const std::string& cmd, OutputHandler onOutput, CompletionHandler onDone) {
+                auto job = std::make_unique<Job>();
+                job->Cmd = cmd;
+                job->OnOutput = std::move(onOutput);
+                job->OnDone = std::move(onDone);
+                {
+                    std::lock_guard<std::mutex> lock(m_Mutex);
+                    m_Queue.push_back(std::move(job));
+                }
+                wake();
+            }
+            /**
+             * Queues a command for execution.
+             * @param cmd Command to execute (passed to /bin/sh -c).
+             * @param onOutput Handler receiving the command output. (optional, output is discarded if empty)
+             * @returns Future holding the exit code of the command.
+             */
+            std::future<int> execute(const std::string& cmd, OutputHandler onOutput = nullptr) {
+                auto prom = std::make_shared<std::promise<int>>();
+                std::future<int> res = prom->get_future();
+                execute(cmd, std::move(onOutput), [prom](int code, std::exception_ptr ex){
+                    if(ex)
+                        prom->set_exception(ex);
+                    else
+                        prom->set_value(code);
+                });
+                return res;
+            }
+            /**
+             * Sets the maximum number of concurrently running commands.
+             * Already running commands are not affected.
+             * @param maxConcurrent Maximum number of concurrently running commands.
+             */
+            void setMaxConcurrent(size_t maxConcurrent) {
+                m_MaxConcurrent = maxConcurrent ? maxConcurrent : 1;
+                wake();
+            }
+            /**
+             * @returns Maximum number of concurrently running commands.
+             */
+            size_t getMaxConcurrent() const {
+                return m_MaxConcurrent;
+            }
+            /**
+             * @returns Number of currently running commands.
+             */
+            size_t getRunning() const {
+                return m_Running;
+            }
+            /**
+             * @returns Number of commands waiting for execution.
+             */
+            size_t getQueued() const {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                return m_Queue.size();
+            }
+            using SPtr = std::shared_ptr<ProcessPool>;
+            using UPtr = std::unique_ptr<ProcessPool>;
+            using WPtr = std::weak_ptr<ProcessPool>;
+        private:
+            struct Job {
+                std::string Cmd;
+                OutputHandler OnOutput;
+                CompletionHandler OnDone;
+                pid_t Pid = -1;
+                int OutFd = -1;
+                int PidFd = -1;
+                int Status = 0;
+                bool Exited = false;
+                std::exception_ptr Error;
+            };
+
+            void wake() {
+                uint64_t one = 1;
+                ssize_t ret = ::write(m_Wake, &one, sizeof(one));
+                (void)ret;
+            }
+
+            static int openPidFd(pid_t pid) {
+            #if defined(SYS_pidfd_open)
+                return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+            #else
+                (void)pid;
+                return -1;
+            #endif
+            }
+
+            void start(std::unique_ptr<Job> job) {
+                int fds[2];
+                if(pipe2(fds, O_CLOEXEC) != 0)
+                    return finish(std::move(job), std::make_exception_ptr(FileSystemException("pipe2() failed!")));
+
+                posix_spawn_file_actions_t actions;
+                posix_spawn_file_actions_init(&actions);
+                posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+                const char* argv[] = {"sh", "-c", job->Cmd.c_str(), nullptr};
+                int err = posix_spawn(&job->Pid, "/bin/sh", &actions, nullptr, const_cast<char* const*>(argv), environ);
+                posix_spawn_file_actions_destroy(&actions);
+                ::close(fds[1]);
+                if(err != 0) {
+                    ::close(fds[0]);
+                    return finish(std::move(job), std::make_exception_ptr(FileSystemException("posix_spawn() failed: " + job->Cmd)));
+                }
+
+                fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+                job->OutFd = fds[0];
+                job->PidFd = openPidFd(job->Pid);
+
+                Job* raw = job.get();
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.fd = raw->OutFd;
+                epoll_ctl(m_Epoll, EPOLL_CTL_ADD, raw->OutFd, &ev);
+                m_ByFd[raw->OutFd] = raw;
+                if(raw->PidFd >= 0) {
+                    ev.data.fd = raw->PidFd;
+                    epoll_ctl(m_Epoll, EPOLL_CTL_ADD, raw->PidFd, &ev);
+                    m_ByFd[raw->PidFd] = raw;
+                }
+                m_Jobs[raw] = std::move(job);
+                ++m_Running;
+            }
+
+            void finish(std::unique_ptr<Job> job, std::exception_ptr ex = nullptr) {
+                int code = -1;
+                if(WIFEXITED(job->Status))
+                    code = WEXITSTATUS(job->Status);
+                else if(WIFSIGNALED(job->Status))
+                    code = 128 + WTERMSIG(job->Status);
+                if(!ex)
+                    ex = job->Error;
+                if(job->OnDone) {
+                    try {
+                        job->OnDone(code, ex);
+                    }
+                    catch(...) {} // never let a handler take down the event loop
+                }
+            }
+
+            void reap(Job* job) {
+                if(job->Exited)
+                    return;
+                pid_t ret = waitpid(job->Pid, &job->Status, WNOHANG);
+                if(ret == job->Pid || (ret < 0 && errno == ECHILD))
+                    job->Exited = true;
+                if(job->Exited && job->PidFd >= 0) { // stays readable, a grandchild may still hold the output open
+                    epoll_ctl(m_Epoll, EPOLL_CTL_DEL, job->PidFd, nullptr);
+                    m_ByFd.erase(job->PidFd);
+                    ::close(job->PidFd);
+                    job->PidFd = -1;
+                }
+            }
+
+            void readOutput(Job* job) {
+                std::array<char, 4096> buffer;
+                while(true) {
+                    ssize_t len = ::read(job->OutFd, buffer.data(), buffer.size());
+                    if(len > 0) {
+                        if(job->OnOutput && !job->Error) {
+                            try {
+                                job->OnOutput(std::string_view(buffer.data(), static_cast<size_t>(len)));
+                            }
+                            catch(...) {
+                                job->Error = std::current_exception();
+                            }
+                        }
+                        continue;
+                    }
+                    if(len < 0 && errno == EINTR)
+                        continue;
+                    if(len < 0 && errno == EAGAIN)
+                        return;
+                    // end of output (or read error)
+                    m_ByFd.erase(job->OutFd);
+                    ::close(job->OutFd);
+                    job->OutFd = -1;
+                    if(job->PidFd < 0 && !job->Exited) {
+                        reap(job);
+                        if(!job->Exited) // no pidfd to wait for, polled by the loop
+                            m_Waiting.push_back(job);
+                    }
+                    return;
+                }
+            }
+
+            void complete(Job* job) {
+                if(job->OutFd >= 0 || !job->Exited)
+                    return;
+                auto node = m_Jobs.extract(job);
+                --m_Running;
+                finish(std::move(node.mapped()));
+            }
+
+            void schedule() {
+                while(m_Running < m_MaxConcurrent) {
+                    std::unique_ptr<Job> job;
+                    {
+                        std::lock_guard<std::mutex> lock(m_Mutex);
+                        if(m_Queue.empty())
+                            return;
+                        job = std::move(m_Queue.front());
+                        m_Queue.pop_front();
+                    }
+                    start(std::move(job));
+                }
+            }
+
+            void loop() {
+                std::array<epoll_event, 64> events;
+                while(true) {
+                    schedule();
+                    if(m_Stop && m_Running == 0 && getQueued() == 0)
+                        return;
+                    int n = epoll_wait(m_Epoll, events.data(), static_cast<int>(events.size()), m_Waiting.empty() ? -1 : WaitPoll);
+                    for(int i = 0; i < n; i++) {
+                        int fd = events[i].data.fd;
+                        if(fd == m_Wake) {
+                            uint64_t val;
+                            ssize_t ret = ::read(m_Wake, &val, sizeof(val));
+                            (void)ret;
+                            continue;
+                        }
+                        auto it = m_ByFd.find(fd);
+                        if(it == m_ByFd.end())
+                            continue;
+                        Job* job = it->second;
+                        if(fd == job->OutFd)
+                            readOutput(job);
+                        else
+                            reap(job);
+                        complete(job);
+                    }
+                    for(size_t i = 0; i < m_Waiting.size();) {
+                        Job* job = m_Waiting[i];
+                        reap(job);
+                        if(!job->Exited) {
+                            ++i;
+                            continue;
+                        }
+                        m_Waiting[i] = m_Waiting.back();
+                        m_Waiting.pop_back();
+                        complete(job);
+                    }
+                }
+            }
+
+            static constexpr int WaitPoll = 20; // milliseconds between checks of m_Waiting
+
+            std::atomic<size_t> m_MaxConcurrent;
+            std::atomic<size_t> m_Running{0};
+            std::atomic<bool> m_Stop{false};
+            int m_Epoll = -1;
+            int m_Wake = -1;
+            mutable std::mutex m_Mutex;
+            std::deque<std::unique_ptr<Job>> m_Queue;
+            std::unordered_map<Job*, std::unique_ptr<Job>> m_Jobs;
+            std::unordered_map<int, Job*> m_ByFd;
+            std::vector<Job*> m_Waiting; // output closed but still running, without pidfd
+            std::thread m_Thread;
+        };
+#endif
+        /**
+         * Executes a command asynchronously. On linux the command is run
+         * by a process wide ProcessPool, use your own ProcessPool to control
+         * concurrency, to receive the exit code or to receive the output
+         * while the command runs.
+         * The output is collected and written to ostr at once when the command
+         * finished, before the future becomes ready. Writes of concurrent
+         * ExecuteAsync calls are serialized, the caller must not use ostr
+         * otherwise until the future is ready.
          * @param cmd Command to execute.
-         * @param ostr Stream to write command output to. (defaults to std::cout) 
+         * @param ostr Stream to write command output to, must stay valid until the command finished. (defaults to std::cout)
          * @returns Future object which can be used for synchronization.
          */
         inline std::future<void> ExecuteAsync(const std::string& cmd, std::ostream& ostr = std::cout) {
-            auto hdl = std::async(std::launch::async, [&] { 
+            static std::mutex writeMutex;
+            auto write = [out = &ostr](const std::string& output) {
+                std::lock_guard<std::mutex> lock(writeMutex);
+                out->write(output.data(), static_cast<std::streamsize>(output.size()));
+                out->flush();
+            };
+        #if defined(__linux__)
+            static ProcessPool pool;
+            auto prom = std::make_shared<std::promise<void>>();
+            std::future<void> hdl = prom->get_future();
+            auto output = std::make_shared<std::string>(); // only touched by the pool thread
+            pool.execute(cmd, [output](std::string_view chunk){
+                output->append(chunk.data(), chunk.size());
+            }, [prom, output, write](int, std::exception_ptr ex){
+                try {
+                    write(*output); // also the output up to a failure
+                }
+                catch(...) {
+                    if(!ex)
+                        ex = std::current_exception();
+                }
+                if(ex)
+                    prom->set_exception(ex);
+                else
+                    prom->set_value();
+            });
+            return hdl;
+        #else
+            return std::async(std::launch::async, [cmd, write] {
+                std::string output;
             #if defined(_WIN32)
                 std::unique_ptr<FILE, decltype(&_pclose)> pipe(_popen(cmd.c_str(), "r"), _pclose);
             #else
@@ -142,11 +1413,11 @@ namespace giri {
                 }
                 std::array<char, 128> buffer;
                 while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-                    ostr << buffer.data();
+                    output.append(buffer.data());
                 }
-                return;
+                write(output);
             });
-            return hdl;
+        #endif
         }
     }
 }
@@ -0,0 +1,424 @@
+/**
+ * @file FileWatcher.h
+ * @brief inotify based file and directory watcher.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_FILEWATCHER_H
+#define SUPPORTLIB_FILEWATCHER_H
+#include "Observer.h"
+#include "Exception.h"
+#include "FileSystem.h"
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace giri {
+    namespace FileSystem {
+
+        /**
+         * @brief Change of a watched file or directory, reported by FileWatcher.
+         *
+         * Multiple changes of the same path within the debounce interval are
+         * coalesced into one FileEvent, its Flags accumulate all of them.
+         */
+        struct FileEvent {
+            /**
+             * Kinds of changes, combined as bit mask in Flags.
+             */
+            enum Kind : uint32_t {
+                Created = 1,    ///< File or directory was created or moved into a watched directory.
+                Modified = 2,   ///< File content was modified.
+                Removed = 4,    ///< File or directory was removed or moved away.
+                Attributes = 8, ///< Permissions, timestamps or ownership changed.
+                Overflow = 16   ///< Events were lost, the watched root (Path) has been rescanned and should be resynchronized.
+            };
+            std::filesystem::path Path;
+            uint32_t Flags = 0;
+            bool IsDirectory = false;
+        };
+
+#if defined(__linux__)
+        /**
+         * @brief Watches files and directories for changes using inotify.
+         *
+         * The inotify descriptor is integrated into an asio io_context, so an idle
+         * watcher does not use any CPU. Events are coalesced per path and delivered
+         * once no new events arrived for the debounce interval (at most 10 intervals
+         * after the first event). Subscribed Observer objects are notified and may fetch
+         * the delivered events using getEvents(), alternatively a callback can be set.
+         * Directories can be watched recursively, newly created subdirectories are added
+         * automatically. If the kernel event queue overflows all watches are rescanned
+         * (watches of directories which vanished meanwhile are dropped) and a
+         * FileEvent::Overflow event is reported for every watched root.
+         *
+         *  Example Usage:
+         *  --------------
+         *
+         *  @code{.cpp}
+         *  #include <FileWatcher.h>
+         *  #include <iostream>
+         *
+         *  using namespace giri;
+         *
+         *  class WatchObserver : public Observer<FileSystem::FileWatcher>
+         *  {
+         *  public:
+         *      void update(FileSystem::FileWatcher::SPtr watcher){
+         *          for(const auto& ev : watcher->getEvents())
+         *              std::cout << ev.Path << " changed (" << ev.Flags << ")" << std::endl;
+         *      }
+         *  };
+         *
+         *  int main()
+         *  {
+         *      boost::asio::io_context ioc;
+         *      auto watcher = std::make_shared<FileSystem::FileWatcher>(ioc);
+         *      auto obs = std::make_shared<WatchObserver>();
+         *      watcher->subscribe(obs);
+         *      watcher->add("/etc/myapp");
+         *      watcher->run();
+         *      ioc.run();
+         *      return EXIT_SUCCESS;
+         *  }
+         *  @endcode
+         */
+        class FileWatcher : public Observable<FileWatcher>
+        {
+        public:
+            /**
+             * Called with the coalesced events.
+             */
+            using Callback = std::function<void(const std::vector<FileEvent>&)>;
+
+            /**
+             * FileWatcher constructor. Throws FileSystemException if inotify is not available.
+             * @param ioc I/O context which should be used.
+             * @param debounce Time without new events before events are delivered. (defaults to 50ms)
+             */
+            explicit FileWatcher(boost::asio::io_context& ioc, std::chrono::milliseconds debounce = std::chrono::milliseconds(50)) :
+                m_Strand(boost::asio::make_strand(ioc)),
+                m_Descriptor(ioc),
+                m_Timer(ioc),
+                m_Debounce(debounce)
+            {
+                int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+                if(fd < 0)
+                    throw FileSystemException("inotify_init1() failed!");
+                m_Descriptor.assign(fd);
+            }
+            /**
+             * Starts watching asynchronously. Automatically notifies subscribed
+             * Observer objects on changes.
+             */
+            void run() {
+                do_wait();
+            }
+            /**
+             * Stops watching, pending events are dropped.
+             */
+            void close() {
+                boost::asio::post(m_Strand, [self = this->shared_from_this()]{
+                    boost::system::error_code ec;
+                    self->m_Timer.cancel();
+                    self->m_Descriptor.close(ec);
+                });
+            }
+            /**
+             * Adds a file or directory to watch. Throws FileSystemException if the
+             * path cannot be watched.
+             * @param path File or directory to watch.
+             * @param recursive Also watch all subdirectories. (defaults to true)
+             */
+            void add(const std::filesystem::path& path, bool recursive = true) {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                std::error_code ec;
+                bool isDir = std::filesystem::is_directory(path, ec);
+                if(addWatch(path) < 0)
+                    throw FileSystemException("Could not watch: " + path.string());
+                m_Roots[path] = recursive && isDir;
+                if(recursive && isDir)
+                    addTree(path, nullptr);
+            }
+            /**
+             * Stops watching a file or directory which was added using add().
+             * @param path File or directory to stop watching.
+             */
+            void remove(const std::filesystem::path& path) {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                auto root = m_Roots.find(path);
+                if(root == m_Roots.end())
+                    return;
+                bool recursive = root->second;
+                m_Roots.erase(root);
+                for(auto it = m_Paths.begin(); it != m_Paths.end();) {
+                    bool below = it->first == path || (recursive && isBelow(it->first, path));
+                    if(below && !isCovered(it->first)) {
+                        inotify_rm_watch(m_Descriptor.native_handle(), it->second);
+                        m_Watches.erase(it->second);
+                        it = m_Paths.erase(it);
+                    }
+                    else
+                        ++it;
+                }
+            }
+            /**
+             * Sets a callback which is called with the coalesced events (in addition to notifying observers).
+             * @param cb Callback to use.
+             */
+            void setCallback(Callback cb) {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Callback = std::move(cb);
+            }
+            /**
+             * @param debounce Time without new events before events are delivered.
+             */
+            void setDebounce(std::chrono::milliseconds debounce) {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Debounce = debounce;
+            }
+            /**
+             * @returns Time without new events before events are delivered.
+             */
+            std::chrono::milliseconds getDebounce() const {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                return m_Debounce;
+            }
+            /**
+             * @returns Events delivered by the last notification.
+             */
+            const std::vector<FileEvent>& getEvents() const {
+                return m_Events;
+            }
+            /**
+             * @returns Number of active inotify watches.
+             */
+            size_t getWatchCount() const {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                return m_Watches.size();
+            }
+            using SPtr = std::shared_ptr<FileWatcher>;
+            using UPtr = std::unique_ptr<FileWatcher>;
+            using WPtr = std::weak_ptr<FileWatcher>;
+        private:
+            static constexpr uint32_t WatchMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM |
+                                                   IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+            static bool isBelow(const std::filesystem::path& p, const std::filesystem::path& dir) {
+                auto rel = p.lexically_relative(dir);
+                return !rel.empty() && *rel.begin() != "..";
+            }
+
+            bool isCovered(const std::filesystem::path& p) const {
+                for(const auto& [root, recursive] : m_Roots)
+                    if(p == root || (recursive && isBelow(p, root)))
+                        return true;
+                return false;
+            }
+
+            // expects m_Mutex to be locked
+            int addWatch(const std::filesystem::path& path) {
+                int wd = inotify_add_watch(m_Descriptor.native_handle(), path.c_str(), WatchMask);
+                if(wd < 0)
+                    return wd;
+                m_Watches[wd] = path;
+                m_Paths[path] = wd;
+                return wd;
+            }
+
+            // expects m_Mutex to be locked, removes the watches of dir and its subdirectories
+            void removeTree(const std::filesystem::path& dir) {
+                for(auto it = m_Paths.lower_bound(dir); it != m_Paths.end() && (it->first == dir || isBelow(it->first, dir));) {
+                    inotify_rm_watch(m_Descriptor.native_handle(), it->second);
+                    m_Watches.erase(it->second);
+                    it = m_Paths.erase(it);
+                }
+            }
+
+            // expects m_Mutex to be locked, reports the found entries as created if created is set
+            void addTree(const std::filesystem::path& dir, std::vector<FileEvent>* created) {
+                WalkOptions opts;
+                opts.Threads = 1;
+                opts.Stat = false;
+                try {
+                    WalkDirectory(dir, [&](const DirEntry& e){
+                        bool isDir = e.Type == std::filesystem::file_type::directory;
+                        if(isDir)
+                            addWatch(e.Path);
+                        if(created)
+                            created->push_back(FileEvent{e.Path, FileEvent::Created, isDir});
+                    }, opts);
+                }
+                catch(const FileSystemException&) {} // directory vanished meanwhile
+            }
+
+            void do_wait() {
+                m_Descriptor.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                    boost::asio::bind_executor(m_Strand, std::bind(&FileWatcher::on_readable, this->shared_from_this(), std::placeholders::_1)));
+            }
+
+            void on_readable(boost::system::error_code ec) {
+                if(ec)
+                    return; // closed
+                alignas(inotify_event) std::array<char, 16 * 1024> buffer;
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                while(true) {
+                    ssize_t len = ::read(m_Descriptor.native_handle(), buffer.data(), buffer.size());
+                    if(len <= 0)
+                        break;
+                    for(ssize_t pos = 0; pos < len;) {
+                        auto* ev = reinterpret_cast<inotify_event*>(buffer.data() + pos);
+                        pos += sizeof(inotify_event) + ev->len;
+                        handle(*ev);
+                    }
+                }
+                schedule();
+                do_wait();
+            }
+
+            // expects m_Mutex to be locked
+            void handle(const inotify_event& ev) {
+                if(ev.mask & IN_Q_OVERFLOW)
+                    return rescan();
+                auto it = m_Watches.find(ev.wd);
+                if(it == m_Watches.end())
+                    return;
+                if(ev.mask & IN_IGNORED) { // watch removed by the kernel
+                    m_Paths.erase(it->second);
+                    m_Watches.erase(it);
+                    return;
+                }
+                std::filesystem::path path = it->second;
+                if(ev.len > 0)
+                    path /= ev.name;
+                bool isDir = ev.mask & IN_ISDIR;
+                uint32_t flags = 0;
+                if(ev.mask & (IN_CREATE | IN_MOVED_TO))
+                    flags |= FileEvent::Created;
+                if(ev.mask & (IN_MODIFY | IN_CLOSE_WRITE))
+                    flags |= FileEvent::Modified;
+                if(ev.mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF))
+                    flags |= FileEvent::Removed;
+                if(ev.mask & IN_ATTRIB)
+                    flags |= FileEvent::Attributes;
+                if(flags == 0)
+                    return;
+                if((ev.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && m_Roots.count(path) == 0)
+                    return; // subdirectories are reported by their parent
+                record(path, flags, isDir);
+
+                if(isDir && (ev.mask & IN_MOVED_FROM) && m_Roots.count(path) == 0)
+                    removeTree(path); // the watches would keep reporting the old paths, re-added if moved back into a watched tree
+
+                if(isDir && (flags & FileEvent::Created) && isCovered(path)) {
+                    // subdirectory of a recursive watch, entries may have been created before the watch was added
+                    std::vector<FileEvent> created;
+                    if(addWatch(path) >= 0)
+                        addTree(path, &created);
+                    for(const auto& c : created)
+                        record(c.Path, c.Flags, c.IsDirectory);
+                }
+            }
+
+            // expects m_Mutex to be locked
+            void record(const std::filesystem::path& path, uint32_t flags, bool isDir) {
+                auto& ev = m_Pending[path];
+                ev.Path = path;
+                ev.Flags |= flags;
+                ev.IsDirectory = ev.IsDirectory || isDir;
+            }
+
+            // expects m_Mutex to be locked
+            void rescan() {
+                for(auto it = m_Paths.begin(); it != m_Paths.end();) { // drop watches of directories which vanished or moved
+                    std::error_code ec;
+                    auto w = m_Watches.find(it->second);
+                    const bool current = w != m_Watches.end() && w->second == it->first; // otherwise the watch belongs to another path now
+                    if(current && std::filesystem::is_directory(it->first, ec)) {
+                        ++it;
+                        continue;
+                    }
+                    if(current) {
+                        inotify_rm_watch(m_Descriptor.native_handle(), it->second);
+                        m_Watches.erase(w);
+                    }
+                    it = m_Paths.erase(it);
+                }
+                for(const auto& [root, recursive] : m_Roots) {
+                    if(addWatch(root) >= 0 && recursive)
+                        addTree(root, nullptr);
+                    record(root, FileEvent::Overflow, recursive);
+                }
+            }
+
+            // expects m_Mutex to be locked
+            void schedule() {
+                if(m_Pending.empty())
+                    return;
+                auto now = std::chrono::steady_clock::now();
+                if(!m_TimerArmed) {
+                    m_TimerArmed = true;
+                    m_FirstPending = now;
+                }
+                auto deadline = std::min(now + m_Debounce, m_FirstPending + 10 * m_Debounce);
+                m_Timer.expires_at(deadline);
+                m_Timer.async_wait(boost::asio::bind_executor(m_Strand, std::bind(&FileWatcher::on_timer, this->shared_from_this(), std::placeholders::_1)));
+            }
+
+            void on_timer(boost::system::error_code ec) {
+                if(ec)
+                    return; // rescheduled or closed
+                Callback cb;
+                {
+                    std::lock_guard<std::mutex> lock(m_Mutex);
+                    m_TimerArmed = false;
+                    m_Events.clear();
+                    m_Events.reserve(m_Pending.size());
+                    for(auto& [path, ev] : m_Pending)
+                        m_Events.push_back(std::move(ev));
+                    m_Pending.clear();
+                    cb = m_Callback;
+                }
+                if(m_Events.empty())
+                    return;
+                notify(); // notify all subscribed observers
+                if(cb)
+                    cb(m_Events);
+            }
+
+            boost::asio::strand<boost::asio::io_context::executor_type> m_Strand;
+            boost::asio::posix::stream_descriptor m_Descriptor;
+            boost::asio::steady_timer m_Timer;
+            std::chrono::milliseconds m_Debounce;
+            std::chrono::steady_clock::time_point m_FirstPending;
+            bool m_TimerArmed = false;
+            mutable std::mutex m_Mutex;
+            std::map<std::filesystem::path, bool> m_Roots;
+            std::unordered_map<int, std::filesystem::path> m_Watches;
+            std::map<std::filesystem::path, int> m_Paths;
+            std::map<std::filesystem::path, FileEvent> m_Pending;
+            std::vector<FileEvent> m_Events;
+            Callback m_Callback;
+        };
+#endif
+    }
+}
+#endif //SUPPORTLIB_FILEWATCHER_H
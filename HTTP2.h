@@ -0,0 +1,675 @@
+/**
+ * @file HTTP2.h
+ * @brief HTTP/2 framing and HPACK header compression.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_HTTP2_H
+#define SUPPORTLIB_HTTP2_H
+#include "Object.h"
+#include "Exception.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace giri {
+
+    /**
+     * @brief Namespace containing the HTTP/2 wire format (RFC 9113) and HPACK (RFC 7541), used by HTTPServer.
+     */
+    namespace HTTP2 {
+
+        /**
+         *  @brief Exception to be thrown on malformed HTTP/2 input.
+         */
+        class HTTP2Exception final : public ExceptionBase
+        {
+        public:
+            HTTP2Exception(const std::string &msg) : ExceptionBase(msg) {};
+            using SPtr = std::shared_ptr<HTTP2Exception>;
+            using UPtr = std::unique_ptr<HTTP2Exception>;
+            using WPtr = std::weak_ptr<HTTP2Exception>;
+        };
+
+        constexpr std::string_view Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"; ///< Connection preface sent by clients.
+        constexpr size_t FrameHeaderSize = 9;
+        constexpr uint32_t DefaultWindowSize = 65535;
+        constexpr uint32_t MaxWindowSize = 0x7fffffff;
+        constexpr uint32_t DefaultMaxFrameSize = 16384;
+        constexpr uint32_t MaxFrameSizeLimit = 16777215;
+
+        enum class FrameType : uint8_t {
+            Data = 0x0,
+            Headers = 0x1,
+            Priority = 0x2,
+            RstStream = 0x3,
+            Settings = 0x4,
+            PushPromise = 0x5,
+            Ping = 0x6,
+            GoAway = 0x7,
+            WindowUpdate = 0x8,
+            Continuation = 0x9
+        };
+
+        enum Flag : uint8_t {
+            EndStream = 0x1,
+            Ack = 0x1,
+            EndHeaders = 0x4,
+            Padded = 0x8,
+            PriorityFlag = 0x20
+        };
+
+        enum class ErrorCode : uint32_t {
+            NoError = 0x0,
+            ProtocolError = 0x1,
+            InternalError = 0x2,
+            FlowControlError = 0x3,
+            SettingsTimeout = 0x4,
+            StreamClosed = 0x5,
+            FrameSizeError = 0x6,
+            RefusedStream = 0x7,
+            Cancel = 0x8,
+            CompressionError = 0x9,
+            ConnectError = 0xa,
+            EnhanceYourCalm = 0xb,
+            InadequateSecurity = 0xc,
+            HTTP11Required = 0xd
+        };
+
+        enum class SettingsId : uint16_t {
+            HeaderTableSize = 0x1,
+            EnablePush = 0x2,
+            MaxConcurrentStreams = 0x3,
+            InitialWindowSize = 0x4,
+            MaxFrameSize = 0x5,
+            MaxHeaderListSize = 0x6
+        };
+
+        /**
+         * @brief Settings a server announces to its clients.
+         */
+        struct Settings {
+            uint32_t HeaderTableSize = 4096;          ///< Size of the HPACK table used to decode requests.
+            uint32_t MaxConcurrentStreams = 128;      ///< Maximum number of concurrent requests per connection.
+            uint32_t InitialWindowSize = 1024 * 1024; ///< Flow control window for request bodies, per stream and per connection.
+            uint32_t MaxFrameSize = DefaultMaxFrameSize; ///< Largest frame accepted.
+            uint32_t MaxHeaderListSize = 64 * 1024;   ///< Largest request header accepted, larger ones are answered with 431.
+        };
+
+        /**
+         * @brief Header of a frame.
+         */
+        struct FrameHeader {
+            uint32_t Length = 0;
+            FrameType Type = FrameType::Data;
+            uint8_t Flags = 0;
+            uint32_t StreamId = 0;
+
+            /**
+             * @param p FrameHeaderSize bytes to parse.
+             * @returns The parsed frame header.
+             */
+            static FrameHeader parse(const uint8_t* p) {
+                FrameHeader h;
+                h.Length = (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | p[2];
+                h.Type = static_cast<FrameType>(p[3]);
+                h.Flags = p[4];
+                h.StreamId = ReadUInt32(p + 5) & MaxWindowSize; // reserved bit is ignored
+                return h;
+            }
+            /**
+             * @param p Receives FrameHeaderSize bytes.
+             */
+            void write(uint8_t* p) const {
+                p[0] = static_cast<uint8_t>(Length >> 16);
+                p[1] = static_cast<uint8_t>(Length >> 8);
+                p[2] = static_cast<uint8_t>(Length);
+                p[3] = static_cast<uint8_t>(Type);
+                p[4] = Flags;
+                p[5] = static_cast<uint8_t>(StreamId >> 24);
+                p[6] = static_cast<uint8_t>(StreamId >> 16);
+                p[7] = static_cast<uint8_t>(StreamId >> 8);
+                p[8] = static_cast<uint8_t>(StreamId);
+            }
+            /**
+             * @param p Big endian 32 bit value.
+             * @returns The value.
+             */
+            static uint32_t ReadUInt32(const uint8_t* p) {
+                return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+            }
+        };
+
+        /**
+         * Appends a big endian 32 bit value.
+         * @param out String to append to.
+         * @param value Value to append.
+         */
+        inline void AppendUInt32(std::string& out, uint32_t value) {
+            const char bytes[4] = {static_cast<char>(value >> 24), static_cast<char>(value >> 16), static_cast<char>(value >> 8), static_cast<char>(value)};
+            out.append(bytes, sizeof(bytes));
+        }
+
+        /**
+         * Appends a frame.
+         * @param out String to append to.
+         * @param type Frame type.
+         * @param flags Frame flags.
+         * @param streamId Stream the frame belongs to, 0 for the connection.
+         * @param payload Payload of the frame.
+         */
+        inline void AppendFrame(std::string& out, FrameType type, uint8_t flags, uint32_t streamId, std::string_view payload = {}) {
+            uint8_t header[FrameHeaderSize];
+            FrameHeader{static_cast<uint32_t>(payload.size()), type, flags, streamId}.write(header);
+            out.append(reinterpret_cast<const char*>(header), sizeof(header));
+            out.append(payload);
+        }
+
+        /**
+         * @brief Huffman code of HPACK (RFC 7541 Appendix B).
+         */
+        class Huffman
+        {
+        public:
+            /**
+             * @param s String to encode.
+             * @returns Size of the encoded string in bytes.
+             */
+            static size_t encodedSize(std::string_view s) {
+                const Table& t = table();
+                uint64_t bits = 0;
+                for(unsigned char c : s)
+                    bits += t.Lengths[c];
+                return static_cast<size_t>((bits + 7) / 8);
+            }
+            /**
+             * Appends an encoded string.
+             * @param out String to append to.
+             * @param s String to encode.
+             */
+            static void encode(std::string& out, std::string_view s) {
+                const Table& t = table();
+                uint64_t bits = 0;
+                unsigned n = 0;
+                for(unsigned char c : s) {
+                    bits = (bits << t.Lengths[c]) | t.Codes[c];
+                    n += t.Lengths[c];
+                    while(n >= 8) {
+                        n -= 8;
+                        out.push_back(static_cast<char>(bits >> n));
+                    }
+                }
+                if(n > 0) // pad with the most significant bits of EOS
+                    out.push_back(static_cast<char>((bits << (8 - n)) | (0xffu >> n)));
+            }
+            /**
+             * Appends a decoded string.
+             * @param out String to append to.
+             * @param data Encoded string.
+             * @param len Length of the encoded string.
+             * @returns false if the encoding is invalid.
+             */
+            static bool decode(std::string& out, const uint8_t* data, size_t len) {
+                const Table& t = table();
+                uint64_t acc = 0;
+                unsigned bits = 0;
+                for(size_t i = 0; i < len; ++i) {
+                    acc = (acc << 8) | data[i];
+                    bits += 8;
+                    while(bits >= MinLength) {
+                        bool found = false;
+                        for(unsigned l = MinLength; l <= std::min(bits, MaxLength); ++l) { // canonical code, shortest match wins
+                            const uint32_t code = static_cast<uint32_t>(acc >> (bits - l)) & ((1u << l) - 1);
+                            if(code >= t.First[l] && code - t.First[l] < t.Count[l]) {
+                                const uint16_t sym = t.Symbols[t.Offset[l] + code - t.First[l]];
+                                if(sym == EOS)
+                                    return false;
+                                out.push_back(static_cast<char>(sym));
+                                bits -= l;
+                                acc &= (uint64_t(1) << bits) - 1;
+                                found = true;
+                                break;
+                            }
+                        }
+                        if(!found) {
+                            if(bits >= MaxLength)
+                                return false;
+                            break; // needs more bits
+                        }
+                    }
+                }
+                return bits < 8 && acc == (uint64_t(1) << bits) - 1; // padding has to be a prefix of EOS
+            }
+        private:
+            static constexpr uint16_t EOS = 256;
+            static constexpr unsigned MinLength = 5;
+            static constexpr unsigned MaxLength = 30;
+            struct Table {
+                std::array<uint32_t, 257> Codes;
+                std::array<uint8_t, 257> Lengths;
+                std::array<uint32_t, MaxLength + 1> First{};  // first code of each length
+                std::array<uint16_t, MaxLength + 1> Count{};  // number of codes of each length
+                std::array<uint16_t, MaxLength + 1> Offset{}; // index of the first symbol of each length
+                std::array<uint16_t, 257> Symbols;            // symbols ordered by code
+            };
+            static const Table& table() {
+                static const Table t = build();
+                return t;
+            }
+            static Table build() {
+                static constexpr uint32_t codes[257] = {
+                    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+                    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+                    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+                    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+                    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+                    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+                    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+                    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+                    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+                    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+                    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+                    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+                    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+                    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+                    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+                    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+                    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+                    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+                    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+                    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+                    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+                    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+                    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+                    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+                    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+                    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+                    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+                    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+                    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+                    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+                    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+                    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+                    0x3fffffff,
+                };
+                static constexpr uint8_t lengths[257] = {
+                    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+                    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+                    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+                    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+                    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+                    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+                    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+                    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+                    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+                    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+                    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+                    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+                    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+                    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+                    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+                    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+                    30,
+                };
+                Table t;
+                for(uint16_t i = 0; i < 257; ++i) {
+                    t.Codes[i] = codes[i];
+                    t.Lengths[i] = lengths[i];
+                    t.Symbols[i] = i;
+                    ++t.Count[lengths[i]];
+                }
+                std::stable_sort(t.Symbols.begin(), t.Symbols.end(), [](uint16_t a, uint16_t b){ return lengths[a] < lengths[b]; });
+                for(uint16_t i = 257; i-- > 0;) { // first code and symbol of every length
+                    t.First[lengths[t.Symbols[i]]] = codes[t.Symbols[i]];
+                    t.Offset[lengths[t.Symbols[i]]] = i;
+                }
+                return t;
+            }
+        };
+
+        /**
+         * @brief HPACK header table, the static table shared by all connections followed by a dynamic table.
+         */
+        class HeaderTable
+        {
+        public:
+            static constexpr size_t StaticSize = 61;
+            static constexpr size_t EntryOverhead = 32;
+
+            /**
+             * HeaderTable constructor.
+             * @param maxSize Maximum size of the dynamic table.
+             */
+            explicit HeaderTable(size_t maxSize = 4096) :
+                m_MaxSize(maxSize)
+            {
+            }
+            /**
+             * @param index Index of the entry, starting with 1.
+             * @param name Receives the name of the entry.
+             * @param value Receives the value of the entry.
+             * @returns false if there is no such entry.
+             */
+            bool get(size_t index, std::string_view& name, std::string_view& value) const {
+                if(index == 0)
+                    return false;
+                if(index <= StaticSize) {
+                    name = staticTable()[index - 1].first;
+                    value = staticTable()[index - 1].second;
+                    return true;
+                }
+                index -= StaticSize + 1;
+                if(index >= m_Entries.size())
+                    return false;
+                name = m_Entries[index].first;
+                value = m_Entries[index].second;
+                return true;
+            }
+            /**
+             * Looks up an entry.
+             * @param name Name to look for.
+             * @param value Value to look for.
+             * @param nameIndex Receives the index of an entry with the same name, 0 if none.
+             * @returns Index of an entry with the same name and value, 0 if none.
+             */
+            size_t find(std::string_view name, std::string_view value, size_t& nameIndex) const {
+                nameIndex = 0;
+                for(size_t i = 0; i < StaticSize; ++i)
+                    if(staticTable()[i].first == name) {
+                        if(!nameIndex)
+                            nameIndex = i + 1;
+                        if(staticTable()[i].second == value)
+                            return i + 1;
+                    }
+                for(size_t i = 0; i < m_Entries.size(); ++i)
+                    if(m_Entries[i].first == name) {
+                        if(!nameIndex)
+                            nameIndex = StaticSize + 1 + i;
+                        if(m_Entries[i].second == value)
+                            return StaticSize + 1 + i;
+                    }
+                return 0;
+            }
+            /**
+             * Adds an entry to the dynamic table, evicting the oldest entries if needed.
+             * @param name Name of the entry.
+             * @param value Value of the entry.
+             */
+            void insert(std::string_view name, std::string_view value) {
+                const size_t size = name.size() + value.size() + EntryOverhead;
+                if(size > m_MaxSize) { // clears the table
+                    m_Entries.clear();
+                    m_Size = 0;
+                    return;
+                }
+                m_Entries.emplace_front(std::string(name), std::string(value));
+                m_Size += size;
+                evict();
+            }
+            /**
+             * @param size New maximum size of the dynamic table.
+             */
+            void setMaxSize(size_t size) {
+                m_MaxSize = size;
+                evict();
+            }
+            /**
+             * @returns Maximum size of the dynamic table.
+             */
+            size_t getMaxSize() const {
+                return m_MaxSize;
+            }
+            /**
+             * @returns Size of the dynamic table.
+             */
+            size_t getSize() const {
+                return m_Size;
+            }
+            /**
+             * @returns The static table.
+             */
+            static const std::array<std::pair<std::string_view, std::string_view>, StaticSize>& staticTable() {
+                static constexpr std::array<std::pair<std::string_view, std::string_view>, StaticSize> table{{
+                    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+                    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+                    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+                    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+                    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""}, {"content-disposition", ""},
+                    {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""}, {"content-location", ""}, {"content-range", ""},
+                    {"content-type", ""}, {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+                    {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+                    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+                    {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+                    {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""}, {"set-cookie", ""},
+                    {"strict-transport-security", ""}, {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+                    {"www-authenticate", ""}
+                }};
+                return table;
+            }
+        private:
+            void evict() {
+                while(m_Size > m_MaxSize) {
+                    m_Size -= m_Entries.back().first.size() + m_Entries.back().second.size() + EntryOverhead;
+                    m_Entries.pop_back();
+                }
+            }
+
+            std::deque<std::pair<std::string, std::string>> m_Entries; // newest first
+            size_t m_Size = 0;
+            size_t m_MaxSize;
+        };
+
+        /**
+         * @brief Decodes HPACK header blocks of one connection.
+         */
+        class HPACKDecoder : public Object<HPACKDecoder>
+        {
+        public:
+            /**
+             * HPACKDecoder constructor.
+             * @param maxTableSize Maximum size of the dynamic table, as announced to the peer.
+             * @param maxHeaderListSize Maximum size of a decoded header list. (0 for unlimited)
+             */
+            explicit HPACKDecoder(size_t maxTableSize = 4096, size_t maxHeaderListSize = 0) :
+                m_Table(maxTableSize),
+                m_MaxTableSize(maxTableSize),
+                m_MaxHeaderListSize(maxHeaderListSize)
+            {
+            }
+            /**
+             * Decodes a header block. Throws HTTP2Exception on malformed input, the
+             * connection needs to be closed then. Blocks exceeding the header list
+             * limit are decoded completely nevertheless, to keep the table in sync.
+             * @param data Header block.
+             * @param len Length of the header block.
+             * @param handler Called with name and value of every field.
+             * @returns false if the header list exceeded the limit, handler was not called for the fields above the limit.
+             */
+            template<class Handler>
+            bool decode(const uint8_t* data, size_t len, Handler&& handler) {
+                const uint8_t* p = data;
+                const uint8_t* end = data + len;
+                size_t listSize = 0;
+                bool fields = false;
+                auto emit = [&](std::string_view name, std::string_view value) {
+                    fields = true;
+                    listSize += name.size() + value.size() + HeaderTable::EntryOverhead;
+                    if(m_MaxHeaderListSize == 0 || listSize <= m_MaxHeaderListSize)
+                        handler(name, value);
+                };
+                while(p < end) {
+                    const uint8_t b = *p;
+                    if(b & 0x80) { // indexed field
+                        std::string_view name, value;
+                        if(!m_Table.get(decodeInt(p, end, 7), name, value))
+                            throw HTTP2Exception("HPACK: invalid index");
+                        emit(name, value);
+                    }
+                    else if(b & 0x40) { // literal with incremental indexing
+                        readLiteral(p, end, 6);
+                        m_Table.insert(m_Name, m_Value);
+                        emit(m_Name, m_Value);
+                    }
+                    else if(b & 0x20) { // dynamic table size update
+                        const size_t size = decodeInt(p, end, 5);
+                        if(fields || size > m_MaxTableSize)
+                            throw HTTP2Exception("HPACK: invalid table size update");
+                        m_Table.setMaxSize(size);
+                    }
+                    else { // literal without indexing or never indexed
+                        readLiteral(p, end, 4);
+                        emit(m_Name, m_Value);
+                    }
+                }
+                return m_MaxHeaderListSize == 0 || listSize <= m_MaxHeaderListSize;
+            }
+            using SPtr = std::shared_ptr<HPACKDecoder>;
+            using UPtr = std::unique_ptr<HPACKDecoder>;
+            using WPtr = std::weak_ptr<HPACKDecoder>;
+        private:
+            static size_t decodeInt(const uint8_t*& p, const uint8_t* end, unsigned prefix) {
+                const size_t mask = (size_t(1) << prefix) - 1;
+                size_t value = *p++ & mask;
+                if(value < mask)
+                    return value;
+                for(unsigned shift = 0; ; shift += 7) {
+                    if(p == end || shift > 28)
+                        throw HTTP2Exception("HPACK: invalid integer");
+                    const uint8_t b = *p++;
+                    value += size_t(b & 0x7f) << shift;
+                    if(!(b & 0x80))
+                        return value;
+                }
+            }
+            void readString(const uint8_t*& p, const uint8_t* end, std::string& out) {
+                if(p == end)
+                    throw HTTP2Exception("HPACK: truncated string");
+                const bool huffman = *p & 0x80;
+                const size_t len = decodeInt(p, end, 7);
+                if(len > static_cast<size_t>(end - p))
+                    throw HTTP2Exception("HPACK: truncated string");
+                out.clear();
+                if(!huffman)
+                    out.assign(reinterpret_cast<const char*>(p), len);
+                else if(!Huffman::decode(out, p, len))
+                    throw HTTP2Exception("HPACK: invalid huffman code");
+                p += len;
+            }
+            void readLiteral(const uint8_t*& p, const uint8_t* end, unsigned prefix) {
+                const size_t index = decodeInt(p, end, prefix);
+                if(index == 0)
+                    readString(p, end, m_Name);
+                else {
+                    std::string_view name, value;
+                    if(!m_Table.get(index, name, value))
+                        throw HTTP2Exception("HPACK: invalid index");
+                    m_Name.assign(name);
+                }
+                readString(p, end, m_Value);
+            }
+
+            HeaderTable m_Table;
+            size_t m_MaxTableSize;
+            size_t m_MaxHeaderListSize;
+            std::string m_Name;  // reused between fields
+            std::string m_Value;
+        };
+
+        /**
+         * @brief Encodes HPACK header blocks of one connection.
+         */
+        class HPACKEncoder : public Object<HPACKEncoder>
+        {
+        public:
+            /**
+             * HPACKEncoder constructor.
+             * @param maxTableSize Size of the dynamic table.
+             */
+            explicit HPACKEncoder(size_t maxTableSize = 4096) :
+                m_Table(maxTableSize),
+                m_Limit(maxTableSize)
+            {
+            }
+            /**
+             * Sets the table size allowed by the peer (SETTINGS_HEADER_TABLE_SIZE), the
+             * table does not grow beyond the size passed to the constructor though.
+             * @param size Allowed table size.
+             */
+            void setMaxTableSize(size_t size) {
+                size = std::min(size, m_Limit);
+                if(size == m_Table.getMaxSize())
+                    return;
+                m_Table.setMaxSize(size);
+                m_SizeUpdate = true; // announced at the start of the next block
+            }
+            /**
+             * Appends a header field to a header block.
+             * @param out Header block to append to.
+             * @param name Name of the field, lower case.
+             * @param value Value of the field.
+             * @param index false for values unlikely to repeat or sensitive ones, those are not added to the table.
+             */
+            void encode(std::string& out, std::string_view name, std::string_view value, bool index = true) {
+                if(m_SizeUpdate) {
+                    encodeInt(out, 0x20, 5, m_Table.getMaxSize());
+                    m_SizeUpdate = false;
+                }
+                size_t nameIndex = 0;
+                const size_t full = m_Table.find(name, value, nameIndex);
+                if(full) {
+                    encodeInt(out, 0x80, 7, full);
+                    return;
+                }
+                index = index && name.size() + value.size() + HeaderTable::EntryOverhead <= m_Table.getMaxSize();
+                encodeInt(out, index ? 0x40 : 0x00, index ? 6 : 4, nameIndex);
+                if(!nameIndex)
+                    encodeString(out, name);
+                encodeString(out, value);
+                if(index)
+                    m_Table.insert(name, value);
+            }
+            using SPtr = std::shared_ptr<HPACKEncoder>;
+            using UPtr = std::unique_ptr<HPACKEncoder>;
+            using WPtr = std::weak_ptr<HPACKEncoder>;
+        private:
+            static void encodeInt(std::string& out, uint8_t bits, unsigned prefix, size_t value) {
+                const size_t mask = (size_t(1) << prefix) - 1;
+                if(value < mask) {
+                    out.push_back(static_cast<char>(bits | value));
+                    return;
+                }
+                out.push_back(static_cast<char>(bits | mask));
+                value -= mask;
+                while(value >= 0x80) {
+                    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                    value >>= 7;
+                }
+                out.push_back(static_cast<char>(value));
+            }
+            static void encodeString(std::string& out, std::string_view s) {
+                const size_t huffman = Huffman::encodedSize(s);
+                if(huffman < s.size()) {
+                    encodeInt(out, 0x80, 7, huffman);
+                    Huffman::encode(out, s);
+                }
+                else {
+                    encodeInt(out, 0x00, 7, s.size());
+                    out.append(s);
+                }
+            }
+
+            HeaderTable m_Table;
+            size_t m_Limit;
+            bool m_SizeUpdate = false;
+        };
+    }
+}
+#endif //SUPPORTLIB_HTTP2_H
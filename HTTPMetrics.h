@@ -0,0 +1,443 @@
+/**
+ * @file HTTPMetrics.h
+ * @brief Low overhead counters and latency histograms of a HTTPServer.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_HTTPMETRICS_H
+#define SUPPORTLIB_HTTPMETRICS_H
+#include "Object.h"
+#include "JSON.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace giri {
+
+    /**
+     * @brief Counters and latency histograms of a HTTPServer.
+     *
+     * Every thread writes to its own slot, so recording costs a few plain stores and
+     * no thread waits for another one. The slots are only merged when a snapshot is
+     * taken (get, getHistogram, toPrometheus, toJSON). Latencies are kept in log-linear
+     * histograms (like HdrHistogram) with 16 buckets per power of two, so percentiles
+     * are accurate to about 6% from one nanosecond up to many hours.
+     *
+     * The phases of a request are measured as follows:
+     * - FirstByte: accepting a connection until the first byte of its first request
+     *   arrived, includes the TLS handshake.
+     * - Parse: first byte of a request until it was received completely, including its body.
+     *   0 if the request arrived with the read which brought its first byte, pipelined
+     *   requests which were buffered completely already are not measured.
+     * - Handler: request received until its response is ready to be sent, i.e. parsing,
+     *   waiting for a thread, routes, observers and static files.
+     * - Write: response ready until it was written to the socket. Streamed responses
+     *   (see HTTPSession::stream) and HTTP/2 streams are not measured.
+     *
+     * The clock is read as rarely as possible, usually three times per request. Pipelined
+     * requests answered with one gathered write are timed together, each of them is
+     * recorded with the average Handler duration and the duration of the write.
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  auto srv = std::make_shared<HTTPServer>("0.0.0.0", "8080", "/var/www", 4);
+     *  srv->setMetrics(true, "/metrics"); // Prometheus text format
+     *  srv->run();
+     *  // ...
+     *  std::cout << srv->getMetrics()->toJSON().dump() << std::endl;
+     *  std::cout << srv->getMetrics()->getHistogram(HTTPMetrics::Phase::Handler).percentile(0.99) << " ns" << std::endl;
+     *  @endcode
+     */
+    class HTTPMetrics : public Object<HTTPMetrics>
+    {
+    public:
+        /**
+         * @brief Counted events.
+         */
+        enum class Counter : size_t {
+            ConnectionsOpened,  ///< Accepted connections.
+            ConnectionsClosed,  ///< Closed connections.
+            Requests,           ///< Answered requests, including HTTP/2 streams.
+            Status1xx,          ///< Responses by status class.
+            Status2xx,
+            Status3xx,
+            Status4xx,
+            Status5xx,
+            BytesReceived,      ///< Received bytes, without TLS overhead.
+            BytesSent,          ///< Sent bytes, without TLS overhead.
+            TLSHandshakes,      ///< Successful TLS handshakes.
+            TLSHandshakeErrors, ///< Failed TLS handshakes.
+            Count               ///< Number of counters.
+        };
+        /**
+         * @brief Measured phases of a request.
+         */
+        enum class Phase : size_t {
+            FirstByte, ///< Accept until the first byte of the first request arrived.
+            Parse,     ///< First byte until the request was received.
+            Handler,   ///< Request received until the response is ready.
+            Write,     ///< Response ready until it was written.
+            Count      ///< Number of phases.
+        };
+
+        /**
+         * @brief Merged latency histogram, values are in nanoseconds.
+         */
+        class Histogram
+        {
+        public:
+            static constexpr unsigned SubBits = 4;                                  ///< log2 of the buckets per power of two.
+            static constexpr size_t SubCount = size_t(1) << SubBits;
+            static constexpr unsigned MaxBits = 46;                                 ///< Larger values (about 19.5 hours) are clamped.
+            static constexpr size_t Buckets = (MaxBits - SubBits + 1) * SubCount;
+
+            /**
+             * @returns Index of the bucket counting a value.
+             * @param value Value in nanoseconds.
+             */
+            static size_t bucket(uint64_t value) {
+                constexpr uint64_t max = (uint64_t(1) << MaxBits) - 1;
+                if(value > max)
+                    value = max;
+                if(value < SubCount) // exact below
+                    return static_cast<size_t>(value);
+                const unsigned shift = msb(value) - SubBits;
+                return (static_cast<size_t>(shift + 1) << SubBits) + static_cast<size_t>((value >> shift) - SubCount);
+            }
+            /**
+             * @returns Smallest value counted by a bucket.
+             * @param index Bucket index.
+             */
+            static uint64_t lowerBound(size_t index) {
+                if(index < SubCount)
+                    return index;
+                const unsigned shift = static_cast<unsigned>(index >> SubBits) - 1;
+                return static_cast<uint64_t>(SubCount + (index & (SubCount - 1))) << shift;
+            }
+            /**
+             * @returns Largest value counted by a bucket.
+             * @param index Bucket index.
+             */
+            static uint64_t upperBound(size_t index) {
+                if(index < SubCount)
+                    return index;
+                return lowerBound(index) + (uint64_t(1) << ((index >> SubBits) - 1)) - 1;
+            }
+            /**
+             * @returns Number of recorded values.
+             */
+            uint64_t getCount() const {
+                return m_Count;
+            }
+            /**
+             * @returns Sum of all recorded values in nanoseconds.
+             */
+            uint64_t getSum() const {
+                return m_Sum;
+            }
+            /**
+             * @returns Largest recorded value in nanoseconds.
+             */
+            uint64_t getMax() const {
+                return m_Max;
+            }
+            /**
+             * @returns Mean of the recorded values in nanoseconds, 0 if none were recorded.
+             */
+            double getMean() const {
+                return m_Count > 0 ? static_cast<double>(m_Sum) / static_cast<double>(m_Count) : 0.0;
+            }
+            /**
+             * @returns Value in nanoseconds which the given share of all recorded values does not exceed,
+             * rounded up to the bucket bounds. 0 if no values were recorded.
+             * @param quantile Share of values, e.g. 0.99 for the 99th percentile.
+             */
+            uint64_t percentile(double quantile) const {
+                if(m_Count == 0)
+                    return 0;
+                uint64_t rank = static_cast<uint64_t>(quantile * static_cast<double>(m_Count) + 0.5);
+                rank = rank < 1 ? 1 : (rank > m_Count ? m_Count : rank);
+                uint64_t seen = 0;
+                for(size_t i = 0; i < Buckets; ++i)
+                    if((seen += m_Buckets[i]) >= rank)
+                        return upperBound(i) < m_Max ? upperBound(i) : m_Max;
+                return m_Max;
+            }
+            /**
+             * @returns Number of values in every bucket, see lowerBound and upperBound.
+             */
+            const std::array<uint64_t, Buckets>& getBuckets() const {
+                return m_Buckets;
+            }
+        private:
+            friend class HTTPMetrics;
+            static unsigned msb(uint64_t value) { // index of the highest set bit, value must not be 0
+            #if defined(__GNUC__)
+                return 63 - static_cast<unsigned>(__builtin_clzll(value));
+            #else
+                unsigned bit = 0;
+                for(unsigned step = 32; step > 0; step /= 2)
+                    if(value >> (bit + step))
+                        bit += step;
+                return bit;
+            #endif
+            }
+            std::array<uint64_t, Buckets> m_Buckets{};
+            uint64_t m_Count = 0;
+            uint64_t m_Sum = 0;
+            uint64_t m_Max = 0;
+        };
+
+        HTTPMetrics() : m_Id(nextId()) {}
+        HTTPMetrics(const HTTPMetrics&) = delete;
+        HTTPMetrics& operator=(const HTTPMetrics&) = delete;
+
+        /**
+         * Adds to a counter.
+         * @param counter Counter to add to.
+         * @param n Value to add. (defaults to 1)
+         */
+        void add(Counter counter, uint64_t n = 1) {
+            bump(local().Counters[static_cast<size_t>(counter)], n);
+        }
+        /**
+         * Records the duration of a phase.
+         * @param phase Measured phase.
+         * @param duration Duration of the phase.
+         * @param count Number of times to record it, e.g. for requests which were timed together. (defaults to 1)
+         */
+        void record(Phase phase, std::chrono::steady_clock::duration duration, uint64_t count = 1) {
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+            const uint64_t value = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+            auto& data = local().Phases[static_cast<size_t>(phase)];
+            bump(data.Buckets[Histogram::bucket(value)], count);
+            bump(data.Sum, value * count);
+            if(value > data.Max.load(std::memory_order_relaxed))
+                data.Max.store(value, std::memory_order_relaxed);
+        }
+        /**
+         * Counts an answered request.
+         * @param status Status code of the response.
+         */
+        void response(unsigned status) {
+            Slot& slot = local();
+            bump(slot.Counters[static_cast<size_t>(Counter::Requests)]);
+            if(status >= 100 && status < 600)
+                bump(slot.Counters[static_cast<size_t>(Counter::Status1xx) + status / 100 - 1]);
+        }
+        /**
+         * @returns Value of a counter, merged from all threads.
+         * @param counter Counter to get.
+         */
+        uint64_t get(Counter counter) const {
+            uint64_t sum = 0;
+            std::lock_guard<std::mutex> lock(m_SlotsMutex);
+            for(const auto& slot : m_Slots)
+                sum += slot->Counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+            return sum;
+        }
+        /**
+         * @returns Number of currently open connections.
+         */
+        uint64_t getActiveConnections() const {
+            uint64_t opened = 0, closed = 0;
+            std::lock_guard<std::mutex> lock(m_SlotsMutex);
+            for(const auto& slot : m_Slots) { // closed first, so the difference never underflows
+                closed += slot->Counters[static_cast<size_t>(Counter::ConnectionsClosed)].load(std::memory_order_relaxed);
+                opened += slot->Counters[static_cast<size_t>(Counter::ConnectionsOpened)].load(std::memory_order_relaxed);
+            }
+            return opened > closed ? opened - closed : 0;
+        }
+        /**
+         * @returns Histogram of a phase, merged from all threads.
+         * @param phase Phase to get.
+         */
+        Histogram getHistogram(Phase phase) const {
+            Histogram h;
+            std::lock_guard<std::mutex> lock(m_SlotsMutex);
+            for(const auto& slot : m_Slots) {
+                const auto& data = slot->Phases[static_cast<size_t>(phase)];
+                for(size_t i = 0; i < Histogram::Buckets; ++i) {
+                    const uint64_t n = data.Buckets[i].load(std::memory_order_relaxed);
+                    h.m_Buckets[i] += n;
+                    h.m_Count += n;
+                }
+                h.m_Sum += data.Sum.load(std::memory_order_relaxed);
+                const uint64_t max = data.Max.load(std::memory_order_relaxed);
+                if(max > h.m_Max)
+                    h.m_Max = max;
+            }
+            return h;
+        }
+        /**
+         * @returns All counters and histograms in the Prometheus text exposition format.
+         * @param prefix Prefix of the metric names. (defaults to "http_server")
+         */
+        std::string toPrometheus(const std::string& prefix = "http_server") const {
+            static constexpr std::array<double, 19> bounds{{0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+                0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10}}; // seconds
+            std::string out;
+            out.reserve(8192);
+            auto header = [&](const char* name, const char* type, const char* help) {
+                out += "# HELP " + prefix + name + ' ' + help + "\n# TYPE " + prefix + name + ' ' + type + '\n';
+            };
+            auto sample = [&](const char* name, const std::string& labels, const std::string& value) {
+                out += prefix + name + (labels.empty() ? "" : '{' + labels + '}') + ' ' + value + '\n';
+            };
+            auto counter = [&](Counter c) { return std::to_string(get(c)); };
+
+            header("_connections_total", "counter", "Accepted connections.");
+            sample("_connections_total", "", counter(Counter::ConnectionsOpened));
+            header("_connections_active", "gauge", "Open connections.");
+            sample("_connections_active", "", std::to_string(getActiveConnections()));
+            header("_requests_total", "counter", "Answered requests.");
+            sample("_requests_total", "", counter(Counter::Requests));
+            header("_responses_total", "counter", "Responses by status class.");
+            for(size_t i = 0; i < 5; ++i)
+                sample("_responses_total", "code=\"" + std::to_string(i + 1) + "xx\"", counter(static_cast<Counter>(static_cast<size_t>(Counter::Status1xx) + i)));
+            header("_received_bytes_total", "counter", "Received bytes without TLS overhead.");
+            sample("_received_bytes_total", "", counter(Counter::BytesReceived));
+            header("_sent_bytes_total", "counter", "Sent bytes without TLS overhead.");
+            sample("_sent_bytes_total", "", counter(Counter::BytesSent));
+            header("_tls_handshakes_total", "counter", "TLS handshakes by result.");
+            sample("_tls_handshakes_total", "result=\"ok\"", counter(Counter::TLSHandshakes));
+            sample("_tls_handshakes_total", "result=\"error\"", counter(Counter::TLSHandshakeErrors));
+            header("_phase_duration_seconds", "histogram", "Duration of request phases.");
+            char value[32];
+            for(size_t p = 0; p < static_cast<size_t>(Phase::Count); ++p) {
+                const Histogram h = getHistogram(static_cast<Phase>(p));
+                const std::string phase = std::string("phase=\"") + phaseName(static_cast<Phase>(p)) + '"';
+                size_t i = 0;
+                uint64_t cumulative = 0;
+                for(double bound : bounds) { // buckets are counted if they lie below the bound completely
+                    const auto limit = static_cast<uint64_t>(bound * 1e9);
+                    for(; i < Histogram::Buckets && Histogram::upperBound(i) <= limit; ++i)
+                        cumulative += h.m_Buckets[i];
+                    std::snprintf(value, sizeof(value), "%g", bound);
+                    sample("_phase_duration_seconds_bucket", phase + ",le=\"" + value + '"', std::to_string(cumulative));
+                }
+                sample("_phase_duration_seconds_bucket", phase + ",le=\"+Inf\"", std::to_string(h.m_Count));
+                std::snprintf(value, sizeof(value), "%.9f", static_cast<double>(h.m_Sum) / 1e9);
+                sample("_phase_duration_seconds_sum", phase, value);
+                sample("_phase_duration_seconds_count", phase, std::to_string(h.m_Count));
+            }
+            return out;
+        }
+        /**
+         * @returns Snapshot of all counters and the percentiles of all phases in microseconds, e.g.
+         * {"requests": 10, "responses": {"2xx": 9, "4xx": 1, ...}, "latency_us": {"handler": {"p99": 12.5, ...}, ...}, ...}
+         */
+        json::JSON toJSON() const {
+            auto value = [this](Counter c) { return static_cast<long long>(get(c)); };
+            json::JSON j = json::Object();
+            json::JSON connections = json::Object();
+            connections["total"] = value(Counter::ConnectionsOpened);
+            connections["active"] = static_cast<long long>(getActiveConnections());
+            j["connections"] = connections;
+            j["requests"] = value(Counter::Requests);
+            json::JSON responses = json::Object();
+            for(size_t i = 0; i < 5; ++i)
+                responses[std::to_string(i + 1) + "xx"] = value(static_cast<Counter>(static_cast<size_t>(Counter::Status1xx) + i));
+            j["responses"] = responses;
+            json::JSON bytes = json::Object();
+            bytes["received"] = value(Counter::BytesReceived);
+            bytes["sent"] = value(Counter::BytesSent);
+            j["bytes"] = bytes;
+            json::JSON tls = json::Object();
+            tls["ok"] = value(Counter::TLSHandshakes);
+            tls["error"] = value(Counter::TLSHandshakeErrors);
+            j["tls_handshakes"] = tls;
+            json::JSON latency = json::Object();
+            for(size_t p = 0; p < static_cast<size_t>(Phase::Count); ++p) {
+                const Histogram h = getHistogram(static_cast<Phase>(p));
+                json::JSON phase = json::Object();
+                phase["count"] = static_cast<long long>(h.getCount());
+                phase["mean"] = h.getMean() / 1e3;
+                phase["p50"] = static_cast<double>(h.percentile(0.5)) / 1e3;
+                phase["p90"] = static_cast<double>(h.percentile(0.9)) / 1e3;
+                phase["p99"] = static_cast<double>(h.percentile(0.99)) / 1e3;
+                phase["p999"] = static_cast<double>(h.percentile(0.999)) / 1e3;
+                phase["max"] = static_cast<double>(h.getMax()) / 1e3;
+                latency[phaseName(static_cast<Phase>(p))] = phase;
+            }
+            j["latency_us"] = latency;
+            return j;
+        }
+        /**
+         * @returns Name of a phase as used by toPrometheus and toJSON, e.g. "first_byte".
+         * @param phase Phase to get the name of.
+         */
+        static const char* phaseName(Phase phase) {
+            static constexpr std::array<const char*, static_cast<size_t>(Phase::Count)> names{{"first_byte", "parse", "handler", "write"}};
+            return names[static_cast<size_t>(phase)];
+        }
+        using SPtr = std::shared_ptr<HTTPMetrics>;
+        using UPtr = std::unique_ptr<HTTPMetrics>;
+        using WPtr = std::weak_ptr<HTTPMetrics>;
+    private:
+        struct PhaseData {
+            std::array<std::atomic<uint64_t>, Histogram::Buckets> Buckets{};
+            std::atomic<uint64_t> Sum{0};
+            std::atomic<uint64_t> Max{0};
+        };
+        struct alignas(64) Slot { // written by one thread only, read by snapshots
+            std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::Count)> Counters{};
+            std::array<PhaseData, static_cast<size_t>(Phase::Count)> Phases;
+        };
+        struct LocalSlots { // slots of the calling thread, by instance
+            uint64_t Id = 0;
+            Slot* Current = nullptr;
+            std::vector<std::pair<uint64_t, Slot*>> Others;
+        };
+
+        static uint64_t nextId() {
+            static std::atomic<uint64_t> id{0};
+            return ++id; // never reused, stale entries of LocalSlots do not match
+        }
+        static void bump(std::atomic<uint64_t>& value, uint64_t n = 1) { // single writer, no locked instruction needed
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        Slot& local() {
+            thread_local LocalSlots slots;
+            if(slots.Id == m_Id)
+                return *slots.Current;
+            return lookup(slots);
+        }
+        Slot& lookup(LocalSlots& slots) { // e.g. several servers run on the same thread
+            Slot* slot = nullptr;
+            for(auto it = slots.Others.begin(); it != slots.Others.end(); ++it)
+                if(it->first == m_Id) {
+                    slot = it->second;
+                    slots.Others.erase(it);
+                    break;
+                }
+            if(!slot) {
+                std::lock_guard<std::mutex> lock(m_SlotsMutex);
+                m_Slots.push_back(std::make_unique<Slot>());
+                slot = m_Slots.back().get();
+            }
+            if(slots.Current)
+                slots.Others.emplace_back(slots.Id, slots.Current);
+            slots.Id = m_Id;
+            slots.Current = slot;
+            return *slot;
+        }
+
+        const uint64_t m_Id;
+        mutable std::mutex m_SlotsMutex;
+        std::vector<std::unique_ptr<Slot>> m_Slots; // kept until destruction, counts of finished threads stay
+    };
+}
+#endif //SUPPORTLIB_HTTPMETRICS_H
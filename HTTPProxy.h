@@ -0,0 +1,913 @@
+/**
+ * @file HTTPProxy.h
+ * @brief Reverse proxy routes forwarding requests to pooled backend connections.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_HTTPPROXY_H
+#define SUPPORTLIB_HTTPPROXY_H
+#include "HTTPServer.h"
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ssl/host_name_verification.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/socket.h>
+#endif
+
+namespace giri {
+
+    /**
+     *  @brief Exception to be thrown on HTTPProxy errors.
+     */
+    class HTTPProxyException : public ExceptionBase
+    {
+    public:
+        HTTPProxyException(const std::string &msg) : ExceptionBase(msg) {};
+        using SPtr = std::shared_ptr<HTTPProxyException>;
+        using UPtr = std::unique_ptr<HTTPProxyException>;
+        using WPtr = std::weak_ptr<HTTPProxyException>;
+    };
+
+    /**
+     * @brief How an HTTPProxy spreads requests over its backends.
+     */
+    enum class HTTPProxyBalancing {
+        RoundRobin,       ///< Backends take turns.
+        LeastConnections, ///< The backend with the fewest requests in flight.
+        ConsistentHash    ///< Requests with the same key go to the same backend, see HTTPProxyOptions::HashHeader.
+    };
+
+    /**
+     * @brief Balancing, connection pooling, timeouts and health checks of an HTTPProxy.
+     */
+    struct HTTPProxyOptions {
+        HTTPProxyBalancing Balancing = HTTPProxyBalancing::RoundRobin; ///< How requests are spread over the backends.
+        std::string HashHeader;                         ///< Request header hashed by ConsistentHash, the client address if empty.
+        size_t MaxIdle = 32;                            ///< Idle connections kept per backend.
+        std::chrono::milliseconds IdleTimeout{30000};   ///< Idle connections are closed instead of reused after this time.
+        std::chrono::milliseconds ConnectTimeout{3000}; ///< Connecting to a backend, including the TLS handshake.
+        std::chrono::milliseconds Timeout{60000};       ///< Waiting for a backend to accept request data or to send response data.
+        uint64_t BodyLimit = 0;                         ///< Maximum request body size in bytes, 0 for unlimited.
+        std::string HealthPath;                         ///< Path polled by the health checks, e.g. "/health". Empty disables them.
+        std::chrono::milliseconds HealthInterval{5000}; ///< Time between health checks, also how long a failing backend is skipped.
+        unsigned FailThreshold = 3;                     ///< Consecutive failures a backend is skipped or considered down after.
+        unsigned PassThreshold = 2;                     ///< Consecutive passed health checks a backend is considered up again after.
+        bool VerifyTLS = true;                          ///< Verifies the certificates of https backends.
+    };
+
+    /**
+     * @brief Reverse proxy forwarding the requests of routes to backends.
+     *
+     * Every backend has a pool of keep-alive connections, so requests do not pay for a
+     * new TCP (and TLS) connection each. Idle connections stay bound to the io_context
+     * of the session which used them last, a session prefers connections of its own.
+     * Request and response bodies are relayed chunk by chunk: reading the request body
+     * pauses while the backend is busy and reading the response body pauses while the
+     * client is, neither is ever buffered in full. Small responses with a known length
+     * are sent in one piece instead.
+     *
+     * Backends failing to connect are skipped for a while. With a health path set, a
+     * background thread polls every backend and takes failing ones out of rotation until
+     * they pass again. Requests are answered with 502 Bad Gateway if the backend fails,
+     * 503 Service Unavailable if none is available and 504 Gateway Timeout if it does not
+     * answer in time.
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  #include <HTTPProxy.h>
+     *
+     *  using namespace giri;
+     *
+     *  int main()
+     *  {
+     *      HTTPProxyOptions options;
+     *      options.Balancing = HTTPProxyBalancing::LeastConnections;
+     *      options.HealthPath = "/health";
+     *      HTTPProxy::SPtr proxy = std::make_shared<HTTPProxy>(options);
+     *      proxy->addBackend("10.0.0.11", "8080");
+     *      proxy->addBackend("10.0.0.12", "8080");
+     *
+     *      auto srv = std::make_shared<HTTPServer>("0.0.0.0", "443", "/var/www", 4, true, "cert.pem", "key.pem");
+     *      proxy->route(srv, "/api/\*path"); // everything else is served from the doc root
+     *      srv->run();
+     *      std::cin.get();
+     *      return EXIT_SUCCESS;
+     *  }
+     *  @endcode
+     */
+    class HTTPProxy : public Object<HTTPProxy>, public std::enable_shared_from_this<HTTPProxy>
+    {
+    public:
+        /**
+         * @brief State of a backend, see getStatus.
+         */
+        struct Status {
+            std::string Host;      ///< Host name or address.
+            std::string Port;      ///< Port.
+            bool SSL = false;      ///< true if connected to via https.
+            bool Available = true; ///< false while the backend is down or skipped after failures.
+            size_t Active = 0;     ///< Requests in flight.
+            size_t Idle = 0;       ///< Pooled idle connections.
+            uint64_t Requests = 0; ///< Forwarded requests.
+            uint64_t Failures = 0; ///< Failed connections and requests.
+        };
+
+        /**
+         * HTTPProxy constructor. Needs to be owned by a std::shared_ptr.
+         * @param options Balancing, pooling, timeouts and health checks.
+         */
+        explicit HTTPProxy(HTTPProxyOptions options = {}) :
+            m_Options(std::move(options))
+        {
+            if(m_Options.VerifyTLS) {
+                boost::system::error_code ec;
+                m_TLS.set_default_verify_paths(ec);
+                m_TLS.set_verify_mode(ssl::verify_peer);
+            }
+        }
+        ~HTTPProxy() {
+            {
+                std::lock_guard<std::mutex> lock(m_HealthMutex);
+                m_Stop = true;
+            }
+            m_HealthCv.notify_all();
+            if(m_HealthThread.joinable())
+                m_HealthThread.join();
+        }
+        /**
+         * Adds a backend, needs to be called before the proxy is routed to.
+         * The host is resolved once, throws HTTPProxyException if that fails.
+         * @param host Host name or address of the backend.
+         * @param port Port of the backend.
+         * @param ssl true to connect via https.
+         */
+        void addBackend(const std::string& host, const std::string& port, bool ssl = false) {
+            auto b = std::make_unique<Backend>();
+            b->Host = host;
+            b->Port = port;
+            b->SSL = ssl;
+            boost::asio::io_context ioc;
+            tcp::resolver resolver(ioc);
+            boost::system::error_code ec;
+            auto results = resolver.resolve(host, port, ec);
+            if(ec)
+                throw HTTPProxyException("Add backend: cannot resolve '" + host + ":" + port + "': " + ec.message());
+            for(const auto& r : results)
+                b->Endpoints.push_back(r.endpoint());
+            for(unsigned i = 0; i < Replicas; i++) // positions on the hash ring
+                m_Ring.emplace_back(hash(host + ":" + port + "#" + std::to_string(i)), m_Backends.size());
+            std::sort(m_Ring.begin(), m_Ring.end());
+            m_Backends.push_back(std::move(b));
+        }
+        /**
+         * Forwards all requests matching a route pattern, for the methods GET, HEAD, POST,
+         * PUT, DELETE, PATCH and OPTIONS. Needs to be called before the server runs, starts
+         * the health checks. Throws RouterException on invalid or conflicting routes.
+         * @param server Server to add the routes to.
+         * @param pattern Path pattern, see Router. The request target is forwarded unchanged.
+         */
+        void route(const HTTPServer::SPtr& server, const std::string& pattern) {
+            HTTPRouteOptions options;
+            options.BodyLimit = m_Options.BodyLimit > 0 ? m_Options.BodyLimit : std::numeric_limits<uint64_t>::max();
+            HTTPProxy::SPtr self = shared_from_this();
+            options.OnBody = [self](HTTPSession::SPtr session, std::string_view chunk) {
+                self->exchange(session, true)->onBody(chunk);
+            };
+            HTTPRouteHandler handler = [self](HTTPSession::SPtr session, const RouteParams&) {
+                self->exchange(session, false)->onRequest();
+            };
+            for(auto method : {http::verb::get, http::verb::head, http::verb::post, http::verb::put, http::verb::delete_, http::verb::patch, http::verb::options})
+                server->route(method, pattern, handler, options);
+            startHealthChecks();
+        }
+        /**
+         * @returns State of every backend, in the order they were added.
+         */
+        std::vector<Status> getStatus() const {
+            std::vector<Status> status;
+            const int64_t now = clock();
+            for(const auto& b : m_Backends) {
+                Status s;
+                s.Host = b->Host;
+                s.Port = b->Port;
+                s.SSL = b->SSL;
+                s.Available = available(*b, now);
+                s.Active = b->Active.load(std::memory_order_relaxed);
+                s.Requests = b->Requests.load(std::memory_order_relaxed);
+                s.Failures = b->Failures.load(std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(b->IdleMutex);
+                s.Idle = b->Idle.size();
+                status.push_back(std::move(s));
+            }
+            return status;
+        }
+        /**
+         * @returns Options of the proxy.
+         */
+        const HTTPProxyOptions& getOptions() const {
+            return m_Options;
+        }
+        using SPtr = std::shared_ptr<HTTPProxy>;
+        using UPtr = std::unique_ptr<HTTPProxy>;
+        using WPtr = std::weak_ptr<HTTPProxy>;
+    private:
+        static constexpr unsigned Replicas = 160;           // positions of a backend on the hash ring
+        static constexpr size_t ChunkSize = 64 * 1024;      // read at once from a backend
+        static constexpr size_t SmallBody = 64 * 1024;      // responses up to this size are sent in one piece
+        static constexpr size_t MaxQueued = 4 * ChunkSize;  // response data queued for a client before reading pauses
+        static constexpr uint32_t HeaderLimit = 64 * 1024;
+
+        struct Connection;
+        struct Backend {
+            std::string Host;
+            std::string Port;
+            bool SSL = false;
+            std::vector<tcp::endpoint> Endpoints;
+            std::atomic<size_t> Active{0};
+            std::atomic<uint64_t> Requests{0};
+            std::atomic<uint64_t> Failures{0};
+            std::atomic<unsigned> Failed{0};   // consecutive failures of requests
+            std::atomic<int64_t> RetryAt{0};   // skipped until then after too many failures
+            std::atomic<bool> Up{true};        // see health checks
+            unsigned ProbeFailed = 0;          // health thread only
+            unsigned ProbePassed = 0;
+            mutable std::mutex IdleMutex;
+            std::deque<std::shared_ptr<Connection>> Idle; // oldest first
+        };
+        struct Connection {
+            Connection(boost::asio::io_context& ioc, Backend& backend, ssl::context* tls) :
+                Socket(ioc.get_executor()),
+                Context(&ioc),
+                Owner(&backend)
+            {
+                if(tls)
+                    TLS = std::make_unique<ssl::stream<tcp::socket&>>(Socket, *tls);
+            }
+            template<class Fn>
+            void visit(Fn&& fn) { // calls fn with the stream to use
+                if(TLS)
+                    fn(*TLS);
+                else
+                    fn(Socket);
+            }
+            tcp::socket Socket;
+            std::unique_ptr<ssl::stream<tcp::socket&>> TLS;
+            boost::beast::flat_buffer Buffer;
+            boost::asio::io_context* Context;
+            Backend* Owner;
+            std::chrono::steady_clock::time_point Since; // idle since
+        };
+
+        /**
+         * One forwarded request, all of it runs on the strand of the client's session.
+         */
+        class Exchange : public std::enable_shared_from_this<Exchange> {
+        public:
+            Exchange(HTTPProxy::SPtr proxy, HTTPSession::SPtr session) :
+                m_Proxy(std::move(proxy)),
+                m_Session(std::move(session)),
+                m_Strand(m_Session->getStrand()),
+                m_Timer(m_Strand),
+                m_Head(m_Session->getRequestHeader().method() == http::verb::head),
+                m_Idempotent(idempotent(m_Session->getRequestHeader().method()))
+            {
+            }
+            ~Exchange() {
+                leave();
+            }
+            void start(bool withBody) {
+                const auto& req = m_Session->getRequestHeader();
+                m_Chunked = withBody && req.find(http::field::content_length) == req.end();
+                m_Request = m_Proxy->requestHead(*m_Session, m_Chunked);
+                pick();
+            }
+            void onBody(std::string_view chunk) {
+                if(m_Failed)
+                    return; // discarded, answered once the request was received
+                m_BodySent = true;
+                m_Queue.push_back(m_Chunked ? HTTPStream::encodeChunk(chunk) : std::make_shared<const std::string>(chunk));
+                m_Session->pauseBody(); // resumed once the backend took it
+                if(m_Connected && !m_Writing)
+                    write();
+            }
+            void onRequest() { // the whole request was received
+                m_RequestDone = true;
+                m_Session->defer();
+                if(m_Failed)
+                    return respondError();
+                if(m_Chunked) {
+                    static const auto last = std::make_shared<const std::string>("0\r\n\r\n");
+                    m_Queue.push_back(last);
+                }
+                if(m_Connected && !m_Writing)
+                    write();
+            }
+        private:
+            void pick() { // chooses a backend and gets a connection to it
+                m_Backend = m_Proxy->select(*m_Session, m_Tried);
+                if(!m_Backend)
+                    return fail(m_Tried.empty() ? http::status::service_unavailable : http::status::bad_gateway, "No backend available");
+                m_Tried.push_back(m_Backend);
+                m_Left = false;
+                m_Backend->Active.fetch_add(1, std::memory_order_relaxed);
+                m_Backend->Requests.fetch_add(1, std::memory_order_relaxed);
+                auto& ioc = static_cast<boost::asio::io_context&>(m_Strand.get_inner_executor().context());
+                m_Connection = m_Proxy->acquire(*m_Backend, ioc);
+                m_Reused = m_Connection != nullptr;
+                if(m_Reused) {
+                    m_Connected = true;
+                    return write();
+                }
+                connect(ioc);
+            }
+            void connect(boost::asio::io_context& ioc) {
+                m_Connection = std::make_shared<Connection>(ioc, *m_Backend, m_Backend->SSL ? &m_Proxy->m_TLS : nullptr);
+                arm(m_Proxy->m_Options.ConnectTimeout);
+                boost::asio::async_connect(m_Connection->Socket, m_Backend->Endpoints, boost::asio::bind_executor(m_Strand,
+                    [self = this->shared_from_this()](boost::system::error_code ec, const tcp::endpoint&) {
+                        self->on_connect(ec);
+                    }));
+            }
+            void on_connect(boost::system::error_code ec) {
+                if(ec)
+                    return connectFailed();
+                boost::system::error_code ignored;
+                m_Connection->Socket.set_option(tcp::no_delay(true), ignored);
+                if(!m_Connection->TLS)
+                    return connected();
+                auto& tls = *m_Connection->TLS;
+                SSL_set_tlsext_host_name(tls.native_handle(), m_Backend->Host.c_str());
+                if(m_Proxy->m_Options.VerifyTLS)
+                    tls.set_verify_callback(ssl::host_name_verification(m_Backend->Host));
+                tls.async_handshake(ssl::stream_base::client, boost::asio::bind_executor(m_Strand, [self = this->shared_from_this()](boost::system::error_code ec) {
+                    if(ec)
+                        return self->connectFailed();
+                    self->connected();
+                }));
+            }
+            void connected() {
+                disarm();
+                m_Connected = true;
+                write();
+            }
+            void connectFailed() { // nothing was sent yet, another backend may take the request
+                disarm();
+                m_Connection.reset();
+                m_Proxy->failed(*m_Backend);
+                leave();
+                if(m_TimedOut) {
+                    m_TimedOut = false;
+                    return fail(http::status::gateway_timeout, "Backend did not accept the connection in time");
+                }
+                pick();
+            }
+            void write() { // sends the request head and the queued body chunks with a gathered write
+                if(!m_HeadSent)
+                    m_InFlight.push_back(std::make_shared<const std::string>(m_Request));
+                for(auto& chunk : m_Queue)
+                    m_InFlight.push_back(std::move(chunk));
+                m_Queue.clear();
+                if(m_InFlight.empty())
+                    return m_RequestDone ? readHeader() : m_Session->resumeBody();
+                m_Buffers.clear();
+                for(const auto& part : m_InFlight)
+                    m_Buffers.emplace_back(part->data(), part->size());
+                m_Writing = true;
+                arm(m_Proxy->m_Options.Timeout);
+                m_Connection->visit([&](auto& stream) {
+                    boost::asio::async_write(stream, m_Buffers, boost::asio::bind_executor(m_Strand, [self = this->shared_from_this()](boost::system::error_code ec, std::size_t) {
+                        self->on_write(ec);
+                    }));
+                });
+            }
+            void on_write(boost::system::error_code ec) {
+                disarm();
+                m_Writing = false;
+                m_InFlight.clear();
+                m_Buffers.clear();
+                if(ec)
+                    return requestFailed(true);
+                m_HeadSent = true;
+                if(!m_Queue.empty())
+                    return write();
+                if(m_RequestDone)
+                    return readHeader();
+                m_Session->resumeBody();
+            }
+            void readHeader() {
+                m_Parser.emplace();
+                m_Parser->header_limit(HeaderLimit);
+                m_Parser->body_limit(std::numeric_limits<uint64_t>::max());
+                if(m_Head)
+                    m_Parser->skip(true);
+                arm(m_Proxy->m_Options.Timeout);
+                m_Connection->visit([&](auto& stream) {
+                    http::async_read_header(stream, m_Connection->Buffer, *m_Parser, boost::asio::bind_executor(m_Strand, [self = this->shared_from_this()](boost::system::error_code ec, std::size_t) {
+                        self->on_header(ec);
+                    }));
+                });
+            }
+            void on_header(boost::system::error_code ec) {
+                disarm();
+                if(ec)
+                    return requestFailed();
+                auto& res = m_Parser->get();
+                if(res.result() == http::status::switching_protocols)
+                    return fail(http::status::bad_gateway, "Unsupported response of the backend"); // upgrades are not forwarded
+                if(res.result_int() < 200)
+                    return readHeader(); // interim response, e.g. 100 Continue or 103 Early Hints, the final one follows
+                m_Proxy->passed(*m_Backend);
+                if(m_Parser->is_done())
+                    return respondBuffered({});
+                if(m_Parser->content_length() && *m_Parser->content_length() <= SmallBody) {
+                    m_Small.emplace(std::move(*m_Parser));
+                    arm(m_Proxy->m_Options.Timeout);
+                    m_Connection->visit([&](auto& stream) {
+                        http::async_read(stream, m_Connection->Buffer, *m_Small, boost::asio::bind_executor(m_Strand, [self = this->shared_from_this()](boost::system::error_code ec, std::size_t) {
+                            self->disarm();
+                            if(ec)
+                                return self->requestFailed();
+                            self->respondBuffered(std::move(self->m_Small->get().body()));
+                        }));
+                    });
+                    return;
+                }
+                respondStreamed();
+            }
+            void respondBuffered(std::vector<char> body) {
+                const http::response_header<>& upstream = m_Small ? m_Small->get().base() : m_Parser->get().base();
+                const bool keepAlive = m_Small ? m_Small->keep_alive() : m_Parser->keep_alive();
+                auto res = std::make_shared<http::response<http::vector_body<char>>>();
+                res->result(upstream.result_int());
+                copyFields(upstream, *res, false); // keeps Content-Length, also that of HEAD responses
+                res->body() = std::move(body);
+                release(keepAlive);
+                resume([res](const HTTPSession::SPtr& s) {
+                    res->version(s->getRequest().version());
+                    res->set(http::field::server, s->getServerString());
+                    res->keep_alive(s->getRequest().keep_alive());
+                    s->setResult(*res);
+                });
+            }
+            void respondStreamed() {
+                const auto& upstream = m_Parser->get();
+                auto fields = std::make_shared<http::fields>();
+                copyFields(upstream.base(), *fields, true);
+                auto type = upstream.find(http::field::content_type);
+                const std::string contentType = type != upstream.end() ? std::string(type->value()) : "application/octet-stream";
+                const auto status = upstream.result();
+                m_Chunk.resize(ChunkSize);
+                resume([self = this->shared_from_this(), fields, contentType, status](const HTTPSession::SPtr& s) {
+                    self->m_Stream = s->stream(status, contentType, *fields);
+                    self->m_Stream->setOnDrain([self]{ self->readBody(); });
+                    self->m_Stream->setOnClose([self]{ self->streamClosed(); });
+                });
+            }
+            void readBody() {
+                if(m_Reading || m_Done || !m_Connection)
+                    return;
+                m_Reading = true;
+                auto& body = m_Parser->get().body();
+                body.data = m_Chunk.data();
+                body.size = m_Chunk.size();
+                arm(m_Proxy->m_Options.Timeout);
+                m_Connection->visit([&](auto& stream) {
+                    http::async_read(stream, m_Connection->Buffer, *m_Parser, boost::asio::bind_executor(m_Strand, [self = this->shared_from_this()](boost::system::error_code ec, std::size_t) {
+                        self->on_body(ec);
+                    }));
+                });
+            }
+            void on_body(boost::system::error_code ec) {
+                disarm();
+                m_Reading = false;
+                if(ec == http::error::need_buffer) // chunk buffer is full
+                    ec = {};
+                if(!m_Connection || !m_Stream)
+                    return; // the client is gone
+                if(ec) {
+                    m_Proxy->failed(*m_Backend);
+                    m_Connection.reset();
+                    return m_Stream->close(); // the response is underway, all that is left is to abort it
+                }
+                const size_t len = m_Chunk.size() - m_Parser->get().body().size;
+                if(len > 0)
+                    m_Stream->write(std::string_view(m_Chunk.data(), len));
+                if(m_Parser->is_done()) {
+                    m_Done = true;
+                    release(m_Parser->keep_alive());
+                    return m_Stream->finish();
+                }
+                if(m_Stream->getQueuedBytes() < MaxQueued)
+                    readBody(); // otherwise continued once the client took it
+            }
+            void streamClosed() { // finished or the client is gone
+                if(!m_Done && m_Connection) { // not reusable in the middle of a response
+                    disarm();
+                    boost::system::error_code ignored;
+                    m_Connection->Socket.close(ignored); // a pending read completes with an error
+                }
+                m_Stream.reset(); // breaks the cycle through the stream's callbacks
+            }
+            void requestFailed(bool writing = false) { // writing the request or reading the response failed
+                const bool timedOut = m_TimedOut;
+                m_Connection.reset();
+                // the backend closed the pooled connection meanwhile, it may have processed a request it got completely though
+                if(m_Reused && !m_Retried && !m_BodySent && !timedOut && (writing || m_Idempotent)) {
+                    m_Retried = true;
+                    m_Reused = false;
+                    m_HeadSent = false;
+                    m_Connected = false;
+                    m_Parser.reset();
+                    return connect(static_cast<boost::asio::io_context&>(m_Strand.get_inner_executor().context()));
+                }
+                m_Proxy->failed(*m_Backend);
+                if(timedOut)
+                    fail(http::status::gateway_timeout, "Backend did not answer in time");
+                else
+                    fail(http::status::bad_gateway, "Backend failed");
+            }
+            void fail(http::status status, const std::string& msg) {
+                m_Failed = true;
+                m_Status = status;
+                m_Message = msg;
+                m_Connection.reset();
+                m_Queue.clear();
+                if(m_RequestDone)
+                    respondError();
+                else if(m_Session)
+                    m_Session->resumeBody(); // the rest of the body is discarded
+            }
+            void respondError() {
+                auto status = m_Status;
+                auto msg = m_Message;
+                resume([status, msg](const HTTPSession::SPtr& s) {
+                    http::response<http::vector_body<char>> res{status, s->getRequest().version()};
+                    res.set(http::field::server, s->getServerString());
+                    res.set(http::field::content_type, "text/html");
+                    res.keep_alive(s->getRequest().keep_alive());
+                    res.body().assign(msg.begin(), msg.end());
+                    res.prepare_payload();
+                    s->setResult(res);
+                });
+            }
+            void resume(std::function<void(const HTTPSession::SPtr&)> respond) {
+                if(!m_Session)
+                    return;
+                m_Session->resume(std::move(respond));
+                m_Session.reset(); // the session keeps this exchange as context until it sends the response
+            }
+            void release(bool keepAlive) {
+                leave();
+                if(keepAlive && m_Connection && m_Connection->Buffer.size() == 0)
+                    m_Proxy->release(std::move(m_Connection));
+                m_Connection.reset();
+            }
+            void leave() { // no longer counted as active request of the backend
+                if(m_Backend && !m_Left)
+                    m_Backend->Active.fetch_sub(1, std::memory_order_relaxed);
+                m_Left = true;
+            }
+            static bool idempotent(http::verb method) {
+                switch(method) {
+                    case http::verb::get:
+                    case http::verb::head:
+                    case http::verb::options:
+                    case http::verb::put:
+                    case http::verb::delete_:
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+            template<class Fields>
+            static void copyFields(const http::response_header<>& from, Fields& to, bool streamed) {
+                auto connection = from.find(http::field::connection);
+                const std::string_view listed = connection != from.end() ? std::string_view(connection->value().data(), connection->value().size()) : std::string_view();
+                for(const auto& field : from) {
+                    if(hopByHop(field.name(), field.name_string(), listed))
+                        continue;
+                    if(field.name() == http::field::server || (streamed && (field.name() == http::field::content_length || field.name() == http::field::content_type)))
+                        continue;
+                    to.insert(field.name_string(), field.value());
+                }
+            }
+            void arm(std::chrono::milliseconds timeout) {
+                m_TimedOut = false;
+                const uint64_t gen = ++m_TimerGen;
+                m_Timer.expires_after(timeout);
+                m_Timer.async_wait(boost::asio::bind_executor(m_Strand, [self = this->shared_from_this(), gen](boost::system::error_code ec) {
+                    if(ec || gen != self->m_TimerGen)
+                        return;
+                    self->m_TimedOut = true;
+                    if(self->m_Connection) { // the pending operation completes with an error
+                        boost::system::error_code ignored;
+                        self->m_Connection->Socket.close(ignored);
+                    }
+                }));
+            }
+            void disarm() {
+                ++m_TimerGen;
+                m_Timer.cancel();
+            }
+
+            HTTPProxy::SPtr m_Proxy;
+            HTTPSession::SPtr m_Session; // released once the response was handed over
+            HTTPStream::Strand m_Strand;
+            boost::asio::steady_timer m_Timer;
+            uint64_t m_TimerGen = 0;
+            bool m_TimedOut = false;
+            const bool m_Head;
+            const bool m_Idempotent; // may be sent again if the backend closed the connection before answering
+            Backend* m_Backend = nullptr;
+            std::vector<Backend*> m_Tried;
+            std::shared_ptr<Connection> m_Connection;
+            bool m_Connected = false;
+            bool m_Reused = false;   // pooled connection, may have been closed by the backend meanwhile
+            bool m_Retried = false;
+            bool m_Left = false;
+            std::string m_Request;   // serialized request head
+            bool m_Chunked = false;  // request body is sent chunked
+            bool m_HeadSent = false;
+            bool m_BodySent = false;
+            bool m_RequestDone = false;
+            bool m_Writing = false;
+            std::deque<std::shared_ptr<const std::string>> m_Queue;
+            std::vector<std::shared_ptr<const std::string>> m_InFlight;
+            std::vector<boost::asio::const_buffer> m_Buffers;
+            boost::optional<http::response_parser<http::buffer_body>> m_Parser;
+            boost::optional<http::response_parser<http::vector_body<char>>> m_Small;
+            std::vector<char> m_Chunk;
+            HTTPStream::SPtr m_Stream;
+            bool m_Reading = false;
+            bool m_Done = false;     // response relayed completely
+            bool m_Failed = false;
+            http::status m_Status = http::status::bad_gateway;
+            std::string m_Message;
+        };
+
+        std::shared_ptr<Exchange> exchange(const HTTPSession::SPtr& session, bool withBody) { // created by the first body chunk or the route handler
+            if(const auto& context = session->getContext())
+                return std::static_pointer_cast<Exchange>(context);
+            auto ex = std::make_shared<Exchange>(shared_from_this(), session);
+            session->setContext(ex);
+            ex->start(withBody);
+            return ex;
+        }
+        static bool hopByHop(http::field name, boost::beast::string_view nameString, std::string_view listed) {
+            switch(name) {
+                case http::field::connection:
+                case http::field::keep_alive:
+                case http::field::proxy_connection:
+                case http::field::te:
+                case http::field::trailer:
+                case http::field::transfer_encoding:
+                case http::field::upgrade:
+                    return true;
+                default:
+                    break;
+            }
+            if(listed.empty())
+                return false;
+            for(const auto& token : http::token_list(boost::beast::string_view(listed.data(), listed.size())))
+                if(boost::beast::iequals(token, nameString))
+                    return true;
+            return false;
+        }
+        std::string requestHead(const HTTPSession& session, bool chunked) const {
+            const auto& req = session.getRequestHeader();
+            auto connection = req.find(http::field::connection);
+            const std::string_view listed = connection != req.end() ? std::string_view(connection->value().data(), connection->value().size()) : std::string_view();
+            std::string head;
+            head.reserve(1024);
+            head.append(req.method_string().data(), req.method_string().size()).append(" ");
+            head.append(req.target().data(), req.target().size()).append(" HTTP/1.1\r\n");
+            std::string forwardedFor;
+            for(const auto& field : req) {
+                if(hopByHop(field.name(), field.name_string(), listed) || field.name() == http::field::expect) // the client got 100 Continue already
+                    continue;
+                if(boost::beast::iequals(field.name_string(), "X-Forwarded-For")) {
+                    forwardedFor.append(forwardedFor.empty() ? "" : ", ").append(field.value().data(), field.value().size());
+                    continue;
+                }
+                if(boost::beast::iequals(field.name_string(), "X-Forwarded-Proto") || boost::beast::iequals(field.name_string(), "X-Forwarded-Host"))
+                    continue; // set below
+                head.append(field.name_string().data(), field.name_string().size()).append(": ");
+                head.append(field.value().data(), field.value().size()).append("\r\n");
+            }
+            forwardedFor.append(forwardedFor.empty() ? "" : ", ").append(session.getClientIP());
+            head.append("X-Forwarded-For: ").append(forwardedFor).append("\r\n");
+            head.append("X-Forwarded-Proto: ").append(session.getSSL() ? "https" : "http").append("\r\n");
+            auto host = req.find(http::field::host);
+            if(host != req.end())
+                head.append("X-Forwarded-Host: ").append(host->value().data(), host->value().size()).append("\r\n");
+            else
+                head.append("Host: ").append(m_Backends.empty() ? std::string() : m_Backends.front()->Host).append("\r\n"); // HTTP/1.0 clients
+            if(chunked)
+                head.append("Transfer-Encoding: chunked\r\n");
+            head.append("\r\n");
+            return head;
+        }
+        static uint64_t hash(std::string_view key) {
+            uint64_t h = 14695981039346656037ull; // FNV-1a
+            for(unsigned char c : key)
+                h = (h ^ c) * 1099511628211ull;
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull; // spreads similar keys over the ring
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+            return h ^ (h >> 31);
+        }
+        static int64_t clock() {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        static bool available(const Backend& b, int64_t now) {
+            return b.Up.load(std::memory_order_relaxed) && now >= b.RetryAt.load(std::memory_order_relaxed);
+        }
+        Backend* select(const HTTPSession& session, const std::vector<Backend*>& tried) {
+            const size_t n = m_Backends.size();
+            if(n == 0)
+                return nullptr;
+            const int64_t now = clock();
+            auto usable = [&](Backend* b) {
+                return available(*b, now) && std::find(tried.begin(), tried.end(), b) == tried.end();
+            };
+            if(m_Options.Balancing == HTTPProxyBalancing::ConsistentHash) {
+                std::string key;
+                if(!m_Options.HashHeader.empty()) {
+                    auto it = session.getRequestHeader().find(m_Options.HashHeader);
+                    if(it != session.getRequestHeader().end())
+                        key.assign(it->value().data(), it->value().size());
+                }
+                if(key.empty())
+                    key = session.getClientIP();
+                const uint64_t h = hash(key);
+                const size_t start = static_cast<size_t>(std::lower_bound(m_Ring.begin(), m_Ring.end(), std::make_pair(h, size_t(0))) - m_Ring.begin());
+                for(size_t i = 0; i < m_Ring.size(); i++) { // the next backend clockwise takes over from unavailable ones
+                    Backend* b = m_Backends[m_Ring[(start + i) % m_Ring.size()].second].get();
+                    if(usable(b))
+                        return b;
+                }
+                return nullptr;
+            }
+            if(m_Options.Balancing == HTTPProxyBalancing::RoundRobin) {
+                for(size_t i = 0; i < n; i++) { // unavailable backends pass their turn on
+                    Backend* b = m_Backends[m_Next.fetch_add(1, std::memory_order_relaxed) % n].get();
+                    if(usable(b))
+                        return b;
+                }
+                return nullptr;
+            }
+            const size_t start = m_Next.fetch_add(1, std::memory_order_relaxed); // ties are rotated
+            Backend* best = nullptr;
+            for(size_t i = 0; i < n; i++) {
+                Backend* b = m_Backends[(start + i) % n].get();
+                if(usable(b) && (!best || b->Active.load(std::memory_order_relaxed) < best->Active.load(std::memory_order_relaxed)))
+                    best = b;
+            }
+            return best;
+        }
+        std::shared_ptr<Connection> acquire(Backend& b, boost::asio::io_context& ioc) { // idle connection of the same io_context, nullptr if none
+            const auto now = std::chrono::steady_clock::now();
+            for(;;) {
+                std::shared_ptr<Connection> c;
+                {
+                    std::lock_guard<std::mutex> lock(b.IdleMutex);
+                    while(!b.Idle.empty() && now - b.Idle.front()->Since > m_Options.IdleTimeout)
+                        b.Idle.pop_front();
+                    for(size_t i = b.Idle.size(); i-- > 0;) {
+                        if(b.Idle[i]->Context == &ioc) {
+                            c = std::move(b.Idle[i]);
+                            b.Idle.erase(b.Idle.begin() + static_cast<std::ptrdiff_t>(i));
+                            break;
+                        }
+                    }
+                }
+                if(!c)
+                    return nullptr;
+                if(alive(*c))
+                    return c;
+            }
+        }
+        static bool alive(Connection& c) { // false if the backend closed the idle connection or sent something unexpected
+        #if defined(__linux__)
+            char byte;
+            const ssize_t n = ::recv(c.Socket.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        #else
+            return c.Socket.is_open();
+        #endif
+        }
+        void release(std::shared_ptr<Connection> c) {
+            Backend& b = *c->Owner;
+            c->Since = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> lock(b.IdleMutex);
+            if(m_Options.MaxIdle == 0)
+                return;
+            if(b.Idle.size() >= m_Options.MaxIdle)
+                b.Idle.pop_front();
+            b.Idle.push_back(std::move(c));
+        }
+        void failed(Backend& b) {
+            b.Failures.fetch_add(1, std::memory_order_relaxed);
+            if(b.Failed.fetch_add(1, std::memory_order_relaxed) + 1 >= m_Options.FailThreshold) {
+                b.Failed = 0;
+                b.RetryAt = clock() + m_Options.HealthInterval.count();
+                std::lock_guard<std::mutex> lock(b.IdleMutex);
+                b.Idle.clear();
+            }
+        }
+        void passed(Backend& b) {
+            if(b.Failed.load(std::memory_order_relaxed) != 0)
+                b.Failed = 0;
+        }
+        void startHealthChecks() {
+            if(m_Options.HealthPath.empty() || m_HealthThread.joinable())
+                return;
+            m_HealthThread = std::thread([this]{
+                std::unique_lock<std::mutex> lock(m_HealthMutex);
+                while(!m_Stop) {
+                    lock.unlock();
+                    for(auto& b : m_Backends)
+                        probe(*b);
+                    lock.lock();
+                    m_HealthCv.wait_for(lock, m_Options.HealthInterval, [this]{ return m_Stop; });
+                }
+            });
+        }
+        void probe(Backend& b) { // requests the health path, 2xx and 3xx pass
+            boost::asio::io_context ioc;
+            Connection c(ioc, b, b.SSL ? &m_TLS : nullptr);
+            const std::string req = "GET " + m_Options.HealthPath + " HTTP/1.1\r\nHost: " + b.Host + "\r\nUser-Agent: giris_supportlib_http_proxy\r\nConnection: close\r\n\r\n";
+            http::response_parser<http::empty_body> parser;
+            parser.skip(true);
+            bool passed = false;
+            auto onHeader = [&](boost::system::error_code ec, std::size_t) {
+                passed = !ec && parser.get().result_int() >= 200 && parser.get().result_int() < 400;
+            };
+            auto onWrite = [&](boost::system::error_code ec, std::size_t) {
+                if(!ec)
+                    c.visit([&](auto& stream){ http::async_read_header(stream, c.Buffer, parser, onHeader); });
+            };
+            auto send = [&]{
+                c.visit([&](auto& stream){ boost::asio::async_write(stream, boost::asio::buffer(req), onWrite); });
+            };
+            boost::asio::async_connect(c.Socket, b.Endpoints, [&](boost::system::error_code ec, const tcp::endpoint&) {
+                if(ec)
+                    return;
+                if(!c.TLS)
+                    return send();
+                SSL_set_tlsext_host_name(c.TLS->native_handle(), b.Host.c_str());
+                if(m_Options.VerifyTLS)
+                    c.TLS->set_verify_callback(ssl::host_name_verification(b.Host));
+                c.TLS->async_handshake(ssl::stream_base::client, [&](boost::system::error_code ec) {
+                    if(!ec)
+                        send();
+                });
+            });
+            ioc.run_for(m_Options.ConnectTimeout + m_Options.ConnectTimeout);
+            if(passed) {
+                b.ProbeFailed = 0;
+                if(!b.Up && ++b.ProbePassed >= m_Options.PassThreshold) {
+                    b.ProbePassed = 0;
+                    b.RetryAt = 0;
+                    b.Up = true;
+                }
+            }
+            else {
+                b.ProbePassed = 0;
+                if(b.Up && ++b.ProbeFailed >= m_Options.FailThreshold) {
+                    b.ProbeFailed = 0;
+                    b.Up = false;
+                    std::lock_guard<std::mutex> lock(b.IdleMutex);
+                    b.Idle.clear();
+                }
+            }
+        }
+
+        HTTPProxyOptions m_Options;
+        ssl::context m_TLS{ssl::context::tls_client};
+        std::vector<std::unique_ptr<Backend>> m_Backends;
+        std::vector<std::pair<uint64_t, size_t>> m_Ring; // consistent hashing: positions of the backends
+        std::atomic<size_t> m_Next{0};
+        std::thread m_HealthThread;
+        std::mutex m_HealthMutex;
+        std::condition_variable m_HealthCv;
+        bool m_Stop = false;
+    };
+}
+#endif //SUPPORTLIB_HTTPPROXY_H
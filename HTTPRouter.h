@@ -0,0 +1,307 @@
+/**
+ * @file HTTPRouter.h
+ * @brief Radix tree router matching HTTP method and path.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_HTTPROUTER_H
+#define SUPPORTLIB_HTTPROUTER_H
+#include "Object.h"
+#include "Exception.h"
+#include <ostream> // needed by boost/beast/http/verb.hpp
+#include <boost/beast/http/verb.hpp>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace giri {
+
+    /**
+     *  @brief Exception to be thrown on invalid or conflicting routes.
+     */
+    class RouterException : public ExceptionBase
+    {
+    public:
+        RouterException(const std::string &msg) : ExceptionBase(msg) {};
+        using SPtr = std::shared_ptr<RouterException>;
+        using UPtr = std::unique_ptr<RouterException>;
+        using WPtr = std::weak_ptr<RouterException>;
+    };
+
+    /**
+     * @brief Parameters captured while matching a route.
+     *
+     * Names point into the router, values into the matched path, so the
+     * parameters are only valid as long as both are.
+     */
+    class RouteParams
+    {
+    public:
+        static constexpr size_t MaxParams = 8; ///< Maximum number of parameters per route.
+        using Param = std::pair<std::string_view, std::string_view>;
+
+        /**
+         * @returns Value of a parameter, empty if there is no such parameter.
+         * @param name Name of the parameter (without leading ':' or '*').
+         */
+        std::string_view get(std::string_view name) const {
+            for(size_t i = 0; i < m_Size; ++i)
+                if(m_Params[i].first == name)
+                    return m_Params[i].second;
+            return {};
+        }
+        /**
+         * @returns Value of a parameter, empty if there is no such parameter.
+         * @param name Name of the parameter (without leading ':' or '*').
+         */
+        std::string_view operator[](std::string_view name) const {
+            return get(name);
+        }
+        /**
+         * @returns Number of captured parameters.
+         */
+        size_t size() const {
+            return m_Size;
+        }
+        /**
+         * @returns true if no parameters were captured.
+         */
+        bool empty() const {
+            return m_Size == 0;
+        }
+        const Param* begin() const {
+            return m_Params.data();
+        }
+        const Param* end() const {
+            return m_Params.data() + m_Size;
+        }
+        void push(std::string_view name, std::string_view value) {
+            m_Params[m_Size++] = {name, value};
+        }
+        void pop() {
+            --m_Size;
+        }
+        void clear() {
+            m_Size = 0;
+        }
+    private:
+        std::array<Param, MaxParams> m_Params;
+        size_t m_Size = 0;
+    };
+
+    /**
+     * @brief Radix tree router mapping HTTP method and path to a handler.
+     *
+     * Patterns consist of static text, named parameters and a trailing wildcard:
+     * - "/users" matches only "/users".
+     * - "/users/:id" matches "/users/42", the parameter "id" is "42". A parameter matches up to the next '/'.
+     * - "/files/\*path" matches everything below "/files/", the parameter "path" holds the rest.
+     *
+     * Static text takes precedence over parameters, parameters over wildcards. Matching
+     * does not allocate, captured parameters reference the matched path. Routes
+     * must be added before the router is used concurrently.
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  #include <HTTPRouter.h>
+     *  #include <functional>
+     *  #include <iostream>
+     *
+     *  using namespace giri;
+     *  using Handler = std::function<void(const RouteParams&)>;
+     *
+     *  int main()
+     *  {
+     *      Router<Handler> router;
+     *      router.add(boost::beast::http::verb::get, "/users/:id", [](const RouteParams& p){ std::cout << "user " << p["id"] << std::endl; });
+     *      RouteParams params;
+     *      auto res = router.match(boost::beast::http::verb::get, "/users/42", params);
+     *      if(res.Handler)
+     *          (*res.Handler)(params); // prints "user 42"
+     *      return EXIT_SUCCESS;
+     *  }
+     *  @endcode
+     */
+    template<class Fn>
+    class Router : public Object<Router<Fn>>
+    {
+    public:
+        /**
+         * @brief Result of Router::match.
+         */
+        struct Match {
+            const Fn* Handler = nullptr;      ///< Matched handler, nullptr if none.
+            bool PathMatched = false;         ///< true if the path matched a route, but for another method.
+        };
+
+        /**
+         * Adds a route. Throws RouterException on invalid or conflicting patterns.
+         * @param method HTTP method to match.
+         * @param pattern Path pattern, needs to start with '/'.
+         * @param handler Handler to be returned for matching requests.
+         */
+        void add(boost::beast::http::verb method, const std::string& pattern, Fn handler) {
+            if(pattern.empty() || pattern[0] != '/')
+                throw RouterException("Route needs to start with '/': " + pattern);
+            Node* n = &m_Root;
+            std::string_view rest = pattern;
+            size_t params = 0;
+            while(!rest.empty()) {
+                if(rest[0] == ':' || rest[0] == '*') {
+                    size_t end = rest[0] == '*' ? rest.size() : std::min(rest.find('/'), rest.size());
+                    std::string name(rest.substr(1, end - 1));
+                    if(name.empty())
+                        throw RouterException("Unnamed parameter in route: " + pattern);
+                    if(++params > RouteParams::MaxParams)
+                        throw RouterException("Too many parameters in route: " + pattern);
+                    auto& child = rest[0] == ':' ? n->Param : n->Wildcard;
+                    if(!child) {
+                        child = std::make_unique<Node>();
+                        child->Name = name;
+                    }
+                    else if(child->Name != name)
+                        throw RouterException("Parameter '" + name + "' conflicts with '" + child->Name + "' in route: " + pattern);
+                    n = child.get();
+                    rest.remove_prefix(end);
+                    continue;
+                }
+                size_t end = std::min(rest.find_first_of(":*"), rest.size());
+                n = insertStatic(n, rest.substr(0, end));
+                rest.remove_prefix(end);
+            }
+            for(auto& h : n->Handlers)
+                if(h.first == method)
+                    throw RouterException("Route already exists: " + std::string(boost::beast::http::to_string(method)) + " " + pattern);
+            n->Handlers.emplace_back(method, std::move(handler));
+            ++m_Routes;
+        }
+        /**
+         * Looks up the handler for a request.
+         * @param method HTTP method of the request.
+         * @param path Path of the request (without query string).
+         * @param params Receives the captured parameters.
+         * @returns The match result.
+         */
+        Match match(boost::beast::http::verb method, std::string_view path, RouteParams& params) const {
+            Match res;
+            params.clear();
+            find(&m_Root, path, method, params, res);
+            return res;
+        }
+        /**
+         * @returns Methods routed for the given path, e.g. for an Allow header.
+         * @param path Path of the request (without query string).
+         */
+        std::vector<boost::beast::http::verb> allowed(std::string_view path) const {
+            std::vector<boost::beast::http::verb> methods;
+            RouteParams params;
+            for(int v = static_cast<int>(boost::beast::http::verb::delete_); v <= static_cast<int>(boost::beast::http::verb::unlink); ++v) {
+                Match res;
+                params.clear();
+                if(find(&m_Root, path, static_cast<boost::beast::http::verb>(v), params, res))
+                    methods.push_back(static_cast<boost::beast::http::verb>(v));
+            }
+            return methods;
+        }
+        /**
+         * @returns Number of routes.
+         */
+        size_t size() const {
+            return m_Routes;
+        }
+        using SPtr = std::shared_ptr<Router<Fn>>;
+        using UPtr = std::unique_ptr<Router<Fn>>;
+        using WPtr = std::weak_ptr<Router<Fn>>;
+    private:
+        struct Node {
+            std::string Path;                     // static text
+            std::string Name;                     // parameter name (parameter and wildcard nodes)
+            std::string Indices;                  // first character of each static child
+            std::vector<std::unique_ptr<Node>> Children;
+            std::unique_ptr<Node> Param;
+            std::unique_ptr<Node> Wildcard;
+            std::vector<std::pair<boost::beast::http::verb, Fn>> Handlers;
+        };
+
+        static Node* insertStatic(Node* n, std::string_view text) {
+            while(!text.empty()) {
+                size_t i = n->Indices.find(text[0]);
+                if(i == std::string::npos) {
+                    auto child = std::make_unique<Node>();
+                    child->Path = std::string(text);
+                    n->Indices.push_back(text[0]);
+                    n->Children.push_back(std::move(child));
+                    return n->Children.back().get();
+                }
+                Node* c = n->Children[i].get();
+                size_t l = 0;
+                while(l < c->Path.size() && l < text.size() && c->Path[l] == text[l])
+                    ++l;
+                if(l < c->Path.size()) { // split the child at the common prefix
+                    auto mid = std::make_unique<Node>();
+                    mid->Path = c->Path.substr(0, l);
+                    c->Path.erase(0, l);
+                    mid->Indices.push_back(c->Path[0]);
+                    mid->Children.push_back(std::move(n->Children[i]));
+                    n->Children[i] = std::move(mid);
+                    c = n->Children[i].get();
+                }
+                n = c;
+                text.remove_prefix(l);
+            }
+            return n;
+        }
+
+        static bool find(const Node* n, std::string_view path, boost::beast::http::verb method, RouteParams& params, Match& res) {
+            if(path.empty()) {
+                for(auto& h : n->Handlers)
+                    if(h.first == method) {
+                        res.Handler = &h.second;
+                        return true;
+                    }
+                if(!n->Handlers.empty())
+                    res.PathMatched = true;
+            }
+            else {
+                size_t i = n->Indices.find(path[0]);
+                if(i != std::string::npos) {
+                    const Node* c = n->Children[i].get();
+                    if(path.compare(0, c->Path.size(), c->Path) == 0 && find(c, path.substr(c->Path.size()), method, params, res))
+                        return true;
+                }
+                if(n->Param && path[0] != '/') {
+                    size_t end = std::min(path.find('/'), path.size());
+                    params.push(n->Param->Name, path.substr(0, end));
+                    if(find(n->Param.get(), path.substr(end), method, params, res))
+                        return true;
+                    params.pop();
+                }
+            }
+            if(n->Wildcard) {
+                for(auto& h : n->Wildcard->Handlers)
+                    if(h.first == method) {
+                        params.push(n->Wildcard->Name, path);
+                        res.Handler = &h.second;
+                        return true;
+                    }
+                if(!n->Wildcard->Handlers.empty())
+                    res.PathMatched = true;
+            }
+            return false;
+        }
+
+        Node m_Root;
+        size_t m_Routes = 0;
+    };
+}
+#endif //SUPPORTLIB_HTTPROUTER_H
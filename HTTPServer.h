@@ -13,23 +13,52 @@
 #include "Observer.h"
 #include "Exception.h"
 #include "FileSystem.h"
+#include "FileCache.h"
+#include "Blob.h"
+#include "FileWatcher.h"
+#include "TLSContext.h"
+#include "IOShards.h"
+#include "SocketHandover.h"
+#include "HTTPRouter.h"
+#include "ConnectionLimiter.h"
+#include "HTTP2.h"
+#include "HTTPMetrics.h"
+#include "AccessLog.h"
+#include "RateLimiter.h"
+#include "PassKey.h"
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/config.hpp>
+#include <boost/optional.hpp>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <random>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <type_traits>
 #include <vector>
 #include <map>
+#include <mutex>
 
 namespace giri {
     using tcp = boost::asio::ip::tcp;
@@ -48,10 +77,430 @@ namespace giri {
         using WPtr = std::weak_ptr<HTTPServerException>;
     };
 
+    /**
+     * @brief Body type for messages sharing an immutable buffer, e.g. the content
+     * of a FileCache entry. The buffer (or a window of it) is written as is without copying it.
+     */
+    struct SharedBufferBody {
+        struct value_type {
+            std::shared_ptr<const std::vector<char>> Data; ///< Shared content.
+            size_t Offset = 0;                             ///< Start of the window to send.
+            size_t Size = 0;                               ///< Size of the window to send.
+        };
+
+        static std::uint64_t size(const value_type& body) {
+            return body.Size;
+        }
+
+        class writer {
+        public:
+            using const_buffers_type = boost::asio::const_buffer;
+
+            template<bool isRequest, class Fields>
+            explicit writer(const http::header<isRequest, Fields>&, const value_type& body) : m_Body(body) {}
+
+            void init(boost::system::error_code& ec) {
+                ec = {};
+            }
+            boost::optional<std::pair<const_buffers_type, bool>> get(boost::system::error_code& ec) {
+                ec = {};
+                if(!m_Body.Data || m_Body.Size == 0)
+                    return boost::none;
+                return {{const_buffers_type(m_Body.Data->data() + m_Body.Offset, m_Body.Size), false}};
+            }
+        private:
+            const value_type& m_Body;
+        };
+    };
+
+    /**
+     * @brief Body type streaming a byte range of a file from disk.
+     */
+    struct FileRangeBody {
+        struct value_type {
+            boost::beast::file File; ///< Opened file.
+            uint64_t Offset = 0;     ///< Position of the first byte to send.
+            uint64_t Size = 0;       ///< Number of bytes to send.
+        };
+
+        static std::uint64_t size(const value_type& body) {
+            return body.Size;
+        }
+
+        class writer {
+        public:
+            using const_buffers_type = boost::asio::const_buffer;
+
+            template<bool isRequest, class Fields>
+            explicit writer(const http::header<isRequest, Fields>&, value_type& body) : m_Body(body), m_Remain(body.Size) {}
+
+            void init(boost::system::error_code& ec) {
+                ec = {};
+                if(m_Remain > 0)
+                    m_Body.File.seek(m_Body.Offset, ec);
+            }
+            boost::optional<std::pair<const_buffers_type, bool>> get(boost::system::error_code& ec) {
+                ec = {};
+                if(m_Remain == 0)
+                    return boost::none;
+                size_t n = m_Body.File.read(m_Buf.data(), static_cast<size_t>(std::min<uint64_t>(m_Remain, m_Buf.size())), ec);
+                if(ec)
+                    return boost::none;
+                if(n == 0) { // file was truncated meanwhile
+                    ec = http::error::short_read;
+                    return boost::none;
+                }
+                m_Remain -= n;
+                return {{const_buffers_type(m_Buf.data(), n), m_Remain > 0}};
+            }
+        private:
+            value_type& m_Body;
+            uint64_t m_Remain;
+            std::array<char, 64 * 1024> m_Buf;
+        };
+    };
+
+    /**
+     * @brief Chunked response body produced while it is being sent, see HTTPSession::stream.
+     *
+     * Chunks are queued and written in order by the session, several queued chunks
+     * are sent with a single gathered write. All methods except setOnDrain and
+     * setOnClose may be called from any thread. Producers should watch
+     * getQueuedBytes or write from the drain callback, so a slow client does not
+     * make the queue grow without bounds. Streams which are neither finished nor
+     * closed are closed once nothing was written for HTTPTimeouts::Idle.
+     */
+    class HTTPStream : public Object<HTTPStream>, public std::enable_shared_from_this<HTTPStream>
+    {
+    public:
+        using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+        /**
+         * HTTPStream constructor, streams are created by HTTPSession::stream.
+         * @param strand Strand of the session.
+         * @param pump Called on the strand whenever chunks were queued, keeps the session alive until the stream was closed.
+         */
+        HTTPStream(Strand strand, std::function<void()> pump) :
+            m_Strand(std::move(strand)),
+            m_Pump(std::move(pump))
+        {
+        }
+        /**
+         * Encodes data as chunk of a chunked transfer encoded body, so it can
+         * be written to many streams without encoding it again.
+         * @param data Chunk data, must not be empty.
+         * @returns Encoded chunk.
+         */
+        static std::shared_ptr<const std::string> encodeChunk(std::string_view data) {
+            char size[20];
+            int len = std::snprintf(size, sizeof(size), "%zx\r\n", data.size());
+            auto chunk = std::make_shared<std::string>();
+            chunk->reserve(static_cast<size_t>(len) + data.size() + 2);
+            chunk->append(size, static_cast<size_t>(len)).append(data).append("\r\n");
+            return chunk;
+        }
+        /**
+         * Queues data to be sent as one chunk.
+         * @param data Data to send, empty data is ignored.
+         * @returns false if the stream is closed.
+         */
+        bool write(std::string_view data) {
+            if(data.empty())
+                return isOpen();
+            return isOpen() && writeEncoded(encodeChunk(data));
+        }
+        /**
+         * Queues an encoded chunk, see encodeChunk.
+         * @param chunk Encoded chunk, shared and not copied.
+         * @returns false if the stream is closed.
+         */
+        bool writeEncoded(std::shared_ptr<const std::string> chunk) {
+            if(!isOpen())
+                return false;
+            m_Queued.fetch_add(chunk->size(), std::memory_order_relaxed);
+            boost::asio::post(m_Strand, [self = shared_from_this(), chunk = std::move(chunk)]() mutable {
+                self->m_Queue.push_back(std::move(chunk));
+                self->pump();
+            });
+            return true;
+        }
+        /**
+         * Ends the body once all queued chunks were sent, the connection is kept alive if the client wants it.
+         */
+        void finish() {
+            if(m_Open.exchange(false))
+                boost::asio::post(m_Strand, [self = shared_from_this()]{
+                    self->m_Finishing = true;
+                    self->pump();
+                });
+        }
+        /**
+         * Aborts the response and closes the connection.
+         */
+        void close() {
+            if(m_Open.exchange(false))
+                boost::asio::post(m_Strand, [self = shared_from_this()]{
+                    self->m_Aborted = true;
+                    self->pump();
+                });
+        }
+        /**
+         * @returns true if chunks can be written.
+         */
+        bool isOpen() const {
+            return m_Open.load(std::memory_order_relaxed);
+        }
+        /**
+         * @returns Number of queued bytes not sent yet.
+         */
+        size_t getQueuedBytes() const {
+            return m_Queued.load(std::memory_order_relaxed);
+        }
+        /**
+         * Sets a callback to be called on the session's strand whenever all queued chunks
+         * were sent, e.g. to produce the next chunk. Set it before the route handler returns.
+         * @param fn Callback.
+         */
+        void setOnDrain(std::function<void()> fn) {
+            m_OnDrain = std::move(fn);
+        }
+        /**
+         * Sets a callback to be called once the stream was finished or the connection was lost.
+         * Set it before the route handler returns.
+         * @param fn Callback.
+         */
+        void setOnClose(std::function<void()> fn) {
+            m_OnClose = std::move(fn);
+        }
+        using SPtr = std::shared_ptr<HTTPStream>;
+        using UPtr = std::unique_ptr<HTTPStream>;
+        using WPtr = std::weak_ptr<HTTPStream>;
+    private:
+        friend class HTTPSession;
+        friend class HTTP2Session;
+
+        void pump() {
+            auto fn = m_Pump; // keeps the session alive while it is pumping
+            if(fn)
+                fn();
+        }
+        void closed() { // called by the session on its strand
+            m_Open = false;
+            if(m_Closed)
+                return;
+            m_Closed = true;
+            m_Pump = nullptr; // releases the session
+            m_OnDrain = nullptr;
+            auto fn = std::move(m_OnClose);
+            m_OnClose = nullptr;
+            if(fn)
+                fn();
+        }
+
+        Strand m_Strand;
+        std::function<void()> m_Pump;
+        std::function<void()> m_OnDrain;
+        std::function<void()> m_OnClose;
+        std::atomic<bool> m_Open{true};
+        std::atomic<size_t> m_Queued{0};
+        // state below is only accessed on the strand
+        std::deque<std::shared_ptr<const std::string>> m_Queue;
+        bool m_Finishing = false;
+        bool m_Aborted = false;
+        bool m_Closed = false;
+    };
+
+    class HTTPSession;
+    class HTTP2Session;
+
+    /**
+     * Route handler, called with the session and the captured route parameters. Sets the
+     * response using HTTPSession::setResult or HTTPSession::setFileResult, if it sets none
+     * the request is handled as if no route matched.
+     */
+    using HTTPRouteHandler = std::function<void(std::shared_ptr<HTTPSession>, const RouteParams&)>;
+
+    /**
+     * Receives a chunk of a streamed request body, see HTTPRouteOptions::OnBody.
+     * Throwing an exception aborts the request with 500 Internal Server Error.
+     */
+    using HTTPBodyHandler = std::function<void(std::shared_ptr<HTTPSession>, std::string_view chunk)>;
+
+    /**
+     * @brief Request body handling of a route.
+     *
+     * By default request bodies are buffered in memory and available via
+     * HTTPSession::getRequest. Routes receiving large uploads can stream the body
+     * to a handler or spool it to a temporary file instead, the route handler is
+     * called once the whole body was received.
+     */
+    struct HTTPRouteOptions {
+        uint64_t BodyLimit = 0;  ///< Maximum request body size in bytes, 0 uses HTTPConfig::BodyLimit.
+        HTTPBodyHandler OnBody;  ///< Receives the request body in chunks as it arrives instead of buffering it. (optional)
+        bool SpoolBody = false;  ///< Writes the request body to a temporary file instead of buffering it, see HTTPSession::getBodyFile.
+        RateLimit Limit;         ///< Request rate per client, checked in addition to the limit of the server, see HTTPServer::setRateLimiter. (optional)
+    };
+
+    /**
+     * @brief Route handler together with its options.
+     */
+    struct HTTPRoute {
+        template<class Fn, class = std::enable_if_t<std::is_constructible<HTTPRouteHandler, Fn>::value>>
+        HTTPRoute(Fn&& handler, HTTPRouteOptions options = {}) :
+            Handler(std::forward<Fn>(handler)),
+            Options(std::move(options))
+        {
+        }
+        HTTPRouteHandler Handler; ///< Handler to be called for matching requests.
+        HTTPRouteOptions Options; ///< Request body handling and rate limit.
+    };
+    using HTTPRouter = Router<HTTPRoute>;
+
+    /**
+     * @brief Timeouts of the phases of a HTTP connection, zero disables a timeout.
+     * A connection is closed if a phase does not complete in time.
+     */
+    struct HTTPTimeouts {
+        std::chrono::milliseconds Header{10000}; ///< Receiving the request header, including the TLS handshake.
+        std::chrono::milliseconds Body{30000};   ///< Receiving the request body, restarted for every chunk of a streamed body.
+        std::chrono::milliseconds Write{30000};  ///< Sending the response, restarted whenever data was sent.
+        std::chrono::milliseconds Idle{60000};   ///< Waiting for the next request on a keep-alive connection.
+    };
+
+    /**
+     * @brief Heads of frequent responses, serialized once per server string.
+     *
+     * Holds the status line (without the HTTP version) and the common header fields
+     * (Server, Content-Type) of error responses and 304 Not Modified. Sessions assemble
+     * these responses from a prebuilt head, a few dynamic fields and the body, instead
+     * of building a http::response field by field.
+     */
+    class HTTPResponseTemplates : public Object<HTTPResponseTemplates>
+    {
+    public:
+        /**
+         * Serializes the heads of all prebuilt statuses.
+         * @param serverString Server string to be added to the responses.
+         */
+        explicit HTTPResponseTemplates(const std::string& serverString) :
+            m_ServerString(serverString)
+        {
+            for(size_t i = 0; i < Statuses.size(); i++)
+                m_Heads[i] = makeHead(Statuses[i], serverString);
+        }
+        /**
+         * @returns Server string the heads were built with.
+         */
+        const std::string& getServerString() const {
+            return m_ServerString;
+        }
+        /**
+         * @param status Status of the response.
+         * @returns Prebuilt head, nullptr if the status is not prebuilt.
+         */
+        const std::string* find(http::status status) const {
+            for(size_t i = 0; i < Statuses.size(); i++)
+                if(Statuses[i] == status)
+                    return &m_Heads[i];
+            return nullptr;
+        }
+        /**
+         * Serializes the head of a response, e.g. " 404 Not Found\r\nServer: name\r\nContent-Type: text/html\r\n".
+         * The HTTP version in front, further fields and the empty line are added by the caller.
+         * @param status Status of the response.
+         * @param serverString Server string to be added.
+         * @returns Serialized head.
+         */
+        static std::string makeHead(http::status status, const std::string& serverString) {
+            const auto reason = http::obsolete_reason(status);
+            std::string head = " " + std::to_string(static_cast<unsigned>(status)) + " ";
+            head.append(reason.data(), reason.size());
+            head.append("\r\nServer: ").append(serverString).append("\r\n");
+            if(status != http::status::not_modified)
+                head.append("Content-Type: text/html\r\n");
+            return head;
+        }
+        using SPtr = std::shared_ptr<HTTPResponseTemplates>;
+        using UPtr = std::unique_ptr<HTTPResponseTemplates>;
+        using WPtr = std::weak_ptr<HTTPResponseTemplates>;
+    private:
+        static constexpr std::array<http::status, 11> Statuses{{
+            http::status::not_modified, http::status::bad_request, http::status::not_found, http::status::method_not_allowed,
+            http::status::not_acceptable, http::status::payload_too_large, http::status::range_not_satisfiable, http::status::too_many_requests,
+            http::status::request_header_fields_too_large, http::status::internal_server_error, http::status::service_unavailable}};
+
+        std::string m_ServerString;
+        std::array<std::string, Statuses.size()> m_Heads;
+    };
+
+    /**
+     * @brief Immutable configuration shared by an HTTPServer and its HTTPSessions.
+     *
+     * A snapshot is never modified once it is shared. Setters of HTTPServer and
+     * HTTPSession copy the current snapshot, modify the copy and replace their
+     * pointer to it, so sessions read their configuration without locking or copying.
+     * A session keeps the snapshot which was current when it was created.
+     */
+    struct HTTPConfig {
+        std::filesystem::path DocRoot;                ///< Folder to serve via http.
+        std::map<std::string, std::string> MimeTypes; ///< Mapping of file extensions to mimetypes.
+        std::string IndexFile;                        ///< Index file to use if no file was provided by request.
+        std::string ServerString;                     ///< Server string to be added to the http answers.
+        uint64_t LargeFileThreshold = 1024 * 1024;    ///< Files from this size on are streamed from disk.
+        uint64_t BodyLimit = 1024 * 1024;             ///< Maximum request body size in bytes, unless a route sets its own.
+        FileCache::SPtr Cache;                        ///< Cache to serve static files from, nullptr disables caching.
+        HTTPRouter::SPtr Routes;                      ///< Routes to dispatch requests to, nullptr serves static files only.
+        std::map<std::string, std::string> CacheControl; ///< Cache-Control header values of static files by path prefix.
+        HTTPTimeouts Timeouts;                        ///< Timeouts of the connection phases.
+        bool EnableHTTP2 = false;                     ///< Serve HTTP/2 next to HTTP/1.1, see HTTPServer::setHTTP2.
+        HTTP2::Settings HTTP2Settings;                ///< HTTP/2 settings announced to clients.
+        std::shared_ptr<const HTTPResponseTemplates> Templates; ///< Prebuilt response heads matching ServerString, see updateTemplates.
+        HTTPMetrics::SPtr Metrics;                    ///< Counters and latencies to record, nullptr disables them, see HTTPServer::setMetrics.
+        AccessLog::SPtr Log;                          ///< Access log of answered requests, nullptr disables it.
+        RateLimiter::SPtr RateLimits;                 ///< Request rates per client, nullptr disables rate limiting, see HTTPServer::setRateLimiter.
+
+        /**
+         * Rebuilds Templates unless they match ServerString. Called before a snapshot is shared.
+         */
+        void updateTemplates() {
+            if(!Templates || Templates->getServerString() != ServerString)
+                Templates = std::make_shared<const HTTPResponseTemplates>(ServerString);
+        }
+        /**
+         * @returns Mimetype of a file extension, "application/text" if unknown.
+         * @param ext File extension including the leading dot.
+         */
+        const std::string& mimeType(const std::string& ext) const {
+            static const std::string fallback = "application/text";
+            auto it = MimeTypes.find(ext);
+            return it != MimeTypes.end() ? it->second : fallback;
+        }
+        /**
+         * @returns Cache-Control header value of the longest matching path prefix, nullptr if none matches.
+         * @param path Request path.
+         */
+        const std::string* cacheControl(std::string_view path) const {
+            const std::string* value = nullptr;
+            size_t longest = 0;
+            for(const auto& cc : CacheControl)
+                if(cc.first.size() >= longest && path.compare(0, cc.first.size(), cc.first) == 0) {
+                    value = &cc.second;
+                    longest = cc.first.size();
+                }
+            return value;
+        }
+        using SPtr = std::shared_ptr<const HTTPConfig>;
+    };
+
     /**
      * @brief Class representing one session/connection
      *  
      * Created by the server when accepting a client connection.
+     * Static files are served with ETag and Last-Modified headers. Conditional
+     * requests (If-None-Match, If-Modified-Since) are answered with 304 Not Modified,
+     * range requests (Range, If-Range) with 206 Partial Content.
+     * Pipelined HTTP/1.1 requests which already arrived completely are answered
+     * in order, their responses are sent with a single gathered write.
      */
     class HTTPSession : public Observable<HTTPSession>
     {
@@ -68,36 +517,74 @@ namespace giri {
          * @param cert If ssl is true, path to certificate file in *.pem format.
          * @param key If ssl is true path to private key file in *pem format.
          * @param ioc I/O context which should be used.
+         * @param fileCache Cache to serve static files from. (optional, files are read from disk on every request if not set)
+         * @param tlsContext Shared TLS context to use if ssl is true. (optional, a context is created from cert and key if not set)
+         * @param router Routes to dispatch requests to before serving static files. (optional)
+         */
+        explicit HTTPSession(tcp::socket socket, const std::filesystem::path& docRoot, const std::map<std::string, std::string>& mimeTypes, const std::string& indexFile, const std::string& serverString, bool ssl, const std::filesystem::path& cert, const std::filesystem::path& key, boost::asio::io_context& ioc, FileCache::SPtr fileCache = nullptr, std::shared_ptr<ssl::context> tlsContext = nullptr, HTTPRouter::SPtr router = nullptr) :
+            HTTPSession(std::move(socket), makeConfig(docRoot, mimeTypes, indexFile, serverString, std::move(fileCache), std::move(router)),
+                        ssl ? (tlsContext ? std::move(tlsContext) : TLSContext(cert, key).get()) : nullptr, ioc)
+        {
+        }
+        /**
+         * HTTPSession constructor, used by HTTPServer.
+         *
+         * @param socket Socket to use.
+         * @param config Shared configuration snapshot.
+         * @param tlsContext TLS context to use, nullptr disables ssl.
+         * @param ioc I/O context which should be used.
+         * @param ticket Admission of the connection, released when the session ends. (optional)
+         * @param onStream Called with the session of every HTTP/2 request, before the request is handled. (optional)
          */
-        explicit HTTPSession(tcp::socket socket, const std::filesystem::path& docRoot, const std::map<std::string, std::string>& mimeTypes, const std::string& indexFile, const std::string& serverString, bool ssl, const std::filesystem::path& cert, const std::filesystem::path& key, boost::asio::io_context& ioc) :
+        explicit HTTPSession(tcp::socket socket, HTTPConfig::SPtr config, std::shared_ptr<ssl::context> tlsContext, boost::asio::io_context& ioc, ConnectionLimiter::Ticket ticket = {}, std::function<void(const std::shared_ptr<HTTPSession>&)> onStream = nullptr) :
             m_Socket(std::move(socket)),
-            m_DocRoot(docRoot),
-            m_MimeTypes(mimeTypes),
-            m_IndexFile(indexFile),
-            m_ServerString(serverString),
-            m_SSL(ssl),
-            m_Strand(boost::asio::make_strand(ioc))
+            m_Config(std::move(config)),
+            m_SSL(tlsContext != nullptr),
+            m_Ctx(std::move(tlsContext)),
+            m_Strand(boost::asio::make_strand(ioc)),
+            m_Timer(m_Strand),
+            m_Ticket(std::move(ticket)),
+            m_OnStream(std::move(onStream)),
+            m_Metrics(m_Config->Metrics)
         {
             if(m_SSL)
             { 
-                m_Ctx.set_options(boost::asio::ssl::context::default_workarounds |
-                                boost::asio::ssl::context::no_sslv2 |
-                                boost::asio::ssl::context::no_sslv3 |
-                                boost::asio::ssl::context::no_tlsv1 |
-                                boost::asio::ssl::context::single_dh_use);
-                m_Ctx.use_certificate_chain_file(cert.string());
-                m_Ctx.use_private_key_file(key.string(), boost::asio::ssl::context::file_format::pem);
-                m_Stream = std::make_shared< ssl::stream<tcp::socket&> >(m_Socket, m_Ctx);
+                m_Stream = std::make_shared< ssl::stream<tcp::socket&> >(m_Socket, *m_Ctx);
                 m_Stream->set_verify_mode(ssl::verify_none);
             }
         }
+        /**
+         * HTTPSession constructor, used by HTTP2Session for every request stream of a connection.
+         *
+         * @param connection Session of the connection.
+         * @param responder Called once the response is ready to be sent.
+         */
+        HTTPSession(const Key<HTTP2Session>&, const std::shared_ptr<HTTPSession>& connection, std::function<void(const std::shared_ptr<HTTPSession>&)> responder) :
+            m_Socket(connection->m_Socket.get_executor()),
+            m_Config(connection->m_Config),
+            m_SSL(connection->m_SSL),
+            m_Strand(connection->m_Strand),
+            m_Timer(m_Strand),
+            m_Connection(connection),
+            m_Responder(std::move(responder)),
+            m_Metrics(m_Config->Metrics)
+        {
+        }
         /**
          * Starts receiving messages asynchrolously. Automatically
          * notifies subscribed Observer objects on new messages.
          */
         void run() {
-            if(m_SSL)
+            boost::system::error_code ec;
+            m_Socket.set_option(tcp::no_delay(true), ec); // writes are gathered already, e.g. pipelined responses must not wait for an ACK
+            if(m_Metrics) {
+                m_Opened = std::chrono::steady_clock::now();
+                m_Metrics->add(HTTPMetrics::Counter::ConnectionsOpened);
+            }
+            if(m_SSL) {
+                setTimeout(m_Config->Timeouts.Header);
                 m_Stream->async_handshake(ssl::stream_base::server, boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_handshake, this->shared_from_this(), std::placeholders::_1)));
+            }
             else
                 do_read();
         }
@@ -117,49 +604,85 @@ namespace giri {
          * @returns IP of connected client.
          */
         std::string getClientIP() const {
+            if(m_Connection)
+                return m_Connection->getClientIP();
             return m_Socket.remote_endpoint().address().to_string();
         }
         /**
          * @returns Port of connected client.
          */
         std::string getClientPort() const {
+            if(m_Connection)
+                return m_Connection->getClientPort();
             return std::to_string(m_Socket.remote_endpoint().port());
         }
         /**
          * @returns HTTP request sent by the client.
          */
-        http::request<http::string_body> getRequest() const {
+        const http::request<http::string_body>& getRequest() const {
             return m_Request;
         }
+        /**
+         * @returns Header of the HTTP request, also while its body is being streamed, see HTTPRouteOptions::OnBody.
+         */
+        const http::request_header<>& getRequestHeader() const {
+            if(m_BodyParser)
+                return m_BodyParser->get().base();
+            return m_Request.base();
+        }
         /**
          * @returns Returns default result which the server is about to send back.
+         * The body is empty if a large file is about to be streamed (see setLargeFileThreshold).
          */
-        http::response<http::vector_body<char>> getResult() const {
+        const http::response<http::vector_body<char>>& getResult() const {
+            if(m_CannedResult && !m_ResultFromCache) { // assembled from a prebuilt head
+                http::response_parser<http::vector_body<char>> parser;
+                parser.skip(m_Request.method() == http::verb::head);
+                parser.eager(true);
+                boost::system::error_code ec;
+                parser.put(boost::asio::buffer(m_CannedData), ec);
+                m_Result = parser.release();
+                m_Result.version(m_Request.version());
+                m_ResultFromCache = true;
+            }
+            else if(m_FileResult && !m_CustomResult && !m_ResultFromCache) { // served from the file cache
+                m_Result = http::response<http::vector_body<char>>(m_FileResult->base());
+                const auto& body = m_FileResult->body();
+                if(body.Data)
+                    m_Result.body().assign(body.Data->begin() + body.Offset, body.Data->begin() + body.Offset + body.Size);
+                m_ResultFromCache = true;
+            }
             return m_Result;
         }
         /**
          * @returns Folder which is served via http.
          */
-        std::filesystem::path getDocRoot() const {
-            return m_DocRoot;
+        const std::filesystem::path& getDocRoot() const {
+            return m_Config->DocRoot;
         }
         /**
          * @returns Default index file to be used.
          */
-        std::string getIndexFile() const {
-            return m_IndexFile;
+        const std::string& getIndexFile() const {
+            return m_Config->IndexFile;
         }
         /**
          * @returns Server string to be added to the http answers.
          */
-        std::string getServerString() const {
-            return m_ServerString;
+        const std::string& getServerString() const {
+            return m_Config->ServerString;
         }
         /**
          * @returns Mapping containing all supported mimetypes.
          */
-        std::map<std::string, std::string> getMimeTypes() const {
-            return m_MimeTypes;
+        const std::map<std::string, std::string>& getMimeTypes() const {
+            return m_Config->MimeTypes;
+        }
+        /**
+         * @returns Configuration snapshot used by this session.
+         */
+        HTTPConfig::SPtr getConfig() const {
+            return m_Config;
         }
         /**
          * Set custom result to be sent back to the client.
@@ -167,207 +690,2681 @@ namespace giri {
          */
         void setResult(const http::response<http::vector_body<char>> &res) {
             m_Result = res;
+            m_CustomResult = true;
+            m_CannedResult = false;
+        }
+        /**
+         * Sends a chunked response whose body is produced while it is being sent, e.g.
+         * a long running export or an event stream (see SSEChannel). Intended to be used
+         * by route handlers, the header is sent once the handler returned. The connection
+         * stays open until the stream is finished or closed, or nothing was written for
+         * HTTPTimeouts::Idle.
+         * @param status Status of the response.
+         * @param contentType Content-Type to be sent.
+         * @param headers Additional header fields. (optional)
+         * @returns Stream to write the body to.
+         */
+        HTTPStream::SPtr stream(http::status status = http::status::ok, const std::string& contentType = "application/octet-stream", const http::fields& headers = {}) {
+            m_CustomResult = false;
+            m_CannedResult = false;
+            m_FileResult.reset();
+            m_StreamResult.reset();
+            m_SendfileResult.reset();
+            m_ChunkHeader = std::make_shared<http::response<http::empty_body>>(status, m_Request.version());
+            for(const auto& field : headers)
+                m_ChunkHeader->set(field.name_string(), field.value());
+            m_ChunkHeader->set(http::field::server, m_Config->ServerString);
+            m_ChunkHeader->set(http::field::content_type, contentType);
+            m_ChunkHeader->chunked(true);
+            m_ChunkHeader->keep_alive(m_Request.keep_alive());
+            m_ChunkStream = std::make_shared<HTTPStream>(m_Strand, [self = this->shared_from_this()]{
+                self->pumpStream();
+            });
+            return m_ChunkStream;
+        }
+        /**
+         * Streams a file from disk as result, without loading it into memory.
+         * Intended to be used by route handlers, e.g. to serve downloads.
+         * @param file File to send.
+         * @param contentType Content-Type to be sent. (defaults to the mimetype of the file extension)
+         * @returns false if the file cannot be opened.
+         */
+        bool setFileResult(const std::filesystem::path& file, const std::string& contentType = "") {
+            m_CustomResult = false;
+            m_CannedResult = false;
+            m_StreamResult.reset();
+            m_SendfileResult.reset();
+            return serveLargeFile(file, 0, contentType.empty() ? m_Config->mimeType(file.extension().string()) : contentType);
         }
         /**
          * Set doc root path. Only affects new requests within this HTTPSession.
          * @param path Path to serve html files from.
          */
         void setDocRoot(const std::filesystem::path& path) {
-            m_DocRoot = path;
+            updateConfig([&](HTTPConfig& c){ c.DocRoot = path; });
         }
         /**
          * Sets default index file to be used. Only affects new requests within this HTTPSession.
          * @param indx default index file to be used.
          */
         void setIndexFile(const std::string& indx) {
-            m_IndexFile = indx;
+            updateConfig([&](HTTPConfig& c){ c.IndexFile = indx; });
         }
         /**
          * Set server string to be added to the http answers. Only affects new requests within this HTTPSession.
          * @param servstr server string to be added to the http answers.
          */
-        void setServerString(const std::string& servstr) {
-            m_ServerString = servstr;
+        void setServerString(const std::string& servstr) {
+            updateConfig([&](HTTPConfig& c){ c.ServerString = servstr; });
+        }
+        /**
+         * Add additional mimetypes. Only affects new requests within this HTTPSession.
+         * @param mimeTypes Additional mimetypes to add.
+         */
+        void addMimeTypes(const std::map<std::string, std::string>& mimeTypes) {
+            updateConfig([&](HTTPConfig& c){ c.MimeTypes.insert(mimeTypes.begin(), mimeTypes.end()); });
+        }
+        /**
+         * Sets the size from which on files are streamed from disk instead of being loaded
+         * into memory. Without ssl they are sent using sendfile (linux), so the
+         * data never passes through user space. Only affects new requests within this HTTPSession.
+         * @param threshold File size in bytes.
+         */
+        void setLargeFileThreshold(uint64_t threshold) {
+            updateConfig([&](HTTPConfig& c){ c.LargeFileThreshold = threshold; });
+        }
+        /**
+         * @returns Size from which on files are streamed from disk.
+         */
+        uint64_t getLargeFileThreshold() const {
+            return m_Config->LargeFileThreshold;
+        }
+        /**
+         * @returns Temporary file holding the request body of a route with HTTPRouteOptions::SpoolBody,
+         * empty otherwise. The file is removed once the response was sent, move it to keep it.
+         */
+        const std::filesystem::path& getBodyFile() const {
+            return m_BodyFile;
+        }
+        /**
+         * Defers the response, e.g. until a backend answered. Intended to be used by route
+         * handlers, the handler returns without a result and the response is passed to resume
+         * later. Further requests of the connection wait meanwhile, the connection is closed
+         * if the response was not resumed within HTTPTimeouts::Idle.
+         */
+        void defer() {
+            m_Deferred = true;
+        }
+        /**
+         * Sends a deferred response, see defer. May be called from any thread.
+         * @param respond Called on the session's strand to set the result, e.g. via setResult or stream.
+         *                The request is answered with 500 Internal Server Error if it sets none.
+         */
+        void resume(std::function<void(const std::shared_ptr<HTTPSession>&)> respond) {
+            boost::asio::post(m_Strand, [self = this->shared_from_this(), respond = std::move(respond)]{
+                if(!self->m_Deferred || self->m_TimedOut)
+                    return;
+                self->m_Deferred = false;
+                try {
+                    respond(self);
+                }
+                catch(const ExceptionBase& e) {
+                    self->respondError(http::status::internal_server_error, "An error occurred: '" + e.getMessage() + "'");
+                }
+                catch(const std::exception& e) {
+                    self->respondError(http::status::internal_server_error, "An error occurred: '" + std::string(e.what()) + "'");
+                }
+                catch(...) {
+                    self->respondError(http::status::internal_server_error, "An unknown error occurred.");
+                }
+                if(!(self->m_CustomResult || self->m_CannedResult || self->m_StreamResult || self->m_SendfileResult || self->m_ChunkStream))
+                    self->respondError(http::status::internal_server_error, "No response was set.");
+                self->send();
+            });
+        }
+        /**
+         * Stops reading a streamed request body after the current chunk, e.g. while the
+         * consumer of an HTTPRouteOptions::OnBody handler is busy. HTTP/2 clients are not
+         * granted further flow control window meanwhile.
+         */
+        void pauseBody() {
+            m_BodyPaused = true;
+        }
+        /**
+         * Continues reading a paused request body, see pauseBody. May be called from any thread.
+         */
+        void resumeBody() {
+            boost::asio::post(m_Strand, [self = this->shared_from_this()]{
+                if(!self->m_BodyPaused)
+                    return;
+                self->m_BodyPaused = false;
+                if(self->m_ResumeBody) // HTTP/2 stream, flow controlled by the connection
+                    return self->m_ResumeBody();
+                if(self->m_BodyWaiting && !self->m_TimedOut) {
+                    self->m_BodyWaiting = false;
+                    self->do_read_body();
+                }
+            });
+        }
+        /**
+         * Attaches data to the current request, e.g. state shared by an OnBody handler
+         * and the route handler. Released once the response is about to be sent.
+         * @param context Data to attach.
+         */
+        void setContext(std::shared_ptr<void> context) {
+            m_Context = std::move(context);
+        }
+        /**
+         * @returns Data attached to the current request, see setContext.
+         */
+        const std::shared_ptr<void>& getContext() const {
+            return m_Context;
+        }
+        /**
+         * @returns Strand the handlers of this session run on, e.g. to continue asynchronous work of a route handler on it.
+         */
+        const HTTPStream::Strand& getStrand() const {
+            return m_Strand;
+        }
+        /**
+         * Close http session.
+         */
+        void close() {
+            if(!m_Ec)
+                if(m_SSL) 
+                    {if(m_Socket.is_open()){setTimeout(m_Config->Timeouts.Write); m_Stream->async_shutdown(boost::asio::bind_executor(m_Strand,std::bind(&HTTPSession::on_shutdown,this->shared_from_this(),std::placeholders::_1)));}}
+                else
+                    {if(m_Socket.is_open()){m_Socket.shutdown(tcp::socket::shutdown_send, m_Ec);}}
+        }
+        /**
+         * Closes the connection gracefully, e.g. before the server stops. An idle keep-alive
+         * connection is closed at once, otherwise the request in progress is completed and
+         * answered with "Connection: close". HTTP/2 connections send GOAWAY and complete their
+         * open streams. Streamed responses (see stream) are not ended. May be called from any thread.
+         */
+        void drain() {
+            boost::asio::post(m_Strand, [self = this->shared_from_this()]{ self->on_drain(); });
+        }
+        using SPtr = std::shared_ptr<HTTPSession>;
+        using UPtr = std::unique_ptr<HTTPSession>;
+        using WPtr = std::weak_ptr<HTTPSession>;
+        ~HTTPSession() {
+            if(m_Metrics && m_Opened != std::chrono::steady_clock::time_point())
+                m_Metrics->add(HTTPMetrics::Counter::ConnectionsClosed);
+            removeBodyFile();
+            if(m_ChunkStream)
+                m_ChunkStream->closed();
+        }
+    private:
+        friend class HTTP2Session;
+        friend class HTTPServer;
+
+        struct ByteRange {
+            uint64_t First; // inclusive
+            uint64_t Last;  // inclusive
+        };
+        static constexpr size_t IdleReadSize = 4096;                   // first read of a keep-alive request
+        static constexpr size_t BodyChunkSize = 64 * 1024;             // chunks of streamed request bodies
+        static constexpr size_t MaxRanges = 16;                        // more ranges are ignored, the whole file is sent
+        static constexpr uint64_t MaxMultipartSize = 16 * 1024 * 1024; // multipart responses are assembled in memory
+        static constexpr size_t MaxPipelined = 16;                     // responses of pipelined requests sent with one write
+        static constexpr size_t MaxPipelineSize = 1024 * 1024;         // stop queueing responses after this many bytes
+        static constexpr size_t PipelineCopySize = 16 * 1024;          // smaller bodies are copied into the pipeline
+
+        struct Encoding {
+            unsigned Bit;
+            const char* Name;      // Content-Encoding token
+            const char* Extension; // extension of precompressed siblings
+        };
+        static constexpr unsigned GzipBit = 4;
+        static constexpr std::array<Encoding, 3> Encodings{{{1, "br", ".br"}, {2, "zstd", ".zst"}, {GzipBit, "gzip", ".gz"}}}; // in order of preference
+        struct AcceptedEncodings { // codings acceptable to the client, see acceptedEncodings
+            std::array<const Encoding*, Encodings.size()> Order{}; // highest q first, ties in server preference
+            size_t Count = 0;
+            bool IdentityRefused = false;
+            const Encoding* const* begin() const { return Order.data(); }
+            const Encoding* const* end() const { return Order.data() + Count; }
+        };
+
+        struct PipelinedBody {
+            size_t Position;                   // offset in m_PipelineData the body is sent at
+            const char* Data;
+            size_t Size;
+            std::shared_ptr<const void> Owner; // keeps the data alive until it was sent
+        };
+
+        static HTTPConfig::SPtr makeConfig(const std::filesystem::path& docRoot, const std::map<std::string, std::string>& mimeTypes, const std::string& indexFile, const std::string& serverString, FileCache::SPtr fileCache, HTTPRouter::SPtr router) {
+            auto config = std::make_shared<HTTPConfig>();
+            config->DocRoot = docRoot;
+            config->MimeTypes = mimeTypes;
+            config->IndexFile = indexFile;
+            config->ServerString = serverString;
+            config->Cache = std::move(fileCache);
+            config->Routes = std::move(router);
+            config->updateTemplates();
+            return config;
+        }
+        template<class Fn>
+        void updateConfig(Fn fn) { // copy on write, the snapshot may be shared with other sessions
+            auto config = std::make_shared<HTTPConfig>(*m_Config);
+            fn(*config);
+            config->updateTemplates();
+            m_Config = std::move(config);
+        }
+        void on_read(boost::system::error_code ec, std::size_t bytes_transferred) {
+            boost::ignore_unused(bytes_transferred);
+            if(m_TimedOut)
+                return;
+            if(m_Metrics && !ec) { // arrived with its first byte unless more was read since
+                m_HandleStart = m_ReadMore ? std::chrono::steady_clock::now() : m_RequestStart;
+                m_Metrics->record(HTTPMetrics::Phase::Parse, m_HandleStart - m_RequestStart);
+            }
+            takeRequest();
+            ++m_Requests;
+            handleRequest(ec);
+        }
+        void handleRequest(boost::system::error_code ec) {
+            m_Ec = ec;
+            if(m_Metrics && m_HandleStart == std::chrono::steady_clock::time_point()) // e.g. HTTP/2 streams
+                m_HandleStart = std::chrono::steady_clock::now();
+            if(m_Draining)
+                m_Request.keep_alive(false); // answered with "Connection: close"
+            m_CustomResult = false;
+            m_CannedResult = false;
+            m_ResultFromCache = false;
+            m_Deferred = false;
+            m_FileResult.reset();
+            m_StreamResult.reset();
+            m_SendfileResult.reset();
+            m_ChunkHeader.reset();
+            m_ChunkStream.reset();
+            m_ChunkHeaderSent = false;
+        #if defined(__linux__)
+            m_SendFd.reset();
+        #endif
+            if(!ec)
+            {
+                if(rateLimited(nullptr)) {
+                    // answered with 429 Too Many Requests
+                }
+                else if(route()) {
+                    // handled by a route handler
+                }
+                else if(m_Request.method() != http::verb::get && m_Request.method() != http::verb::head)
+                    respondError(http::status::bad_request, "Unknown HTTP-method");
+                else if(m_Request.target().empty() || m_Request.target()[0] != '/' || m_Request.target().find("..") != boost::beast::string_view::npos)
+                    respondError(http::status::bad_request, "Illegal request-target");
+                else if(!serveCached()) {
+                    std::error_code fEc;
+                    std::filesystem::path path = m_Config->DocRoot;
+                    path += std::string{m_Request.target()};
+                    if(m_Request.target().back() == '/')
+                        path.append(m_Config->IndexFile);
+                    else if((m_Request.target().back() != '/') && std::filesystem::is_directory(path, fEc)) {
+                        path += "/";
+                        path.append(m_Config->IndexFile);
+                    }
+                    if(!std::filesystem::exists(path, fEc)){
+                        beginCanned(http::status::not_found);
+                        endCanned({"The resource '", std::string_view(m_Request.target().data(), m_Request.target().size()), "' was not found."}, m_Request.keep_alive());
+                    }
+                    else if(fEc)
+                        respondError(http::status::internal_server_error, "An error occurred: '" + fEc.message() + "'");
+                    else if(!cacheFile(path) && !serveLargeFile(path) && !refuseIdentity() && !respondCached(FileCache::load(path, m_Config->mimeType(path.extension().string())))) {
+                        try{
+                            std::vector<char> sfile = FileSystem::LoadFile(path);
+                            if(m_Request.method() == http::verb::head)
+                                m_Result = {http::status::ok, m_Request.version()};
+                            else {
+                                m_Result = {http::status::ok, m_Request.version()};
+                                m_Result.body() = sfile;
+                            }
+                            m_Result.set(http::field::server, m_Config->ServerString);
+                            m_Result.set(http::field::content_type, m_Config->mimeType(path.extension().string()));
+                            m_Result.keep_alive(m_Request.keep_alive());
+                            m_Result.prepare_payload();
+                        }
+                        catch(const ExceptionBase& e)
+                        {
+                            respondError(http::status::internal_server_error, "An error occurred: '" + e.getMessage() + "'");
+                        }
+                        catch(...)
+                        {
+                            respondError(http::status::internal_server_error, "An unknown error occurred.");
+                        }
+                    }
+                }
+            }
+            else if(ec == http::error::end_of_stream)
+                return close();
+            else if(ec == http::error::body_limit)
+                respondError(http::status::payload_too_large, "Request body too large", false); // the body was not read
+            else if(ec == http::error::header_limit)
+                respondError(http::status::request_header_fields_too_large, "Request header too large", false);
+            else
+                respondError(http::status::internal_server_error, "An error occurred: '" + ec.message() + "'");
+            if(ec)
+                m_Buffer.consume(m_Buffer.size()); // clear buffer, pipelined requests are kept otherwise
+            try {
+                notify(); // notify all subscribed observers
+            }
+            catch(const ExceptionBase& e) {
+                respondError(http::status::internal_server_error, "An error occurred: '" + e.getMessage() + "'");
+            }
+            catch(const std::exception& e) {
+                respondError(http::status::internal_server_error, "An error occurred: '" + std::string(e.what()) + "'");
+            }
+            catch(...) {
+                respondError(http::status::internal_server_error, "An unknown error occurred.");
+            }
+            if(m_Deferred) { // see resume
+                if(!m_Responder)
+                    setTimeout(m_Config->Timeouts.Idle);
+                return;
+            }
+            send();
+        }
+        void send() {
+            m_Context.reset();
+            if(m_Metrics) {
+                m_Metrics->response(resultStatus());
+                ++m_Unmeasured;
+            }
+            if(m_Config->Log)
+                logAccess();
+            if(m_Responder) { // HTTP/2 stream, framed by the connection
+                measureHandler();
+                return m_Responder(this->shared_from_this());
+            }
+            if(m_Buffer.size() == 0 && m_PipelineCount == 0) {
+                measureHandler();
+                return writeResult();
+            }
+            if(!queueResult()) { // flush the queued responses first, the result is written once they were sent
+                measureHandler();
+                return m_PipelineCount > 0 ? flushPipeline(true) : writeResult();
+            }
+            if(!m_PipelineClose && m_PipelineCount < MaxPipelined && m_PipelineSize < MaxPipelineSize && nextRequest()) {
+                ++m_Requests;
+                return handleRequest({}); // timed together with the queued ones
+            }
+            measureHandler();
+            flushPipeline(false);
+        }
+        void logAccess() {
+            AccessLog::Entry entry;
+            entry.Client = clientAddress();
+            entry.Method = std::string_view(m_Request.method_string().data(), m_Request.method_string().size());
+            entry.Target = std::string_view(m_Request.target().data(), m_Request.target().size());
+            entry.Version = m_Request.version();
+            entry.Status = resultStatus();
+            entry.Bytes = resultBodySize();
+            auto referer = m_Request.find(http::field::referer);
+            if(referer != m_Request.end())
+                entry.Referer = std::string_view(referer->value().data(), referer->value().size());
+            auto agent = m_Request.find(http::field::user_agent);
+            if(agent != m_Request.end())
+                entry.UserAgent = std::string_view(agent->value().data(), agent->value().size());
+            m_Config->Log->log(entry);
+        }
+        const boost::asio::ip::address& clientAddress() { // looked up once per connection
+            if(m_Connection)
+                return m_Connection->clientAddress();
+            if(!m_ClientKnown) {
+                boost::system::error_code ec;
+                const tcp::endpoint remote = m_Socket.remote_endpoint(ec);
+                if(!ec)
+                    m_Client = remote.address();
+                m_ClientKnown = true;
+            }
+            return m_Client;
+        }
+        uint64_t resultBodySize() const {
+            if(m_CannedResult)
+                return m_CannedBodySize;
+            if(m_CustomResult)
+                return m_Result.body().size();
+            if(m_FileResult)
+                return m_FileResult->body().Size;
+            if(m_StreamResult)
+                return m_StreamResult->body().Size;
+            if(m_SendfileResult)
+        #if defined(__linux__)
+                return m_SendFd ? m_SendSize - m_SendOffset : 0;
+        #else
+                return 0;
+        #endif
+            if(m_ChunkHeader)
+                return AccessLog::Unknown;
+            return m_Result.body().size();
+        }
+        void measureHandler() { // records the answered requests, each with the average duration
+            if(!m_Metrics || m_Unmeasured == 0)
+                return;
+            const auto now = std::chrono::steady_clock::now();
+            if(m_HandleStart != std::chrono::steady_clock::time_point()) // unset if rejected while reading
+                m_Metrics->record(HTTPMetrics::Phase::Handler, (now - m_HandleStart) / m_Unmeasured, m_Unmeasured);
+            m_Unmeasured = 0;
+            m_HandleStart = {};
+            m_WriteStart = now;
+        }
+        unsigned resultStatus() const {
+            if(m_CannedResult)
+                return static_cast<unsigned>(m_CannedStatus);
+            if(m_CustomResult)
+                return m_Result.result_int();
+            if(m_FileResult)
+                return m_FileResult->result_int();
+            if(m_StreamResult)
+                return m_StreamResult->result_int();
+            if(m_SendfileResult)
+                return m_SendfileResult->result_int();
+            if(m_ChunkHeader)
+                return m_ChunkHeader->result_int();
+            return m_Result.result_int();
+        }
+        void measureWrite(boost::system::error_code ec) {
+            if(!m_Metrics || m_WriteStart == std::chrono::steady_clock::time_point())
+                return;
+            if(!ec && !m_ChunkStream) // streamed responses last as long as their producer wants
+                m_Metrics->record(HTTPMetrics::Phase::Write, std::chrono::steady_clock::now() - m_WriteStart);
+            m_WriteStart = {};
+        }
+        void measureFirstByte() {
+            m_RequestStart = std::chrono::steady_clock::now();
+            if(m_Requests == 0)
+                m_Metrics->record(HTTPMetrics::Phase::FirstByte, m_RequestStart - m_Opened);
+        }
+        void countReceived(size_t n) {
+            if(m_Metrics)
+                m_Metrics->add(HTTPMetrics::Counter::BytesReceived, n);
+        }
+        void countSent(size_t n) {
+            if(m_Metrics)
+                m_Metrics->add(HTTPMetrics::Counter::BytesSent, n);
+        }
+        void countParsed(size_t consumed) { // bytes read since m_ReadMark, some may be left in the buffer
+            if(!m_Metrics)
+                return;
+            const size_t n = consumed + m_Buffer.size() - m_ReadMark;
+            m_Metrics->add(HTTPMetrics::Counter::BytesReceived, n);
+            m_ReadMore = m_ReadMore || n > 0;
+        }
+        bool queueResult() { // appends small buffered responses to the pipeline
+            if(m_CannedResult) {
+                m_PipelineData.append(m_CannedData);
+                m_PipelineSize += m_CannedData.size();
+                m_PipelineClose = m_CannedClose;
+            }
+            else if(m_CustomResult || (!m_FileResult && !m_StreamResult && !m_SendfileResult && !m_ChunkStream)) {
+                if(m_Result.chunked())
+                    return false;
+                queueHeader(m_Result);
+                auto& body = m_Result.body();
+                m_PipelineSize += body.size();
+                if(body.size() < PipelineCopySize)
+                    m_PipelineData.append(body.data(), body.size());
+                else { // moved, the result is not used anymore
+                    auto owner = std::make_shared<std::vector<char>>(std::move(body));
+                    m_PipelineBodies.push_back({m_PipelineData.size(), owner->data(), owner->size(), owner});
+                }
+                m_PipelineClose = m_Result.need_eof();
+            }
+            else if(m_FileResult) {
+                if(m_FileResult->chunked())
+                    return false;
+                queueHeader(*m_FileResult);
+                const auto& body = m_FileResult->body();
+                if(body.Data && body.Size > 0) { // cached files are referenced, not copied
+                    if(body.Size < PipelineCopySize)
+                        m_PipelineData.append(body.Data->data() + body.Offset, body.Size);
+                    else
+                        m_PipelineBodies.push_back({m_PipelineData.size(), body.Data->data() + body.Offset, body.Size, body.Data});
+                    m_PipelineSize += body.Size;
+                }
+                m_PipelineClose = m_FileResult->need_eof();
+            }
+            else
+                return false;
+            ++m_PipelineCount;
+            return true;
+        }
+        template<class Message>
+        void queueHeader(const Message& msg) {
+            http::fields::writer fw(msg.base(), msg.version(), msg.result_int());
+            const auto header = fw.get();
+            const size_t pos = m_PipelineData.size();
+            m_PipelineData.resize(pos + boost::asio::buffer_size(header));
+            boost::asio::buffer_copy(boost::asio::buffer(&m_PipelineData[pos], m_PipelineData.size() - pos), header);
+            m_PipelineSize += m_PipelineData.size() - pos;
+        }
+        bool nextRequest() { // takes the next request if it arrived completely and has no body
+            if(m_Buffer.size() == 0)
+                return false;
+            http::request_parser<http::string_body> parser;
+            parser.eager(true);
+            boost::system::error_code ec;
+            const size_t used = parser.put(m_Buffer.data(), ec);
+            if(ec || !parser.is_done() || parser.chunked() || (parser.content_length() && *parser.content_length() > 0))
+                return false; // incomplete, with body or invalid, read as usual once the queued responses were sent
+            m_Buffer.consume(used);
+            removeBodyFile();
+            m_Request = parser.release();
+            return true;
+        }
+        void flushPipeline(bool result) { // one gathered write for all queued responses
+            m_PipelineBuffers.clear();
+            size_t pos = 0;
+            for(const auto& body : m_PipelineBodies) {
+                if(body.Position > pos)
+                    m_PipelineBuffers.emplace_back(m_PipelineData.data() + pos, body.Position - pos);
+                m_PipelineBuffers.emplace_back(body.Data, body.Size);
+                pos = body.Position;
+            }
+            if(m_PipelineData.size() > pos)
+                m_PipelineBuffers.emplace_back(m_PipelineData.data() + pos, m_PipelineData.size() - pos);
+            setTimeout(m_Config->Timeouts.Write);
+            auto handler = boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_pipeline_write, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2, result));
+            if(m_SSL)
+                boost::asio::async_write(*m_Stream, m_PipelineBuffers, std::move(handler));
+            else
+                boost::asio::async_write(m_Socket, m_PipelineBuffers, std::move(handler));
+        }
+        void on_pipeline_write(boost::system::error_code ec, std::size_t bytes_transferred, bool result) {
+            countSent(bytes_transferred);
+            if(m_TimedOut)
+                return;
+            measureWrite(ec);
+            if(m_Metrics && result)
+                m_WriteStart = std::chrono::steady_clock::now();
+            const bool close = m_PipelineClose;
+            m_PipelineData.clear();
+            m_PipelineBodies.clear();
+            m_PipelineBuffers.clear();
+            m_PipelineCount = 0;
+            m_PipelineSize = 0;
+            m_PipelineClose = false;
+            if(result && !ec)
+                return writeResult();
+            on_write(ec, bytes_transferred, close);
+        }
+        void writeResult() {
+            if(m_CustomResult)
+                do_write(m_Result);
+            else if(m_CannedResult) {
+                setTimeout(m_Config->Timeouts.Write);
+                auto handler = boost::asio::bind_executor(m_Strand, [self = this->shared_from_this(), close = m_CannedClose](boost::system::error_code ec, std::size_t bytes_transferred) {
+                    self->countSent(bytes_transferred);
+                    self->on_write(ec, bytes_transferred, close);
+                });
+                if(m_SSL)
+                    boost::asio::async_write(*m_Stream, boost::asio::buffer(m_CannedData), std::move(handler));
+                else
+                    boost::asio::async_write(m_Socket, boost::asio::buffer(m_CannedData), std::move(handler));
+            }
+            else if(m_FileResult)
+                do_write(*m_FileResult);
+            else if(m_StreamResult)
+                do_write(*m_StreamResult);
+            else if(m_SendfileResult)
+                do_write(*m_SendfileResult, &HTTPSession::do_sendfile);
+            else if(m_ChunkStream)
+                do_write_stream_header();
+            else
+                do_write(m_Result);
+        }
+        bool route() {
+            HTTPRouter::SPtr router = m_Config->Routes; // a handler may replace the configuration
+            if(!router || router->size() == 0)
+                return false;
+            std::string_view path(m_Request.target().data(), m_Request.target().size());
+            path = path.substr(0, path.find('?'));
+            RouteParams params;
+            auto res = router->match(m_Request.method(), path, params);
+            if(res.Handler) {
+                if(res.Handler->Options.Limit && rateLimited(res.Handler))
+                    return true;
+                try {
+                    res.Handler->Handler(this->shared_from_this(), params);
+                }
+                catch(const ExceptionBase& e) {
+                    respondError(http::status::internal_server_error, "An error occurred: '" + e.getMessage() + "'");
+                }
+                catch(const std::exception& e) {
+                    respondError(http::status::internal_server_error, "An error occurred: '" + std::string(e.what()) + "'");
+                }
+                catch(...) {
+                    respondError(http::status::internal_server_error, "An unknown error occurred.");
+                }
+                return m_CustomResult || m_CannedResult || m_StreamResult || m_SendfileResult || m_ChunkStream || m_Deferred;
+            }
+            if(res.PathMatched && m_Request.method() != http::verb::get && m_Request.method() != http::verb::head) {
+                std::string allow;
+                for(auto v : router->allowed(path))
+                    allow += (allow.empty() ? "" : ", ") + std::string(http::to_string(v));
+                beginCanned(http::status::method_not_allowed);
+                cannedField("Allow", allow);
+                endCanned({"Method not allowed"}, m_Request.keep_alive());
+                return true;
+            }
+            return false;
+        }
+        bool rateLimited(const HTTPRoute* route) { // answers 429 Too Many Requests above the limit of the server or a route
+            const RateLimiter::SPtr& limiter = m_Config->RateLimits;
+            if(!limiter)
+                return false;
+            const RateLimiter::Decision decision = route ? limiter->check(clientAddress(), route->Options.Limit, reinterpret_cast<uintptr_t>(route))
+                                                         : limiter->check(clientAddress());
+            if(decision)
+                return false;
+            char seconds[24];
+            auto res = std::to_chars(seconds, seconds + sizeof(seconds), std::chrono::ceil<std::chrono::seconds>(decision.RetryAfter).count());
+            beginCanned(http::status::too_many_requests);
+            cannedField("Retry-After", std::string_view(seconds, static_cast<size_t>(res.ptr - seconds)));
+            endCanned({"Too many requests"}, m_Request.keep_alive());
+            return true;
+        }
+        void respondError(http::status status, std::string_view msg) {
+            respondError(status, msg, m_Request.keep_alive());
+        }
+        void respondError(http::status status, std::string_view msg, bool keepAlive) {
+            beginCanned(status);
+            endCanned({msg}, keepAlive);
+        }
+        void beginCanned(http::status status) { // response assembled from a prebuilt head, see HTTPResponseTemplates
+            m_Deferred = false; // e.g. the handler threw after deferring
+            m_CustomResult = false;
+            m_CannedResult = true;
+            m_ResultFromCache = false;
+            m_CannedStatus = status;
+            const unsigned version = std::min(m_Request.version(), 11u); // HTTP/2 streams parse it back, see getResult
+            const char start[] = {'H', 'T', 'T', 'P', '/', static_cast<char>('0' + version / 10 % 10), '.', static_cast<char>('0' + version % 10)};
+            m_CannedData.assign(start, sizeof(start));
+            const std::string* head = m_Config->Templates ? m_Config->Templates->find(status) : nullptr;
+            if(head)
+                m_CannedData.append(*head);
+            else
+                m_CannedData.append(HTTPResponseTemplates::makeHead(status, m_Config->ServerString));
+        }
+        void cannedField(std::string_view name, std::string_view value) {
+            m_CannedData.append(name.data(), name.size()).append(": ").append(value.data(), value.size()).append("\r\n");
+        }
+        void endCanned(std::initializer_list<std::string_view> body, bool keepAlive) {
+            size_t size = 0;
+            for(const auto& part : body)
+                size += part.size();
+            if(m_CannedStatus != http::status::not_modified) {
+                char length[24];
+                auto res = std::to_chars(length, length + sizeof(length), size);
+                cannedField("Content-Length", std::string_view(length, static_cast<size_t>(res.ptr - length)));
+            }
+            if(m_Request.version() >= 11 && !keepAlive)
+                cannedField("Connection", "close");
+            else if(m_Request.version() < 11 && keepAlive)
+                cannedField("Connection", "keep-alive");
+            m_CannedData.append("\r\n");
+            m_CannedBodySize = m_Request.method() != http::verb::head ? size : 0;
+            if(m_CannedBodySize > 0)
+                for(const auto& part : body)
+                    m_CannedData.append(part.data(), part.size());
+            m_CannedClose = !keepAlive;
+        }
+        struct CannedFields { // lets setValidators add fields to a canned response
+            HTTPSession& Session;
+            void set(http::field name, std::string_view value) {
+                const auto str = http::to_string(name);
+                Session.cannedField(std::string_view(str.data(), str.size()), value);
+            }
+        };
+        AcceptedEncodings acceptedEncodings() const {
+            AcceptedEncodings res;
+            auto it = m_Request.find(http::field::accept_encoding);
+            if(it == m_Request.end())
+                return res;
+            auto trim = [](std::string_view v) {
+                while(!v.empty() && (v.front() == ' ' || v.front() == '\t'))
+                    v.remove_prefix(1);
+                while(!v.empty() && (v.back() == ' ' || v.back() == '\t'))
+                    v.remove_suffix(1);
+                return v;
+            };
+            auto iequals = [](std::string_view a, std::string_view b) {
+                return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y){ return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y)); });
+            };
+            auto quality = [&](std::string_view params) { // q in thousandths, 1000 if absent or malformed
+                while(!params.empty()) {
+                    size_t end = std::min(params.find(';'), params.size());
+                    std::string_view param = trim(params.substr(0, end));
+                    params.remove_prefix(std::min(end + 1, params.size()));
+                    if(param.size() < 3 || (param[0] != 'q' && param[0] != 'Q') || param[1] != '=')
+                        continue;
+                    param.remove_prefix(2);
+                    if(param[0] != '0')
+                        return 1000;
+                    int q = 0, digits = 0;
+                    for(size_t i = 2; i < param.size() && param[1] == '.' && digits < 3; ++i, ++digits) {
+                        if(param[i] < '0' || param[i] > '9')
+                            return 1000;
+                        q = q * 10 + (param[i] - '0');
+                    }
+                    for(; digits < 3; ++digits)
+                        q *= 10;
+                    return q;
+                }
+                return 1000;
+            };
+            std::array<int, Encodings.size()> q;
+            q.fill(-1);            // -1: not listed, a wildcard does not override listed codings
+            int wildcard = -1;     // q of "*", -1 if absent
+            int identity = -1;     // q of "identity", -1 if absent
+            std::string_view value(it->value().data(), it->value().size());
+            while(!value.empty()) { // e.g. "gzip, deflate;q=0.5, br;q=0"
+                size_t end = std::min(value.find(','), value.size());
+                std::string_view item = value.substr(0, end);
+                value.remove_prefix(std::min(end + 1, value.size()));
+                size_t semi = item.find(';');
+                std::string_view token = trim(item.substr(0, semi));
+                const int itemQ = semi != std::string_view::npos ? quality(item.substr(semi + 1)) : 1000;
+                if(token == "*")
+                    wildcard = itemQ;
+                else if(iequals(token, "identity"))
+                    identity = itemQ;
+                for(size_t i = 0; i < Encodings.size(); ++i)
+                    if(iequals(token, Encodings[i].Name))
+                        q[i] = itemQ;
+            }
+            for(size_t i = 0; i < Encodings.size(); ++i) {
+                if(q[i] < 0)
+                    q[i] = wildcard;
+                if(q[i] > 0 && q[i] >= identity) // an explicitly preferred identity wins
+                    res.Order[res.Count++] = &Encodings[i];
+            }
+            std::stable_sort(res.Order.begin(), res.Order.begin() + static_cast<std::ptrdiff_t>(res.Count), [&](const Encoding* a, const Encoding* b) {
+                return q[static_cast<size_t>(a - Encodings.data())] > q[static_cast<size_t>(b - Encodings.data())];
+            });
+            res.IdentityRefused = identity == 0 || (identity < 0 && wildcard == 0);
+            return res;
+        }
+        bool hasVariants(const std::filesystem::path& path) const { // precompressed siblings exist, e.g. app.js.br
+            for(const auto& enc : Encodings) {
+                std::error_code fEc;
+                if(std::filesystem::is_regular_file(std::filesystem::path(path) += enc.Extension, fEc))
+                    return true;
+            }
+            return false;
+        }
+        bool refuseIdentity() { // answers 406 if the client does not accept unencoded content, see acceptedEncodings
+            if(!acceptedEncodings().IdentityRefused)
+                return false;
+            beginCanned(http::status::not_acceptable);
+            cannedField("Vary", "Accept-Encoding");
+            endCanned({"No acceptable content coding available"}, m_Request.keep_alive());
+            return true;
+        }
+        static bool isCompressible(const std::string& mime) {
+            auto endsWith = [&](std::string_view suffix) {
+                return mime.size() >= suffix.size() && mime.compare(mime.size() - suffix.size(), suffix.size(), suffix) == 0;
+            };
+            return mime.compare(0, 5, "text/") == 0 || mime == "application/javascript" || mime == "application/json" ||
+                   mime == "application/xml" || mime == "application/x-mpegURL" || endsWith("+xml") || endsWith("+json");
+        }
+        static bool gzip(std::vector<char>& body) {
+            Blob blob(body.begin(), body.end());
+            blob.compress();
+            if(blob.size() >= body.size())
+                return false; // not worth it
+            body.assign(blob.begin(), blob.end());
+            return true;
+        }
+        std::string cacheKey() const {
+            std::string key = m_Config->DocRoot.string();
+            key.append(m_Request.target().data(), m_Request.target().size());
+            return key;
+        }
+        bool serveCached() {
+            if(!m_Config->Cache)
+                return false;
+            std::string key = cacheKey();
+            const size_t base = key.size();
+            for(const Encoding* enc : acceptedEncodings()) { // encoded variants are cached as key + "\n" + encoding
+                key.resize(base);
+                key.append("\n").append(enc->Name);
+                FileCache::EntryPtr entry = m_Config->Cache->find(key);
+                if(!entry)
+                    return false; // not negotiated yet
+                if(!entry->ContentEncoding.empty())
+                    return respondCached(entry);
+            }
+            key.resize(base);
+            FileCache::EntryPtr entry = m_Config->Cache->find(key);
+            if(entry && refuseIdentity())
+                return true;
+            return respondCached(entry);
+        }
+        bool cacheFile(const std::filesystem::path& path) {
+            if(!m_Config->Cache)
+                return false;
+            FileCache& cache = *m_Config->Cache;
+            const std::string key = cacheKey();
+            const std::string& mime = m_Config->mimeType(path.extension().string());
+            const bool compressible = isCompressible(mime);
+            FileCache::EntryPtr identity;
+            auto loadIdentity = [&]{
+                if(!identity)
+                    identity = cache.insert(key, path, mime, "", nullptr, compressible || hasVariants(path));
+                return identity;
+            };
+            for(const Encoding* enc : acceptedEncodings()) {
+                const std::string variantKey = key + "\n" + enc->Name;
+                FileCache::EntryPtr variant = cache.insert(variantKey, std::filesystem::path(path) += enc->Extension, mime, enc->Name, nullptr, true);
+                if(!variant && enc->Bit == GzipBit && compressible)
+                    variant = cache.insert(variantKey, path, mime, enc->Name, &HTTPSession::gzip, true);
+                if(variant)
+                    return respondCached(variant);
+                if(!loadIdentity())
+                    return false;
+                cache.alias(variantKey, identity); // no such variant, serve the file as is
+            }
+            if(loadIdentity() && refuseIdentity())
+                return true;
+            return respondCached(loadIdentity());
+        }
+        bool respondCached(const FileCache::EntryPtr& entry) {
+            if(!entry)
+                return false;
+            if(isNotModified(entry->ETag, entry->LastModified, entry->MTime / 1000000000))
+                return respondNotModified(entry->ETag, entry->LastModified, entry->Vary);
+            const uint64_t size = entry->Body->size();
+            std::vector<ByteRange> ranges;
+            int range = parseRanges(size, entry->ETag, entry->LastModified, ranges);
+            if(range < 0)
+                return respondRangeNotSatisfiable(size);
+            if(ranges.size() > 1)
+                return respondMultipart(ranges, size, entry->ContentType, entry->ContentEncoding, entry->ETag, entry->LastModified, entry->Vary,
+                                        [&](char* dst, uint64_t offset, uint64_t len){ std::copy_n(entry->Body->data() + offset, len, dst); return true; });
+            m_FileResult = std::make_shared<http::response<SharedBufferBody>>(ranges.empty() ? http::status::ok : http::status::partial_content, m_Request.version());
+            setFileHeaders(*m_FileResult, entry->ContentType, entry->ContentEncoding, entry->ETag, entry->LastModified, entry->Vary);
+            SharedBufferBody::value_type body{entry->Body, 0, entry->Body->size()};
+            if(ranges.empty())
+                m_FileResult->set(http::field::content_length, entry->ContentLength);
+            else {
+                body.Offset = ranges[0].First;
+                body.Size = ranges[0].Last - ranges[0].First + 1;
+                m_FileResult->set(http::field::content_range, contentRange(ranges[0], size));
+                m_FileResult->content_length(body.Size);
+            }
+            if(m_Request.method() != http::verb::head)
+                m_FileResult->body() = std::move(body);
+            return true;
+        }
+        bool serveLargeFile(const std::filesystem::path& path) {
+            FileSystem::DirEntry st;
+            if(!FileCache::statFile(path, st) || st.Type != std::filesystem::file_type::regular || st.Size < m_Config->LargeFileThreshold)
+                return false;
+            const std::string& mime = m_Config->mimeType(path.extension().string());
+            const AcceptedEncodings accepted = acceptedEncodings();
+            for(const Encoding* enc : accepted) // precompressed sibling, e.g. app.js.br
+                if(serveLargeFile(std::filesystem::path(path) += enc->Extension, 0, mime, enc->Name, true))
+                    return true;
+            if(accepted.IdentityRefused)
+                return refuseIdentity();
+            return serveLargeFile(path, m_Config->LargeFileThreshold, mime, "", hasVariants(path)); // large files are not compressed on the fly
+        }
+        bool serveLargeFile(const std::filesystem::path& path, uint64_t threshold, const std::string& contentType, const std::string& contentEncoding = "", bool vary = false) {
+            FileSystem::DirEntry st;
+            if(!FileCache::statFile(path, st) || st.Type != std::filesystem::file_type::regular || st.Size < threshold)
+                return false;
+            const std::string etag = FileCache::makeETag(st);
+            const std::string lastModified = FileCache::httpDate(st.MTime / 1000000000);
+            if(isNotModified(etag, lastModified, st.MTime / 1000000000))
+                return respondNotModified(etag, lastModified, vary);
+            std::vector<ByteRange> ranges;
+            int range = parseRanges(st.Size, etag, lastModified, ranges);
+            if(range < 0)
+                return respondRangeNotSatisfiable(st.Size);
+            if(ranges.size() > 1) { // read only the requested ranges
+                std::ifstream file(path, std::ios::binary);
+                return file && respondMultipart(ranges, st.Size, contentType, contentEncoding, etag, lastModified, vary, [&](char* dst, uint64_t offset, uint64_t len){
+                    file.seekg(static_cast<std::streamoff>(offset));
+                    return file.read(dst, static_cast<std::streamsize>(len)) && static_cast<uint64_t>(file.gcount()) == len;
+                });
+            }
+            const ByteRange window = ranges.empty() ? ByteRange{0, st.Size - 1} : ranges[0];
+            const uint64_t length = ranges.empty() ? st.Size : window.Last - window.First + 1;
+            m_Result = {ranges.empty() ? http::status::ok : http::status::partial_content, m_Request.version()};
+            setFileHeaders(m_Result, contentType, contentEncoding, etag, lastModified, vary);
+            if(!ranges.empty())
+                m_Result.set(http::field::content_range, contentRange(window, st.Size));
+            m_Result.content_length(length);
+        #if defined(__linux__)
+            if(!m_SSL && !m_Responder) {
+                FileSystem::FileDescriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+                if(!fd)
+                    return false;
+                m_SendfileResult = std::make_shared<http::response<http::empty_body>>(m_Result.base());
+                if(m_Request.method() != http::verb::head) {
+                    m_SendFd = std::move(fd);
+                    m_SendOffset = window.First;
+                    m_SendSize = window.First + length; // end of the window
+                }
+                return true;
+            }
+        #endif
+            FileRangeBody::value_type body;
+            if(m_Request.method() != http::verb::head) {
+                boost::beast::error_code bec;
+                body.File.open(path.string().c_str(), boost::beast::file_mode::scan, bec);
+                if(bec)
+                    return false;
+                body.Offset = window.First;
+                body.Size = length;
+            }
+            m_StreamResult = std::make_shared<http::response<FileRangeBody>>(m_Result.base(), std::move(body));
+            return true;
+        }
+        template<class Message>
+        void setFileHeaders(Message& res, const std::string& contentType, const std::string& contentEncoding, const std::string& etag, const std::string& lastModified, bool vary) const {
+            res.set(http::field::server, m_Config->ServerString);
+            res.set(http::field::content_type, contentType);
+            if(!contentEncoding.empty())
+                res.set(http::field::content_encoding, contentEncoding);
+            setValidators(res, etag, lastModified, vary);
+            res.set(http::field::accept_ranges, "bytes");
+            res.keep_alive(m_Request.keep_alive());
+        }
+        template<class Message>
+        void setValidators(Message& res, const std::string& etag, const std::string& lastModified, bool vary) const {
+            if(vary)
+                res.set(http::field::vary, "Accept-Encoding");
+            res.set(http::field::etag, etag);
+            res.set(http::field::last_modified, lastModified);
+            std::string_view path(m_Request.target().data(), m_Request.target().size());
+            if(const std::string* cc = m_Config->cacheControl(path.substr(0, path.find('?'))))
+                res.set(http::field::cache_control, *cc);
+        }
+        static bool etagMatches(std::string_view list, std::string_view etag, bool strong) {
+            auto opaque = [](std::string_view tag) { return tag.compare(0, 2, "W/") == 0 ? tag.substr(2) : tag; };
+            while(!list.empty()) { // e.g. "\"a\", W/\"b\"" or "*"
+                size_t end = std::min(list.find(','), list.size());
+                std::string_view tag = list.substr(0, end);
+                list.remove_prefix(std::min(end + 1, list.size()));
+                while(!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+                    tag.remove_prefix(1);
+                while(!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+                    tag.remove_suffix(1);
+                if(tag == "*")
+                    return true;
+                if(strong ? tag == etag && tag.compare(0, 2, "W/") != 0 : opaque(tag) == opaque(etag))
+                    return true;
+            }
+            return false;
+        }
+        bool isNotModified(const std::string& etag, const std::string& lastModified, std::time_t mtime) const {
+            if(m_Request.method() != http::verb::get && m_Request.method() != http::verb::head)
+                return false;
+            auto inm = m_Request.find(http::field::if_none_match);
+            if(inm != m_Request.end()) // takes precedence over If-Modified-Since
+                return etagMatches(std::string_view(inm->value().data(), inm->value().size()), etag, false);
+            auto ims = m_Request.find(http::field::if_modified_since);
+            if(ims == m_Request.end())
+                return false;
+            std::string_view since(ims->value().data(), ims->value().size());
+            std::time_t time;
+            return since == lastModified || (FileCache::parseHttpDate(since, time) && mtime <= time);
+        }
+        // Parses the Range header. Returns 0 to send the whole file, 1 if ranges were parsed, -1 if no range is satisfiable.
+        int parseRanges(uint64_t size, const std::string& etag, const std::string& lastModified, std::vector<ByteRange>& ranges) const {
+            if(m_Request.method() != http::verb::get)
+                return 0;
+            auto it = m_Request.find(http::field::range);
+            if(it == m_Request.end())
+                return 0;
+            auto ifRange = m_Request.find(http::field::if_range);
+            if(ifRange != m_Request.end()) { // send the whole file if it changed
+                std::string_view validator(ifRange->value().data(), ifRange->value().size());
+                bool isETag = !validator.empty() && (validator[0] == '"' || validator.compare(0, 2, "W/") == 0);
+                if(isETag ? !etagMatches(validator, etag, true) : validator != lastModified)
+                    return 0;
+            }
+            auto number = [](std::string_view v, uint64_t& n) {
+                auto res = std::from_chars(v.data(), v.data() + v.size(), n);
+                return !v.empty() && res.ec == std::errc() && res.ptr == v.data() + v.size();
+            };
+            std::string_view spec(it->value().data(), it->value().size());
+            if(spec.compare(0, 6, "bytes=") != 0)
+                return 0;
+            spec.remove_prefix(6);
+            bool any = false;
+            uint64_t total = 0;
+            while(!spec.empty()) { // e.g. "0-499, 1000-, -500"
+                size_t end = std::min(spec.find(','), spec.size());
+                std::string_view item = spec.substr(0, end);
+                spec.remove_prefix(std::min(end + 1, spec.size()));
+                while(!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+                    item.remove_prefix(1);
+                while(!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+                    item.remove_suffix(1);
+                if(item.empty())
+                    continue;
+                size_t dash = item.find('-');
+                if(dash == std::string_view::npos)
+                    return ranges.clear(), 0; // invalid, ignore the header
+                ByteRange r{0, 0};
+                std::string_view first = item.substr(0, dash);
+                std::string_view last = item.substr(dash + 1);
+                if(first.empty()) { // suffix, the last n bytes
+                    if(!number(last, r.Last))
+                        return ranges.clear(), 0;
+                    any = true;
+                    if(r.Last == 0 || size == 0)
+                        continue;
+                    r.First = size - std::min(r.Last, size);
+                    r.Last = size - 1;
+                }
+                else {
+                    if(!number(first, r.First) || (!last.empty() && (!number(last, r.Last) || r.Last < r.First)))
+                        return ranges.clear(), 0;
+                    any = true;
+                    if(r.First >= size)
+                        continue;
+                    r.Last = last.empty() ? size - 1 : std::min(r.Last, size - 1);
+                }
+                total += r.Last - r.First + 1;
+                ranges.push_back(r);
+                if(ranges.size() > MaxRanges || (ranges.size() > 1 && total > MaxMultipartSize))
+                    return ranges.clear(), 0; // too expensive, send the whole file instead
+            }
+            if(!ranges.empty())
+                return 1;
+            return any ? -1 : 0;
+        }
+        static std::string contentRange(const ByteRange& range, uint64_t size) {
+            return "bytes " + std::to_string(range.First) + "-" + std::to_string(range.Last) + "/" + std::to_string(size);
+        }
+        bool respondNotModified(const std::string& etag, const std::string& lastModified, bool vary) {
+            beginCanned(http::status::not_modified);
+            CannedFields fields{*this};
+            setValidators(fields, etag, lastModified, vary);
+            endCanned({}, m_Request.keep_alive());
+            return true;
+        }
+        bool respondRangeNotSatisfiable(uint64_t size) {
+            beginCanned(http::status::range_not_satisfiable);
+            cannedField("Content-Range", "bytes */" + std::to_string(size));
+            endCanned({"Requested range not satisfiable"}, m_Request.keep_alive());
+            return true;
+        }
+        template<class Read>
+        bool respondMultipart(const std::vector<ByteRange>& ranges, uint64_t size, const std::string& contentType, const std::string& contentEncoding, const std::string& etag, const std::string& lastModified, bool vary, Read read) {
+            static const std::string boundary = [] {
+                std::random_device rd;
+                char buf[40];
+                std::snprintf(buf, sizeof(buf), "giri_%08x%08x", rd(), rd());
+                return std::string(buf);
+            }();
+            m_Result = {http::status::partial_content, m_Request.version()};
+            setFileHeaders(m_Result, "multipart/byteranges; boundary=" + boundary, contentEncoding, etag, lastModified, vary);
+            auto& body = m_Result.body();
+            auto append = [&](const std::string& str) { body.insert(body.end(), str.begin(), str.end()); };
+            for(const auto& r : ranges) {
+                append("--" + boundary + "\r\nContent-Type: " + contentType + "\r\nContent-Range: " + contentRange(r, size) + "\r\n\r\n");
+                size_t offset = body.size();
+                body.resize(offset + (r.Last - r.First + 1));
+                if(!read(body.data() + offset, r.First, r.Last - r.First + 1)) {
+                    m_Result = {};
+                    return false;
+                }
+                append("\r\n");
+            }
+            append("--" + boundary + "--\r\n");
+            m_Result.prepare_payload();
+            m_CustomResult = true;
+            return true;
+        }
+        using WriteHandler = void (HTTPSession::*)(boost::system::error_code, std::size_t, bool);
+        template<class Message>
+        void do_write(Message& msg, WriteHandler handler = &HTTPSession::on_write) {
+            using Serializer = http::serializer<Message::header_type::is_request::value, typename Message::body_type, typename Message::fields_type>;
+            setTimeout(m_Config->Timeouts.Write);
+            write_some(std::make_shared<Serializer>(msg), handler, msg.need_eof());
+        }
+        template<class Serializer>
+        void write_some(std::shared_ptr<Serializer> sr, WriteHandler handler, bool close) { // piecewise, so every write restarts the write timeout
+            auto next = [self = this->shared_from_this(), sr, handler, close](boost::system::error_code ec, std::size_t bytes_transferred) {
+                self->countSent(bytes_transferred);
+                if(!ec && !sr->is_done() && !self->m_TimedOut) {
+                    self->setTimeout(self->m_Config->Timeouts.Write);
+                    return self->write_some(sr, handler, close);
+                }
+                ((*self).*handler)(ec, bytes_transferred, close);
+            };
+            if(m_SSL)
+                http::async_write_some(*m_Stream, *sr, boost::asio::bind_executor(m_Strand, std::move(next)));
+            else
+                http::async_write_some(m_Socket, *sr, boost::asio::bind_executor(m_Strand, std::move(next)));
+        }
+        void setTimeout(std::chrono::milliseconds timeout) {
+            m_Deadline = timeout.count() > 0 ? std::chrono::steady_clock::now() + timeout : std::chrono::steady_clock::time_point::max();
+            if(timeout.count() <= 0 || (m_TimerPending && m_Timer.expiry() <= m_Deadline))
+                return; // the pending wait is extended when it expires
+            m_TimerPending = true;
+            m_Timer.expires_at(m_Deadline);
+            m_Timer.async_wait(boost::asio::bind_executor(m_Strand, [self = this->weak_from_this()](boost::system::error_code ec){
+                auto session = self.lock();
+                if(!ec && session) // aborted if replaced by an earlier deadline
+                    session->on_timeout();
+            }));
+        }
+        void on_timeout() {
+            m_TimerPending = false;
+            if(m_Deadline == std::chrono::steady_clock::time_point::max() || m_TimedOut)
+                return;
+            if(std::chrono::steady_clock::now() < m_Deadline) { // deadline was extended meanwhile
+                m_TimerPending = true;
+                m_Timer.expires_at(m_Deadline);
+                m_Timer.async_wait(boost::asio::bind_executor(m_Strand, [self = this->weak_from_this()](boost::system::error_code ec){
+                    auto session = self.lock();
+                    if(!ec && session)
+                        session->on_timeout();
+                }));
+                return;
+            }
+            abort();
+        }
+        void abort() { // closes the connection at once
+            if(m_TimedOut)
+                return;
+            m_TimedOut = true; // pending operations complete with an error and end the session
+            boost::system::error_code ec;
+            m_Socket.shutdown(tcp::socket::shutdown_both, ec);
+            m_Socket.close(ec);
+            if(m_ChunkStream)
+                m_ChunkStream->closed();
+        }
+        void on_drain(); // defined below HTTP2Session
+        void do_write_stream_header() {
+            auto sr = std::make_shared<http::response_serializer<http::empty_body>>(*m_ChunkHeader);
+            sr->split(true); // the chunks are written by pumpStream
+            auto handler = boost::asio::bind_executor(m_Strand, [self = this->shared_from_this(), sr](boost::system::error_code ec, std::size_t bytes_transferred) {
+                self->countSent(bytes_transferred);
+                if(self->m_TimedOut)
+                    return;
+                if(ec)
+                    return self->abortStream(ec);
+                self->m_ChunkHeaderSent = true;
+                self->drainStream();
+            });
+            setTimeout(m_Config->Timeouts.Write);
+            if(m_SSL)
+                http::async_write_header(*m_Stream, *sr, std::move(handler));
+            else
+                http::async_write_header(m_Socket, *sr, std::move(handler));
+        }
+        void pumpStream() {
+            if(!m_ChunkStream || m_TimedOut)
+                return;
+            HTTPStream& st = *m_ChunkStream;
+            if(st.m_Aborted) // also cancels a pending write
+                return abortStream(boost::asio::error::operation_aborted);
+            if(!m_ChunkHeaderSent || m_ChunkWriting)
+                return;
+            if(st.m_Queue.empty() && !st.m_Finishing) { // abandoned streams are closed after the idle timeout
+                setTimeout(m_Config->Timeouts.Idle);
+                return;
+            }
+            static const char last[] = "0\r\n\r\n";
+            m_ChunkBuffers.clear();
+            m_ChunkInFlight.clear();
+            for(auto& chunk : st.m_Queue) { // gathered write of all queued chunks
+                m_ChunkBuffers.emplace_back(chunk->data(), chunk->size());
+                m_ChunkInFlight.push_back(std::move(chunk));
+            }
+            st.m_Queue.clear();
+            const bool finish = st.m_Finishing;
+            if(finish)
+                m_ChunkBuffers.emplace_back(last, sizeof(last) - 1);
+            m_ChunkWriting = true;
+            setTimeout(m_Config->Timeouts.Write);
+            auto handler = boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_stream_write, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2, finish));
+            if(m_SSL)
+                boost::asio::async_write(*m_Stream, m_ChunkBuffers, std::move(handler));
+            else
+                boost::asio::async_write(m_Socket, m_ChunkBuffers, std::move(handler));
+        }
+        void on_stream_write(boost::system::error_code ec, std::size_t bytes_transferred, bool finish) {
+            countSent(bytes_transferred);
+            if(m_TimedOut)
+                return;
+            m_ChunkWriting = false;
+            size_t sent = 0;
+            for(const auto& chunk : m_ChunkInFlight)
+                sent += chunk->size();
+            m_ChunkStream->m_Queued.fetch_sub(sent, std::memory_order_relaxed);
+            m_ChunkInFlight.clear();
+            if(ec)
+                return abortStream(ec);
+            if(finish) {
+                m_ChunkStream->closed();
+                return on_write(ec, bytes_transferred, m_ChunkHeader->need_eof());
+            }
+            drainStream();
+        }
+        void drainStream() {
+            if(m_ChunkStream->m_Queue.empty() && m_ChunkStream->m_OnDrain) {
+                try {
+                    m_ChunkStream->m_OnDrain();
+                }
+                catch(...) { // the response is already underway, all that is left is to abort it
+                    return abortStream(boost::asio::error::operation_aborted);
+                }
+            }
+            pumpStream();
+        }
+        void abortStream(boost::system::error_code ec) {
+            m_Ec = ec;
+            boost::system::error_code ignored;
+            m_Socket.shutdown(tcp::socket::shutdown_both, ignored);
+            m_Socket.close(ignored);
+            if(m_ChunkStream)
+                m_ChunkStream->closed();
+        }
+        void do_sendfile(boost::system::error_code ec, std::size_t bytes_transferred, bool close) {
+            boost::ignore_unused(bytes_transferred);
+            if(m_TimedOut)
+                return;
+        #if defined(__linux__)
+            constexpr uint64_t chunk = 4 * 1024 * 1024;
+            constexpr uint64_t turn = 16 * 1024 * 1024; // give other sessions a chance after this many bytes
+            uint64_t sent = 0;
+            if(!ec && m_SendFd)
+                m_Socket.native_non_blocking(true, ec);
+            while(!ec && m_SendFd && m_SendOffset < m_SendSize) {
+                if(sent >= turn) {
+                    boost::asio::post(m_Strand, std::bind(&HTTPSession::do_sendfile, this->shared_from_this(), ec, 0, close));
+                    return;
+                }
+                off_t off = static_cast<off_t>(m_SendOffset);
+                ssize_t n = ::sendfile(m_Socket.native_handle(), m_SendFd.get(), &off, static_cast<size_t>(std::min(m_SendSize - m_SendOffset, chunk)));
+                if(n > 0) {
+                    m_SendOffset += static_cast<uint64_t>(n);
+                    sent += static_cast<uint64_t>(n);
+                    countSent(static_cast<size_t>(n));
+                    setTimeout(m_Config->Timeouts.Write);
+                }
+                else if(n < 0 && errno == EAGAIN) {
+                    m_Socket.async_wait(tcp::socket::wait_write, boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::do_sendfile, this->shared_from_this(), std::placeholders::_1, 0, close)));
+                    return;
+                }
+                else if(n < 0 && errno != EINTR)
+                    ec = boost::system::error_code(errno, boost::system::system_category());
+                else if(n == 0) // file was truncated meanwhile
+                    ec = boost::asio::error::eof;
+            }
+            m_SendFd.reset();
+            on_write(ec, static_cast<std::size_t>(m_SendOffset), close || ec);
+        #else
+            on_write(ec, bytes_transferred, close);
+        #endif
+        }
+        void do_read() {
+            m_Request = {};
+            m_ReadMore = false;
+            removeBodyFile();
+            if(!m_Socket.is_open())
+                return;
+            m_Idle = m_Buffer.size() == 0; // no byte of the next request arrived yet
+            if(m_Idle && m_Draining)
+                return abort();
+            if(m_Buffer.size() == 0 && (m_Requests > 0 || m_Metrics)) { // keep-alive, wait for the next request, also tells when its first byte arrived
+                setTimeout(m_Requests > 0 ? m_Config->Timeouts.Idle : m_Config->Timeouts.Header);
+                return do_read_some();
+            }
+            if(detectHTTP2()) { // h2c with prior knowledge, see on_idle
+                setTimeout(m_Config->Timeouts.Header);
+                return do_read_some();
+            }
+            if(m_Metrics) // buffered already, e.g. pipelined
+                m_RequestStart = std::chrono::steady_clock::now();
+            do_read_header();
+        }
+        void do_read_some() {
+            auto handler = boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_idle, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+            if(m_SSL)
+                m_Stream->async_read_some(m_Buffer.prepare(IdleReadSize), std::move(handler));
+            else
+                m_Socket.async_read_some(m_Buffer.prepare(IdleReadSize), std::move(handler));
+        }
+        void on_idle(boost::system::error_code ec, std::size_t bytes_transferred) {
+            if(m_TimedOut)
+                return;
+            m_Buffer.commit(bytes_transferred);
+            if(m_Metrics && bytes_transferred > 0) {
+                m_Metrics->add(HTTPMetrics::Counter::BytesReceived, bytes_transferred);
+                if(m_Buffer.size() == bytes_transferred) // first byte of the request
+                    measureFirstByte();
+            }
+            m_Idle = false;
+            if(ec) { // closed by the client
+                m_Ec = ec;
+                return;
+            }
+            if(detectHTTP2()) { // the connection preface tells HTTP/2 from HTTP/1.1 requests
+                std::string_view data(static_cast<const char*>(m_Buffer.data().data()), m_Buffer.size());
+                const size_t len = std::min(data.size(), HTTP2::Preface.size());
+                if(data.compare(0, len, HTTP2::Preface.substr(0, len)) == 0)
+                    return len == HTTP2::Preface.size() ? startHTTP2() : do_read_some();
+            }
+            do_read_header();
+        }
+        bool detectHTTP2() const {
+            return m_Requests == 0 && !m_SSL && !m_Responder && m_Config->EnableHTTP2;
+        }
+        void startHTTP2(); // defined below HTTP2Session
+        void do_read_header() {
+            setTimeout(m_Config->Timeouts.Header);
+            m_Parser.emplace();
+            m_Parser->body_limit(std::numeric_limits<std::uint64_t>::max()); // checked once the route is known
+            m_ReadMark = m_Buffer.size();
+            auto handler = boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_read_header, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+            if(m_SSL)
+                http::async_read_header(*m_Stream, m_Buffer, *m_Parser, std::move(handler));
+            else
+                http::async_read_header(m_Socket, m_Buffer, *m_Parser, std::move(handler));
+        }
+        void on_read_header(boost::system::error_code ec, std::size_t bytes_transferred) {
+            countParsed(bytes_transferred);
+            if(m_TimedOut)
+                return;
+            m_Idle = false;
+            if(ec || m_Parser->is_done())
+                return on_read(ec, bytes_transferred);
+            const auto& req = m_Parser->get();
+            const uint64_t limit = matchBodyRoute(req.method(), req.target());
+            if(m_Parser->content_length() && *m_Parser->content_length() > limit)
+                return on_read(http::error::body_limit, bytes_transferred); // reject without reading the body
+            m_Parser->body_limit(limit);
+            auto expect = req.find(http::field::expect);
+            const bool sendContinue = req.version() >= 11 && expect != req.end() && boost::beast::iequals(expect->value(), "100-continue");
+            if(m_BodyRoute && (m_BodyRoute->Options.OnBody || m_BodyRoute->Options.SpoolBody)) {
+                if(!m_BodyRoute->Options.OnBody && !openBodyFile())
+                    return reject(http::status::internal_server_error, "Cannot create temporary file");
+                m_BodyParser.emplace(std::move(*m_Parser)); // req is moved from now on
+                m_BodyBuffer.resize(BodyChunkSize);
+            }
+            if(sendContinue) {
+                static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                setTimeout(m_Config->Timeouts.Write);
+                auto handler = boost::asio::bind_executor(m_Strand, [self = this->shared_from_this()](boost::system::error_code ec, std::size_t bytes_transferred) {
+                    self->countSent(bytes_transferred);
+                    if(self->m_TimedOut)
+                        return;
+                    if(ec)
+                        self->m_Ec = ec;
+                    else
+                        self->do_read_body();
+                });
+                if(m_SSL)
+                    boost::asio::async_write(*m_Stream, boost::asio::buffer(interim, sizeof(interim) - 1), std::move(handler));
+                else
+                    boost::asio::async_write(m_Socket, boost::asio::buffer(interim, sizeof(interim) - 1), std::move(handler));
+                return;
+            }
+            do_read_body();
+        }
+        uint64_t matchBodyRoute(http::verb method, boost::beast::string_view target) { // the route decides how to receive the body
+            m_BodyRoute = nullptr;
+            m_BodyRouter = m_Config->Routes;
+            if(m_BodyRouter && m_BodyRouter->size() > 0) {
+                std::string_view path(target.data(), target.size());
+                RouteParams params;
+                m_BodyRoute = m_BodyRouter->match(method, path.substr(0, path.find('?')), params).Handler;
+            }
+            return m_BodyRoute && m_BodyRoute->Options.BodyLimit > 0 ? m_BodyRoute->Options.BodyLimit : m_Config->BodyLimit;
+        }
+        void do_read_body() {
+            setTimeout(m_Config->Timeouts.Body);
+            m_ReadMark = m_Buffer.size();
+            if(m_BodyParser) { // streamed, read up to one chunk
+                auto& body = m_BodyParser->get().body();
+                body.data = m_BodyBuffer.data();
+                body.size = m_BodyBuffer.size();
+                auto handler = boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_read_body, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+                if(m_SSL)
+                    http::async_read(*m_Stream, m_Buffer, *m_BodyParser, std::move(handler));
+                else
+                    http::async_read(m_Socket, m_Buffer, *m_BodyParser, std::move(handler));
+                return;
+            }
+            auto handler = boost::asio::bind_executor(m_Strand, [self = this->shared_from_this()](boost::system::error_code ec, std::size_t bytes_transferred) {
+                self->countParsed(bytes_transferred);
+                self->on_read(ec, bytes_transferred);
+            });
+            if(m_SSL)
+                http::async_read(*m_Stream, m_Buffer, *m_Parser, std::move(handler));
+            else
+                http::async_read(m_Socket, m_Buffer, *m_Parser, std::move(handler));
+        }
+        void on_read_body(boost::system::error_code ec, std::size_t bytes_transferred) {
+            countParsed(bytes_transferred);
+            if(m_TimedOut)
+                return;
+            if(ec == http::error::need_buffer) // chunk buffer is full
+                ec = {};
+            const size_t len = m_BodyBuffer.size() - m_BodyParser->get().body().size;
+            if(!ec && len > 0 && !deliverBody(std::string_view(m_BodyBuffer.data(), len)))
+                return;
+            if(ec || m_BodyParser->is_done())
+                return on_read(ec, bytes_transferred);
+            if(m_BodyPaused) { // continued by resumeBody
+                m_BodyWaiting = true;
+                return;
+            }
+            do_read_body();
+        }
+        bool deliverBody(std::string_view chunk) {
+            try {
+                if(m_BodyRoute->Options.OnBody)
+                    m_BodyRoute->Options.OnBody(this->shared_from_this(), chunk);
+                else if(!m_BodyStream.write(chunk.data(), static_cast<std::streamsize>(chunk.size())))
+                    throw HTTPServerException("Cannot write " + m_BodyFile.string());
+                return true;
+            }
+            catch(const ExceptionBase& e) {
+                reject(http::status::internal_server_error, "An error occurred: '" + e.getMessage() + "'");
+            }
+            catch(const std::exception& e) {
+                reject(http::status::internal_server_error, "An error occurred: '" + std::string(e.what()) + "'");
+            }
+            catch(...) {
+                reject(http::status::internal_server_error, "An unknown error occurred.");
+            }
+            return false;
+        }
+        void takeRequest() {
+            if(m_BodyParser) // the body was streamed, keep the header only
+                m_Request = http::request<http::string_body>(std::move(m_BodyParser->get().base()));
+            else if(m_Parser)
+                m_Request = m_Parser->release();
+            m_Parser.reset();
+            m_BodyParser.reset();
+            m_BodyRouter.reset();
+            m_BodyRoute = nullptr;
+            m_BodyPaused = false;
+            m_BodyWaiting = false;
+            if(m_BodyStream.is_open())
+                m_BodyStream.close();
+        }
+        void reject(http::status status, const std::string& msg) { // answers and closes without reading the rest of the request
+            takeRequest();
+            respondError(status, msg, false);
+            send();
+        }
+        bool openBodyFile() {
+            static std::atomic<uint64_t> counter{0};
+            static const uint64_t seed = (static_cast<uint64_t>(std::random_device()()) << 32) | std::random_device()();
+            std::error_code ec;
+            std::filesystem::path dir = std::filesystem::temp_directory_path(ec);
+            if(ec)
+                return false;
+            char name[64];
+            std::snprintf(name, sizeof(name), "giri_body_%016llx_%llu", static_cast<unsigned long long>(seed), static_cast<unsigned long long>(counter++));
+            m_BodyFile = dir / name;
+            m_BodyStream.open(m_BodyFile, std::ios::binary | std::ios::trunc);
+            return m_BodyStream.is_open();
+        }
+        void removeBodyFile() {
+            if(m_BodyFile.empty())
+                return;
+            if(m_BodyStream.is_open())
+                m_BodyStream.close();
+            std::error_code ec;
+            std::filesystem::remove(m_BodyFile, ec);
+            m_BodyFile.clear();
+        }
+        void on_write(boost::system::error_code ec, std::size_t bytes_transferred, bool close) {
+            boost::ignore_unused(bytes_transferred);
+            if(m_TimedOut)
+                return;
+            measureWrite(ec);
+            if(ec) { // e.g. the client went away
+                m_Ec = ec;
+                return abort();
+            }
+            if(close || m_Draining)
+                return this->close();
+            m_Result.clear();
+            m_FileResult.reset();
+            m_StreamResult.reset();
+            m_SendfileResult.reset();
+            m_ChunkHeader.reset();
+            m_ChunkStream.reset();
+            do_read();
+        }
+        void on_handshake(boost::system::error_code ec) {
+            if(m_Metrics)
+                m_Metrics->add(ec ? HTTPMetrics::Counter::TLSHandshakeErrors : HTTPMetrics::Counter::TLSHandshakes);
+            if(m_TimedOut)
+                return;
+            if(ec){
+                m_Result = {http::status::internal_server_error, m_Request.version()};
+                m_Result.set(http::field::server, m_Config->ServerString);
+                m_Result.set(http::field::content_type, "text/html");
+                m_Result.keep_alive(m_Request.keep_alive());
+                std::string msg = "An error occurred during SSL handshake: '" + ec.message() + "'";
+                m_Result.body().assign(msg.begin(), msg.end());
+                m_Result.prepare_payload();
+                http::async_write(m_Socket, m_Result, boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_write, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2, m_Result.need_eof())));
+            }
+            else if(m_Config->EnableHTTP2 && TLSContext::negotiatedProtocol(m_Stream->native_handle()) == "h2")
+                startHTTP2();
+            else
+                do_read();
+        }
+        void on_shutdown(boost::system::error_code ec) {
+            if(m_TimedOut)
+                return;
+            if(ec && ec != boost::beast::errc::broken_pipe)
+                m_Ec = ec; // e.g. the client closed without close_notify
+        }
+        tcp::socket m_Socket;
+        HTTPConfig::SPtr m_Config;
+        bool m_SSL;
+        std::shared_ptr<ssl::context> m_Ctx;
+        std::shared_ptr< ssl::stream<tcp::socket&> > m_Stream;
+        boost::asio::strand<boost::asio::io_context::executor_type> m_Strand;
+        boost::asio::steady_timer m_Timer;
+        std::chrono::steady_clock::time_point m_Deadline = std::chrono::steady_clock::time_point::max();
+        bool m_TimerPending = false;
+        bool m_TimedOut = false;
+        ConnectionLimiter::Ticket m_Ticket;
+        uint64_t m_Requests = 0;
+        boost::beast::flat_buffer m_Buffer;
+        boost::optional<http::request_parser<http::string_body>> m_Parser;
+        boost::optional<http::request_parser<http::buffer_body>> m_BodyParser; // streamed request bodies
+        HTTPRouter::SPtr m_BodyRouter;
+        const HTTPRoute* m_BodyRoute = nullptr;
+        std::vector<char> m_BodyBuffer;
+        std::filesystem::path m_BodyFile;
+        std::ofstream m_BodyStream;
+        bool m_BodyPaused = false;  // see pauseBody
+        bool m_BodyWaiting = false; // paused after a chunk, the next read waits for resumeBody
+        std::function<void()> m_ResumeBody; // HTTP/2 streams: grants the client window again
+        bool m_Deferred = false;    // see defer
+        std::shared_ptr<void> m_Context;
+        http::request<http::string_body> m_Request;
+        boost::system::error_code m_Ec;
+        mutable http::response<http::vector_body<char>> m_Result; // filled lazily by getResult for cached files
+        std::shared_ptr<http::response<SharedBufferBody>> m_FileResult;
+        std::shared_ptr<http::response<FileRangeBody>> m_StreamResult;
+        std::shared_ptr<http::response<http::empty_body>> m_SendfileResult;
+        std::shared_ptr<http::response<http::empty_body>> m_ChunkHeader;
+        HTTPStream::SPtr m_ChunkStream;
+        std::vector<std::shared_ptr<const std::string>> m_ChunkInFlight;
+        std::vector<boost::asio::const_buffer> m_ChunkBuffers;
+        bool m_ChunkHeaderSent = false;
+        bool m_ChunkWriting = false;
+        std::string m_PipelineData;                      // serialized headers and small bodies of queued responses
+        std::vector<PipelinedBody> m_PipelineBodies;     // larger bodies, sent without copying
+        std::vector<boost::asio::const_buffer> m_PipelineBuffers;
+        size_t m_PipelineCount = 0;
+        size_t m_PipelineSize = 0;
+        bool m_PipelineClose = false;
+    #if defined(__linux__)
+        FileSystem::FileDescriptor m_SendFd;
+    #endif
+        uint64_t m_SendOffset = 0;
+        uint64_t m_SendSize = 0;
+        bool m_CustomResult = false;
+        mutable bool m_ResultFromCache = false;              // m_Result was filled by getResult
+        bool m_CannedResult = false;
+        bool m_CannedClose = false;
+        http::status m_CannedStatus = http::status::ok;
+        std::string m_CannedData;                            // serialized response, see beginCanned
+        size_t m_CannedBodySize = 0;
+        std::function<void(const std::shared_ptr<HTTPSession>&)> m_OnStream;   // announces HTTP/2 request streams
+        std::shared_ptr<HTTPSession> m_Connection;                             // HTTP/2 streams: session of the connection
+        std::function<void(const std::shared_ptr<HTTPSession>&)> m_Responder; // HTTP/2 streams: sends the response
+        std::weak_ptr<HTTP2Session> m_HTTP2;                                   // HTTP/2 connection this session carries
+        bool m_Draining = false;                                               // close once the current request was answered
+        bool m_Idle = false;                                                   // waiting for the first byte of a request
+        HTTPMetrics::SPtr m_Metrics;                                           // nullptr if disabled
+        std::chrono::steady_clock::time_point m_Opened;                        // metrics: connection accepted
+        std::chrono::steady_clock::time_point m_RequestStart;                  // metrics: first byte of the request arrived
+        std::chrono::steady_clock::time_point m_HandleStart;                   // metrics: request received
+        std::chrono::steady_clock::time_point m_WriteStart;                    // metrics: response ready to be sent
+        size_t m_ReadMark = 0;                                                 // metrics: buffered bytes when the read started
+        bool m_ReadMore = false;                                               // metrics: read again after the first byte of the request
+        uint64_t m_Unmeasured = 0;                                             // metrics: answered requests whose handler was not timed yet
+        boost::asio::ip::address m_Client;                                     // see clientAddress
+        bool m_ClientKnown = false;
+    };
+
+    /**
+     * @brief HTTP/2 connection, multiplexes many requests over one HTTPSession.
+     *
+     * Started by HTTPSession once a client negotiated h2 via ALPN or opened the
+     * connection with the HTTP/2 preface (h2c with prior knowledge), see
+     * HTTPServer::setHTTP2. Every request stream is handled by its own HTTPSession,
+     * so routes, observers and static files work as with HTTP/1.1. Responses of
+     * all streams are interleaved round robin and the frames of many streams are
+     * sent with one gathered write. Cached files are framed without copying them,
+     * other files are read from disk in blocks. Server push and stream priorities
+     * are not supported.
+     */
+    class HTTP2Session : public Object<HTTP2Session>, public std::enable_shared_from_this<HTTP2Session>
+    {
+    public:
+        /**
+         * HTTP2Session constructor.
+         * @param connection Session of the connection, may have buffered the connection preface already.
+         */
+        explicit HTTP2Session(HTTPSession::SPtr connection) :
+            m_Conn(std::move(connection)),
+            m_Settings(clamp(m_Conn->m_Config->HTTP2Settings)),
+            m_Decoder(m_Settings.HeaderTableSize, m_Settings.MaxHeaderListSize),
+            m_RecvWindow(m_Settings.InitialWindowSize)
+        {
+        }
+        /**
+         * Sends the server settings and starts receiving frames.
+         */
+        void run() {
+            std::string settings;
+            auto set = [&](HTTP2::SettingsId id, uint32_t value) {
+                settings.push_back(static_cast<char>(static_cast<uint16_t>(id) >> 8));
+                settings.push_back(static_cast<char>(static_cast<uint16_t>(id)));
+                HTTP2::AppendUInt32(settings, value);
+            };
+            set(HTTP2::SettingsId::MaxConcurrentStreams, m_Settings.MaxConcurrentStreams);
+            set(HTTP2::SettingsId::InitialWindowSize, m_Settings.InitialWindowSize);
+            set(HTTP2::SettingsId::MaxHeaderListSize, m_Settings.MaxHeaderListSize);
+            if(m_Settings.HeaderTableSize != HTTP2::Settings().HeaderTableSize)
+                set(HTTP2::SettingsId::HeaderTableSize, m_Settings.HeaderTableSize);
+            if(m_Settings.MaxFrameSize != HTTP2::DefaultMaxFrameSize)
+                set(HTTP2::SettingsId::MaxFrameSize, m_Settings.MaxFrameSize);
+            HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::Settings, 0, 0, settings);
+            if(m_RecvWindow > HTTP2::DefaultWindowSize) // the connection window is not affected by the settings
+                windowUpdate(0, m_RecvWindow - HTTP2::DefaultWindowSize);
+            process(); // the preface may have been read together with the first frames
+            flush();
+            do_read();
+        }
+        /**
+         * Sends GOAWAY, refuses new streams and closes the connection once the open
+         * streams were completed. Needs to be called on the strand of the connection.
+         */
+        void drain() {
+            if(m_Closing || m_Draining)
+                return;
+            m_Draining = true;
+            std::string payload;
+            HTTP2::AppendUInt32(payload, m_LastStreamId);
+            HTTP2::AppendUInt32(payload, static_cast<uint32_t>(HTTP2::ErrorCode::NoError));
+            HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::GoAway, 0, 0, payload);
+            if(!m_Processing)
+                flush();
+        }
+        using SPtr = std::shared_ptr<HTTP2Session>;
+        using UPtr = std::unique_ptr<HTTP2Session>;
+        using WPtr = std::weak_ptr<HTTP2Session>;
+    private:
+        enum class Source { None, Memory, File, Chunks };
+        struct Stream {
+            HTTPSession::SPtr Session;
+            int64_t SendWindow = 0;       // may become negative if the peer shrinks its window
+            uint32_t RecvWindow = 0;
+            uint32_t RecvConsumed = 0;    // not yet replenished
+            uint64_t Received = 0;        // request body bytes
+            uint64_t Limit = 0;           // request body limit
+            uint64_t ContentLength = std::numeric_limits<uint64_t>::max();
+            bool RemoteClosed = false;    // request complete
+            bool Responded = false;
+            bool SendDone = false;        // END_STREAM queued
+            bool Ready = false;           // in m_Ready
+            bool Drained = false;         // in m_Drained
+            HTTP2::ErrorCode Failed = HTTP2::ErrorCode::NoError;
+            Source Body = Source::None;
+            std::shared_ptr<const void> Owner; // Memory: keeps Data alive
+            const char* Data = nullptr;
+            size_t Remaining = 0;
+            std::shared_ptr<http::response<FileRangeBody>> File;
+            uint64_t FileLeft = 0;        // not yet read from the file
+            std::shared_ptr<std::vector<char>> FileBuf;
+            size_t BufPos = 0;
+            size_t BufLen = 0;
+            uint64_t FillGen = 0;         // flush in which FileBuf was filled
+            HTTPStream::SPtr Chunks;
+            size_t ChunkPos = 0;          // sent bytes of the first queued chunk
+        };
+        static constexpr size_t ReadSize = 64 * 1024;
+        static constexpr size_t Quantum = 128 * 1024;         // per stream and turn, bounds head of line blocking
+        static constexpr size_t MaxWriteSize = 1024 * 1024;   // data frames per gathered write
+        static constexpr size_t MaxPending = 1024 * 1024;     // control frames queued before reading is paused
+        static constexpr size_t FileBufSize = 128 * 1024;
+        static constexpr uint32_t MinResetBudget = 100;       // streams a client may cancel per second, see countReset
+
+        static HTTP2::Settings clamp(HTTP2::Settings s) {
+            s.MaxConcurrentStreams = std::max<uint32_t>(s.MaxConcurrentStreams, 1);
+            s.InitialWindowSize = std::clamp(s.InitialWindowSize, HTTP2::DefaultWindowSize, HTTP2::MaxWindowSize);
+            s.MaxFrameSize = std::clamp(s.MaxFrameSize, HTTP2::DefaultMaxFrameSize, HTTP2::MaxFrameSizeLimit);
+            return s;
+        }
+        void do_read() {
+            if(m_Closing || m_ReadPaused)
+                return;
+            auto handler = boost::asio::bind_executor(m_Conn->m_Strand, [self = shared_from_this()](boost::system::error_code ec, std::size_t bytes_transferred) {
+                self->on_read(ec, bytes_transferred);
+            });
+            if(m_Conn->m_SSL)
+                m_Conn->m_Stream->async_read_some(m_Conn->m_Buffer.prepare(ReadSize), std::move(handler));
+            else
+                m_Conn->m_Socket.async_read_some(m_Conn->m_Buffer.prepare(ReadSize), std::move(handler));
+        }
+        void on_read(boost::system::error_code ec, std::size_t bytes_transferred) {
+            m_Conn->m_Buffer.commit(bytes_transferred);
+            m_Conn->countReceived(bytes_transferred);
+            if(m_Conn->m_Metrics && !m_PrefaceReceived && bytes_transferred > 0 && m_Conn->m_Buffer.size() == bytes_transferred) // h2 via ALPN, nothing was read before
+                m_Conn->measureFirstByte();
+            if(ec)
+                return terminate();
+            if(m_Closing)
+                return;
+            process();
+            flush();
+            if(m_Writing && m_Pending.size() > MaxPending) // e.g. a ping flood, continue once written
+                m_ReadPaused = true;
+            do_read();
+        }
+        void process() {
+            auto& buffer = m_Conn->m_Buffer;
+            const uint8_t* data = static_cast<const uint8_t*>(buffer.data().data());
+            const size_t size = buffer.size();
+            size_t pos = 0;
+            m_Processing = true;
+            if(!m_PrefaceReceived && size >= HTTP2::Preface.size()) {
+                if(std::string_view(reinterpret_cast<const char*>(data), HTTP2::Preface.size()) != HTTP2::Preface)
+                    goAway(HTTP2::ErrorCode::ProtocolError);
+                m_PrefaceReceived = true;
+                pos = HTTP2::Preface.size();
+            }
+            while(m_PrefaceReceived && !m_Closing && size - pos >= HTTP2::FrameHeaderSize) {
+                const HTTP2::FrameHeader h = HTTP2::FrameHeader::parse(data + pos);
+                if(h.Length > m_Settings.MaxFrameSize) {
+                    goAway(HTTP2::ErrorCode::FrameSizeError);
+                    break;
+                }
+                if(size - pos - HTTP2::FrameHeaderSize < h.Length)
+                    break; // incomplete
+                onFrame(h, data + pos + HTTP2::FrameHeaderSize);
+                pos += HTTP2::FrameHeaderSize + h.Length;
+            }
+            buffer.consume(pos);
+            m_Processing = false;
+        }
+        void onFrame(const HTTP2::FrameHeader& h, const uint8_t* p) {
+            if(m_HeaderStream && (h.Type != HTTP2::FrameType::Continuation || h.StreamId != m_HeaderStream))
+                return goAway(HTTP2::ErrorCode::ProtocolError); // header blocks must not be interleaved
+            if(!m_SettingsReceived && h.Type != HTTP2::FrameType::Settings)
+                return goAway(HTTP2::ErrorCode::ProtocolError);
+            switch(h.Type) {
+                case HTTP2::FrameType::Data:
+                    return onData(h, p);
+                case HTTP2::FrameType::Headers:
+                    return onHeaders(h, p);
+                case HTTP2::FrameType::Continuation:
+                    if(!m_HeaderStream)
+                        return goAway(HTTP2::ErrorCode::ProtocolError);
+                    return appendHeaderBlock(h, p, h.Length);
+                case HTTP2::FrameType::Priority:
+                    if(h.StreamId == 0 || h.Length != 5)
+                        return goAway(HTTP2::ErrorCode::ProtocolError);
+                    return;
+                case HTTP2::FrameType::RstStream:
+                    if(h.StreamId == 0 || h.Length != 4 || h.StreamId > m_LastStreamId)
+                        return goAway(HTTP2::ErrorCode::ProtocolError);
+                    if(m_Streams.count(h.StreamId) && !countReset())
+                        return goAway(HTTP2::ErrorCode::EnhanceYourCalm); // rapid reset, the handlers of cancelled streams may still run
+                    return closeStream(h.StreamId);
+                case HTTP2::FrameType::Settings:
+                    return onSettings(h, p);
+                case HTTP2::FrameType::Ping:
+                    if(h.StreamId != 0 || h.Length != 8)
+                        return goAway(HTTP2::ErrorCode::ProtocolError);
+                    if(!(h.Flags & HTTP2::Ack))
+                        HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::Ping, HTTP2::Ack, 0, std::string_view(reinterpret_cast<const char*>(p), 8));
+                    return;
+                case HTTP2::FrameType::GoAway:
+                    if(h.StreamId != 0)
+                        return goAway(HTTP2::ErrorCode::ProtocolError);
+                    return; // the client opens no more streams, the open ones are completed
+                case HTTP2::FrameType::WindowUpdate:
+                    return onWindowUpdate(h, p);
+                case HTTP2::FrameType::PushPromise: // clients must not push
+                    return goAway(HTTP2::ErrorCode::ProtocolError);
+            }
+            // unknown frame types are ignored
+        }
+        void onData(const HTTP2::FrameHeader& h, const uint8_t* p) {
+            if(h.StreamId == 0)
+                return goAway(HTTP2::ErrorCode::ProtocolError);
+            m_RecvConsumed += h.Length; // padding counts as well
+            if(m_RecvConsumed > m_RecvWindow)
+                return goAway(HTTP2::ErrorCode::FlowControlError);
+            if(m_RecvConsumed >= m_RecvWindow / 2) {
+                windowUpdate(0, m_RecvConsumed);
+                m_RecvConsumed = 0;
+            }
+            auto it = m_Streams.find(h.StreamId);
+            if(it == m_Streams.end()) {
+                if(h.StreamId > m_LastStreamId)
+                    goAway(HTTP2::ErrorCode::ProtocolError);
+                return; // closed meanwhile
+            }
+            Stream& st = it->second;
+            size_t len = h.Length;
+            if(h.Flags & HTTP2::Padded) {
+                if(len == 0 || p[0] >= len)
+                    return goAway(HTTP2::ErrorCode::ProtocolError);
+                len -= 1 + p[0];
+                ++p;
+            }
+            if(st.RemoteClosed)
+                return resetStream(h.StreamId, HTTP2::ErrorCode::StreamClosed);
+            st.RecvConsumed += h.Length;
+            if(st.RecvConsumed > st.RecvWindow)
+                return resetStream(h.StreamId, HTTP2::ErrorCode::FlowControlError);
+            st.RemoteClosed = h.Flags & HTTP2::EndStream;
+            if(!st.RemoteClosed && !st.Responded && !st.Session->m_BodyPaused && st.RecvConsumed >= st.RecvWindow / 2) {
+                windowUpdate(h.StreamId, st.RecvConsumed);
+                st.RecvConsumed = 0;
+            }
+            if(!st.Responded && len > 0)
+                receiveBody(st, std::string_view(reinterpret_cast<const char*>(p), len));
+            if(st.RemoteClosed && !st.Responded)
+                endRequest(h.StreamId, st);
+        }
+        void receiveBody(Stream& st, std::string_view data) {
+            HTTPSession& s = *st.Session;
+            st.Received += data.size();
+            if(st.Received > st.Limit) {
+                s.takeRequest();
+                return s.handleRequest(http::error::body_limit);
+            }
+            if(s.m_BodyRoute && (s.m_BodyRoute->Options.OnBody || s.m_BodyRoute->Options.SpoolBody))
+                s.deliverBody(data); // answers on error
+            else
+                s.m_Request.body().append(data);
+        }
+        void resumeBody(uint32_t id) { // the stream's consumer is ready for more, see HTTPSession::pauseBody
+            auto it = m_Streams.find(id);
+            if(it == m_Streams.end())
+                return;
+            Stream& st = it->second;
+            if(st.RemoteClosed || st.Responded || st.RecvConsumed == 0)
+                return;
+            windowUpdate(id, st.RecvConsumed);
+            st.RecvConsumed = 0;
+            if(!m_Processing)
+                flush();
+        }
+        void endRequest(uint32_t id, Stream& st) {
+            if(st.ContentLength != std::numeric_limits<uint64_t>::max() && st.ContentLength != st.Received)
+                return resetStream(id, HTTP2::ErrorCode::ProtocolError); // malformed
+            HTTPSession& s = *st.Session;
+            s.takeRequest();
+            ++s.m_Requests;
+            s.handleRequest({});
+        }
+        void onHeaders(const HTTP2::FrameHeader& h, const uint8_t* p) {
+            if(h.StreamId == 0)
+                return goAway(HTTP2::ErrorCode::ProtocolError);
+            size_t offset = 0, padding = 0;
+            if(h.Flags & HTTP2::Padded) {
+                if(h.Length < 1)
+                    return goAway(HTTP2::ErrorCode::ProtocolError);
+                padding = p[0];
+                offset = 1;
+            }
+            if(h.Flags & HTTP2::PriorityFlag)
+                offset += 5; // stream dependency and weight, not supported
+            if(offset + padding > h.Length)
+                return goAway(HTTP2::ErrorCode::ProtocolError);
+            m_HeaderStream = h.StreamId;
+            m_HeaderEndStream = h.Flags & HTTP2::EndStream;
+            m_HeaderBlock.clear();
+            appendHeaderBlock(h, p + offset, h.Length - offset - padding);
+        }
+        void appendHeaderBlock(const HTTP2::FrameHeader& h, const uint8_t* p, size_t len) {
+            if(m_HeaderBlock.size() + len > static_cast<size_t>(m_Settings.MaxHeaderListSize) + 64 * 1024)
+                return goAway(HTTP2::ErrorCode::EnhanceYourCalm); // endless CONTINUATION frames
+            m_HeaderBlock.append(reinterpret_cast<const char*>(p), len);
+            if(!(h.Flags & HTTP2::EndHeaders))
+                return;
+            const uint32_t id = m_HeaderStream;
+            m_HeaderStream = 0;
+            m_Fields.clear();
+            bool fits = false;
+            try { // decoded even if the stream is refused, to keep the table in sync
+                fits = m_Decoder.decode(reinterpret_cast<const uint8_t*>(m_HeaderBlock.data()), m_HeaderBlock.size(), [&](std::string_view name, std::string_view value) {
+                    m_Fields.emplace_back(name, value);
+                });
+            }
+            catch(const HTTP2::HTTP2Exception&) {
+                return goAway(HTTP2::ErrorCode::CompressionError);
+            }
+            auto it = m_Streams.find(id);
+            if(it != m_Streams.end()) { // trailers, ignored
+                Stream& st = it->second;
+                if(st.RemoteClosed || !m_HeaderEndStream)
+                    return resetStream(id, HTTP2::ErrorCode::ProtocolError);
+                st.RemoteClosed = true;
+                if(!st.Responded)
+                    endRequest(id, st);
+                return;
+            }
+            if(id <= m_LastStreamId || !(id & 1))
+                return goAway(HTTP2::ErrorCode::ProtocolError);
+            m_LastStreamId = id;
+            if(m_Draining || m_Streams.size() >= m_Settings.MaxConcurrentStreams) // opened before the client saw GOAWAY
+                return resetStream(id, HTTP2::ErrorCode::RefusedStream);
+            startRequest(id, fits);
+        }
+        void startRequest(uint32_t id, bool fits) {
+            http::request<http::string_body> req;
+            std::string_view method, scheme, path, authority;
+            std::string cookie;
+            bool pseudo = true;
+            bool malformed = false;
+            for(const auto& field : m_Fields) {
+                const std::string_view name = field.first, value = field.second;
+                if(!name.empty() && name[0] == ':') {
+                    std::string_view* target = name == ":method" ? &method : name == ":scheme" ? &scheme :
+                                               name == ":path" ? &path : name == ":authority" ? &authority : nullptr;
+                    malformed = malformed || !pseudo || !target || !target->empty();
+                    if(target)
+                        *target = value;
+                    continue;
+                }
+                pseudo = false; // pseudo header fields come first
+                malformed = malformed || name.empty() || std::any_of(name.begin(), name.end(), [](char c){ return c >= 'A' && c <= 'Z'; }) ||
+                            name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" ||
+                            name == "upgrade" || (name == "te" && value != "trailers");
+                if(name == "cookie") // may be split into several fields
+                    cookie.append(cookie.empty() ? "" : "; ").append(value);
+                else if(!malformed)
+                    req.insert(boost::beast::string_view(name.data(), name.size()), boost::beast::string_view(value.data(), value.size()));
+            }
+            if(malformed || method.empty() || scheme.empty() || path.empty())
+                return resetStream(id, HTTP2::ErrorCode::ProtocolError);
+            req.method_string(boost::beast::string_view(method.data(), method.size()));
+            req.target(boost::beast::string_view(path.data(), path.size()));
+            req.version(20);
+            if(!authority.empty() && req.find(http::field::host) == req.end())
+                req.set(http::field::host, boost::beast::string_view(authority.data(), authority.size()));
+            if(!cookie.empty())
+                req.set(http::field::cookie, cookie);
+
+            Stream& st = m_Streams[id];
+            st.SendWindow = m_PeerWindow;
+            st.RecvWindow = m_Settings.InitialWindowSize;
+            st.RemoteClosed = m_HeaderEndStream;
+            st.Session = std::make_shared<HTTPSession>(Key<HTTP2Session>(), m_Conn, [self = weak_from_this(), id](const HTTPSession::SPtr& session) {
+                if(auto conn = self.lock())
+                    conn->respond(id, session);
+            });
+            HTTPSession& s = *st.Session;
+            s.m_ResumeBody = [self = weak_from_this(), id]{
+                if(auto conn = self.lock())
+                    conn->resumeBody(id);
+            };
+            s.m_Request = std::move(req);
+            if(m_Conn->m_OnStream)
+                m_Conn->m_OnStream(st.Session);
+            if(!fits)
+                return s.handleRequest(http::error::header_limit);
+            auto cl = s.m_Request.find(http::field::content_length);
+            if(cl != s.m_Request.end()) {
+                const std::string_view value(cl->value().data(), cl->value().size());
+                const auto res = std::from_chars(value.data(), value.data() + value.size(), st.ContentLength);
+                if(value.empty() || value.find_first_not_of("0123456789") != std::string_view::npos || res.ec != std::errc() || res.ptr != value.data() + value.size())
+                    return resetStream(id, HTTP2::ErrorCode::ProtocolError); // e.g. "-1", "+5" or " 5"
+            }
+            st.Limit = s.matchBodyRoute(s.m_Request.method(), s.m_Request.target());
+            if(st.ContentLength != std::numeric_limits<uint64_t>::max() && st.ContentLength > st.Limit)
+                return s.handleRequest(http::error::body_limit);
+            if(s.m_BodyRoute && s.m_BodyRoute->Options.SpoolBody && !s.m_BodyRoute->Options.OnBody && !s.openBodyFile())
+                return s.reject(http::status::internal_server_error, "Cannot create temporary file");
+            if(st.RemoteClosed)
+                endRequest(id, st);
+        }
+        void onSettings(const HTTP2::FrameHeader& h, const uint8_t* p) {
+            if(h.StreamId != 0)
+                return goAway(HTTP2::ErrorCode::ProtocolError);
+            if(h.Flags & HTTP2::Ack)
+                return h.Length == 0 ? void() : goAway(HTTP2::ErrorCode::FrameSizeError);
+            if(h.Length % 6 != 0)
+                return goAway(HTTP2::ErrorCode::FrameSizeError);
+            for(size_t i = 0; i < h.Length; i += 6) {
+                const auto id = static_cast<HTTP2::SettingsId>((p[i] << 8) | p[i + 1]);
+                const uint32_t value = HTTP2::FrameHeader::ReadUInt32(p + i + 2);
+                if(id == HTTP2::SettingsId::HeaderTableSize)
+                    m_Encoder.setMaxTableSize(value);
+                else if(id == HTTP2::SettingsId::EnablePush && value > 1)
+                    return goAway(HTTP2::ErrorCode::ProtocolError);
+                else if(id == HTTP2::SettingsId::InitialWindowSize) {
+                    if(value > HTTP2::MaxWindowSize)
+                        return goAway(HTTP2::ErrorCode::FlowControlError);
+                    const int64_t delta = static_cast<int64_t>(value) - m_PeerWindow;
+                    m_PeerWindow = value;
+                    for(auto& s : m_Streams) {
+                        s.second.SendWindow += delta;
+                        if(s.second.SendWindow > HTTP2::MaxWindowSize)
+                            return goAway(HTTP2::ErrorCode::FlowControlError);
+                        markReady(s.first, s.second);
+                    }
+                }
+                else if(id == HTTP2::SettingsId::MaxFrameSize) {
+                    if(value < HTTP2::DefaultMaxFrameSize || value > HTTP2::MaxFrameSizeLimit)
+                        return goAway(HTTP2::ErrorCode::ProtocolError);
+                    m_PeerMaxFrame = value;
+                }
+            }
+            m_SettingsReceived = true;
+            HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::Settings, HTTP2::Ack, 0);
+        }
+        void onWindowUpdate(const HTTP2::FrameHeader& h, const uint8_t* p) {
+            if(h.Length != 4)
+                return goAway(HTTP2::ErrorCode::FrameSizeError);
+            const uint32_t increment = HTTP2::FrameHeader::ReadUInt32(p) & HTTP2::MaxWindowSize;
+            if(h.StreamId == 0) {
+                m_SendWindow += increment;
+                if(increment == 0 || m_SendWindow > HTTP2::MaxWindowSize)
+                    return goAway(increment ? HTTP2::ErrorCode::FlowControlError : HTTP2::ErrorCode::ProtocolError);
+                for(auto& s : m_Streams)
+                    markReady(s.first, s.second);
+                return;
+            }
+            auto it = m_Streams.find(h.StreamId);
+            if(it == m_Streams.end())
+                return;
+            it->second.SendWindow += increment;
+            if(increment == 0 || it->second.SendWindow > HTTP2::MaxWindowSize)
+                return resetStream(h.StreamId, increment ? HTTP2::ErrorCode::FlowControlError : HTTP2::ErrorCode::ProtocolError);
+            markReady(h.StreamId, it->second);
+        }
+        void windowUpdate(uint32_t id, uint32_t increment) {
+            std::string payload;
+            HTTP2::AppendUInt32(payload, increment);
+            HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::WindowUpdate, 0, id, payload);
+        }
+        void markReady(uint32_t id, Stream& st) {
+            if(st.Ready || !st.Responded)
+                return;
+            st.Ready = true;
+            m_Ready.push_back(id);
+        }
+        void respond(uint32_t id, const HTTPSession::SPtr& session) {
+            auto it = m_Streams.find(id);
+            if(it == m_Streams.end() || it->second.Responded)
+                return; // reset by the client meanwhile
+            Stream& st = it->second;
+            HTTPSession& s = *session;
+            st.Responded = true;
+            const http::response_header<>* header = &s.m_Result;
+            if(s.m_CannedResult)
+                s.getResult(); // parsed back, the HTTP/1.1 head does not apply
+            if(s.m_CustomResult || s.m_CannedResult || !(s.m_FileResult || s.m_StreamResult || s.m_ChunkStream)) {
+                auto body = std::make_shared<std::vector<char>>(std::move(s.m_Result.body()));
+                st.Data = body->data();
+                st.Remaining = body->size();
+                st.Owner = std::move(body);
+                st.Body = Source::Memory;
+            }
+            else if(s.m_FileResult) { // shares the cached buffer
+                header = s.m_FileResult.get();
+                const auto& body = s.m_FileResult->body();
+                if(body.Data) {
+                    st.Data = body.Data->data() + body.Offset;
+                    st.Remaining = body.Size;
+                    st.Owner = body.Data;
+                }
+                st.Body = Source::Memory;
+            }
+            else if(s.m_StreamResult) {
+                header = s.m_StreamResult.get();
+                st.File = s.m_StreamResult;
+                st.FileLeft = st.File->body().Size;
+                boost::beast::error_code ec;
+                if(st.FileLeft > 0)
+                    st.File->body().File.seek(st.File->body().Offset, ec);
+                st.Failed = ec ? HTTP2::ErrorCode::InternalError : HTTP2::ErrorCode::NoError; // reset by flush
+                st.Body = Source::File;
+            }
+            else {
+                header = s.m_ChunkHeader.get();
+                st.Chunks = s.m_ChunkStream;
+                st.Chunks->m_Pump = [self = weak_from_this(), id]{ // replaces the HTTP/1.1 writer
+                    if(auto conn = self.lock())
+                        conn->wake(id);
+                };
+                st.Body = Source::Chunks;
+            }
+            if(s.m_Request.method() == http::verb::head) {
+                st.Body = Source::None;
+                st.Remaining = 0;
+                st.FileLeft = 0;
+            }
+            m_Block.clear();
+            char status[4];
+            std::snprintf(status, sizeof(status), "%03u", header->result_int() % 1000);
+            m_Encoder.encode(m_Block, ":status", status);
+            for(const auto& field : *header) {
+                const auto name = field.name_string();
+                m_Name.resize(name.size());
+                std::transform(name.begin(), name.end(), m_Name.begin(), [](char c){ return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+                if(m_Name == "connection" || m_Name == "keep-alive" || m_Name == "proxy-connection" || m_Name == "transfer-encoding" || m_Name == "upgrade")
+                    continue; // connection specific, not allowed in HTTP/2
+                const bool index = !(m_Name == "content-length" || m_Name == "content-range" || m_Name == "etag" || m_Name == "last-modified" ||
+                                     m_Name == "date" || m_Name == "set-cookie" || m_Name == "age"); // values unlikely to repeat
+                m_Encoder.encode(m_Block, m_Name, std::string_view(field.value().data(), field.value().size()), index);
+            }
+            const bool empty = st.Body == Source::None || (st.Body == Source::Memory && st.Remaining == 0) || (st.Body == Source::File && st.FileLeft == 0);
+            appendHeaders(id, empty);
+            if(empty) {
+                st.SendDone = true;
+                if(st.Chunks && st.Body == Source::None)
+                    st.Chunks->closed();
+            }
+            st.Ready = true; // completed or sent by flush
+            m_Ready.push_back(id);
+            if(!m_Processing)
+                flush();
+        }
+        void appendHeaders(uint32_t id, bool endStream) { // split into HEADERS and CONTINUATION frames
+            const std::string_view block = m_Block;
+            size_t len = std::min<size_t>(block.size(), m_PeerMaxFrame);
+            uint8_t flags = (endStream ? HTTP2::EndStream : 0) | (len == block.size() ? HTTP2::EndHeaders : 0);
+            HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::Headers, flags, id, block.substr(0, len));
+            for(size_t pos = len; pos < block.size(); pos += len) {
+                len = std::min<size_t>(block.size() - pos, m_PeerMaxFrame);
+                HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::Continuation, pos + len == block.size() ? HTTP2::EndHeaders : 0, id, block.substr(pos, len));
+            }
+        }
+        void wake(uint32_t id) { // chunks were queued, the stream was finished or closed
+            auto it = m_Streams.find(id);
+            if(it == m_Streams.end())
+                return;
+            if(it->second.Chunks->m_Aborted)
+                resetStream(id, HTTP2::ErrorCode::Cancel);
+            else
+                markReady(id, it->second);
+            if(!m_Processing)
+                flush();
+        }
+        void flush() {
+            if(m_Writing || m_Terminated)
+                return;
+            m_Keep.clear();
+            m_Hold.clear();
+            m_FrameHeaders.clear();
+            m_Buffers.clear();
+            ++m_FlushGen;
+            hold();
+            size_t budget = MaxWriteSize;
+            for(bool progress = true; progress && budget > 0 && m_SendWindow > 0 && !m_Ready.empty(); ) { // round robin
+                progress = false;
+                for(size_t n = m_Ready.size(); n > 0 && budget > 0 && m_SendWindow > 0; --n) { // streams keep their turn while the connection window is exhausted
+                    const uint32_t id = m_Ready.front();
+                    m_Ready.pop_front();
+                    auto it = m_Streams.find(id);
+                    if(it == m_Streams.end())
+                        continue;
+                    Stream& st = it->second;
+                    st.Ready = false;
+                    const size_t before = budget;
+                    const bool more = produce(id, st, budget);
+                    if(st.Failed != HTTP2::ErrorCode::NoError)
+                        resetStream(id, st.Failed);
+                    else if(st.SendDone)
+                        complete(it);
+                    else if(more) {
+                        st.Ready = true;
+                        m_Ready.push_back(id);
+                    }
+                    progress = progress || budget != before;
+                }
+            }
+            hold(); // e.g. RST_STREAM of completed streams
+            if(m_Buffers.empty()) {
+                if(m_Closing || (m_Draining && m_Streams.empty()))
+                    return shutdown();
+                m_Conn->setTimeout(m_Conn->m_Config->Timeouts.Idle);
+                return;
+            }
+            m_Writing = true;
+            m_Conn->setTimeout(m_Conn->m_Config->Timeouts.Write);
+            auto handler = boost::asio::bind_executor(m_Conn->m_Strand, [self = shared_from_this()](boost::system::error_code ec, std::size_t bytes_transferred) {
+                self->m_Conn->countSent(bytes_transferred);
+                self->on_write(ec);
+            });
+            if(m_Conn->m_SSL)
+                boost::asio::async_write(*m_Conn->m_Stream, m_Buffers, std::move(handler));
+            else
+                boost::asio::async_write(m_Conn->m_Socket, m_Buffers, std::move(handler));
+        }
+        void hold() { // control frames are written in order with the data
+            if(m_Pending.empty())
+                return;
+            m_Hold.push_back(std::move(m_Pending));
+            m_Pending.clear();
+            m_Buffers.emplace_back(m_Hold.back().data(), m_Hold.back().size());
+        }
+        bool produce(uint32_t id, Stream& st, size_t& budget) { // returns true if the stream could send more
+            const size_t quantum = std::min(Quantum, budget);
+            size_t produced = 0;
+            while(!st.SendDone) {
+                const char* data = nullptr;
+                size_t avail = 0;
+                bool last = true; // data is the rest of the body
+                if(st.Body == Source::Memory) {
+                    data = st.Data;
+                    avail = st.Remaining;
+                }
+                else if(st.Body == Source::File) {
+                    if(st.BufPos == st.BufLen && st.FileLeft > 0) {
+                        if(st.FillGen == m_FlushGen)
+                            return true; // the buffer is part of this write
+                        if(!st.FileBuf)
+                            st.FileBuf = std::make_shared<std::vector<char>>(FileBufSize);
+                        boost::beast::error_code ec;
+                        const size_t n = st.File->body().File.read(st.FileBuf->data(), static_cast<size_t>(std::min<uint64_t>(st.FileLeft, FileBufSize)), ec);
+                        if(ec || n == 0) { // n == 0: file was truncated meanwhile
+                            st.Failed = HTTP2::ErrorCode::InternalError;
+                            return false;
+                        }
+                        st.FileLeft -= n;
+                        st.BufPos = 0;
+                        st.BufLen = n;
+                        st.FillGen = m_FlushGen;
+                    }
+                    data = st.FileBuf ? st.FileBuf->data() + st.BufPos : nullptr;
+                    avail = st.BufLen - st.BufPos;
+                    last = st.FileLeft == 0;
+                }
+                else if(st.Body == Source::Chunks) {
+                    HTTPStream& chunks = *st.Chunks;
+                    if(chunks.m_Aborted) {
+                        st.Failed = HTTP2::ErrorCode::Cancel;
+                        return false;
+                    }
+                    if(chunks.m_Queue.empty()) {
+                        if(!chunks.m_Finishing) {
+                            if(!st.Drained && chunks.m_OnDrain) {
+                                st.Drained = true;
+                                m_Drained.push_back(id);
+                            }
+                            return false; // woken up by the next write
+                        }
+                    }
+                    else { // the chunk framing of HTTP/1.1 is stripped
+                        const std::string& chunk = *chunks.m_Queue.front();
+                        const size_t start = chunk.find("\r\n") + 2;
+                        data = chunk.data() + start + st.ChunkPos;
+                        avail = chunk.size() - start - 2 - st.ChunkPos;
+                        last = chunks.m_Finishing && chunks.m_Queue.size() == 1;
+                    }
+                }
+                if(avail == 0 && !last && st.Body == Source::Chunks) { // empty chunk
+                    popChunk(st);
+                    continue;
+                }
+                const int64_t window = std::min(m_SendWindow, st.SendWindow);
+                if(avail > 0 && window <= 0)
+                    return m_SendWindow <= 0 && st.SendWindow > 0; // continued on WINDOW_UPDATE, in turn if only the connection window is exhausted
+                if(avail > 0 && produced >= quantum)
+                    return true;
+                const size_t n = static_cast<size_t>(std::min<uint64_t>({avail, m_PeerMaxFrame, static_cast<uint64_t>(std::max<int64_t>(window, 0)), quantum - std::min(produced, quantum)}));
+                const bool end = last && n == avail;
+                if(n == 0 && !end)
+                    return false;
+                m_FrameHeaders.emplace_back();
+                HTTP2::FrameHeader{static_cast<uint32_t>(n), HTTP2::FrameType::Data, static_cast<uint8_t>(end ? HTTP2::EndStream : 0), id}.write(m_FrameHeaders.back().data());
+                m_Buffers.emplace_back(m_FrameHeaders.back().data(), HTTP2::FrameHeaderSize);
+                if(n > 0)
+                    m_Buffers.emplace_back(data, n);
+                m_SendWindow -= static_cast<int64_t>(n);
+                st.SendWindow -= static_cast<int64_t>(n);
+                produced += n;
+                budget -= std::min(budget, n);
+                if(st.Body == Source::Memory) {
+                    st.Data += n;
+                    st.Remaining -= n;
+                }
+                else if(st.Body == Source::File)
+                    st.BufPos += n;
+                else if(st.Body == Source::Chunks && avail > 0) {
+                    st.ChunkPos += n;
+                    if(n == avail)
+                        popChunk(st);
+                }
+                st.SendDone = end;
+            }
+            return false;
+        }
+        void popChunk(Stream& st) {
+            HTTPStream& chunks = *st.Chunks;
+            chunks.m_Queued.fetch_sub(chunks.m_Queue.front()->size(), std::memory_order_relaxed);
+            m_Keep.push_back(std::move(chunks.m_Queue.front())); // part of this write
+            chunks.m_Queue.pop_front();
+            st.ChunkPos = 0;
+            st.Drained = false;
+        }
+        void complete(std::map<uint32_t, Stream>::iterator it) {
+            if(!it->second.RemoteClosed) // the rest of the request body is not needed
+                rstStream(it->first, HTTP2::ErrorCode::NoError);
+            release(it);
+        }
+        void release(std::map<uint32_t, Stream>::iterator it) {
+            if(it->second.Chunks)
+                it->second.Chunks->closed();
+            m_Keep.push_back(std::make_shared<Stream>(std::move(it->second))); // buffers may be part of the current write
+            m_Streams.erase(it);
+        }
+        void rstStream(uint32_t id, HTTP2::ErrorCode code) {
+            std::string payload;
+            HTTP2::AppendUInt32(payload, static_cast<uint32_t>(code));
+            HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::RstStream, 0, id, payload);
+        }
+        void resetStream(uint32_t id, HTTP2::ErrorCode code) {
+            rstStream(id, code);
+            closeStream(id);
+        }
+        bool countReset() { // false if the client cancels more streams per second than it may open at once, or MinResetBudget
+            const auto now = std::chrono::steady_clock::now();
+            if(now - m_ResetWindow >= std::chrono::seconds(1)) {
+                m_ResetWindow = now;
+                m_Resets = 0;
+            }
+            return ++m_Resets <= std::max(m_Settings.MaxConcurrentStreams, MinResetBudget);
+        }
+        void closeStream(uint32_t id) {
+            auto it = m_Streams.find(id);
+            if(it != m_Streams.end())
+                release(it);
+        }
+        void on_write(boost::system::error_code ec) {
+            m_Writing = false;
+            if(ec)
+                return terminate();
+            std::deque<uint32_t> drained;
+            drained.swap(m_Drained);
+            m_Processing = true; // flushed once below
+            for(uint32_t id : drained) {
+                auto it = m_Streams.find(id);
+                if(it == m_Streams.end() || !it->second.Drained)
+                    continue;
+                it->second.Drained = false;
+                auto fn = it->second.Chunks->m_OnDrain;
+                if(!fn || !it->second.Chunks->m_Queue.empty())
+                    continue;
+                try {
+                    fn();
+                }
+                catch(...) { // the response is already underway, all that is left is to abort it
+                    resetStream(id, HTTP2::ErrorCode::InternalError);
+                }
+            }
+            m_Processing = false;
+            if(m_ReadPaused && !m_Closing) {
+                m_ReadPaused = false;
+                do_read();
+            }
+            flush();
+        }
+        void goAway(HTTP2::ErrorCode code) {
+            if(m_Closing)
+                return;
+            m_Closing = true;
+            std::string payload;
+            HTTP2::AppendUInt32(payload, m_LastStreamId);
+            HTTP2::AppendUInt32(payload, static_cast<uint32_t>(code));
+            HTTP2::AppendFrame(m_Pending, HTTP2::FrameType::GoAway, 0, 0, payload);
+            while(!m_Streams.empty())
+                release(m_Streams.begin());
+            m_Ready.clear();
+            if(!m_Processing)
+                flush();
+        }
+        void shutdown() { // after GOAWAY was sent
+            if(m_Terminated)
+                return;
+            m_Terminated = true;
+            boost::system::error_code ec;
+            if(!m_Conn->m_SSL)
+                m_Conn->m_Socket.shutdown(tcp::socket::shutdown_send, ec);
+            else
+                m_Conn->m_Stream->async_shutdown(boost::asio::bind_executor(m_Conn->m_Strand, [self = shared_from_this()](boost::system::error_code){}));
+        }
+        void terminate() { // the connection failed or timed out
+            m_Closing = true;
+            m_Terminated = true;
+            while(!m_Streams.empty())
+                release(m_Streams.begin());
+            m_Ready.clear();
+            boost::system::error_code ec;
+            m_Conn->m_Socket.shutdown(tcp::socket::shutdown_both, ec);
+            m_Conn->m_Socket.close(ec);
+        }
+
+        HTTPSession::SPtr m_Conn;
+        HTTP2::Settings m_Settings;
+        HTTP2::HPACKDecoder m_Decoder;
+        HTTP2::HPACKEncoder m_Encoder;
+        uint32_t m_RecvWindow;                             // connection window announced to the client
+        uint32_t m_RecvConsumed = 0;
+        int64_t m_SendWindow = HTTP2::DefaultWindowSize;   // connection window granted by the client
+        uint32_t m_PeerWindow = HTTP2::DefaultWindowSize;  // initial stream window granted by the client
+        uint32_t m_PeerMaxFrame = HTTP2::DefaultMaxFrameSize;
+        uint32_t m_LastStreamId = 0;
+        std::chrono::steady_clock::time_point m_ResetWindow; // see countReset
+        uint32_t m_Resets = 0;
+        uint32_t m_HeaderStream = 0;                       // header block in progress
+        bool m_HeaderEndStream = false;
+        std::string m_HeaderBlock;
+        std::vector<std::pair<std::string, std::string>> m_Fields;
+        std::string m_Block;                               // reused while encoding
+        std::string m_Name;
+        std::map<uint32_t, Stream> m_Streams;
+        std::deque<uint32_t> m_Ready;                      // streams with data to send, round robin
+        std::deque<uint32_t> m_Drained;                    // streams to call HTTPStream::setOnDrain for
+        std::string m_Pending;                             // control and header frames to send
+        std::deque<std::string> m_Hold;                    // part of the current write
+        std::deque<std::array<uint8_t, HTTP2::FrameHeaderSize>> m_FrameHeaders;
+        std::vector<boost::asio::const_buffer> m_Buffers;
+        std::vector<std::shared_ptr<const void>> m_Keep;   // keeps buffers of the current write alive
+        uint64_t m_FlushGen = 0;
+        bool m_Writing = false;
+        bool m_Processing = false;                         // responses are flushed once the input was processed
+        bool m_ReadPaused = false;
+        bool m_Closing = false;
+        bool m_Draining = false;                           // GOAWAY sent, open streams are completed
+        bool m_Terminated = false;
+        bool m_PrefaceReceived = false;
+        bool m_SettingsReceived = false;
+    };
+
+    inline void HTTPSession::startHTTP2() {
+        auto session = std::make_shared<HTTP2Session>(this->shared_from_this());
+        m_HTTP2 = session;
+        session->run();
+        if(m_Draining)
+            session->drain();
+    }
+
+    inline void HTTPSession::on_drain() {
+        if(m_Draining || m_TimedOut || m_Responder)
+            return;
+        m_Draining = true;
+        if(auto session = m_HTTP2.lock())
+            session->drain();
+        else if(m_Idle && m_Buffer.size() == 0)
+            abort();
+    }
+
+    /**
+     * @brief Publishes Server-Sent Events to many clients.
+     *
+     * Every event is encoded once and the same buffer is queued on all subscribed
+     * streams. Clients which fall behind by more than the configured number of
+     * queued bytes are disconnected instead of buffering without bounds, they
+     * may reconnect using the Last-Event-ID header. Call ping() more often than
+     * HTTPTimeouts::Idle to keep quiet channels open.
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  #include <HTTPServer.h>
+     *
+     *  using namespace giri;
+     *
+     *  int main()
+     *  {
+     *      auto events = std::make_shared<SSEChannel>();
+     *      HTTPServer::SPtr server = std::make_shared<HTTPServer>("0.0.0.0", "8080", "/var/www", 2);
+     *      server->route(boost::beast::http::verb::get, "/events", [events](HTTPSession::SPtr session, const RouteParams&){
+     *          events->subscribe(session);
+     *      });
+     *      server->run();
+     *      for(int i = 0; ; ++i) {
+     *          events->publish("tick " + std::to_string(i), "tick", std::to_string(i));
+     *          std::this_thread::sleep_for(std::chrono::seconds(1));
+     *      }
+     *  }
+     *  @endcode
+     */
+    class SSEChannel : public Object<SSEChannel>
+    {
+    public:
+        /**
+         * SSEChannel constructor.
+         * @param maxQueued Maximum number of bytes queued per client before it gets disconnected.
+         */
+        explicit SSEChannel(size_t maxQueued = 1024 * 1024) :
+            m_MaxQueued(maxQueued)
+        {
+        }
+        /**
+         * Answers a request with an event stream and adds it to the channel.
+         * Intended to be used by route handlers.
+         * @param session Session of the request.
+         * @returns The event stream, e.g. to send an initial event only to this client.
+         */
+        HTTPStream::SPtr subscribe(const HTTPSession::SPtr& session) {
+            http::fields headers;
+            headers.set(http::field::cache_control, "no-cache");
+            headers.set("X-Accel-Buffering", "no");
+            HTTPStream::SPtr stream = session->stream(http::status::ok, "text/event-stream", headers);
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Streams.push_back(stream);
+            return stream;
+        }
+        /**
+         * Sends an event to all clients.
+         * @param data Data of the event, may span multiple lines.
+         * @param event Event type. (optional)
+         * @param id Event id, sent back by reconnecting clients. (optional)
+         * @returns Number of clients the event was queued for.
+         */
+        size_t publish(std::string_view data, std::string_view event = {}, std::string_view id = {}) {
+            return broadcast(HTTPStream::encodeChunk(encode(data, event, id)));
         }
         /**
-         * Add additional mimetypes. Only affects new requests within this HTTPSession.
-         * @param mimeTypes Additional mimetypes to add.
+         * Sends a comment to all clients, keeps idle connections open through proxies
+         * and detects disconnected clients.
+         * @returns Number of clients the comment was queued for.
          */
-        void addMimeTypes(const std::map<std::string, std::string>& mimeTypes) {
-            m_MimeTypes.insert(mimeTypes.begin(), mimeTypes.end());
+        size_t ping() {
+            static const auto comment = HTTPStream::encodeChunk(": ping\n\n");
+            return broadcast(comment);
         }
         /**
-         * Close http session.
+         * Ends all event streams.
          */
         void close() {
-            if(!m_Ec)
-                if(m_SSL) 
-                    {if(m_Socket.is_open()){m_Stream->async_shutdown(boost::asio::bind_executor(m_Strand,std::bind(&HTTPSession::on_shutdown,this->shared_from_this(),std::placeholders::_1)));}}
-                else
-                    {if(m_Socket.is_open()){m_Socket.shutdown(tcp::socket::shutdown_send, m_Ec);}}
-        }
-        using SPtr = std::shared_ptr<HTTPSession>;
-        using UPtr = std::unique_ptr<HTTPSession>;
-        using WPtr = std::weak_ptr<HTTPSession>;
-    private:
-        void on_read(boost::system::error_code ec, std::size_t bytes_transferred) {
-            boost::ignore_unused(bytes_transferred);
-            m_Ec = ec;
-            if(!ec)
+            std::vector<HTTPStream::WPtr> streams;
             {
-                if(m_Request.method() != http::verb::get && m_Request.method() != http::verb::head){
-                    m_Result = {http::status::bad_request, m_Request.version()};
-                    m_Result.set(http::field::server, m_ServerString);
-                    m_Result.set(http::field::content_type, "text/html");
-                    m_Result.keep_alive(m_Request.keep_alive());
-                    std::string msg = "Unknown HTTP-method";
-                    m_Result.body().assign(msg.begin(), msg.end());
-                    m_Result.prepare_payload();
-                }
-                else if(m_Request.target().empty() || m_Request.target()[0] != '/' || m_Request.target().find("..") != boost::beast::string_view::npos) {
-                    m_Result = {http::status::bad_request, m_Request.version()};
-                    m_Result.set(http::field::server, m_ServerString);
-                    m_Result.set(http::field::content_type, "text/html");
-                    m_Result.keep_alive(m_Request.keep_alive());
-                    std::string msg = "Illegal request-target";
-                    m_Result.body().assign(msg.begin(), msg.end());
-                    m_Result.prepare_payload();
-                }
-                else {
-                    std::error_code fEc;
-                    std::filesystem::path path = m_DocRoot;
-                    path += std::string{m_Request.target()};
-                    if(m_Request.target().back() == '/')
-                        path.append(m_IndexFile);
-                    else if((m_Request.target().back() != '/') && std::filesystem::is_directory(path, fEc)) {
-                        path += "/";
-                        path.append(m_IndexFile);
-                    }
-                    if(!std::filesystem::exists(path, fEc)){
-                        m_Result = {http::status::not_found, m_Request.version()};
-                        m_Result.set(http::field::server, m_ServerString);
-                        m_Result.set(http::field::content_type, "text/html");
-                        m_Result.keep_alive(m_Request.keep_alive());
-                        std::string msg = "The resource '" + std::string{m_Request.target()} + "' was not found.";
-                        m_Result.body().assign(msg.begin(), msg.end());
-                        m_Result.prepare_payload();
-                    }
-                    else if(fEc)
-                    {
-                        m_Result = {http::status::internal_server_error, m_Request.version()};
-                        m_Result.set(http::field::server, m_ServerString);
-                        m_Result.set(http::field::content_type, "text/html");
-                        m_Result.keep_alive(m_Request.keep_alive());
-                        std::string msg = "An error occurred: '" + fEc.message() + "'";
-                        m_Result.body().assign(msg.begin(), msg.end());
-                        m_Result.prepare_payload(); 
-                    }
-                    else {
-                        try{
-                            std::vector<char> sfile = FileSystem::LoadFile(path);
-                            if(m_Request.method() == http::verb::head)
-                                m_Result = {http::status::ok, m_Request.version()};
-                            else {
-                                m_Result = {http::status::ok, m_Request.version()};
-                                m_Result.body() = sfile;
-                            }
-                            m_MimeTypes.try_emplace(path.extension().string(), "application/text");
-                            m_Result.set(http::field::server, m_ServerString);
-                            m_Result.set(http::field::content_type, m_MimeTypes[path.extension().string()]);
-                            m_Result.keep_alive(m_Request.keep_alive());
-                            m_Result.prepare_payload();
-                        }
-                        catch(const ExceptionBase& e)
-                        {
-                            m_Result = {http::status::internal_server_error, m_Request.version()};
-                            m_Result.set(http::field::server, m_ServerString);
-                            m_Result.set(http::field::content_type, "text/html");
-                            m_Result.keep_alive(m_Request.keep_alive());
-                            std::string msg = "An error occurred: '" + e.getMessage() + "'";
-                            m_Result.body().assign(msg.begin(), msg.end());
-                            m_Result.prepare_payload();
-                        }
-                        catch(...)
-                        {
-                            m_Result = {http::status::internal_server_error, m_Request.version()};
-                            m_Result.set(http::field::server, m_ServerString);
-                            m_Result.set(http::field::content_type, "text/html");
-                            m_Result.keep_alive(m_Request.keep_alive());
-                            std::string msg = "An unknown error occurred.";
-                            m_Result.body().assign(msg.begin(), msg.end());
-                            m_Result.prepare_payload();
-                        }
-                    }
-                }
-            }
-            else if(ec == http::error::end_of_stream)
-                return close();
-            else {
-                m_Result = {http::status::internal_server_error, m_Request.version()};
-                m_Result.set(http::field::server, m_ServerString);
-                m_Result.set(http::field::content_type, "text/html");
-                m_Result.keep_alive(m_Request.keep_alive());
-                std::string msg = "An error occurred: '" + ec.message() + "'";
-                m_Result.body().assign(msg.begin(), msg.end());
-                m_Result.prepare_payload(); 
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                streams.swap(m_Streams);
             }
-            m_Buffer.consume(m_Buffer.size()); // clear buffer
-            notify(); // notify all subscribed observers
-            if(m_SSL)
-                http::async_write(*m_Stream, m_Result, boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_write, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2, m_Result.need_eof())));
-            else
-                http::async_write(m_Socket, m_Result, boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_write, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2, m_Result.need_eof())));
+            for(auto& s : streams)
+                if(auto stream = s.lock())
+                    stream->finish();
         }
-        void do_read() {
-            m_Request = {};
-            if(m_SSL)
-                {if(m_Socket.is_open()){http::async_read(*m_Stream, m_Buffer, m_Request, boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_read, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2)));}}
-            else
-                {if(m_Socket.is_open()){http::async_read(m_Socket, m_Buffer, m_Request, boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_read, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2)));}}
+        /**
+         * @returns Number of subscribed clients, including ones disconnected since the last publish.
+         */
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            return m_Streams.size();
         }
-        void on_write(boost::system::error_code ec, std::size_t bytes_transferred, bool close) {
-            boost::ignore_unused(bytes_transferred);
-            if(ec == boost::beast::errc::broken_pipe)
-                return this->close();
-            else if(ec)
-                throw HTTPServerException("Write: " + ec.message());
-            if(close)
-                return this->close();
-            m_Result.clear();
-            do_read();
+        /**
+         * Encodes a Server-Sent Event.
+         * @param data Data of the event, may span multiple lines.
+         * @param event Event type. (optional)
+         * @param id Event id. (optional)
+         * @returns The encoded event.
+         */
+        static std::string encode(std::string_view data, std::string_view event = {}, std::string_view id = {}) {
+            std::string msg;
+            msg.reserve(data.size() + event.size() + id.size() + 32);
+            if(!id.empty())
+                msg.append("id: ").append(id).append("\n");
+            if(!event.empty())
+                msg.append("event: ").append(event).append("\n");
+            size_t pos = 0;
+            do {
+                size_t end = std::min(data.find('\n', pos), data.size());
+                std::string_view line = data.substr(pos, end - pos);
+                if(!line.empty() && line.back() == '\r')
+                    line.remove_suffix(1);
+                msg.append("data: ").append(line).append("\n");
+                pos = end + 1;
+            } while(pos <= data.size());
+            msg.append("\n");
+            return msg;
         }
-        void on_handshake(boost::system::error_code ec) {
-            if(ec){
-                m_Result = {http::status::internal_server_error, m_Request.version()};
-                m_Result.set(http::field::server, m_ServerString);
-                m_Result.set(http::field::content_type, "text/html");
-                m_Result.keep_alive(m_Request.keep_alive());
-                std::string msg = "An error occurred during SSL handshake: '" + ec.message() + "'";
-                m_Result.body().assign(msg.begin(), msg.end());
-                m_Result.prepare_payload();
-                http::async_write(m_Socket, m_Result, boost::asio::bind_executor(m_Strand, std::bind(&HTTPSession::on_write, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2, m_Result.need_eof())));
+        using SPtr = std::shared_ptr<SSEChannel>;
+        using UPtr = std::unique_ptr<SSEChannel>;
+        using WPtr = std::weak_ptr<SSEChannel>;
+    private:
+        size_t broadcast(const std::shared_ptr<const std::string>& chunk) {
+            std::vector<HTTPStream::SPtr> streams;
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                streams.reserve(m_Streams.size());
+                auto it = std::remove_if(m_Streams.begin(), m_Streams.end(), [&](const HTTPStream::WPtr& s){
+                    auto stream = s.lock();
+                    if(!stream || !stream->isOpen())
+                        return true;
+                    streams.push_back(std::move(stream));
+                    return false;
+                });
+                m_Streams.erase(it, m_Streams.end());
             }
-            else{
-                do_read();
+            size_t sent = 0;
+            for(auto& stream : streams) {
+                if(stream->getQueuedBytes() > m_MaxQueued)
+                    stream->close(); // too slow, drop it
+                else if(stream->writeEncoded(chunk))
+                    ++sent;
             }
+            return sent;
         }
-        void on_shutdown(boost::system::error_code ec) {
-            if(ec && ec != boost::beast::errc::broken_pipe)
-                throw HTTPServerException("Shutdown: " + ec.message());
-        }
-        tcp::socket m_Socket;
-        std::filesystem::path m_DocRoot;
-        bool m_SSL;
-        std::shared_ptr< ssl::stream<tcp::socket&> > m_Stream;
-        boost::asio::strand<boost::asio::io_context::executor_type> m_Strand;
-        boost::beast::flat_buffer m_Buffer;
-        http::request<http::string_body> m_Request;
-        ssl::context m_Ctx{ssl::context::sslv23};
-        boost::system::error_code m_Ec;
-        http::response<http::vector_body<char>> m_Result;
-        std::string m_ServerString;
-        std::string m_IndexFile;
-        std::map<std::string, std::string> m_MimeTypes;
+
+        const size_t m_MaxQueued;
+        mutable std::mutex m_Mutex;
+        std::vector<HTTPStream::WPtr> m_Streams;
     };
 
     /**
@@ -449,64 +3446,88 @@ namespace giri {
         HTTPServer(const std::string& address = "0.0.0.0", const std::string& port = "80", const std::filesystem::path& docRoot = "./", const size_t numThreads = 0, bool ssl = false, const std::filesystem::path& cert = "", const std::filesystem::path& key = "", const std::map<std::string, std::string>& mimeTypes = {}, const std::string& indexFile = "index.html", const std::string& serverString = "giris_supportlib_http_server") : 
             m_Endpoint(boost::asio::ip::make_address(address), 
                        std::atoi(port.c_str())),
-            m_DocRoot(docRoot),
+            m_Ioc(numThreads),
             m_NumThreads(numThreads),
             m_SSL(ssl),
             m_Cert(cert),
             m_Key(key),
-            m_MimeTypes(mimeTypes),
-            m_IndexFile(indexFile),
-            m_ServerString(serverString),
-            m_Ioc(numThreads),
             m_Acceptor(m_Ioc),
-            m_Socket(m_Ioc)
+            m_Socket(m_Ioc),
+            m_AcceptStrand(boost::asio::make_strand(m_Ioc)),
+            m_AcceptTimer(m_AcceptStrand)
         {
             boost::system::error_code ec;
-            m_Acceptor.open(m_Endpoint.protocol(), ec);
-            if(ec)
-                throw HTTPServerException("Open: " + ec.message());
-            m_Acceptor.set_option(boost::asio::socket_base::reuse_address(true));
-            if(ec)
-                throw HTTPServerException("Set Option: " + ec.message());
-            m_Acceptor.bind(m_Endpoint, ec);
-            if(ec)
-                throw HTTPServerException("Bind: " + ec.message());
-            m_Acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
-            if(ec)
-                throw HTTPServerException("Listen: " + ec.message());
-            m_MimeTypes.try_emplace(".htm","text/html");
-            m_MimeTypes.try_emplace(".html", "text/html");
-            m_MimeTypes.try_emplace(".php", "text/html");
-            m_MimeTypes.try_emplace(".txt", "text/plain");
-            m_MimeTypes.try_emplace(".css", "text/css");
-            m_MimeTypes.try_emplace(".map", "text/map");
-            m_MimeTypes.try_emplace(".js", "application/javascript");
-            m_MimeTypes.try_emplace(".json","application/json");
-            m_MimeTypes.try_emplace(".xml","application/xml");
-            m_MimeTypes.try_emplace(".swf", "application/x-shockwave-flash");
-            m_MimeTypes.try_emplace(".flv", "video/x-flv");
-            m_MimeTypes.try_emplace(".png", "image/png");
-            m_MimeTypes.try_emplace(".jpg", "image/jpeg");
-            m_MimeTypes.try_emplace(".jpe", "image/jpeg");
-            m_MimeTypes.try_emplace(".jpeg", "image/jpeg");
-            m_MimeTypes.try_emplace(".bmp", "image/bmp");
-            m_MimeTypes.try_emplace(".ico", "image/vnd.microsoft.icon");
-            m_MimeTypes.try_emplace(".svg", "image/svg+xml");
-            m_MimeTypes.try_emplace(".svgz", "image/svg+xml");
-            m_MimeTypes.try_emplace(".woff", "text/plain");
-            m_MimeTypes.try_emplace(".woff2", "text/plain");
-            m_MimeTypes.try_emplace(".ttf", "text/plain");
-            m_MimeTypes.try_emplace(".m3u8", "application/x-mpegURL");
-            m_MimeTypes.try_emplace(".m3u", "audio/x-mpegurl");
-            m_MimeTypes.try_emplace(".wav", "audio/x-wav");
-            m_MimeTypes.try_emplace(".mp3", "audio/mpeg");
-            m_MimeTypes.try_emplace(".m4a", "audio/mpeg");
-            m_MimeTypes.try_emplace(".mpeg", "video/mpeg");
-            m_MimeTypes.try_emplace(".mpg","video/mpeg");
-            m_MimeTypes.try_emplace(".ts","video/MP2T");
-            m_MimeTypes.try_emplace(".gif", "image/gif");
-            m_MimeTypes.try_emplace(".tiff", "image/tiff");
-            m_MimeTypes.try_emplace(".tif", "image/tiff");
+            m_Inherited = SocketHandover::inherited(m_Endpoint);
+            if(!m_Inherited.empty()) { // passed by the previous process, see handover
+                m_Acceptor.assign(m_Endpoint.protocol(), m_Inherited.front(), ec);
+                if(ec)
+                    throw HTTPServerException("Assign: " + ec.message());
+                m_Inherited.erase(m_Inherited.begin());
+                m_Adopted = true;
+            }
+            else {
+                m_Acceptor.open(m_Endpoint.protocol(), ec);
+                if(ec)
+                    throw HTTPServerException("Open: " + ec.message());
+                m_Acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+                if(ec)
+                    throw HTTPServerException("Set Option: " + ec.message());
+                m_Acceptor.bind(m_Endpoint, ec);
+                if(ec)
+                    throw HTTPServerException("Bind: " + ec.message());
+                m_Acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+                if(ec)
+                    throw HTTPServerException("Listen: " + ec.message());
+            }
+            auto config = std::make_shared<HTTPConfig>();
+            config->DocRoot = docRoot;
+            config->MimeTypes = mimeTypes;
+            config->IndexFile = indexFile;
+            config->ServerString = serverString;
+            config->Cache = std::make_shared<FileCache>();
+            config->MimeTypes.try_emplace(".htm","text/html");
+            config->MimeTypes.try_emplace(".html", "text/html");
+            config->MimeTypes.try_emplace(".php", "text/html");
+            config->MimeTypes.try_emplace(".txt", "text/plain");
+            config->MimeTypes.try_emplace(".css", "text/css");
+            config->MimeTypes.try_emplace(".map", "text/map");
+            config->MimeTypes.try_emplace(".js", "application/javascript");
+            config->MimeTypes.try_emplace(".json","application/json");
+            config->MimeTypes.try_emplace(".xml","application/xml");
+            config->MimeTypes.try_emplace(".swf", "application/x-shockwave-flash");
+            config->MimeTypes.try_emplace(".flv", "video/x-flv");
+            config->MimeTypes.try_emplace(".png", "image/png");
+            config->MimeTypes.try_emplace(".jpg", "image/jpeg");
+            config->MimeTypes.try_emplace(".jpe", "image/jpeg");
+            config->MimeTypes.try_emplace(".jpeg", "image/jpeg");
+            config->MimeTypes.try_emplace(".bmp", "image/bmp");
+            config->MimeTypes.try_emplace(".ico", "image/vnd.microsoft.icon");
+            config->MimeTypes.try_emplace(".svg", "image/svg+xml");
+            config->MimeTypes.try_emplace(".svgz", "image/svg+xml");
+            config->MimeTypes.try_emplace(".woff", "text/plain");
+            config->MimeTypes.try_emplace(".woff2", "text/plain");
+            config->MimeTypes.try_emplace(".ttf", "text/plain");
+            config->MimeTypes.try_emplace(".m3u8", "application/x-mpegURL");
+            config->MimeTypes.try_emplace(".m3u", "audio/x-mpegurl");
+            config->MimeTypes.try_emplace(".wav", "audio/x-wav");
+            config->MimeTypes.try_emplace(".mp3", "audio/mpeg");
+            config->MimeTypes.try_emplace(".m4a", "audio/mpeg");
+            config->MimeTypes.try_emplace(".mpeg", "video/mpeg");
+            config->MimeTypes.try_emplace(".mpg","video/mpeg");
+            config->MimeTypes.try_emplace(".ts","video/MP2T");
+            config->MimeTypes.try_emplace(".gif", "image/gif");
+            config->MimeTypes.try_emplace(".tiff", "image/tiff");
+            config->MimeTypes.try_emplace(".tif", "image/tiff");
+            config->updateTemplates();
+            m_Config = config;
+            if(m_SSL) {
+                try {
+                    m_TLS = std::make_shared<TLSContext>(m_Cert, m_Key);
+                }
+                catch(const TLSContextException& e) {
+                    throw HTTPServerException(std::string("TLS: ") + e.what());
+                }
+            }
         }
         /**
          * Starts receiving messages asynchrolously. Automatically
@@ -514,12 +3535,24 @@ namespace giri {
          * new connections.
          */
         void run() {
-            if(!m_Acceptor.is_open()) return;
+            if(!m_Acceptor.is_open() || m_Stopping) return;
+            m_Started = true;
+            watchDocRoot();
+            if(m_Sharding && m_NumThreads > 1 && IOShards::supported()) {
+                run_sharded();
+                return;
+            }
+            for(int fd : m_Inherited) { // one acceptor is used without sharding
+                tcp::acceptor surplus(m_Ioc);
+                boost::system::error_code ec;
+                surplus.assign(m_Endpoint.protocol(), fd, ec);
+            }
+            m_Inherited.clear();
             do_accept();
 
             m_Threads.reserve(m_NumThreads);
             for(auto i = m_NumThreads; i > 0; --i)
-                m_Threads.emplace_back([this]{ m_Ioc.run();});
+                m_Threads.emplace_back([this]{ IOShards::runContext(m_Ioc); });
         }
         /**
          * When no execution threads are used you can call this functioun constatly to handle ready executors.
@@ -528,10 +3561,85 @@ namespace giri {
             m_Ioc.poll_one();
         }
         /**
-         * @returns last created session.
+         * Stops the server. Accepting stops at once, every connection completes the
+         * request in progress and is closed then, idle keep-alive connections are
+         * closed right away (see HTTPSession::drain). Connections still open once the
+         * drain timeout expired are closed forcibly, then the worker threads are joined.
+         * Blocks until the server was stopped, if called from a handler (e.g. a route)
+         * another thread stops the server and the call returns at once. The server
+         * cannot be run again afterwards.
+         * @param drainTimeout Time granted to complete the requests in progress. (defaults to 10 seconds)
+         */
+        void stop(std::chrono::milliseconds drainTimeout = std::chrono::seconds(10)) {
+            if(m_Ioc.get_executor().running_in_this_thread() || (m_Shards && m_Shards->runningInThisThread())) {
+                std::thread([self = this->shared_from_this(), drainTimeout]{ self->stop(drainTimeout); }).detach(); // a worker cannot join itself
+                return;
+            }
+            std::lock_guard<std::mutex> lock(m_StopMutex);
+            if(m_Stopped)
+                return;
+            m_Stopping = true;
+            if(m_Shards)
+                m_Shards->close();
+            boost::asio::post(m_AcceptStrand, [self = this->shared_from_this()]{
+                boost::system::error_code ec;
+                self->m_Acceptor.close(ec);
+                self->m_AcceptTimer.cancel();
+            });
+            if(m_Threads.empty() && !m_Shards) // no worker threads, see poll
+                m_Ioc.poll();
+            if(m_Watcher)
+                m_Watcher->close();
+            for(auto& session : getSessions())
+                session->drain();
+            awaitSessions(std::chrono::steady_clock::now() + drainTimeout);
+            for(auto& session : getSessions())
+                boost::asio::post(session->m_Strand, [session]{ session->abort(); });
+            awaitSessions(std::chrono::steady_clock::now() + std::chrono::milliseconds(AbortTimeout));
+            m_Ioc.stop();
+            if(m_Shards)
+                m_Shards->stop();
+            for(auto& t : m_Threads)
+                if(t.joinable())
+                    t.join();
+            m_Threads.clear();
+            m_Stopped = true;
+        }
+        /**
+         * Starts a new process which takes over the listening socket(s), e.g. the updated
+         * binary, see SocketHandover. The new process adopts them when it creates a server
+         * for the same endpoint. Both processes accept connections until stop() is called
+         * on this server, so no connection is refused during the restart.
+         * Throws HTTPServerException on error.
+         * @param argv Path of the program and its arguments, e.g. {"/proc/self/exe", ...}.
+         * @returns Process id of the new process.
+         */
+        long handover(const std::vector<std::string>& argv) {
+            std::vector<int> fds;
+            if(m_Shards)
+                fds = m_Shards->getHandles();
+            else if(!m_Stopping && m_Acceptor.is_open())
+                fds.push_back(static_cast<int>(m_Acceptor.native_handle()));
+            if(fds.empty())
+                throw HTTPServerException("Handover: the server is not listening");
+            try {
+                return SocketHandover::spawn(argv, fds);
+            }
+            catch(const SocketHandoverException& e) {
+                throw HTTPServerException(std::string("Handover: ") + e.what());
+            }
+        }
+        /**
+         * @returns true once stop() was called.
+         */
+        bool isStopping() const {
+            return m_Stopping;
+        }
+        /**
+         * @returns last created session, nullptr if its connection is already closed.
          */
         HTTPSession::SPtr getSession() const { 
-            return m_NewSession;
+            return m_NewSession.lock();
         }
         /**
          * @returns true if ssl is enabled, false otherwise.
@@ -551,87 +3659,546 @@ namespace giri {
         std::filesystem::path getKey() const {
             return m_Key;
         }
+        /**
+         * @returns TLS context shared by all sessions, nullptr if ssl is disabled.
+         */
+        TLSContext::SPtr getTLSContext() const {
+            return m_TLS;
+        }
+        /**
+         * Reloads certificate and private key, e.g. after they got renewed. Only
+         * affects new HTTPSessions, established connections are kept.
+         * Throws HTTPServerException on error, the previous certificate stays in use then.
+         */
+        void reloadCertificate() {
+            if(!m_TLS)
+                throw HTTPServerException("Reload certificate: ssl is disabled");
+            try {
+                m_TLS->reload();
+            }
+            catch(const TLSContextException& e) {
+                throw HTTPServerException(std::string("TLS: ") + e.what());
+            }
+        }
         /**
          * @returns Folder which is served via http.
          */
         std::filesystem::path getDocRoot() const {
-            return m_DocRoot;
+            return getConfig()->DocRoot;
         }
         /**
          * @returns Default index file to be used.
          */
         std::string getIndexFile() const {
-            return m_IndexFile;
+            return getConfig()->IndexFile;
         }
         /**
          * @returns Server string to be added to the http answers.
          */
         std::string getServerString() const {
-            return m_ServerString;
+            return getConfig()->ServerString;
         }
         /**
          * @returns Mapping containing all supported mimetypes.
          */
         std::map<std::string, std::string> getMimeTypes() const {
-            return m_MimeTypes;
+            return getConfig()->MimeTypes;
         }
         /**
          * Set doc root path. Only affects new HTTPSessions.
          * @param path Path to serve html files from.
          */
         void setDocRoot(const std::filesystem::path& path) {
-            m_DocRoot = path;
+            updateConfig([&](HTTPConfig& c){ c.DocRoot = path; });
+            if(m_Watcher)
+                watchDocRoot();
+        }
+        /**
+         * Sets the size from which on files are streamed from disk instead of being loaded
+         * into memory, see HTTPSession::setLargeFileThreshold. Only affects new HTTPSessions.
+         * @param threshold File size in bytes. (defaults to 1MiB)
+         */
+        void setLargeFileThreshold(uint64_t threshold) {
+            updateConfig([&](HTTPConfig& c){ c.LargeFileThreshold = threshold; });
+        }
+        /**
+         * @returns Size from which on files are streamed from disk.
+         */
+        uint64_t getLargeFileThreshold() const {
+            return getConfig()->LargeFileThreshold;
+        }
+        /**
+         * Sets the Cache-Control header sent with static files below a path, the longest
+         * matching prefix wins. Only affects new HTTPSessions.
+         * @param prefix Path prefix, e.g. "/assets/".
+         * @param value Header value, e.g. "public, max-age=31536000, immutable". Empty removes the prefix.
+         */
+        void setCacheControl(const std::string& prefix, const std::string& value) {
+            updateConfig([&](HTTPConfig& c){
+                if(value.empty())
+                    c.CacheControl.erase(prefix);
+                else
+                    c.CacheControl[prefix] = value;
+            });
+        }
+        /**
+         * @returns Cache-Control header values by path prefix.
+         */
+        std::map<std::string, std::string> getCacheControl() const {
+            return getConfig()->CacheControl;
+        }
+        /**
+         * Sets the maximum size of request bodies, larger requests are answered with
+         * 413 Payload Too Large. Routes can set their own limit, see HTTPRouteOptions. Only affects new HTTPSessions.
+         * @param limit Maximum body size in bytes. (defaults to 1MiB)
+         */
+        void setBodyLimit(uint64_t limit) {
+            updateConfig([&](HTTPConfig& c){ c.BodyLimit = limit; });
+        }
+        /**
+         * @returns Maximum size of request bodies in bytes.
+         */
+        uint64_t getBodyLimit() const {
+            return getConfig()->BodyLimit;
+        }
+        /**
+         * Sets the timeouts of the connection phases. Only affects new HTTPSessions.
+         * @param timeouts Timeouts to use, zero disables a timeout.
+         */
+        void setTimeouts(const HTTPTimeouts& timeouts) {
+            updateConfig([&](HTTPConfig& c){ c.Timeouts = timeouts; });
+        }
+        /**
+         * @returns Timeouts of the connection phases.
+         */
+        HTTPTimeouts getTimeouts() const {
+            return getConfig()->Timeouts;
+        }
+        /**
+         * Limits the number of concurrent connections. Connections above a limit are
+         * answered with 503 Service Unavailable (without ssl) and closed right away.
+         * @param maxConnections Maximum number of concurrent connections. (0 for unlimited, the default)
+         * @param maxPerAddress Maximum number of concurrent connections per client address. (0 for unlimited, the default)
+         */
+        void setConnectionLimits(size_t maxConnections, size_t maxPerAddress) {
+            m_Limiter->setLimits(maxConnections, maxPerAddress);
+        }
+        /**
+         * @returns Connection limiter, e.g. to query the number of open or rejected connections.
+         */
+        ConnectionLimiter::SPtr getConnectionLimiter() const {
+            return m_Limiter;
+        }
+        /**
+         * Enables sharding, needs to be called before run(). Instead of running all
+         * worker threads on one io_context with one acceptor, every worker thread
+         * gets its own io_context and SO_REUSEPORT acceptor and is pinned to a CPU,
+         * so connections stay on the core which accepted them. Only has an effect
+         * with more than one worker thread and on platforms supporting it (linux),
+         * see IOShards. Observers may be notified from several threads at once then.
+         * @param enable true to enable sharding. (defaults to false)
+         */
+        void setSharding(bool enable) {
+            m_Sharding = enable;
+        }
+        /**
+         * @returns true if sharding is enabled.
+         */
+        bool getSharding() const {
+            return m_Sharding;
+        }
+        /**
+         * Enables HTTP/2, needs to be called before run(). With ssl clients negotiate
+         * h2 via ALPN, without ssl clients need to start with the HTTP/2 connection
+         * preface (h2c with prior knowledge, the Upgrade header is not supported).
+         * HTTP/1.1 keeps working either way. Every request of a HTTP/2 connection is
+         * handled by its own HTTPSession, observers are notified of each of them like
+         * of a new connection. Throws HTTPServerException if the TLS context cannot be updated.
+         * @param enable true to enable HTTP/2. (defaults to false)
+         * @param settings Settings announced to clients, e.g. the number of concurrent requests per connection.
+         */
+        void setHTTP2(bool enable, const HTTP2::Settings& settings = HTTP2::Settings()) {
+            if(m_TLS) {
+                try {
+                    m_TLS->setProtocols(enable ? std::vector<std::string>{"h2", "http/1.1"} : std::vector<std::string>{"http/1.1"});
+                }
+                catch(const TLSContextException& e) {
+                    throw HTTPServerException(std::string("TLS: ") + e.what());
+                }
+            }
+            updateConfig([&](HTTPConfig& c){
+                c.EnableHTTP2 = enable;
+                c.HTTP2Settings = settings;
+            });
+        }
+        /**
+         * @returns true if HTTP/2 is enabled.
+         */
+        bool getHTTP2() const {
+            return getConfig()->EnableHTTP2;
+        }
+        /**
+         * @returns Load statistics per shard, empty if the server does not run sharded.
+         */
+        std::vector<IOShards::Stats> getShardStats() const {
+            return m_Shards ? m_Shards->getStats() : std::vector<IOShards::Stats>();
+        }
+        /**
+         * Enables built-in metrics: counters of connections, requests, status classes, bytes
+         * and TLS handshakes, and latency histograms of the request phases, see HTTPMetrics.
+         * Only affects new HTTPSessions, so it is best called before run(). Calling it again
+         * while enabled keeps the recorded values.
+         * The route is added once and stays, it answers 404 Not Found while metrics are
+         * disabled. Like all routes it needs to be added before run(), throws HTTPServerException
+         * if the server already runs or a different metrics route was added before.
+         * @param enable true to enable metrics. (defaults to false)
+         * @param path Route serving the metrics in the Prometheus text format, e.g. "/metrics". (optional)
+         */
+        void setMetrics(bool enable, const std::string& path = "") {
+            if(!path.empty() && path != m_MetricsPath) {
+                if(m_Started)
+                    throw HTTPServerException("Set Metrics: routes need to be added before run()");
+                if(!m_MetricsPath.empty())
+                    throw HTTPServerException("Set Metrics: metrics are already served at '" + m_MetricsPath + "'");
+                HTTPServer::WPtr self = this->weak_from_this();
+                route(http::verb::get, path, [self](HTTPSession::SPtr session, const RouteParams&){
+                    HTTPServer::SPtr srv = self.lock();
+                    HTTPMetrics::SPtr metrics = srv ? srv->getMetrics() : nullptr;
+                    const std::string text = metrics ? metrics->toPrometheus() : "The resource '" + std::string(session->getRequest().target()) + "' was not found.";
+                    http::response<http::vector_body<char>> res{metrics ? http::status::ok : http::status::not_found, session->getRequest().version()};
+                    res.set(http::field::server, session->getServerString());
+                    res.set(http::field::content_type, metrics ? "text/plain; version=0.0.4; charset=utf-8" : "text/html");
+                    res.set(http::field::cache_control, "no-store");
+                    res.keep_alive(session->getRequest().keep_alive());
+                    res.body().assign(text.begin(), text.end());
+                    res.prepare_payload();
+                    session->setResult(res);
+                });
+                m_MetricsPath = path;
+            }
+            HTTPMetrics::SPtr metrics = enable ? getConfig()->Metrics : nullptr;
+            if(enable && !metrics)
+                metrics = std::make_shared<HTTPMetrics>();
+            updateConfig([&](HTTPConfig& c){ c.Metrics = metrics; });
+        }
+        /**
+         * @returns Metrics of the server, nullptr if disabled, see setMetrics.
+         */
+        HTTPMetrics::SPtr getMetrics() const {
+            return getConfig()->Metrics;
+        }
+        /**
+         * Sets the access log answered requests are written to, see AccessLog.
+         * Unlike an observer, logging neither locks nor formats on the io threads.
+         * Only affects new HTTPSessions.
+         * @param log Access log to write to, nullptr disables logging.
+         */
+        void setAccessLog(const AccessLog::SPtr& log) {
+            updateConfig([&](HTTPConfig& c){ c.Log = log; });
+        }
+        /**
+         * @returns Access log of the server, nullptr if disabled.
+         */
+        AccessLog::SPtr getAccessLog() const {
+            return getConfig()->Log;
+        }
+        /**
+         * Limits the request rate per client, requests above the limit are answered with
+         * 429 Too Many Requests and a Retry-After header, see RateLimiter. Routes can set
+         * limits of their own, see HTTPRouteOptions::Limit. Only affects new HTTPSessions.
+         * @param limiter Rate limiter to check requests against, nullptr disables rate limiting.
+         */
+        void setRateLimiter(const RateLimiter::SPtr& limiter) {
+            updateConfig([&](HTTPConfig& c){ c.RateLimits = limiter; });
+        }
+        /**
+         * @returns Rate limiter of the server, nullptr if disabled.
+         */
+        RateLimiter::SPtr getRateLimiter() const {
+            return getConfig()->RateLimits;
+        }
+        /**
+         * Adds a route, see Router for the pattern syntax. Requests matching a route are
+         * passed to its handler, all other requests are served from the doc root.
+         * Routes need to be added before run(). Throws RouterException on invalid or conflicting routes.
+         * @param method HTTP method to match.
+         * @param pattern Path pattern, e.g. "/users/:id" or "/files/\*path".
+         * @param handler Handler to be called for matching requests.
+         */
+        void route(http::verb method, const std::string& pattern, HTTPRouteHandler handler) {
+            route(method, pattern, std::move(handler), HTTPRouteOptions());
+        }
+        /**
+         * Adds a route with options, e.g. to stream large request bodies, see HTTPRouteOptions.
+         * Routes need to be added before run(). Throws RouterException on invalid or conflicting routes.
+         * @param method HTTP method to match.
+         * @param pattern Path pattern, e.g. "/upload/:name".
+         * @param handler Handler to be called once the request was received.
+         * @param options Request body handling of the route.
+         */
+        void route(http::verb method, const std::string& pattern, HTTPRouteHandler handler, HTTPRouteOptions options) {
+            HTTPRouter::SPtr router = getConfig()->Routes;
+            if(!router) {
+                router = std::make_shared<HTTPRouter>();
+                updateConfig([&](HTTPConfig& c){ c.Routes = router; });
+            }
+            if(options.Limit && !getConfig()->RateLimits) // route limits are counted by the server's limiter
+                setRateLimiter(std::make_shared<RateLimiter>());
+            router->add(method, pattern, HTTPRoute(std::move(handler), std::move(options)));
+        }
+        /**
+         * @returns Router used to dispatch requests, nullptr if none is set.
+         */
+        HTTPRouter::SPtr getRouter() const {
+            return getConfig()->Routes;
+        }
+        /**
+         * Sets the router used to dispatch requests. Only affects new HTTPSessions.
+         * @param router Router to use, nullptr serves static files only.
+         */
+        void setRouter(const HTTPRouter::SPtr& router) {
+            updateConfig([&](HTTPConfig& c){ c.Routes = router; });
+        }
+        /**
+         * @returns Cache used to serve static files, nullptr if caching is disabled.
+         */
+        FileCache::SPtr getFileCache() const {
+            return getConfig()->Cache;
+        }
+        /**
+         * Sets the cache used to serve static files. Only affects new HTTPSessions.
+         * Cached files are revalidated using their modification time, unless the
+         * doc root is watched using inotify (linux), which is set up by run().
+         * @param cache Cache to use, nullptr disables caching.
+         */
+        void setFileCache(const FileCache::SPtr& cache) {
+            updateConfig([&](HTTPConfig& c){ c.Cache = cache; });
+            if(m_Watcher)
+                watchDocRoot();
         }
         /**
          * Sets default index file to be used. Only affects new HTTPSessions.
          * @param indx default index file to be used.
          */
         void setIndexFile(const std::string& indx) {
-            m_IndexFile = indx;
+            updateConfig([&](HTTPConfig& c){ c.IndexFile = indx; });
         }
         /**
          * Set server string to be added to the http answers. Only affects new HTTPSessions.
          * @param servstr server string to be added to the http answers.
          */
         void setServerString(const std::string& servstr) {
-            m_ServerString = servstr;
+            updateConfig([&](HTTPConfig& c){ c.ServerString = servstr; });
         }
         /**
          * Add additional mimetypes. Only affects new HTTPSessions.
          * @param mimeTypes Additional mimetypes to add.
          */
         void addMimeTypes(const std::map<std::string, std::string>& mimeTypes) {
-            m_MimeTypes.insert(mimeTypes.begin(), mimeTypes.end());
+            updateConfig([&](HTTPConfig& c){ c.MimeTypes.insert(mimeTypes.begin(), mimeTypes.end()); });
+        }
+        /**
+         * @returns Current configuration snapshot, shared with all sessions created from now on.
+         */
+        HTTPConfig::SPtr getConfig() const {
+            return std::atomic_load(&m_Config);
         }
         using SPtr = std::shared_ptr<HTTPServer>;
         using UPtr = std::unique_ptr<HTTPServer>;
         using WPtr = std::weak_ptr<HTTPServer>;
     private:
+        template<class Fn>
+        void updateConfig(Fn fn) { // copy, modify and publish, sessions keep their snapshot
+            std::lock_guard<std::mutex> lock(m_ConfigMutex);
+            auto config = std::make_shared<HTTPConfig>(*getConfig());
+            fn(*config);
+            config->updateTemplates();
+            std::atomic_store(&m_Config, HTTPConfig::SPtr(std::move(config)));
+        }
+        static constexpr int AcceptRetryDelay = 50; // milliseconds
+        static constexpr int AbortTimeout = 1000;   // milliseconds granted to forcibly closed connections
+
         void do_accept() {
-            m_Acceptor.async_accept(m_Socket, std::bind(&HTTPServer::on_accept, this->shared_from_this(), std::placeholders::_1));
+            m_Acceptor.async_accept(m_Socket, boost::asio::bind_executor(m_AcceptStrand, std::bind(&HTTPServer::on_accept, this->shared_from_this(), std::placeholders::_1)));
         }
         void on_accept(boost::system::error_code ec) {
+            if(ec == boost::asio::error::operation_aborted)
+                return; // stopped
+            if(ec) { // e.g. out of file descriptors, accepting again at once would spin
+                m_AcceptTimer.expires_after(std::chrono::milliseconds(AcceptRetryDelay));
+                m_AcceptTimer.async_wait([self = this->shared_from_this()](boost::system::error_code ec){
+                    if(!ec && !self->m_Stopping)
+                        self->do_accept();
+                });
+                return;
+            }
+            start_session(std::move(m_Socket), m_Ioc);
+            if(!m_Stopping)
+                do_accept(); // Accept another connection
+        }
+        void run_sharded() {
+            boost::system::error_code ec;
+            std::vector<int> inherited = std::move(m_Inherited);
+            if(m_Adopted) // kept by the first shard, shared by all if it lacks SO_REUSEPORT since the old process still holds it
+                inherited.insert(inherited.begin(), static_cast<int>(m_Acceptor.release(ec)));
+            else
+                m_Acceptor.close(ec); // every shard binds its own SO_REUSEPORT acceptor
+            try {
+                m_Shards = std::make_unique<IOShards>(m_Ioc, m_Endpoint, m_NumThreads, true, std::move(inherited));
+            }
+            catch(const IOShardsException& e) {
+                throw HTTPServerException(std::string("Sharding: ") + e.what());
+            }
+            HTTPServer::WPtr self = this->shared_from_this();
+            m_Shards->run([self](size_t, boost::asio::io_context& ioc, boost::system::error_code ec, tcp::socket socket){
+                auto server = self.lock();
+                if(!server || ec) // accepting continues after a short delay
+                    return;
+                server->start_session(std::move(socket), ioc);
+            });
+        }
+        void start_session(tcp::socket socket, boost::asio::io_context& ioc) {
+            boost::system::error_code ec;
+            tcp::endpoint remote = socket.remote_endpoint(ec);
             if(ec)
-                throw HTTPServerException("Accept: " + ec.message());
-            m_NewSession = std::make_shared<HTTPSession>(std::move(m_Socket), m_DocRoot, m_MimeTypes, m_IndexFile, m_ServerString, m_SSL, m_Cert, m_Key, m_Ioc);
-            m_NewSession->run();
-            notify(); // notify all subscribed observers
-            do_accept(); // Accept another connection
+                return; // already disconnected
+            ConnectionLimiter::Ticket ticket = m_Limiter->acquire(remote.address());
+            if(!ticket)
+                return shed(std::move(socket));
+            HTTPConfig::SPtr config = getConfig();
+            std::function<void(const HTTPSession::SPtr&)> onStream;
+            if(config->EnableHTTP2) {
+                HTTPServer::WPtr self = this->shared_from_this();
+                onStream = [self](const HTTPSession::SPtr& stream){
+                    if(auto server = self.lock())
+                        server->announce(stream);
+                };
+            }
+            auto session = std::make_shared<HTTPSession>(std::move(socket), std::move(config), m_TLS ? m_TLS->get() : nullptr, ioc, std::move(ticket), std::move(onStream));
+            track(session);
+            session->run();
+            if(m_Stopping) // accepted while stopping
+                session->drain();
+            announce(session);
+        }
+        void announce(const HTTPSession::SPtr& session) {
+            std::lock_guard<std::mutex> lock(m_NotifyMutex); // shards accept concurrently
+            m_NewSession = session;
+            try {
+                notify(); // notify all subscribed observers
+            }
+            catch(...) { // a failing observer must not stop accepting
+            }
+        }
+        void track(const HTTPSession::SPtr& session) {
+            std::lock_guard<std::mutex> lock(m_SessionsMutex);
+            if(m_Sessions.size() >= m_SessionsCompact) { // drop closed connections, amortized over many accepts
+                m_Sessions.erase(std::remove_if(m_Sessions.begin(), m_Sessions.end(), [](const HTTPSession::WPtr& s){ return s.expired(); }), m_Sessions.end());
+                m_SessionsCompact = std::max<size_t>(64, 2 * m_Sessions.size());
+            }
+            m_Sessions.push_back(session);
+        }
+        std::vector<HTTPSession::SPtr> getSessions() {
+            std::vector<HTTPSession::SPtr> sessions;
+            std::lock_guard<std::mutex> lock(m_SessionsMutex);
+            for(const auto& s : m_Sessions)
+                if(auto session = s.lock())
+                    sessions.push_back(std::move(session));
+            return sessions;
+        }
+        void awaitSessions(std::chrono::steady_clock::time_point deadline) {
+            for(;;) {
+                {
+                    std::lock_guard<std::mutex> lock(m_SessionsMutex);
+                    m_Sessions.erase(std::remove_if(m_Sessions.begin(), m_Sessions.end(), [](const HTTPSession::WPtr& s){ return s.expired(); }), m_Sessions.end());
+                    if(m_Sessions.empty() || std::chrono::steady_clock::now() >= deadline)
+                        return;
+                }
+                if(m_Threads.empty() && !m_Shards) // no worker threads, see poll
+                    m_Ioc.run_for(std::chrono::milliseconds(10));
+                else
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        void shed(tcp::socket socket) const {
+            boost::system::error_code ec;
+            if(!m_SSL) { // not worth a TLS handshake
+                const std::string res = "HTTP/1.1 503 Service Unavailable\r\nServer: " + getConfig()->ServerString +
+                                        "\r\nContent-Type: text/html\r\nContent-Length: 19\r\nRetry-After: 1\r\nConnection: close\r\n\r\nService Unavailable";
+                socket.non_blocking(true, ec);
+                socket.write_some(boost::asio::buffer(res), ec);
+            }
+            socket.shutdown(tcp::socket::shutdown_both, ec);
+            socket.close(ec);
+        }
+        void watchDocRoot() {
+        #if defined(__linux__)
+            if(m_Watcher) {
+                m_Watcher->close();
+                m_Watcher.reset();
+            }
+            HTTPConfig::SPtr config = getConfig();
+            if(!config->Cache)
+                return;
+            try {
+                m_Watcher = std::make_shared<FileSystem::FileWatcher>(m_Ioc, std::chrono::milliseconds(10));
+                m_Watcher->add(config->DocRoot);
+                FileCache::WPtr cache = config->Cache;
+                m_Watcher->setCallback([cache](const std::vector<FileSystem::FileEvent>& events){
+                    auto c = cache.lock();
+                    if(!c)
+                        return;
+                    for(const auto& ev : events) {
+                        if(ev.Flags & FileSystem::FileEvent::Overflow)
+                            return c->clear();
+                        c->invalidate(ev.Path);
+                    }
+                });
+                m_Watcher->run();
+                config->Cache->setRevalidateInterval(std::chrono::milliseconds(-1));
+                return;
+            }
+            catch(const ExceptionBase&) { // e.g. out of inotify watches
+                m_Watcher.reset();
+            }
+        #endif
+            if(getConfig()->Cache)
+                getConfig()->Cache->setRevalidateInterval(std::chrono::seconds(1));
         }
         tcp::endpoint m_Endpoint;
         boost::asio::io_context m_Ioc;
-        std::filesystem::path m_DocRoot;
         size_t m_NumThreads;
         bool m_SSL;
         std::filesystem::path m_Cert;
         std::filesystem::path m_Key;
-        std::map<std::string, std::string> m_MimeTypes;
-        std::string m_IndexFile;
-        std::string m_ServerString;  
+        TLSContext::SPtr m_TLS;
         std::vector<std::thread> m_Threads;
         tcp::acceptor m_Acceptor;
         tcp::socket m_Socket;
-        HTTPSession::SPtr m_NewSession;    
+        boost::asio::strand<boost::asio::io_context::executor_type> m_AcceptStrand; // serializes accepting and stop()
+        boost::asio::steady_timer m_AcceptTimer;
+        std::vector<int> m_Inherited;                // further inherited listening sockets, see SocketHandover
+        bool m_Adopted = false;                      // m_Acceptor was passed by the previous process
+        bool m_Started = false;                      // run() was called, routes are read by the sessions
+        std::string m_MetricsPath;                   // route added by setMetrics
+        std::vector<HTTPSession::WPtr> m_Sessions;   // connections, drained by stop()
+        size_t m_SessionsCompact = 64;
+        std::mutex m_SessionsMutex;
+        std::mutex m_StopMutex;
+        std::atomic<bool> m_Stopping{false};
+        bool m_Stopped = false;
+        HTTPSession::WPtr m_NewSession; // does not keep the connection open
+        HTTPConfig::SPtr m_Config;
+        std::mutex m_ConfigMutex;
+        bool m_Sharding = false;
+        IOShards::UPtr m_Shards;
+        std::mutex m_NotifyMutex;
+        ConnectionLimiter::SPtr m_Limiter = std::make_shared<ConnectionLimiter>();
+    #if defined(__linux__)
+        FileSystem::FileWatcher::SPtr m_Watcher;
+    #else
+        std::shared_ptr<void> m_Watcher;
+    #endif
     };
 }
 #endif //SUPPORTLIB_HTTPSERVER_H
@@ -0,0 +1,373 @@
+/**
+ * @file IOShards.h
+ * @brief One io_context, thread and SO_REUSEPORT acceptor per core.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_IOSHARDS_H
+#define SUPPORTLIB_IOSHARDS_H
+#include "Object.h"
+#include "Exception.h"
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+namespace giri {
+
+    /**
+     *  @brief Exception to be thrown on IOShards errors.
+     */
+    class IOShardsException : public ExceptionBase
+    {
+    public:
+        IOShardsException(const std::string &msg) : ExceptionBase(msg) {};
+        using SPtr = std::shared_ptr<IOShardsException>;
+        using UPtr = std::unique_ptr<IOShardsException>;
+        using WPtr = std::weak_ptr<IOShardsException>;
+    };
+
+    /**
+     * @brief Runs a server on several independent io_contexts.
+     *
+     * Every shard owns an io_context run by exactly one thread, which is pinned
+     * to a CPU, and an acceptor listening on the same endpoint via SO_REUSEPORT.
+     * The kernel distributes incoming connections over the acceptors, a connection
+     * is then handled entirely by the shard (and core) which accepted it. This avoids
+     * contention on a single acceptor and on the scheduler lock of a shared io_context.
+     * Only supported on Linux, where SO_REUSEPORT balances connections over the acceptors.
+     *
+     * Used by HTTPServer and WebSocketServer, see HTTPServer::setSharding().
+     */
+    class IOShards : public Object<IOShards>
+    {
+    public:
+        /**
+         * @brief Load statistics of a shard.
+         */
+        struct Stats {
+            size_t Index = 0;      ///< Shard number.
+            int Cpu = -1;          ///< CPU the shard's thread is pinned to, -1 if not pinned.
+            uint64_t Accepted = 0; ///< Number of accepted connections.
+        };
+
+        /**
+         * Called for every accepted connection (or accept error) on the thread of the shard.
+         * Accepting continues after the handler returns, after errors (e.g. out of file
+         * descriptors) with a short delay.
+         */
+        using AcceptHandler = std::function<void(size_t shard, boost::asio::io_context& ioc, boost::system::error_code ec, boost::asio::ip::tcp::socket socket)>;
+
+        /**
+         * @returns true if sharding is supported on this platform.
+         */
+        static constexpr bool supported() {
+        #if defined(__linux__)
+            return true;
+        #else
+            return false;
+        #endif
+        }
+        /**
+         * Runs an io_context until it was stopped. Exceptions escaping a handler are
+         * dropped and the thread goes on serving the other connections.
+         * @param ioc io_context to run.
+         */
+        static void runContext(boost::asio::io_context& ioc) {
+            for(;;) {
+                try {
+                    ioc.run();
+                    return;
+                }
+                catch(...) { // a failing handler must not take the thread down
+                }
+            }
+        }
+        /**
+         * IOShards constructor. Opens and binds all acceptors, throws IOShardsException on error.
+         * @param first io_context to be used for the first shard, e.g. the server's main context.
+         * @param endpoint Endpoint to listen on.
+         * @param count Number of shards. (0 uses one per available CPU, CPUs are only known on Linux)
+         * @param pin Pin shard threads to CPUs. (defaults to true)
+         * @param inherited Listening sockets to use instead of binding new ones, e.g. passed by
+         * SocketHandover. A socket without SO_REUSEPORT (e.g. of a process which did not shard)
+         * does not allow binding further acceptors next to it while the old process holds it,
+         * all shards accept from that socket then. Surplus sockets are closed. (optional)
+         */
+        IOShards(boost::asio::io_context& first, const boost::asio::ip::tcp::endpoint& endpoint, size_t count = 0, bool pin = true, std::vector<int> inherited = {}) {
+            std::vector<int> cpus = allowedCpus();
+            if(count == 0)
+                count = cpus.empty() ? 1 : cpus.size();
+            m_Shards.reserve(count);
+            for(size_t i = 0; i < count; ++i) {
+                auto s = std::make_unique<Shard>();
+                if(i > 0)
+                    s->Own = std::make_unique<boost::asio::io_context>(1);
+                s->Ioc = i > 0 ? s->Own.get() : &first;
+                s->Acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(*s->Ioc);
+                s->Retry = std::make_unique<boost::asio::steady_timer>(*s->Ioc);
+                s->Cpu = pin && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+                if(m_Shared)
+                    share(*s->Acceptor, endpoint, *m_Shards.front()->Acceptor);
+                else if(!adopt(*s->Acceptor, endpoint, inherited, i == 0 ? &m_Shared : nullptr))
+                    open(*s->Acceptor, endpoint);
+                m_Shards.push_back(std::move(s));
+            }
+            for(int fd : inherited) {
+                boost::asio::ip::tcp::acceptor surplus(first);
+                boost::system::error_code ec;
+                surplus.assign(endpoint.protocol(), fd, ec);
+            }
+        }
+        IOShards(const IOShards&) = delete;
+        IOShards& operator=(const IOShards&) = delete;
+        /**
+         * Stops all shards and joins their threads.
+         */
+        ~IOShards() {
+            stop();
+        }
+        /**
+         * Starts accepting and one thread per shard.
+         * @param handler Handler to be called for accepted connections.
+         */
+        void run(AcceptHandler handler) {
+            if(!m_Threads.empty())
+                return;
+            m_Handler = std::move(handler);
+            for(size_t i = 0; i < m_Shards.size(); ++i)
+                do_accept(i);
+            m_Threads.reserve(m_Shards.size());
+            for(size_t i = 0; i < m_Shards.size(); ++i) {
+                m_Threads.emplace_back([this, i]{ runContext(*m_Shards[i]->Ioc); });
+            #if defined(__linux__)
+                if(m_Shards[i]->Cpu >= 0) {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    CPU_SET(m_Shards[i]->Cpu, &set);
+                    if(pthread_setaffinity_np(m_Threads.back().native_handle(), sizeof(set), &set) != 0)
+                        m_Shards[i]->Cpu = -1;
+                }
+            #endif
+            }
+        }
+        /**
+         * Stops accepting, connections already accepted are served until stop() is called.
+         * May be called from any thread.
+         */
+        void close() {
+            m_Closed = true;
+            for(auto& s : m_Shards) {
+                Shard* shard = s.get();
+                boost::asio::post(*shard->Ioc, [shard]{ // acceptors are only touched by their shard's thread
+                    boost::system::error_code ec;
+                    shard->Acceptor->close(ec);
+                    shard->Retry->cancel();
+                });
+            }
+        }
+        /**
+         * Closes all acceptors, stops all io_contexts and joins the shard threads.
+         */
+        void stop() {
+            m_Closed = true;
+            for(auto& s : m_Shards)
+                s->Ioc->stop();
+            for(auto& t : m_Threads)
+                if(t.joinable() && t.get_id() != std::this_thread::get_id())
+                    t.join();
+                else if(t.joinable())
+                    t.detach();
+            m_Threads.clear();
+            for(auto& s : m_Shards) { // no handler runs anymore
+                boost::system::error_code ec;
+                s->Acceptor->close(ec);
+            }
+        }
+        /**
+         * @returns Number of shards.
+         */
+        size_t size() const {
+            return m_Shards.size();
+        }
+        /**
+         * @returns io_context of a shard.
+         * @param shard Shard number.
+         */
+        boost::asio::io_context& getContext(size_t shard) {
+            return *m_Shards.at(shard)->Ioc;
+        }
+        /**
+         * @returns Native handles of the listening sockets, e.g. to pass them to SocketHandover.
+         */
+        std::vector<int> getHandles() const {
+            std::vector<int> fds;
+            if(m_Closed)
+                return fds;
+            for(const auto& s : m_Shards) {
+                fds.push_back(static_cast<int>(s->Acceptor->native_handle()));
+                if(m_Shared)
+                    break; // the others are duplicates
+            }
+            return fds;
+        }
+        /**
+         * @returns true if called from one of the shard threads.
+         */
+        bool runningInThisThread() const {
+            for(const auto& s : m_Shards)
+                if(s->Ioc->get_executor().running_in_this_thread())
+                    return true;
+            return false;
+        }
+        /**
+         * @returns Load statistics of all shards.
+         */
+        std::vector<Stats> getStats() const {
+            std::vector<Stats> stats;
+            stats.reserve(m_Shards.size());
+            for(size_t i = 0; i < m_Shards.size(); ++i)
+                stats.push_back({i, m_Shards[i]->Cpu, m_Shards[i]->Accepted.load(std::memory_order_relaxed)});
+            return stats;
+        }
+        using SPtr = std::shared_ptr<IOShards>;
+        using UPtr = std::unique_ptr<IOShards>;
+        using WPtr = std::weak_ptr<IOShards>;
+    private:
+        struct Shard {
+            std::unique_ptr<boost::asio::io_context> Own;
+            boost::asio::io_context* Ioc = nullptr;
+            std::unique_ptr<boost::asio::ip::tcp::acceptor> Acceptor;
+            std::unique_ptr<boost::asio::steady_timer> Retry; // delays accepting after errors
+            int Cpu = -1;
+            std::atomic<uint64_t> Accepted{0};
+        };
+
+        static void open(boost::asio::ip::tcp::acceptor& acceptor, const boost::asio::ip::tcp::endpoint& endpoint) {
+            boost::system::error_code ec;
+            if(!supported())
+                throw IOShardsException("Sharding is not supported on this platform");
+            acceptor.open(endpoint.protocol(), ec);
+            if(ec)
+                throw IOShardsException("Open: " + ec.message());
+            acceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
+            if(ec)
+                throw IOShardsException("Set Option: " + ec.message());
+        #if defined(__linux__)
+            using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+            acceptor.set_option(reuse_port(true), ec);
+            if(ec)
+                throw IOShardsException("Set Option SO_REUSEPORT: " + ec.message());
+        #endif
+            acceptor.bind(endpoint, ec);
+            if(ec)
+                throw IOShardsException("Bind: " + ec.message());
+            acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+            if(ec)
+                throw IOShardsException("Listen: " + ec.message());
+        }
+        // shared is set if a socket without SO_REUSEPORT was adopted, those are closed if shared is nullptr
+        static bool adopt(boost::asio::ip::tcp::acceptor& acceptor, const boost::asio::ip::tcp::endpoint& endpoint, std::vector<int>& inherited, bool* shared) {
+        #if defined(__linux__)
+            while(!inherited.empty()) {
+                const int fd = inherited.front();
+                inherited.erase(inherited.begin());
+                boost::system::error_code ec;
+                acceptor.assign(endpoint.protocol(), fd, ec);
+                if(ec)
+                    continue;
+                using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+                reuse_port option;
+                acceptor.get_option(option, ec);
+                if(!ec && option.value())
+                    return true;
+                if(!ec && shared) { // other shards could not bind next to it, they accept from it as well
+                    *shared = true;
+                    return true;
+                }
+                acceptor.close(ec);
+            }
+        #else
+            (void)acceptor;
+            (void)endpoint;
+            (void)inherited;
+            (void)shared;
+        #endif
+            return false;
+        }
+        static void share(boost::asio::ip::tcp::acceptor& acceptor, const boost::asio::ip::tcp::endpoint& endpoint, boost::asio::ip::tcp::acceptor& from) {
+        #if defined(__linux__)
+            const int fd = ::fcntl(static_cast<int>(from.native_handle()), F_DUPFD_CLOEXEC, 0);
+            if(fd < 0)
+                throw IOShardsException("Share inherited socket: " + std::string(std::strerror(errno)));
+            boost::system::error_code ec;
+            acceptor.assign(endpoint.protocol(), fd, ec);
+            if(ec) {
+                ::close(fd);
+                throw IOShardsException("Share inherited socket: " + ec.message());
+            }
+        #else
+            (void)acceptor;
+            (void)endpoint;
+            (void)from;
+            throw IOShardsException("Sharding is not supported on this platform");
+        #endif
+        }
+        static std::vector<int> allowedCpus() {
+            std::vector<int> cpus;
+        #if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if(sched_getaffinity(0, sizeof(set), &set) == 0)
+                for(int i = 0; i < CPU_SETSIZE; ++i)
+                    if(CPU_ISSET(i, &set))
+                        cpus.push_back(i);
+        #endif
+            return cpus;
+        }
+        void do_accept(size_t i) {
+            Shard& s = *m_Shards[i];
+            s.Acceptor->async_accept(*s.Ioc, [this, i](boost::system::error_code ec, boost::asio::ip::tcp::socket socket){
+                if(ec == boost::asio::error::operation_aborted || m_Closed)
+                    return; // stopped
+                if(!ec)
+                    m_Shards[i]->Accepted.fetch_add(1, std::memory_order_relaxed);
+                m_Handler(i, *m_Shards[i]->Ioc, ec, std::move(socket));
+                if(!ec)
+                    return do_accept(i);
+                m_Shards[i]->Retry->expires_after(std::chrono::milliseconds(RetryDelay)); // accepting again at once would spin, e.g. on EMFILE
+                m_Shards[i]->Retry->async_wait([this, i](boost::system::error_code ec){
+                    if(!ec && !m_Closed)
+                        do_accept(i);
+                });
+            });
+        }
+
+        std::vector<std::unique_ptr<Shard>> m_Shards;
+        bool m_Shared = false; // all shards accept from one inherited socket, see adopt
+        static constexpr int RetryDelay = 50; // milliseconds
+
+        std::vector<std::thread> m_Threads;
+        AcceptHandler m_Handler;
+        std::atomic<bool> m_Closed{false};
+    };
+}
+#endif //SUPPORTLIB_IOSHARDS_H
@@ -0,0 +1,413 @@
+/**
+ * @file Manifest.h
+ * @brief Parallel checksum manifests of directory trees.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_MANIFEST_H
+#define SUPPORTLIB_MANIFEST_H
+#include "Object.h"
+#include "Exception.h"
+#include "FileSystem.h"
+#include "JSON.h"
+#include <openssl/evp.h>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace giri {
+    namespace FileSystem {
+
+        /**
+         * @brief Hash algorithms supported by Hasher and ManifestBuilder.
+         */
+        enum class HashAlgorithm {
+            SHA256, ///< Cryptographic SHA-256 (OpenSSL).
+            XXH64   ///< Fast non-cryptographic xxHash64 (seed 0).
+        };
+
+        /**
+         * @brief Incremental hash calculation.
+         */
+        class Hasher : public Object<Hasher>
+        {
+        public:
+            /**
+             * @param algo Algorithm to use.
+             */
+            explicit Hasher(HashAlgorithm algo = HashAlgorithm::SHA256) : m_Algo(algo) {
+                reset();
+            }
+            ~Hasher() {
+                if(m_Ctx)
+                    EVP_MD_CTX_free(m_Ctx);
+            }
+            Hasher(const Hasher&) = delete;
+            Hasher& operator=(const Hasher&) = delete;
+
+            /**
+             * Restarts the hash calculation.
+             */
+            void reset() {
+                if(m_Algo == HashAlgorithm::SHA256) {
+                    if(!m_Ctx)
+                        m_Ctx = EVP_MD_CTX_new();
+                    if(!m_Ctx || EVP_DigestInit_ex(m_Ctx, EVP_sha256(), nullptr) != 1)
+                        throw FileSystemException("Could not initialize SHA-256.");
+                    return;
+                }
+                m_Acc = {Seed + Prime1 + Prime2, Seed + Prime2, Seed, Seed - Prime1};
+                m_Total = 0;
+                m_BufLen = 0;
+            }
+            /**
+             * Hashes more data.
+             * @param data Data to hash.
+             * @param len Length of data.
+             */
+            void update(const void* data, size_t len) {
+                if(m_Algo == HashAlgorithm::SHA256) {
+                    EVP_DigestUpdate(m_Ctx, data, len);
+                    return;
+                }
+                const unsigned char* p = static_cast<const unsigned char*>(data);
+                m_Total += len;
+                if(m_BufLen + len < 32) {
+                    std::memcpy(m_Buf.data() + m_BufLen, p, len);
+                    m_BufLen += len;
+                    return;
+                }
+                if(m_BufLen > 0) {
+                    size_t fill = 32 - m_BufLen;
+                    std::memcpy(m_Buf.data() + m_BufLen, p, fill);
+                    stripe(m_Buf.data());
+                    p += fill;
+                    len -= fill;
+                    m_BufLen = 0;
+                }
+                for(; len >= 32; p += 32, len -= 32)
+                    stripe(p);
+                std::memcpy(m_Buf.data(), p, len);
+                m_BufLen = len;
+            }
+            /**
+             * Finishes the hash calculation, call reset() to hash new data.
+             * @returns Hash as lowercase hex string.
+             */
+            std::string final() {
+                if(m_Algo == HashAlgorithm::SHA256) {
+                    unsigned char md[EVP_MAX_MD_SIZE];
+                    unsigned int len = 0;
+                    EVP_DigestFinal_ex(m_Ctx, md, &len);
+                    return toHex(md, len);
+                }
+                uint64_t h;
+                if(m_Total >= 32) {
+                    h = rotl(m_Acc[0], 1) + rotl(m_Acc[1], 7) + rotl(m_Acc[2], 12) + rotl(m_Acc[3], 18);
+                    for(uint64_t acc : m_Acc)
+                        h = (h ^ round(0, acc)) * Prime1 + Prime4;
+                }
+                else
+                    h = Seed + Prime5;
+                h += m_Total;
+                const unsigned char* p = m_Buf.data();
+                size_t len = m_BufLen;
+                for(; len >= 8; p += 8, len -= 8)
+                    h = rotl(h ^ round(0, read64(p)), 27) * Prime1 + Prime4;
+                if(len >= 4) {
+                    h = rotl(h ^ (static_cast<uint64_t>(read32(p)) * Prime1), 23) * Prime2 + Prime3;
+                    p += 4;
+                    len -= 4;
+                }
+                for(; len > 0; p++, len--)
+                    h = rotl(h ^ (*p * Prime5), 11) * Prime1;
+                h ^= h >> 33;
+                h *= Prime2;
+                h ^= h >> 29;
+                h *= Prime3;
+                h ^= h >> 32;
+                unsigned char out[8];
+                for(int i = 0; i < 8; i++)
+                    out[i] = static_cast<unsigned char>(h >> (56 - 8 * i));
+                return toHex(out, sizeof(out));
+            }
+            /**
+             * Hashes a file using streaming reads, big files are memory mapped.
+             * Throws FileSystemException on error.
+             * @param file File to hash.
+             * @param algo Algorithm to use.
+             * @returns Hash as lowercase hex string.
+             */
+            static std::string HashFile(const std::filesystem::path& file, HashAlgorithm algo = HashAlgorithm::SHA256) {
+                Hasher h(algo);
+                h.updateFile(file);
+                return h.final();
+            }
+            /**
+             * Hashes the content of a file, see HashFile.
+             * @param file File to hash.
+             */
+            void updateFile(const std::filesystem::path& file) {
+            #if defined(__linux__)
+                FileDescriptor fd(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+                if(!fd)
+                    throw FileSystemException("Could not open file: " + file.string());
+                struct stat st;
+                if(::fstat(fd.get(), &st) != 0)
+                    throw FileSystemException("Could not stat file: " + file.string());
+                size_t size = static_cast<size_t>(st.st_size);
+                if(size >= MapThreshold) {
+                    void* map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+                    if(map != MAP_FAILED) {
+                        ::madvise(map, size, MADV_SEQUENTIAL);
+                        update(map, size);
+                        ::munmap(map, size);
+                        return;
+                    }
+                }
+                ::posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+                std::vector<char> buffer(ReadChunk);
+                while(true) {
+                    ssize_t len = ::read(fd.get(), buffer.data(), buffer.size());
+                    if(len < 0 && errno == EINTR)
+                        continue;
+                    if(len < 0)
+                        throw FileSystemException("Could not read file: " + file.string());
+                    if(len == 0)
+                        break;
+                    update(buffer.data(), static_cast<size_t>(len));
+                }
+            #else
+                std::ifstream in(file, std::ios::in | std::ios::binary);
+                if(!in.good())
+                    throw FileSystemException("Could not open file: " + file.string());
+                std::vector<char> buffer(ReadChunk);
+                while(in) {
+                    in.read(buffer.data(), buffer.size());
+                    update(buffer.data(), static_cast<size_t>(in.gcount()));
+                }
+            #endif
+            }
+            using SPtr = std::shared_ptr<Hasher>;
+            using UPtr = std::unique_ptr<Hasher>;
+            using WPtr = std::weak_ptr<Hasher>;
+        private:
+            static constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+            static constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+            static constexpr uint64_t Prime3 = 0x165667B19E3779F9ULL;
+            static constexpr uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+            static constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+            static constexpr uint64_t Seed = 0;
+            static constexpr size_t MapThreshold = 1024 * 1024;
+            static constexpr size_t ReadChunk = 256 * 1024;
+
+            static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+            static uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * Prime2, 31) * Prime1; }
+            static uint64_t read64(const unsigned char* p) { uint64_t v; std::memcpy(&v, p, 8); return v; } // xxHash is defined little endian
+            static uint32_t read32(const unsigned char* p) { uint32_t v; std::memcpy(&v, p, 4); return v; }
+            void stripe(const unsigned char* p) {
+                for(int i = 0; i < 4; i++)
+                    m_Acc[i] = round(m_Acc[i], read64(p + 8 * i));
+            }
+            static std::string toHex(const unsigned char* data, size_t len) {
+                static constexpr char digits[] = "0123456789abcdef";
+                std::string res(len * 2, '0');
+                for(size_t i = 0; i < len; i++) {
+                    res[2 * i] = digits[data[i] >> 4];
+                    res[2 * i + 1] = digits[data[i] & 0x0f];
+                }
+                return res;
+            }
+
+            HashAlgorithm m_Algo;
+            EVP_MD_CTX* m_Ctx = nullptr;
+            std::array<uint64_t, 4> m_Acc{};
+            std::array<unsigned char, 32> m_Buf{};
+            size_t m_BufLen = 0;
+            uint64_t m_Total = 0;
+        };
+
+        /**
+         * @brief Builds checksum manifests of directory trees.
+         *
+         * The tree is walked using WalkDirectory and all regular files are hashed
+         * in parallel. Hashes are cached keyed by inode, modification time and size,
+         * so building the manifest of the same tree again only hashes changed files.
+         * The cache can be seeded with a previously built manifest.
+         *
+         * The manifest has the following format, paths are relative to root and use '/' as separator:
+         * @code{.json}
+         * {
+         *   "algorithm" : "sha256",
+         *   "files" : {
+         *     "css/main.css" : { "hash" : "...", "inode" : 1234, "mtime" : 1580000000000000000, "size" : 42 }
+         *   }
+         * }
+         * @endcode
+         *
+         *  Example Usage:
+         *  --------------
+         *
+         *  @code{.cpp}
+         *  #include <Manifest.h>
+         *  #include <iostream>
+         *
+         *  using namespace giri;
+         *
+         *  int main()
+         *  {
+         *      FileSystem::ManifestBuilder builder(FileSystem::HashAlgorithm::SHA256);
+         *      json::JSON manifest = builder.build("/var/www/assets");
+         *      std::cout << manifest << std::endl;
+         *      // ... files change ...
+         *      manifest = builder.build("/var/www/assets"); // only rehashes changed files
+         *      return EXIT_SUCCESS;
+         *  }
+         *  @endcode
+         */
+        class ManifestBuilder : public Object<ManifestBuilder>
+        {
+        public:
+            /**
+             * @param algo Hash algorithm to use. (defaults to SHA-256)
+             * @param threads Number of threads used to walk and hash. (defaults to the number of cores)
+             */
+            explicit ManifestBuilder(HashAlgorithm algo = HashAlgorithm::SHA256, size_t threads = std::thread::hardware_concurrency()) :
+                m_Algo(algo),
+                m_Threads(threads ? threads : 1) {}
+
+            /**
+             * Builds the manifest of a directory tree. Throws FileSystemException
+             * if root is not a directory or a file cannot be hashed.
+             * @param root Directory to build the manifest for.
+             * @param prune Optional handler returning true for directories which should be skipped.
+             * @returns The manifest.
+             */
+            json::JSON build(const std::filesystem::path& root, std::function<bool(const DirEntry&)> prune = nullptr) {
+                std::vector<DirEntry> files;
+                std::mutex mutex;
+                WalkOptions opts;
+                opts.Threads = m_Threads;
+                opts.Prune = std::move(prune);
+                opts.Filter = [](const DirEntry& e){ return e.Type == std::filesystem::file_type::regular; };
+                WalkDirectoryBatched(root, [&](std::vector<DirEntry>&& batch){
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::move(batch.begin(), batch.end(), std::back_inserter(files));
+                }, opts);
+
+                std::vector<std::string> hashes(files.size());
+                std::atomic<size_t> next{0};
+                std::atomic<size_t> hits{0};
+                std::exception_ptr error;
+                auto work = [&]{
+                    Hasher hasher(m_Algo);
+                    for(size_t i = next++; i < files.size(); i = next++) {
+                        auto cached = m_Cache.find(key(files[i]));
+                        if(cached != m_Cache.end()) {
+                            hashes[i] = cached->second;
+                            ++hits;
+                            continue;
+                        }
+                        try {
+                            hasher.reset();
+                            hasher.updateFile(files[i].Path);
+                            hashes[i] = hasher.final();
+                        }
+                        catch(...) {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            if(!error)
+                                error = std::current_exception();
+                            next = files.size();
+                        }
+                    }
+                };
+                std::vector<std::thread> threads;
+                for(size_t i = 1; i < std::min(m_Threads, files.size()); i++)
+                    threads.emplace_back(work);
+                work();
+                for(auto& t : threads)
+                    t.join();
+                if(error)
+                    std::rethrow_exception(error);
+                m_CacheHits = hits;
+
+                json::JSON manifest = json::Object();
+                manifest["algorithm"] = algorithmName(m_Algo);
+                json::JSON& list = manifest["files"] = json::Object();
+                std::map<Key, std::string> cache;
+                for(size_t i = 0; i < files.size(); i++) {
+                    const DirEntry& e = files[i];
+                    json::JSON& entry = list[e.Path.lexically_relative(root).generic_string()] = json::Object();
+                    entry["hash"] = hashes[i];
+                    entry["size"] = static_cast<long long>(e.Size);
+                    entry["mtime"] = static_cast<long long>(e.MTime);
+                    entry["inode"] = static_cast<long long>(e.Inode);
+                    cache.emplace(key(e), std::move(hashes[i]));
+                }
+                m_Cache = std::move(cache); // only keep entries of existing files
+                return manifest;
+            }
+            /**
+             * Seeds the cache with the entries of a previously built manifest. Entries
+             * built with another algorithm are ignored.
+             * @param manifest Manifest previously returned by build().
+             */
+            void loadCache(const json::JSON& manifest) {
+                if(!manifest.hasKey("algorithm") || !manifest.hasKey("files") || manifest.at("algorithm").ToString() != algorithmName(m_Algo))
+                    return;
+                for(const auto& [path, entry] : manifest.at("files").ObjectRange()) {
+                    if(!entry.hasKey("hash") || !entry.hasKey("size") || !entry.hasKey("mtime") || !entry.hasKey("inode"))
+                        continue;
+                    Key k{static_cast<uint64_t>(entry.at("inode").ToInt()), entry.at("mtime").ToInt(), static_cast<uint64_t>(entry.at("size").ToInt())};
+                    m_Cache[k] = entry.at("hash").ToString();
+                }
+            }
+            /**
+             * Drops all cached hashes.
+             */
+            void clearCache() {
+                m_Cache.clear();
+            }
+            /**
+             * @returns Number of files taken from the cache by the last build().
+             */
+            size_t getCacheHits() const {
+                return m_CacheHits;
+            }
+            /**
+             * @returns Name of the algorithm as used within manifests.
+             */
+            static std::string algorithmName(HashAlgorithm algo) {
+                return algo == HashAlgorithm::SHA256 ? "sha256" : "xxh64";
+            }
+            using SPtr = std::shared_ptr<ManifestBuilder>;
+            using UPtr = std::unique_ptr<ManifestBuilder>;
+            using WPtr = std::weak_ptr<ManifestBuilder>;
+        private:
+            using Key = std::tuple<uint64_t, int64_t, uint64_t>; // inode, mtime, size
+            static Key key(const DirEntry& e) {
+                return Key{e.Inode, e.MTime, e.Size};
+            }
+
+            HashAlgorithm m_Algo;
+            size_t m_Threads;
+            size_t m_CacheHits = 0;
+            std::map<Key, std::string> m_Cache;
+        };
+    }
+}
+#endif //SUPPORTLIB_MANIFEST_H
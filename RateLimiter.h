@@ -0,0 +1,427 @@
+/**
+ * @file RateLimiter.h
+ * @brief Limits the request rate per client address.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_RATELIMITER_H
+#define SUPPORTLIB_RATELIMITER_H
+#include "Object.h"
+#include "Exception.h"
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/address_v6.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#if defined(__linux__)
+#include <time.h>
+#endif
+
+namespace giri {
+
+    /**
+     *  @brief Exception to be thrown on RateLimiter errors.
+     */
+    class RateLimiterException : public ExceptionBase
+    {
+    public:
+        RateLimiterException(const std::string &msg) : ExceptionBase(msg) {};
+        using SPtr = std::shared_ptr<RateLimiterException>;
+        using UPtr = std::unique_ptr<RateLimiterException>;
+        using WPtr = std::weak_ptr<RateLimiterException>;
+    };
+
+    /**
+     * @brief Rate and burst of a limit, see RateLimiter.
+     */
+    struct RateLimit {
+        double Rate = 0;  ///< Requests per second, 0 for unlimited.
+        double Burst = 1; ///< Requests admitted at once after a client was idle, at least 1.
+
+        /**
+         * @returns true if the rate is limited.
+         */
+        explicit operator bool() const {
+            return Rate > 0;
+        }
+    };
+
+    /**
+     * @brief Limits the request rate per client address.
+     *
+     * Every client has a virtual token bucket, kept as the generic cell rate algorithm
+     * (GCRA): a single timestamp per client tells when the bucket is full again. Buckets
+     * are refilled lazily by comparing it to the current time, nothing runs in the
+     * background. Clients are kept in independently locked shards of open addressing
+     * tables with a fixed capacity, the least recently seen client of a shard is evicted
+     * once it is full. Evicted clients are usually idle ones, whose bucket is full anyway.
+     *
+     * Limits are set per network (longest prefix wins), routes of a HTTPServer can add
+     * their own limits, see HTTPRouteOptions::Limit. IPv6 clients are counted per /64
+     * by default, as a single host usually owns all of it. Limits need to be set before
+     * the limiter is used, check() may then be called from any thread.
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  #include <HTTPServer.h>
+     *
+     *  using namespace giri;
+     *
+     *  int main()
+     *  {
+     *      RateLimiter::SPtr limiter = std::make_shared<RateLimiter>(RateLimit{50, 100}); // 50 requests per second, bursts of 100
+     *      limiter->setLimit("10.0.0.0/8", RateLimit{});                                 // internal clients are not limited
+     *      limiter->setLimit("203.0.113.0/24", RateLimit{5, 10});
+     *
+     *      auto srv = std::make_shared<HTTPServer>("0.0.0.0", "8080", "/var/www", 4);
+     *      srv->setRateLimiter(limiter); // answers 429 Too Many Requests above the limit
+     *      srv->run();
+     *      std::cin.get();
+     *      return EXIT_SUCCESS;
+     *  }
+     *  @endcode
+     */
+    class RateLimiter : public Object<RateLimiter>
+    {
+    public:
+        /**
+         * @brief Outcome of a check.
+         */
+        struct Decision {
+            bool Allowed = true;                  ///< true if the request may be served.
+            std::chrono::nanoseconds RetryAfter{0}; ///< Time until the request would be admitted, if it was not.
+
+            /**
+             * @returns true if the request may be served.
+             */
+            explicit operator bool() const {
+                return Allowed;
+            }
+        };
+
+        /**
+         * RateLimiter constructor.
+         * @param limit Limit of clients not matching a network set with setLimit. (unlimited by default)
+         * @param capacity Maximum number of clients tracked at once, about 64 bytes each.
+         */
+        explicit RateLimiter(RateLimit limit = {}, size_t capacity = 65536) :
+            m_Default(limit),
+            m_Seed(std::random_device()() | (static_cast<uint64_t>(std::random_device()()) << 32)) // unpredictable placement of clients
+        {
+            const size_t perShard = std::max<size_t>(1, (capacity + m_Shards.size() - 1) / m_Shards.size());
+            size_t slots = 2;
+            while(slots < 2 * perShard)
+                slots *= 2;
+            for(auto& s : m_Shards) {
+                s.Entries.resize(perShard);
+                s.Index.assign(slots, 0);
+            }
+            m_Capacity = perShard * m_Shards.size();
+        #if defined(__linux__)
+            timespec res{};
+            if(clock_getres(CLOCK_MONOTONIC_COARSE, &res) == 0)
+                m_Resolution = res.tv_sec * 1000000000ll + res.tv_nsec;
+        #endif
+        }
+        /**
+         * Sets the limit of clients not matching any network.
+         * @param limit Default limit, unlimited if Rate is 0.
+         */
+        void setLimit(RateLimit limit) {
+            m_Default = limit;
+        }
+        /**
+         * Sets the limit of a network, the longest matching network of a client is used.
+         * Throws RateLimiterException on invalid networks.
+         * @param network Address or network in CIDR notation, e.g. "192.168.0.0/16" or "2001:db8::/32".
+         * @param limit Limit of clients within the network, unlimited if Rate is 0.
+         */
+        void setLimit(const std::string& network, RateLimit limit) {
+            const size_t slash = network.find('/');
+            boost::system::error_code ec;
+            const auto address = boost::asio::ip::make_address(network.substr(0, slash), ec);
+            if(ec)
+                throw RateLimiterException("Set limit: invalid address '" + network + "'");
+            const unsigned max = address.is_v4() ? 32 : 128;
+            unsigned bits = max;
+            if(slash != std::string::npos) {
+                char* end = nullptr;
+                const unsigned long len = std::strtoul(network.c_str() + slash + 1, &end, 10);
+                if(slash + 1 == network.size() || *end != '\0' || len > max)
+                    throw RateLimiterException("Set limit: invalid prefix length '" + network + "'");
+                bits = static_cast<unsigned>(len);
+            }
+            Rule rule{mask(key(address), address.is_v4() ? 96 + bits : bits), address.is_v4() ? 96 + bits : bits, limit};
+            auto it = std::find_if(m_Rules.begin(), m_Rules.end(), [&](const Rule& r){ return r.Bits == rule.Bits && r.Network == rule.Network; });
+            if(it != m_Rules.end())
+                it->Limit = limit;
+            else
+                m_Rules.insert(std::upper_bound(m_Rules.begin(), m_Rules.end(), rule, [](const Rule& a, const Rule& b){ return a.Bits > b.Bits; }), rule);
+        }
+        /**
+         * Sets how many leading bits of an address identify a client, clients sharing
+         * them are limited together.
+         * @param v4Bits Prefix length of IPv4 clients. (defaults to 32)
+         * @param v6Bits Prefix length of IPv6 clients. (defaults to 64)
+         */
+        void setClientPrefix(unsigned v4Bits, unsigned v6Bits) {
+            m_V4Bits = std::min(v4Bits, 32u);
+            m_V6Bits = std::min(v6Bits, 128u);
+        }
+        /**
+         * @param client Address of the client.
+         * @returns Limit of a client, the one of its longest matching network or the default.
+         */
+        const RateLimit& getLimit(const boost::asio::ip::address& client) const {
+            return rule(key(client));
+        }
+        /**
+         * Checks a request against the limit of the client's network.
+         * @param client Address of the client.
+         * @returns Whether the request may be served.
+         */
+        Decision check(const boost::asio::ip::address& client) {
+            const Key k = key(client);
+            const RateLimit& limit = rule(k);
+            if(!limit)
+                return {};
+            return admit(k, limit, 0);
+        }
+        /**
+         * Checks a request against a limit of its own, e.g. the one of a route.
+         * The limit is counted separately from other scopes of the same client.
+         * @param client Address of the client.
+         * @param limit Limit to check against.
+         * @param scope Identifies the limit, other than 0 (used by check(client)).
+         * @returns Whether the request may be served.
+         */
+        Decision check(const boost::asio::ip::address& client, const RateLimit& limit, uint64_t scope) {
+            if(!limit)
+                return {};
+            return admit(key(client), limit, scope);
+        }
+        /**
+         * Forgets all clients, their buckets are full again.
+         */
+        void clear() {
+            for(auto& s : m_Shards) {
+                std::lock_guard<std::mutex> lock(s.Mutex);
+                std::fill(s.Index.begin(), s.Index.end(), 0);
+                s.Used = 0;
+                s.Newest = s.Oldest = Nil;
+            }
+        }
+        /**
+         * @returns Number of clients currently tracked.
+         */
+        size_t getSize() {
+            size_t size = 0;
+            for(auto& s : m_Shards) {
+                std::lock_guard<std::mutex> lock(s.Mutex);
+                size += s.Used;
+            }
+            return size;
+        }
+        /**
+         * @returns Maximum number of clients tracked at once.
+         */
+        size_t getCapacity() const {
+            return m_Capacity;
+        }
+        /**
+         * @returns Number of rejected requests.
+         */
+        uint64_t getRejected() const {
+            return m_Rejected.load(std::memory_order_relaxed);
+        }
+        /**
+         * @returns Number of clients evicted before their bucket was full again, non zero if the capacity is too small.
+         */
+        uint64_t getEvicted() const {
+            return m_Evicted.load(std::memory_order_relaxed);
+        }
+        using SPtr = std::shared_ptr<RateLimiter>;
+        using UPtr = std::unique_ptr<RateLimiter>;
+        using WPtr = std::weak_ptr<RateLimiter>;
+    private:
+        using Key = boost::asio::ip::address_v6::bytes_type; // IPv4 addresses are mapped to IPv6
+        static constexpr uint32_t Nil = ~0u;
+
+        struct Rule {
+            Key Network;
+            unsigned Bits; // of the mapped address
+            RateLimit Limit;
+        };
+        struct Entry {
+            uint64_t Hi = 0, Lo = 0, Scope = 0;
+            uint64_t Hash = 0;
+            int64_t Full = 0; // time the bucket is full again (theoretical arrival time)
+            uint32_t Newer = Nil, Older = Nil;
+        };
+        struct alignas(64) Shard {
+            std::mutex Mutex;
+            std::vector<uint32_t> Index;  // linear probing, entry + 1, 0 if empty
+            std::vector<Entry> Entries;
+            uint32_t Used = 0;
+            uint32_t Newest = Nil, Oldest = Nil; // least recently used list
+        };
+
+        static Key key(const boost::asio::ip::address& address) {
+            if(address.is_v4())
+                return boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes();
+            return address.to_v6().to_bytes();
+        }
+        static Key mask(Key k, unsigned bits) {
+            for(size_t i = 0; i < k.size(); i++, bits = bits > 8 ? bits - 8 : 0)
+                if(bits < 8)
+                    k[i] &= static_cast<unsigned char>(0xff00 >> bits);
+            return k;
+        }
+        static bool matches(const Key& k, const Rule& r) {
+            const size_t bytes = r.Bits / 8;
+            if(std::memcmp(k.data(), r.Network.data(), bytes) != 0)
+                return false;
+            return r.Bits % 8 == 0 || ((k[bytes] ^ r.Network[bytes]) & static_cast<unsigned char>(0xff00 >> (r.Bits % 8))) == 0;
+        }
+        const RateLimit& rule(const Key& k) const {
+            for(const auto& r : m_Rules) // longest first
+                if(matches(k, r))
+                    return r.Limit;
+            return m_Default;
+        }
+        int64_t now() const {
+        #if defined(__linux__)
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // a few ns, the resolution is added to the burst tolerance
+            return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+        #else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        #endif
+        }
+        Decision admit(const Key& address, const RateLimit& limit, uint64_t scope) {
+            const bool v4 = boost::asio::ip::address_v6(address).is_v4_mapped();
+            const Key k = mask(address, v4 ? 96 + m_V4Bits : m_V6Bits);
+            uint64_t hi, lo;
+            std::memcpy(&hi, k.data(), sizeof(hi));
+            std::memcpy(&lo, k.data() + sizeof(hi), sizeof(lo));
+            const uint64_t hash = mix(mix(hi ^ m_Seed) ^ lo ^ (scope * 0x9e3779b97f4a7c15ull));
+            const int64_t interval = static_cast<int64_t>(1e9 / limit.Rate);
+            const int64_t tolerance = std::max(static_cast<int64_t>(std::max(limit.Burst, 1.0) * 1e9 / limit.Rate), interval + m_Resolution);
+            const int64_t t = now();
+
+            Shard& s = m_Shards[hash >> 58];
+            std::lock_guard<std::mutex> lock(s.Mutex);
+            Entry& e = find(s, hash, hi, lo, scope, t);
+            const int64_t full = std::max(e.Full, t) + interval;
+            if(full - t > tolerance) {
+                m_Rejected.fetch_add(1, std::memory_order_relaxed);
+                return {false, std::chrono::nanoseconds(full - t - tolerance)};
+            }
+            e.Full = full;
+            return {};
+        }
+        Entry& find(Shard& s, uint64_t hash, uint64_t hi, uint64_t lo, uint64_t scope, int64_t t) {
+            const size_t mask = s.Index.size() - 1;
+            size_t pos = hash & mask;
+            for(uint32_t i; (i = s.Index[pos]) != 0; pos = (pos + 1) & mask) {
+                Entry& e = s.Entries[i - 1];
+                if(e.Hash == hash && e.Hi == hi && e.Lo == lo && e.Scope == scope) {
+                    touch(s, i - 1);
+                    return e;
+                }
+            }
+            uint32_t i;
+            if(s.Used < s.Entries.size())
+                i = s.Used++;
+            else { // full, reuse the least recently used entry
+                i = s.Oldest;
+                if(s.Entries[i].Full > t)
+                    m_Evicted.fetch_add(1, std::memory_order_relaxed);
+                erase(s, i);
+                unlink(s, i);
+                for(pos = hash & mask; s.Index[pos] != 0; pos = (pos + 1) & mask); // erasing may have moved the free slot
+            }
+            Entry& e = s.Entries[i];
+            e.Hi = hi;
+            e.Lo = lo;
+            e.Scope = scope;
+            e.Hash = hash;
+            e.Full = t;
+            s.Index[pos] = i + 1;
+            e.Older = s.Newest;
+            e.Newer = Nil;
+            if(s.Newest != Nil)
+                s.Entries[s.Newest].Newer = i;
+            s.Newest = i;
+            if(s.Oldest == Nil)
+                s.Oldest = i;
+            return e;
+        }
+        static void erase(Shard& s, uint32_t i) { // removes an entry from the index, backward shift deletion
+            const size_t mask = s.Index.size() - 1;
+            size_t pos = s.Entries[i].Hash & mask;
+            while(s.Index[pos] != i + 1)
+                pos = (pos + 1) & mask;
+            for(size_t next = (pos + 1) & mask; s.Index[next] != 0; next = (next + 1) & mask) {
+                const size_t home = s.Entries[s.Index[next] - 1].Hash & mask;
+                if(((next - home) & mask) >= ((next - pos) & mask)) { // may move back without passing its home
+                    s.Index[pos] = s.Index[next];
+                    pos = next;
+                }
+            }
+            s.Index[pos] = 0;
+        }
+        static void unlink(Shard& s, uint32_t i) {
+            Entry& e = s.Entries[i];
+            if(e.Newer != Nil)
+                s.Entries[e.Newer].Older = e.Older;
+            else
+                s.Newest = e.Older;
+            if(e.Older != Nil)
+                s.Entries[e.Older].Newer = e.Newer;
+            else
+                s.Oldest = e.Newer;
+        }
+        static void touch(Shard& s, uint32_t i) {
+            if(s.Newest == i)
+                return;
+            unlink(s, i);
+            Entry& e = s.Entries[i];
+            e.Older = s.Newest;
+            e.Newer = Nil;
+            s.Entries[s.Newest].Newer = i;
+            s.Newest = i;
+        }
+        static uint64_t mix(uint64_t h) { // splitmix64 finalizer
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+            return h ^ (h >> 31);
+        }
+
+        RateLimit m_Default;
+        std::vector<Rule> m_Rules; // longest prefix first
+        unsigned m_V4Bits = 32;
+        unsigned m_V6Bits = 64;
+        uint64_t m_Seed;
+        int64_t m_Resolution = 0; // of the clock in ns
+        size_t m_Capacity = 0;
+        std::atomic<uint64_t> m_Rejected{0};
+        std::atomic<uint64_t> m_Evicted{0};
+        std::array<Shard, 64> m_Shards;
+    };
+}
+#endif //SUPPORTLIB_RATELIMITER_H
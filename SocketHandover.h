@@ -0,0 +1,187 @@
+/**
+ * @file SocketHandover.h
+ * @brief Passes listening sockets to a new process, e.g. to restart a server without downtime.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_SOCKETHANDOVER_H
+#define SUPPORTLIB_SOCKETHANDOVER_H
+#include "Object.h"
+#include "Exception.h"
+#include <boost/asio/ip/tcp.hpp>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+namespace giri {
+
+    /**
+     *  @brief Exception to be thrown on SocketHandover errors.
+     */
+    class SocketHandoverException : public ExceptionBase
+    {
+    public:
+        SocketHandoverException(const std::string &msg) : ExceptionBase(msg) {};
+        using SPtr = std::shared_ptr<SocketHandoverException>;
+        using UPtr = std::unique_ptr<SocketHandoverException>;
+        using WPtr = std::weak_ptr<SocketHandoverException>;
+    };
+
+    /**
+     * @brief Passes listening sockets to a new process.
+     *
+     * Sockets are passed the way systemd socket activation does it: the new process
+     * inherits them as file descriptors 3, 4, ... and the environment variables
+     * LISTEN_FDS and LISTEN_PID tell how many there are and whom they are meant for.
+     * HTTPServer and WebSocketServer adopt inherited sockets bound to their endpoint
+     * instead of binding a new one, so they work with systemd socket units as well.
+     *
+     * Both processes accept connections from the same kernel queue until the old one
+     * was stopped, no connection is refused during the restart. Only supported on Linux.
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  // old process, e.g. on SIGHUP after the binary was updated
+     *  srv->handover({"/proc/self/exe", "--config", "/etc/myserver.conf"});
+     *  srv->stop(std::chrono::seconds(30)); // completes the requests in flight
+     *
+     *  // new process, the constructor adopts the inherited socket
+     *  auto srv = std::make_shared<HTTPServer>("0.0.0.0", "443", "/var/www", 4, true, cert, key);
+     *  srv->run();
+     *  @endcode
+     */
+    class SocketHandover : public Object<SocketHandover>
+    {
+    public:
+        /**
+         * @returns true if sockets can be passed on this platform.
+         */
+        static constexpr bool supported() {
+        #if defined(__linux__)
+            return true;
+        #else
+            return false;
+        #endif
+        }
+        /**
+         * Looks for inherited listening sockets bound to an endpoint. Found sockets
+         * are not passed on to further child processes (close on exec).
+         * @param endpoint Endpoint the sockets have to be bound to.
+         * @returns Native handles of the sockets, empty if none were inherited.
+         */
+        static std::vector<int> inherited(const boost::asio::ip::tcp::endpoint& endpoint) {
+            std::vector<int> fds;
+        #if defined(__linux__)
+            const char* count = std::getenv("LISTEN_FDS");
+            const char* pid = std::getenv("LISTEN_PID");
+            if(!count || (pid && std::strtol(pid, nullptr, 10) != static_cast<long>(getpid())))
+                return fds; // not meant for this process
+            const long n = std::strtol(count, nullptr, 10);
+            for(int fd = FirstFd; n > 0 && fd < FirstFd + n; ++fd) {
+                int listening = 0;
+                socklen_t len = sizeof(listening);
+                if(getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening)
+                    continue;
+                boost::asio::ip::tcp::endpoint local;
+                len = static_cast<socklen_t>(local.capacity());
+                if(getsockname(fd, local.data(), &len) != 0)
+                    continue;
+                local.resize(len);
+                if(local != endpoint)
+                    continue;
+                fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+                fds.push_back(fd);
+            }
+        #else
+            (void)endpoint;
+        #endif
+            return fds;
+        }
+        /**
+         * Starts a new process which inherits sockets, throws SocketHandoverException on error.
+         * The sockets stay open in this process, they are usually closed by stopping the server.
+         * All other descriptors except standard input, output and error are closed in the new process.
+         * @param argv Path of the program and its arguments, e.g. "/proc/self/exe" to start the (updated) binary again.
+         * @param sockets Native handles of the sockets to pass.
+         * @returns Process id of the new process.
+         */
+        static long spawn(const std::vector<std::string>& argv, const std::vector<int>& sockets) {
+            if(argv.empty())
+                throw SocketHandoverException("Spawn: no program given");
+        #if defined(__linux__)
+            // everything the child needs is prepared up front, it may only call async-signal-safe functions
+            std::vector<std::string> env;
+            for(char** e = environ; e && *e; ++e)
+                if(std::strncmp(*e, "LISTEN_FDS=", 11) != 0 && std::strncmp(*e, "LISTEN_PID=", 11) != 0 && std::strncmp(*e, "LISTEN_FDNAMES=", 15) != 0)
+                    env.emplace_back(*e);
+            env.push_back("LISTEN_FDS=" + std::to_string(sockets.size()));
+            env.push_back("LISTEN_PID=" + std::string(20, '\0')); // filled in by the child
+            std::vector<char*> envp, args;
+            for(auto& e : env)
+                envp.push_back(&e[0]);
+            envp.push_back(nullptr);
+            for(const auto& a : argv)
+                args.push_back(const_cast<char*>(a.c_str()));
+            args.push_back(nullptr);
+            char* pidValue = envp[env.size() - 1] + 11;
+            const int target = FirstFd + static_cast<int>(sockets.size());
+            std::vector<int> moved(sockets.size(), -1);
+            const long maxFd = sysconf(_SC_OPEN_MAX);
+
+            const pid_t pid = fork();
+            if(pid < 0)
+                throw SocketHandoverException(std::string("Spawn: fork() failed: ") + std::strerror(errno));
+            if(pid == 0) {
+                for(size_t i = 0; i < sockets.size(); ++i) // out of the way first, a socket may already use a target number
+                    if((moved[i] = fcntl(sockets[i], F_DUPFD, target)) < 0)
+                        _exit(127);
+                for(size_t i = 0; i < sockets.size(); ++i) {
+                    if(dup2(moved[i], FirstFd + static_cast<int>(i)) < 0) // clears close on exec
+                        _exit(127);
+                    close(moved[i]);
+                }
+                // nothing else is passed on, e.g. client connections would never see EOF while this process drains
+            #if defined(SYS_close_range)
+                if(syscall(SYS_close_range, static_cast<unsigned>(target), ~0U, 0U) != 0)
+            #endif
+                    for(long fd = target; fd < maxFd; ++fd)
+                        close(static_cast<int>(fd));
+                char digits[20];
+                int len = 0;
+                for(long p = getpid(); p > 0 || len == 0; p /= 10)
+                    digits[len++] = static_cast<char>('0' + p % 10);
+                while(len > 0)
+                    *pidValue++ = digits[--len];
+                execve(args[0], args.data(), envp.data());
+                _exit(127);
+            }
+            return static_cast<long>(pid);
+        #else
+            (void)sockets;
+            throw SocketHandoverException("Spawn: passing sockets is not supported on this platform");
+        #endif
+        }
+        using SPtr = std::shared_ptr<SocketHandover>;
+        using UPtr = std::unique_ptr<SocketHandover>;
+        using WPtr = std::weak_ptr<SocketHandover>;
+    private:
+        static constexpr int FirstFd = 3; // SD_LISTEN_FDS_START
+    };
+}
+#endif //SUPPORTLIB_SOCKETHANDOVER_H
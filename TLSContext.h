@@ -0,0 +1,252 @@
+/**
+ * @file TLSContext.h
+ * @brief Shared, hot reloadable TLS server context.
+ * @author Daniel Giritzer
+ * @copyright "THE BEER-WARE LICENSE" (Revision 42):
+ * <giri@nwrk.biz> wrote this file. As long as you retain this notice you
+ * can do whatever you want with this stuff. If we meet some day, and you think
+ * this stuff is worth it, you can buy me a beer in return Daniel Giritzer
+ */
+#ifndef SUPPORTLIB_TLSCONTEXT_H
+#define SUPPORTLIB_TLSCONTEXT_H
+#include "Object.h"
+#include "Exception.h"
+#include <boost/asio/ssl/context.hpp>
+#include <openssl/ssl.h>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace giri {
+
+    /**
+     *  @brief Exception to be thrown on TLS context errors.
+     */
+    class TLSContextException : public ExceptionBase
+    {
+    public:
+        TLSContextException(const std::string &msg) : ExceptionBase(msg) {};
+        using SPtr = std::shared_ptr<TLSContextException>;
+        using UPtr = std::unique_ptr<TLSContextException>;
+        using WPtr = std::weak_ptr<TLSContextException>;
+    };
+
+    /**
+     * @brief TLS server context shared by all connections of a server.
+     *
+     * Certificate and key are loaded once instead of once per connection. The
+     * context allows TLS 1.2 and 1.3 only, prefers forward secret AEAD ciphers,
+     * enables a server side session cache and session tickets for resumption, and
+     * negotiates the application protocol (ALPN). reload() loads the certificate
+     * again and atomically replaces the context, established connections keep the
+     * context they were created with. Session ticket keys are carried over, so
+     * clients can still resume after a reload.
+     *
+     *  Example Usage:
+     *  --------------
+     *
+     *  @code{.cpp}
+     *  #include <TLSContext.h>
+     *
+     *  using namespace giri;
+     *
+     *  int main()
+     *  {
+     *      TLSContext::SPtr tls = std::make_shared<TLSContext>("cert.pem", "key.pem");
+     *      std::shared_ptr<ssl::context> ctx = tls->get(); // use for new connections
+     *      // ... certificate got renewed
+     *      tls->reload();
+     *      return EXIT_SUCCESS;
+     *  }
+     *  @endcode
+     */
+    class TLSContext : public Object<TLSContext>
+    {
+    public:
+        /**
+         * TLSContext constructor. Throws TLSContextException if certificate or key cannot be loaded.
+         * @param cert Path to certificate (chain) file in *.pem format.
+         * @param key Path to private key file in *.pem format.
+         * @param alpn Supported application protocols in order of preference. (defaults to http/1.1)
+         */
+        TLSContext(const std::filesystem::path& cert, const std::filesystem::path& key, const std::vector<std::string>& alpn = {"http/1.1"}) :
+            m_Cert(cert),
+            m_Key(key),
+            m_Alpn(encodeAlpn(alpn))
+        {
+            std::atomic_store(&m_Ctx, build(nullptr));
+        }
+        /**
+         * @returns Context to be used for new connections.
+         */
+        std::shared_ptr<boost::asio::ssl::context> get() const {
+            return std::atomic_load(&m_Ctx);
+        }
+        /**
+         * Loads certificate and key again and replaces the context used for new
+         * connections. Throws TLSContextException on error, the current context stays in use then.
+         */
+        void reload() {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            std::atomic_store(&m_Ctx, build(get()));
+        }
+        /**
+         * Loads a new certificate and key and replaces the context used for new
+         * connections. Throws TLSContextException on error, the current context stays in use then.
+         * @param cert Path to certificate (chain) file in *.pem format.
+         * @param key Path to private key file in *.pem format.
+         */
+        void reload(const std::filesystem::path& cert, const std::filesystem::path& key) {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            std::filesystem::path oldCert = m_Cert;
+            std::filesystem::path oldKey = m_Key;
+            m_Cert = cert;
+            m_Key = key;
+            try {
+                std::atomic_store(&m_Ctx, build(get()));
+            }
+            catch(...) {
+                m_Cert = oldCert;
+                m_Key = oldKey;
+                throw;
+            }
+        }
+        /**
+         * Sets the application protocols offered via ALPN and replaces the context used
+         * for new connections. Throws TLSContextException on error, the current context stays in use then.
+         * @param alpn Supported application protocols in order of preference, e.g. {"h2", "http/1.1"}.
+         */
+        void setProtocols(const std::vector<std::string>& alpn) {
+            std::vector<unsigned char> list = encodeAlpn(alpn);
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            std::swap(m_Alpn, list);
+            try {
+                std::atomic_store(&m_Ctx, build(get()));
+            }
+            catch(...) {
+                m_Alpn = std::move(list);
+                throw;
+            }
+        }
+        /**
+         * @returns Path to the used certificate *.pem file.
+         */
+        std::filesystem::path getCert() const {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            return m_Cert;
+        }
+        /**
+         * @returns Path to the used private key *.pem file.
+         */
+        std::filesystem::path getKey() const {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            return m_Key;
+        }
+        /**
+         * @returns Number of resumed sessions (session cache hits) of the current context.
+         */
+        long getSessionCacheHits() const {
+            return SSL_CTX_sess_hits(get()->native_handle());
+        }
+        /**
+         * @returns Number of completed server handshakes of the current context.
+         */
+        long getHandshakes() const {
+            return SSL_CTX_sess_accept_good(get()->native_handle());
+        }
+        /**
+         * @returns The application protocol negotiated for a connection, empty if none.
+         * @param ssl Native handle of the connection.
+         */
+        static std::string negotiatedProtocol(SSL* ssl) {
+            const unsigned char* proto = nullptr;
+            unsigned int len = 0;
+            SSL_get0_alpn_selected(ssl, &proto, &len);
+            return proto ? std::string(reinterpret_cast<const char*>(proto), len) : std::string();
+        }
+        using SPtr = std::shared_ptr<TLSContext>;
+        using UPtr = std::unique_ptr<TLSContext>;
+        using WPtr = std::weak_ptr<TLSContext>;
+    private:
+        // Keeps the ALPN list alive as long as the context, the select callback points to it.
+        struct Holder {
+            boost::asio::ssl::context Ctx{boost::asio::ssl::context::tls_server};
+            std::vector<unsigned char> Alpn;
+        };
+
+        static std::vector<unsigned char> encodeAlpn(const std::vector<std::string>& alpn) { // length prefixed protocol names
+            std::vector<unsigned char> list;
+            for(const auto& proto : alpn) {
+                if(proto.empty() || proto.size() > 255)
+                    throw TLSContextException("Invalid ALPN protocol: " + proto);
+                list.push_back(static_cast<unsigned char>(proto.size()));
+                list.insert(list.end(), proto.begin(), proto.end());
+            }
+            return list;
+        }
+        static int selectAlpn(SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg) {
+            const auto* alpn = static_cast<const std::vector<unsigned char>*>(arg);
+            unsigned char* selected = nullptr;
+            if(SSL_select_next_proto(&selected, outlen, alpn->data(), static_cast<unsigned int>(alpn->size()), in, inlen) != OPENSSL_NPN_NEGOTIATED)
+                return SSL_TLSEXT_ERR_NOACK;
+            *out = selected;
+            return SSL_TLSEXT_ERR_OK;
+        }
+
+        // expects m_Mutex to be locked (or to be called by the constructor)
+        std::shared_ptr<boost::asio::ssl::context> build(const std::shared_ptr<boost::asio::ssl::context>& previous) const {
+            auto holder = std::make_shared<Holder>();
+            holder->Alpn = m_Alpn;
+            auto& ctx = holder->Ctx;
+            SSL_CTX* native = ctx.native_handle();
+            ctx.set_options(boost::asio::ssl::context::default_workarounds |
+                            boost::asio::ssl::context::no_sslv2 |
+                            boost::asio::ssl::context::no_sslv3 |
+                            boost::asio::ssl::context::no_tlsv1 |
+                            boost::asio::ssl::context::no_tlsv1_1 |
+                            boost::asio::ssl::context::single_dh_use);
+            SSL_CTX_set_options(native, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION);
+            SSL_CTX_set_min_proto_version(native, TLS1_2_VERSION);
+            SSL_CTX_set_cipher_list(native, "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                                            "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+                                            "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305");
+            SSL_CTX_set_ciphersuites(native, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+            SSL_CTX_set_mode(native, SSL_MODE_RELEASE_BUFFERS); // free idle connection buffers
+
+            // resumption: stateful session cache (TLS 1.2 session ids) and tickets (TLS 1.2 + 1.3)
+            static const unsigned char sidCtx[] = "giri_supportlib";
+            SSL_CTX_set_session_id_context(native, sidCtx, sizeof(sidCtx) - 1);
+            SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(native, 20480);
+            SSL_CTX_set_timeout(native, 300);
+            if(previous) { // keep ticket keys, so tickets issued before the reload stay valid
+                unsigned char keys[80];
+                if(SSL_CTX_get_tlsext_ticket_keys(previous->native_handle(), keys, sizeof(keys)) == 1)
+                    SSL_CTX_set_tlsext_ticket_keys(native, keys, sizeof(keys));
+            }
+            if(!holder->Alpn.empty())
+                SSL_CTX_set_alpn_select_cb(native, &TLSContext::selectAlpn, &holder->Alpn);
+
+            boost::system::error_code ec;
+            ctx.use_certificate_chain_file(m_Cert.string(), ec);
+            if(ec)
+                throw TLSContextException("Certificate " + m_Cert.string() + ": " + ec.message());
+            ctx.use_private_key_file(m_Key.string(), boost::asio::ssl::context::file_format::pem, ec);
+            if(ec)
+                throw TLSContextException("Private key " + m_Key.string() + ": " + ec.message());
+            if(SSL_CTX_check_private_key(native) != 1)
+                throw TLSContextException("Private key does not match certificate: " + m_Key.string());
+            return std::shared_ptr<boost::asio::ssl::context>(holder, &holder->Ctx);
+        }
+
+        std::filesystem::path m_Cert;
+        std::filesystem::path m_Key;
+        std::vector<unsigned char> m_Alpn;
+        mutable std::mutex m_Mutex;
+        std::shared_ptr<boost::asio::ssl::context> m_Ctx;
+    };
+}
+#endif //SUPPORTLIB_TLSCONTEXT_H
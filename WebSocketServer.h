@@ -11,18 +11,27 @@
 #define SUPPORTLIB_WEBSOCKETSERVER_H
 #include "Observer.h"
 #include "Exception.h"
+#include "TLSContext.h"
+#include "IOShards.h"
+#include "SocketHandover.h"
+#include "RateLimiter.h"
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/websocket/ssl.hpp>
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <charconv>
 #include <filesystem>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -61,22 +70,19 @@ namespace giri {
          * @param cert If ssl is true, path to certificate file in *.pem format.
          * @param key If ssl is true path to private key file in *pem format.
          * @param ioc I/O context which should be used.
+         * @param tlsContext Shared TLS context to use if ssl is true. (optional, a context is created from cert and key if not set)
          */
-        explicit WebSocketSession(tcp::socket socket, bool ssl, const std::filesystem::path& cert, const std::filesystem::path& key, boost::asio::io_context& ioc) :
+        explicit WebSocketSession(tcp::socket socket, bool ssl, const std::filesystem::path& cert, const std::filesystem::path& key, boost::asio::io_context& ioc, std::shared_ptr<ssl::context> tlsContext = nullptr) :
             m_Socket(std::move(socket)),
             m_SSL(ssl),
+            m_Ctx(std::move(tlsContext)),
             m_Strand(boost::asio::make_strand(ioc))
         {
             if(m_SSL)
             { 
-                m_Ctx.set_options(boost::asio::ssl::context::default_workarounds |
-                                boost::asio::ssl::context::no_sslv2 |
-                                boost::asio::ssl::context::no_sslv3 |
-                                boost::asio::ssl::context::no_tlsv1 |
-                                boost::asio::ssl::context::single_dh_use);
-                m_Ctx.use_certificate_chain_file(cert.string());
-                m_Ctx.use_private_key_file(key.string(), boost::asio::ssl::context::file_format::pem);
-                m_Wss = std::make_shared<websocket::stream<ssl::stream<tcp::socket&> >>(m_Socket, m_Ctx);
+                if(!m_Ctx)
+                    m_Ctx = TLSContext(cert, key).get();
+                m_Wss = std::make_shared<websocket::stream<ssl::stream<tcp::socket&> >>(m_Socket, *m_Ctx);
                 m_Wss->next_layer().set_verify_mode(ssl::verify_none);
                 m_Wss->text(true);
             }
@@ -148,28 +154,72 @@ namespace giri {
                 else
                     {if(m_Ws->is_open()){m_Ws->close(websocket::close_code::normal);}}
         }
+        /**
+         * Closes the session gracefully with close code "going away", e.g. before the
+         * server stops. Observers are notified once the client answered the close frame.
+         * May be called from any thread.
+         */
+        void drain() {
+            boost::asio::post(m_Strand, [self = this->shared_from_this()]{
+                if(self->m_Draining)
+                    return;
+                self->m_Draining = true;
+                if(self->m_Accepted)
+                    self->do_close();
+            });
+        }
         using SPtr = std::shared_ptr<WebSocketSession>;
         using UPtr = std::unique_ptr<WebSocketSession>;
         using WPtr = std::weak_ptr<WebSocketSession>;
     private:
+        friend class WebSocketServer;
+
         void on_read(boost::system::error_code ec, std::size_t bytes_transferred) {
             boost::ignore_unused(bytes_transferred);
             m_Message.clear();
             m_Ec = ec;
+            if(!ec && m_Limiter && !m_Limiter->check(m_Address, m_MessageLimit, MessageScope)) {
+                m_Buffer.consume(m_Buffer.size());
+                return do_close(websocket::close_code::try_again_later); // floods are not passed to the observers
+            }
             if(!ec)
             {
                 m_Message = boost::beast::buffers_to_string(m_Buffer.data());
             }
             m_Buffer.consume(m_Buffer.size()); // clear buffer
-            notify(); // notify all subscribed observers
+            notifyObservers();
             if(!ec)
                 do_read(); // wait for new message
         }
+        void notifyObservers() {
+            try {
+                notify(); // notify all subscribed observers
+            }
+            catch(...) { // a failing observer must not end the session or take the thread down
+            }
+        }
         void on_accept(boost::system::error_code ec) {
-            if(ec)
-                throw WebSocketServerException("Accept: " + ec.message());
+            if(ec) { // e.g. not a websocket upgrade request
+                m_Ec = ec;
+                return notifyObservers();
+            }
+            m_Accepted = true;
+            if(m_Draining)
+                do_close();
             do_read();
         }
+        void do_close(websocket::close_code code = websocket::close_code::going_away) {
+            auto handler = boost::asio::bind_executor(m_Strand, [self = this->shared_from_this()](boost::system::error_code){});
+            if(m_SSL)
+                {if(m_Wss->is_open()){m_Wss->async_close(code, std::move(handler));}}
+            else
+                {if(m_Ws->is_open()){m_Ws->async_close(code, std::move(handler));}}
+        }
+        void abort() { // closes the connection at once, needs to be called on the strand
+            boost::system::error_code ec;
+            m_Socket.shutdown(tcp::socket::shutdown_both, ec);
+            m_Socket.close(ec);
+        }
         void do_read() {
             if(m_SSL)
                 {if(m_Wss->is_open()){m_Wss->async_read(m_Buffer, boost::asio::bind_executor(m_Strand, std::bind(&WebSocketSession::on_read, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2)));}}
@@ -177,19 +227,27 @@ namespace giri {
                 {if(m_Ws->is_open()){m_Ws->async_read(m_Buffer, boost::asio::bind_executor(m_Strand, std::bind(&WebSocketSession::on_read, this->shared_from_this(), std::placeholders::_1, std::placeholders::_2)));}}
         }
         void on_handshake(boost::system::error_code ec) {
-            if(ec)
-                throw WebSocketServerException("Handshake: " + ec.message());
+            if(ec) { // e.g. the client does not speak TLS
+                m_Ec = ec;
+                return notifyObservers();
+            }
             m_Wss->async_accept(boost::asio::bind_executor(m_Strand, std::bind( &WebSocketSession::on_accept, this->shared_from_this(), std::placeholders::_1)));
         }
         tcp::socket m_Socket;
         bool m_SSL;
+        std::shared_ptr<ssl::context> m_Ctx;
         std::shared_ptr< websocket::stream<tcp::socket&> > m_Ws;
         std::shared_ptr< websocket::stream<ssl::stream<tcp::socket&> > > m_Wss;
         boost::asio::strand<boost::asio::io_context::executor_type> m_Strand;
         boost::beast::multi_buffer m_Buffer;
         std::string m_Message;
-        ssl::context m_Ctx{ssl::context::sslv23};
         boost::system::error_code m_Ec;
+        bool m_Accepted = false; // websocket handshake completed
+        bool m_Draining = false; // close once accepted
+        static constexpr uint64_t MessageScope = 1; // of message limits within the rate limiter
+        RateLimiter::SPtr m_Limiter;                // limits received messages, see WebSocketServer::setMessageLimit
+        RateLimit m_MessageLimit;
+        boost::asio::ip::address m_Address;
     };
 
     /**
@@ -262,22 +320,42 @@ namespace giri {
             m_NumThreads(numThreads),
             m_Acceptor(m_Ioc),
             m_Socket(m_Ioc),
+            m_AcceptStrand(boost::asio::make_strand(m_Ioc)),
+            m_AcceptTimer(m_AcceptStrand),
             m_Cert(cert),
             m_Key(key)
         {
             boost::system::error_code ec;
-            m_Acceptor.open(m_Endpoint.protocol(), ec);
-            if(ec)
-                throw WebSocketServerException("Open: " + ec.message());
-            m_Acceptor.set_option(boost::asio::socket_base::reuse_address(true));
-            if(ec)
-                throw WebSocketServerException("Set Option: " + ec.message());
-            m_Acceptor.bind(m_Endpoint, ec);
-            if(ec)
-                throw WebSocketServerException("Bind: " + ec.message());
-            m_Acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
-            if(ec)
-                throw WebSocketServerException("Listen: " + ec.message());
+            m_Inherited = SocketHandover::inherited(m_Endpoint);
+            if(!m_Inherited.empty()) { // passed by the previous process, see handover
+                m_Acceptor.assign(m_Endpoint.protocol(), m_Inherited.front(), ec);
+                if(ec)
+                    throw WebSocketServerException("Assign: " + ec.message());
+                m_Inherited.erase(m_Inherited.begin());
+                m_Adopted = true;
+            }
+            else {
+                m_Acceptor.open(m_Endpoint.protocol(), ec);
+                if(ec)
+                    throw WebSocketServerException("Open: " + ec.message());
+                m_Acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+                if(ec)
+                    throw WebSocketServerException("Set Option: " + ec.message());
+                m_Acceptor.bind(m_Endpoint, ec);
+                if(ec)
+                    throw WebSocketServerException("Bind: " + ec.message());
+                m_Acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+                if(ec)
+                    throw WebSocketServerException("Listen: " + ec.message());
+            }
+            if(m_SSL) {
+                try {
+                    m_TLS = std::make_shared<TLSContext>(m_Cert, m_Key);
+                }
+                catch(const TLSContextException& e) {
+                    throw WebSocketServerException(std::string("TLS: ") + e.what());
+                }
+            }
         }
         /**
          * Starts receiving messages asynchrolously. Automatically
@@ -285,12 +363,22 @@ namespace giri {
          * new connections.
          */
         void run() {
-            if(!m_Acceptor.is_open()) return;
+            if(!m_Acceptor.is_open() || m_Stopping) return;
+            if(m_Sharding && m_NumThreads > 1 && IOShards::supported()) {
+                run_sharded();
+                return;
+            }
+            for(int fd : m_Inherited) { // one acceptor is used without sharding
+                tcp::acceptor surplus(m_Ioc);
+                boost::system::error_code ec;
+                surplus.assign(m_Endpoint.protocol(), fd, ec);
+            }
+            m_Inherited.clear();
             do_accept();
 
             m_Threads.reserve(m_NumThreads);
             for(auto i = m_NumThreads; i > 0; --i)
-                m_Threads.emplace_back([this]{ m_Ioc.run();});
+                m_Threads.emplace_back([this]{ IOShards::runContext(m_Ioc); });
         }
         /**
          * When no execution threads are used you can call this function constatly to handle ready executors.
@@ -298,6 +386,79 @@ namespace giri {
         void poll() {
             m_Ioc.poll_one();
         }
+        /**
+         * Stops the server. Accepting stops at once and every session is closed with
+         * close code "going away" (see WebSocketSession::drain). Sessions still open once
+         * the drain timeout expired are closed forcibly, then the worker threads are joined.
+         * Blocks until the server was stopped, if called from a handler (e.g. an observer)
+         * another thread stops the server and the call returns at once. The server
+         * cannot be run again afterwards.
+         * @param drainTimeout Time granted to the clients to answer the close frame. (defaults to 10 seconds)
+         */
+        void stop(std::chrono::milliseconds drainTimeout = std::chrono::seconds(10)) {
+            if(m_Ioc.get_executor().running_in_this_thread() || (m_Shards && m_Shards->runningInThisThread())) {
+                std::thread([self = this->shared_from_this(), drainTimeout]{ self->stop(drainTimeout); }).detach(); // a worker cannot join itself
+                return;
+            }
+            std::lock_guard<std::mutex> lock(m_StopMutex);
+            if(m_Stopped)
+                return;
+            m_Stopping = true;
+            if(m_Shards)
+                m_Shards->close();
+            boost::asio::post(m_AcceptStrand, [self = this->shared_from_this()]{
+                boost::system::error_code ec;
+                self->m_Acceptor.close(ec);
+                self->m_AcceptTimer.cancel();
+            });
+            if(m_Threads.empty() && !m_Shards) // no worker threads, see poll
+                m_Ioc.poll();
+            {
+                std::lock_guard<std::mutex> notifyLock(m_NotifyMutex);
+                m_NewSession.reset(); // would keep the last session open
+            }
+            for(auto& session : getSessions())
+                session->drain();
+            awaitSessions(std::chrono::steady_clock::now() + drainTimeout);
+            for(auto& session : getSessions())
+                boost::asio::post(session->m_Strand, [session]{ session->abort(); });
+            awaitSessions(std::chrono::steady_clock::now() + std::chrono::milliseconds(AbortTimeout));
+            m_Ioc.stop();
+            if(m_Shards)
+                m_Shards->stop();
+            for(auto& t : m_Threads)
+                if(t.joinable())
+                    t.join();
+            m_Threads.clear();
+            m_Stopped = true;
+        }
+        /**
+         * Starts a new process which takes over the listening socket(s), see HTTPServer::handover.
+         * Throws WebSocketServerException on error.
+         * @param argv Path of the program and its arguments, e.g. {"/proc/self/exe", ...}.
+         * @returns Process id of the new process.
+         */
+        long handover(const std::vector<std::string>& argv) {
+            std::vector<int> fds;
+            if(m_Shards)
+                fds = m_Shards->getHandles();
+            else if(!m_Stopping && m_Acceptor.is_open())
+                fds.push_back(static_cast<int>(m_Acceptor.native_handle()));
+            if(fds.empty())
+                throw WebSocketServerException("Handover: the server is not listening");
+            try {
+                return SocketHandover::spawn(argv, fds);
+            }
+            catch(const SocketHandoverException& e) {
+                throw WebSocketServerException(std::string("Handover: ") + e.what());
+            }
+        }
+        /**
+         * @returns true once stop() was called.
+         */
+        bool isStopping() const {
+            return m_Stopping;
+        }
         /**
          * @returns last created session.
          */
@@ -322,20 +483,198 @@ namespace giri {
         std::filesystem::path getKey() const {
             return m_Key;
         }
+        /**
+         * Enables sharding, needs to be called before run(). Every worker thread
+         * gets its own io_context and SO_REUSEPORT acceptor and is pinned to a CPU,
+         * see HTTPServer::setSharding.
+         * @param enable true to enable sharding. (defaults to false)
+         */
+        void setSharding(bool enable) {
+            m_Sharding = enable;
+        }
+        /**
+         * @returns true if sharding is enabled.
+         */
+        bool getSharding() const {
+            return m_Sharding;
+        }
+        /**
+         * @returns Load statistics per shard, empty if the server does not run sharded.
+         */
+        std::vector<IOShards::Stats> getShardStats() const {
+            return m_Shards ? m_Shards->getStats() : std::vector<IOShards::Stats>();
+        }
+        /**
+         * @returns TLS context shared by all sessions, nullptr if ssl is disabled.
+         */
+        TLSContext::SPtr getTLSContext() const {
+            return m_TLS;
+        }
+        /**
+         * Limits the rate of new connections per client, needs to be called before run().
+         * Connections above the limit are answered with 429 Too Many Requests (without ssl)
+         * and closed right away, see RateLimiter.
+         * @param limiter Rate limiter to check connections against, nullptr disables rate limiting.
+         */
+        void setRateLimiter(const RateLimiter::SPtr& limiter) {
+            m_RateLimits = limiter;
+        }
+        /**
+         * @returns Rate limiter of the server, nullptr if disabled.
+         */
+        RateLimiter::SPtr getRateLimiter() const {
+            return m_RateLimits;
+        }
+        /**
+         * Limits the rate of received messages per client, needs to be called before run().
+         * Sessions exceeding it are closed with close code "try again later", the messages
+         * above the limit are not passed to the observers. All sessions of a client share
+         * the limit, which is counted by the rate limiter (a default one is created if none was set).
+         * @param limit Messages per client, unlimited if Rate is 0 (the default).
+         */
+        void setMessageLimit(RateLimit limit) {
+            m_MessageLimit = limit;
+            if(limit && !m_RateLimits)
+                m_RateLimits = std::make_shared<RateLimiter>();
+        }
+        /**
+         * @returns Limit of received messages per client.
+         */
+        RateLimit getMessageLimit() const {
+            return m_MessageLimit;
+        }
+        /**
+         * Reloads certificate and private key, e.g. after they got renewed. Only
+         * affects new WebSocketSessions, established connections are kept.
+         * Throws WebSocketServerException on error, the previous certificate stays in use then.
+         */
+        void reloadCertificate() {
+            if(!m_TLS)
+                throw WebSocketServerException("Reload certificate: ssl is disabled");
+            try {
+                m_TLS->reload();
+            }
+            catch(const TLSContextException& e) {
+                throw WebSocketServerException(std::string("TLS: ") + e.what());
+            }
+        }
         using SPtr = std::shared_ptr<WebSocketServer>;
         using UPtr = std::unique_ptr<WebSocketServer>;
         using WPtr = std::weak_ptr<WebSocketServer>;
     private:
+        static constexpr int AcceptRetryDelay = 50; // milliseconds
+        static constexpr int AbortTimeout = 1000;   // milliseconds granted to forcibly closed sessions
+
         void do_accept() {
-            m_Acceptor.async_accept(m_Socket, std::bind(&WebSocketServer::on_accept, this->shared_from_this(), std::placeholders::_1));
+            m_Acceptor.async_accept(m_Socket, boost::asio::bind_executor(m_AcceptStrand, std::bind(&WebSocketServer::on_accept, this->shared_from_this(), std::placeholders::_1)));
         }
         void on_accept(boost::system::error_code ec) {
-            if(ec)
-                throw WebSocketServerException("Accept: " + ec.message());
-            m_NewSession = std::make_shared<WebSocketSession>(std::move(m_Socket), m_SSL, m_Cert, m_Key, m_Ioc);
-            m_NewSession->run();
-            notify(); // notify all subscribed observers
-            do_accept(); // Accept another connection
+            if(ec == boost::asio::error::operation_aborted)
+                return; // stopped
+            if(ec) { // e.g. out of file descriptors, accepting again at once would spin
+                m_AcceptTimer.expires_after(std::chrono::milliseconds(AcceptRetryDelay));
+                m_AcceptTimer.async_wait([self = this->shared_from_this()](boost::system::error_code ec){
+                    if(!ec && !self->m_Stopping)
+                        self->do_accept();
+                });
+                return;
+            }
+            start_session(std::move(m_Socket), m_Ioc);
+            if(!m_Stopping)
+                do_accept(); // Accept another connection
+        }
+        void run_sharded() {
+            boost::system::error_code ec;
+            std::vector<int> inherited = std::move(m_Inherited);
+            if(m_Adopted) // kept by the first shard, shared by all if it lacks SO_REUSEPORT since the old process still holds it
+                inherited.insert(inherited.begin(), static_cast<int>(m_Acceptor.release(ec)));
+            else
+                m_Acceptor.close(ec); // every shard binds its own SO_REUSEPORT acceptor
+            try {
+                m_Shards = std::make_unique<IOShards>(m_Ioc, m_Endpoint, m_NumThreads, true, std::move(inherited));
+            }
+            catch(const IOShardsException& e) {
+                throw WebSocketServerException(std::string("Sharding: ") + e.what());
+            }
+            WebSocketServer::WPtr self = this->shared_from_this();
+            m_Shards->run([self](size_t, boost::asio::io_context& ioc, boost::system::error_code ec, tcp::socket socket){
+                auto server = self.lock();
+                if(!server || ec) // accepting continues after a short delay
+                    return;
+                server->start_session(std::move(socket), ioc);
+            });
+        }
+        void start_session(tcp::socket socket, boost::asio::io_context& ioc) {
+            boost::asio::ip::address address;
+            if(m_RateLimits) {
+                boost::system::error_code ec;
+                address = socket.remote_endpoint(ec).address();
+                if(ec)
+                    return; // already disconnected
+                const RateLimiter::Decision decision = m_RateLimits->check(address);
+                if(!decision)
+                    return shed(std::move(socket), decision.RetryAfter);
+            }
+            auto session = std::make_shared<WebSocketSession>(std::move(socket), m_SSL, m_Cert, m_Key, ioc, m_TLS ? m_TLS->get() : nullptr);
+            if(m_MessageLimit) {
+                session->m_Limiter = m_RateLimits;
+                session->m_MessageLimit = m_MessageLimit;
+                session->m_Address = address;
+            }
+            track(session);
+            session->run();
+            if(m_Stopping) // accepted while stopping
+                session->drain();
+            std::lock_guard<std::mutex> lock(m_NotifyMutex); // shards accept concurrently
+            m_NewSession = session;
+            try {
+                notify(); // notify all subscribed observers
+            }
+            catch(...) { // a failing observer must not stop accepting
+            }
+        }
+        void shed(tcp::socket socket, std::chrono::nanoseconds retryAfter) const {
+            boost::system::error_code ec;
+            if(!m_SSL) { // not worth a TLS handshake
+                char seconds[24];
+                auto res = std::to_chars(seconds, seconds + sizeof(seconds), std::chrono::ceil<std::chrono::seconds>(retryAfter).count());
+                const std::string response = "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\nRetry-After: " +
+                                             std::string(seconds, res.ptr) + "\r\nConnection: close\r\n\r\n";
+                socket.non_blocking(true, ec);
+                socket.write_some(boost::asio::buffer(response), ec);
+            }
+            socket.shutdown(tcp::socket::shutdown_both, ec);
+            socket.close(ec);
+        }
+        void track(const WebSocketSession::SPtr& session) {
+            std::lock_guard<std::mutex> lock(m_SessionsMutex);
+            if(m_Sessions.size() >= m_SessionsCompact) { // drop closed sessions, amortized over many accepts
+                m_Sessions.erase(std::remove_if(m_Sessions.begin(), m_Sessions.end(), [](const WebSocketSession::WPtr& s){ return s.expired(); }), m_Sessions.end());
+                m_SessionsCompact = std::max<size_t>(64, 2 * m_Sessions.size());
+            }
+            m_Sessions.push_back(session);
+        }
+        std::vector<WebSocketSession::SPtr> getSessions() {
+            std::vector<WebSocketSession::SPtr> sessions;
+            std::lock_guard<std::mutex> lock(m_SessionsMutex);
+            for(const auto& s : m_Sessions)
+                if(auto session = s.lock())
+                    sessions.push_back(std::move(session));
+            return sessions;
+        }
+        void awaitSessions(std::chrono::steady_clock::time_point deadline) {
+            for(;;) {
+                {
+                    std::lock_guard<std::mutex> lock(m_SessionsMutex);
+                    m_Sessions.erase(std::remove_if(m_Sessions.begin(), m_Sessions.end(), [](const WebSocketSession::WPtr& s){ return s.expired(); }), m_Sessions.end());
+                    if(m_Sessions.empty() || std::chrono::steady_clock::now() >= deadline)
+                        return;
+                }
+                if(m_Threads.empty() && !m_Shards) // no worker threads, see poll
+                    m_Ioc.run_for(std::chrono::milliseconds(10));
+                else
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
         }
         tcp::endpoint m_Endpoint;
         boost::asio::io_context m_Ioc;
@@ -344,9 +683,25 @@ namespace giri {
         size_t m_NumThreads;
         tcp::acceptor m_Acceptor;
         tcp::socket m_Socket;
+        boost::asio::strand<boost::asio::io_context::executor_type> m_AcceptStrand; // serializes accepting and stop()
+        boost::asio::steady_timer m_AcceptTimer;
+        std::vector<int> m_Inherited;                  // further inherited listening sockets, see SocketHandover
+        bool m_Adopted = false;                        // m_Acceptor was passed by the previous process
+        std::vector<WebSocketSession::WPtr> m_Sessions; // drained by stop()
+        size_t m_SessionsCompact = 64;
+        std::mutex m_SessionsMutex;
+        std::mutex m_StopMutex;
+        std::atomic<bool> m_Stopping{false};
+        bool m_Stopped = false;
         WebSocketSession::SPtr m_NewSession;
         std::filesystem::path m_Cert;
         std::filesystem::path m_Key;
+        TLSContext::SPtr m_TLS;
+        bool m_Sharding = false;
+        IOShards::UPtr m_Shards;
+        std::mutex m_NotifyMutex;
+        RateLimiter::SPtr m_RateLimits;
+        RateLimit m_MessageLimit;
     };
 }
 #endif //SUPPORTLIB_WEBSOCKETSERVER_H